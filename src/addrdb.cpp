@@ -119,16 +119,26 @@ CAddrDB::CAddrDB()
 }
 
 bool CAddrDB::Write(const CAddrMan& addr)
+{
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    Snapshot(addr, ssPeers);
+    return WriteSnapshot(ssPeers);
+}
+
+void CAddrDB::Snapshot(const CAddrMan& addr, CDataStream& ssPeers)
+{
+    ssPeers << FLATDATA(Params().MessageStart());
+    ssPeers << addr;
+}
+
+bool CAddrDB::WriteSnapshot(CDataStream& ssPeers)
 {
     // Generate random temporary filename
     unsigned short randv = 0;
     GetRandBytes((unsigned char*)&randv, sizeof(randv));
     std::string tmpfn = strprintf("peers.dat.%04x", randv);
 
-    // serialize addresses, checksum data up to that point, then append csum
-    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
-    ssPeers << FLATDATA(Params().MessageStart());
-    ssPeers << addr;
+    // checksum the serialized addresses, then append csum
     uint256 hash = Hash(ssPeers.begin(), ssPeers.end());
     ssPeers << hash;
 
@@ -84,6 +84,9 @@ private:
 public:
     CAddrDB();
     bool Write(const CAddrMan& addr);
+    //! Serialize addr into ssPeers, to be written later by WriteSnapshot
+    static void Snapshot(const CAddrMan& addr, CDataStream& ssPeers);
+    bool WriteSnapshot(CDataStream& ssPeers);
     bool Read(CAddrMan& addr);
     bool Read(CAddrMan& addr, CDataStream& ssPeers);
 };
@@ -171,6 +171,52 @@ public:
 //! the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+/**
+ * The occupied positions of a bucket table, kept densely so that a random
+ * occupied position can be picked in constant time however sparse the table is.
+ */
+class CAddrTableSlots
+{
+private:
+    //! occupied positions, in no particular order
+    std::vector<int> vSlots;
+
+    //! index of every position in vSlots, -1 if it is free
+    std::vector<int> vIndex;
+
+public:
+    void Init(int nPositions)
+    {
+        vSlots.clear();
+        vIndex.assign(nPositions, -1);
+    }
+
+    void Occupy(int nPos)
+    {
+        if (vIndex[nPos] != -1)
+            return;
+        vIndex[nPos] = vSlots.size();
+        vSlots.push_back(nPos);
+    }
+
+    void Free(int nPos)
+    {
+        int nIndex = vIndex[nPos];
+        if (nIndex == -1)
+            return;
+        // move the last position into the hole
+        vSlots[nIndex] = vSlots.back();
+        vIndex[vSlots[nIndex]] = nIndex;
+        vSlots.pop_back();
+        vIndex[nPos] = -1;
+    }
+
+    size_t size() const { return vSlots.size(); }
+
+    //! The nIndex'th occupied position
+    int Get(size_t nIndex) const { return vSlots[nIndex]; }
+};
+
 /** 
  * Stochastical (IP) address manager 
  */
@@ -204,6 +250,10 @@ private:
     //! list of "new" buckets
     int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
+    //! occupied positions (bucket * ADDRMAN_BUCKET_SIZE + position) of vvTried and vvNew
+    CAddrTableSlots slotsTried;
+    CAddrTableSlots slotsNew;
+
     //! last time Good was called (memory only)
     int64_t nLastGood;
 
@@ -224,6 +274,12 @@ protected:
     //! Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
+    //! Set a position in the "tried" table to nId, or clear it with -1.
+    void SetTried(int nKBucket, int nKBucketPos, int nId);
+
+    //! Set a position in the "new" table to nId, or clear it with -1.
+    void SetNew(int nUBucket, int nUBucketPos, int nId);
+
     //! Move an entry from the "new" table(s) to the "tried" table
     void MakeTried(CAddrInfo& info, int nId);
 
@@ -384,7 +440,7 @@ public:
                 int nUBucket = info.GetNewBucket(nKey);
                 int nUBucketPos = info.GetBucketPosition(nKey, true, nUBucket);
                 if (vvNew[nUBucket][nUBucketPos] == -1) {
-                    vvNew[nUBucket][nUBucketPos] = n;
+                    SetNew(nUBucket, nUBucketPos, n);
                     info.nRefCount++;
                 }
             }
@@ -404,7 +460,7 @@ public:
                 vRandom.push_back(nIdCount);
                 mapInfo[nIdCount] = info;
                 mapAddr[info] = nIdCount;
-                vvTried[nKBucket][nKBucketPos] = nIdCount;
+                SetTried(nKBucket, nKBucketPos, nIdCount);
                 nIdCount++;
             } else {
                 nLost++;
@@ -424,7 +480,7 @@ public:
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
                     if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
                         info.nRefCount++;
-                        vvNew[bucket][nUBucketPos] = nIndex;
+                        SetNew(bucket, nUBucketPos, nIndex);
                     }
                 }
             }
@@ -462,6 +518,8 @@ public:
                 vvTried[bucket][entry] = -1;
             }
         }
+        slotsNew.Init(ADDRMAN_NEW_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE);
+        slotsTried.Init(ADDRMAN_TRIED_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE);
 
         nIdCount = 0;
         nTried = 0;
@@ -4,6 +4,7 @@
 
 #include "bench.h"
 
+#include "chainparams.h"
 #include "key.h"
 #include "main.h"
 #include "util.h"
@@ -13,6 +14,8 @@ main(int argc, char** argv)
 {
     ECC_Start();
     SetupEnvironment();
+    ParseParameters(argc, argv);
+    SelectParams(CBaseChainParams::MAIN);
     fPrintToDebugLog = false; // don't want to write to debug.log file
 
     benchmark::BenchRunner::RunAll();
@@ -0,0 +1,85 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chain_setup.h"
+
+#include "chainparams.h"
+#include "consensus/consensus.h"
+#include "main.h"
+#include "miner.h"
+#include "random.h"
+#include "txmempool.h"
+
+/**
+ * Assembles block templates from a mempool of about ASSEMBLE_MEMPOOL_USAGE
+ * bytes, made of chains of up to DEFAULT_ANCESTOR_LIMIT transactions with
+ * random sizes and fees. Each chain spends an output of one transaction
+ * confirmed on a regtest chain, so the templates pass TestBlockValidity.
+ */
+static const size_t ASSEMBLE_MEMPOOL_USAGE = 300 * 1000 * 1000;
+static const int ASSEMBLE_CHAIN_COUNT = 16000;
+
+static void AddAssembleTx(const CTransaction& tx, const CAmount& nFee)
+{
+    LockPoints lp;
+    mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nFee, 0, 0.0, chainActive.Height(), mempool.HasNoInputsOf(tx),
+                                                       0, false, 0, lp));
+}
+
+static void BlockAssemble(benchmark::State& state)
+{
+    BenchChainSetup setup("assemble");
+    const CChainParams& chainparams = Params();
+
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    std::vector<CTransactionRef> vCoinbase;
+    for (int i = 0; i <= COINBASE_MATURITY; i++)
+        vCoinbase.push_back(setup.MineBlock(scriptPubKey));
+
+    // Confirm the roots of the chains
+    CMutableTransaction txRoots;
+    txRoots.vin.resize(1);
+    txRoots.vin[0].prevout = COutPoint(vCoinbase[0]->GetHash(), 0);
+    txRoots.vout.resize(ASSEMBLE_CHAIN_COUNT);
+    CAmount nRootFee = COIN;
+    BOOST_FOREACH(CTxOut& txout, txRoots.vout) {
+        txout.nValue = (vCoinbase[0]->vout[0].nValue - nRootFee) / ASSEMBLE_CHAIN_COUNT;
+        txout.scriptPubKey = scriptPubKey;
+    }
+    AddAssembleTx(txRoots, nRootFee);
+    setup.MineBlock(scriptPubKey);
+    assert(mempool.size() == 0);
+
+    // Grow the chains one transaction at a time until the mempool is full
+    FastRandomContext rand(true);
+    std::vector<CTransactionRef> vTips(ASSEMBLE_CHAIN_COUNT, MakeTransactionRef(txRoots));
+    std::vector<unsigned int> vLength(ASSEMBLE_CHAIN_COUNT, 0);
+    int nFullChains = 0;
+    while (mempool.DynamicMemoryUsage() < ASSEMBLE_MEMPOOL_USAGE && nFullChains < ASSEMBLE_CHAIN_COUNT) {
+        int nChain = rand.rand32() % ASSEMBLE_CHAIN_COUNT;
+        if (vLength[nChain] == DEFAULT_ANCESTOR_LIMIT)
+            continue;
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(vTips[nChain]->GetHash(), vLength[nChain] == 0 ? nChain : 0);
+        tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(rand.rand32() % 400, 0);
+        CAmount nFee = 1000 + rand.rand32() % 9000;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = vTips[nChain]->vout[tx.vin[0].prevout.n].nValue - nFee;
+        tx.vout[0].scriptPubKey = scriptPubKey;
+        vTips[nChain] = MakeTransactionRef(tx);
+        AddAssembleTx(*vTips[nChain], nFee);
+        if (++vLength[nChain] == DEFAULT_ANCESTOR_LIMIT)
+            nFullChains++;
+    }
+
+    while (state.KeepRunning()) {
+        std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    }
+
+    mempool.clear();
+}
+
+BENCHMARK(BlockAssemble);
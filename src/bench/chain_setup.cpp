@@ -0,0 +1,64 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain_setup.h"
+
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "miner.h"
+#include "pow.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+BenchChainSetup::BenchChainSetup(const std::string& strName)
+{
+    strNetworkSaved = Params().NetworkIDString();
+    SelectParams(CBaseChainParams::REGTEST);
+    const CChainParams& chainparams = Params();
+    pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bench_bitcoin_" + strName + "_%%%%%%%%");
+    boost::filesystem::create_directories(pathTemp);
+    strDataDirSaved = GetArg("-datadir", "");
+    mapArgs["-datadir"] = pathTemp.string();
+    ClearDatadirCache();
+
+    pblocktree = new CBlockTreeDB(1 << 20, true);
+    pcoinsdbview = new CCoinsViewDB(1 << 23, true);
+    pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+    InitBlockIndex(chainparams);
+    CValidationState validationState;
+    ActivateBestChain(validationState, chainparams);
+}
+
+BenchChainSetup::~BenchChainSetup()
+{
+    UnloadBlockIndex();
+    delete pcoinsTip;
+    delete pcoinsdbview;
+    delete pblocktree;
+    pcoinsTip = NULL;
+    pblocktree = NULL;
+    if (strDataDirSaved.empty())
+        mapArgs.erase("-datadir");
+    else
+        mapArgs["-datadir"] = strDataDirSaved;
+    ClearDatadirCache();
+    boost::filesystem::remove_all(pathTemp);
+    SelectParams(strNetworkSaved);
+}
+
+CTransactionRef BenchChainSetup::MineBlock(const CScript& scriptPubKey)
+{
+    const CChainParams& chainparams = Params();
+    std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    CBlock& block = pblocktemplate->block;
+    unsigned int nExtraNonce = 0;
+    IncrementExtraNonce(&block, chainActive.Tip(), nExtraNonce);
+    while (!CheckProofOfWork(block.GetHash(), block.nBits, chainparams.GetConsensus()))
+        ++block.nNonce;
+    ProcessNewBlock(chainparams, &block, true, NULL, NULL);
+    return block.vtx[0];
+}
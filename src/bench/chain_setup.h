@@ -0,0 +1,40 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_CHAIN_SETUP_H
+#define BITCOIN_BENCH_CHAIN_SETUP_H
+
+#include "primitives/transaction.h"
+
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+
+class CCoinsViewDB;
+class CScript;
+
+/**
+ * A regtest chainstate with only the genesis block, in a temporary data
+ * directory, for benchmarks that need blocks and coins. The chain params and
+ * -datadir in effect before are restored, and the directory removed, when it
+ * goes out of scope.
+ */
+class BenchChainSetup
+{
+public:
+    //! strName names the temporary data directory
+    explicit BenchChainSetup(const std::string& strName);
+    ~BenchChainSetup();
+
+    //! Mine a block on the tip paying to scriptPubKey, and return its coinbase
+    CTransactionRef MineBlock(const CScript& scriptPubKey);
+
+private:
+    std::string strNetworkSaved;
+    std::string strDataDirSaved;
+    boost::filesystem::path pathTemp;
+    CCoinsViewDB* pcoinsdbview;
+};
+
+#endif // BITCOIN_BENCH_CHAIN_SETUP_H
@@ -0,0 +1,81 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "arith_uint256.h"
+#include "policy/policy.h"
+#include "txmempool.h"
+
+#include <limits>
+#include <vector>
+
+static const int TRAVERSAL_PACKAGES = 400;
+static const int TRAVERSAL_CHAIN_LENGTH = 25;
+static const int TRAVERSAL_FAN_OUT = 23;
+
+static CMutableTransaction TraversalTx(const std::vector<COutPoint>& vPrevouts, size_t nOutputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(vPrevouts.size());
+    for (size_t i = 0; i < vPrevouts.size(); i++) {
+        tx.vin[i].prevout = vPrevouts[i];
+        tx.vin[i].scriptSig = CScript() << OP_11;
+    }
+    tx.vout.resize(nOutputs);
+    for (size_t i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = COIN;
+    }
+    return tx;
+}
+
+static void AddTraversalTx(const CTransaction& tx, const CAmount& nFee, CTxMemPool& pool)
+{
+    LockPoints lp;
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nFee, 0, 10.0, 1, pool.HasNoInputsOf(tx),
+                                                    tx.GetValueOut(), false, 4, lp));
+}
+
+// Walks the ancestors of every entry and the descendants of every package
+// root in a mempool of TRAVERSAL_PACKAGES packages. Each package is a chain
+// of TRAVERSAL_CHAIN_LENGTH transactions, and a fan: a parent with
+// TRAVERSAL_FAN_OUT children which are all spent by one transaction.
+static void MempoolTraversal(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    LOCK(pool.cs);
+    std::vector<CTxMemPool::txiter> vRoots;
+    for (int n = 0; n < TRAVERSAL_PACKAGES; n++) {
+        CMutableTransaction tx = TraversalTx(std::vector<COutPoint>(1, COutPoint(ArithToUint256(arith_uint256(2 * n + 1)), 0)), 1);
+        AddTraversalTx(tx, 1000, pool);
+        vRoots.push_back(pool.mapTx.find(tx.GetHash()));
+        for (int i = 1; i < TRAVERSAL_CHAIN_LENGTH; i++) {
+            tx = TraversalTx(std::vector<COutPoint>(1, COutPoint(tx.GetHash(), 0)), 1);
+            AddTraversalTx(tx, 1000 + i, pool);
+        }
+
+        CMutableTransaction txFan = TraversalTx(std::vector<COutPoint>(1, COutPoint(ArithToUint256(arith_uint256(2 * n + 2)), 0)), TRAVERSAL_FAN_OUT);
+        AddTraversalTx(txFan, 1000, pool);
+        vRoots.push_back(pool.mapTx.find(txFan.GetHash()));
+        std::vector<COutPoint> vSweep;
+        for (int i = 0; i < TRAVERSAL_FAN_OUT; i++) {
+            CMutableTransaction txChild = TraversalTx(std::vector<COutPoint>(1, COutPoint(txFan.GetHash(), i)), 1);
+            AddTraversalTx(txChild, 2000, pool);
+            vSweep.push_back(COutPoint(txChild.GetHash(), 0));
+        }
+        AddTraversalTx(TraversalTx(vSweep, 1), 5000, pool);
+    }
+
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    CTxMemPool::vecEntries vEntries;
+    while (state.KeepRunning()) {
+        for (CTxMemPool::txiter it = pool.mapTx.begin(); it != pool.mapTx.end(); it++)
+            pool.CalculateMemPoolAncestors(*it, vEntries, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        for (const CTxMemPool::txiter& root : vRoots)
+            pool.CalculateDescendants(root, vEntries);
+    }
+}
+
+BENCHMARK(MempoolTraversal);
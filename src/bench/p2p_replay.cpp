@@ -0,0 +1,221 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chain_setup.h"
+
+#include "chainparams.h"
+#include "consensus/consensus.h"
+#include "main.h"
+#include "net.h"
+#include "netbase.h"
+#include "netmessagemaker.h"
+#include "pubkey.h"
+#include "script/standard.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <iostream>
+
+/**
+ * Replays the messages of one peer into ProcessMessages, over a fixed regtest
+ * chain of REPLAY_CHAIN_LENGTH blocks and without sockets; our responses are
+ * made but not sent. Each iteration replays the whole capture to a new peer,
+ * from an empty mempool, with the mock time following the capture. Run
+ * bench_bitcoin -replaycapture=<msgs_recv.dat> to replay a capture made with
+ * -capturemessages instead of the built-in one.
+ */
+
+//! When the chain is mined and the built-in capture starts
+static const int64_t REPLAY_START_TIME = 1500000000;
+static const int REPLAY_CHAIN_LENGTH = COINBASE_MATURITY + 20;
+
+static CScript ReplayRedeemScript()
+{
+    return CScript() << OP_TRUE;
+}
+
+static void MineReplayChain(BenchChainSetup& setup, std::vector<CTransactionRef>& vCoinbase)
+{
+    CScript scriptPubKey = GetScriptForDestination(CScriptID(ReplayRedeemScript()));
+    for (int i = 0; i < REPLAY_CHAIN_LENGTH; i++)
+        vCoinbase.push_back(setup.MineBlock(scriptPubKey));
+}
+
+static CTransactionRef SpendReplayOutput(const CTransaction& txPrev)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+    CScript redeemScript = ReplayRedeemScript();
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(redeemScript.begin(), redeemScript.end());
+    tx.vout.resize(1);
+    tx.vout[0].nValue = txPrev.vout[0].nValue - 10000;
+    tx.vout[0].scriptPubKey = txPrev.vout[0].scriptPubKey;
+    return MakeTransactionRef(std::move(tx));
+}
+
+template <typename... Args>
+static void AddReplayMessage(std::vector<CCapturedMessage>& vMessages, int nVersion, const std::string& strCommand, Args&&... args)
+{
+    CSerializedNetMsg msg = CNetMsgMaker(nVersion).Make(strCommand, std::forward<Args>(args)...);
+    CCapturedMessage captured;
+    captured.nTime = (REPLAY_START_TIME + 60) * 1000000 + (int64_t)vMessages.size() * 100000;
+    captured.strCommand = msg.command;
+    captured.vPayload = std::move(msg.data);
+    vMessages.push_back(std::move(captured));
+}
+
+/** A peer that connects, syncs headers, relays transactions (some of them orphans at first) and fetches blocks */
+static std::vector<CCapturedMessage> MakeReplayCapture(const std::vector<CTransactionRef>& vCoinbase)
+{
+    std::vector<CCapturedMessage> vMessages;
+    uint64_t nPing = 0;
+
+    AddReplayMessage(vMessages, INIT_PROTO_VERSION, NetMsgType::VERSION, PROTOCOL_VERSION, (uint64_t)NODE_NETWORK, REPLAY_START_TIME,
+        CAddress(CService(), NODE_NONE), CAddress(CService(), NODE_NETWORK), (uint64_t)0x5eed, std::string("/replay/"), REPLAY_CHAIN_LENGTH, true);
+    AddReplayMessage(vMessages, INIT_PROTO_VERSION, NetMsgType::VERACK);
+    AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::SENDHEADERS);
+    AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::SENDCMPCT, false, (uint64_t)1);
+    AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::PING, ++nPing);
+    AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::FEEFILTER, (CAmount)1000);
+    AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::GETADDR);
+
+    // Header sync, in both directions
+    CBlockLocator locator = chainActive.GetLocator(chainActive.Genesis());
+    AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::GETHEADERS, locator, uint256());
+    std::vector<CBlock> vHeaders;
+    for (int nHeight = 1; nHeight <= chainActive.Height(); nHeight++)
+        vHeaders.push_back(chainActive[nHeight]->GetBlockHeader());
+    AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::HEADERS, vHeaders);
+
+    std::vector<CAddress> vAddr;
+    for (int i = 0; i < 10; i++) {
+        CAddress addr(CService(CNetAddr(), 8333), NODE_NETWORK);
+        CService service;
+        if (Lookup(strprintf("250.1.%d.1", i).c_str(), service, 8333, false))
+            addr = CAddress(service, NODE_NETWORK);
+        addr.nTime = REPLAY_START_TIME;
+        vAddr.push_back(addr);
+    }
+    AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::ADDR, vAddr);
+
+    // Transaction relay: spend the mature coinbases, then the outputs of
+    // those spends; every other child arrives before its parent.
+    int nSpendable = REPLAY_CHAIN_LENGTH - COINBASE_MATURITY;
+    for (int i = 0; i < nSpendable; i++) {
+        CTransactionRef txParent = SpendReplayOutput(*vCoinbase[i]);
+        CTransactionRef txChild = SpendReplayOutput(*txParent);
+        std::vector<CInv> vInv;
+        vInv.push_back(CInv(MSG_TX, txParent->GetHash()));
+        vInv.push_back(CInv(MSG_TX, txChild->GetHash()));
+        AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::INV, vInv);
+        if (i % 2) {
+            AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::TX, *txChild);
+            AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::TX, *txParent);
+        } else {
+            AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::TX, *txParent);
+            AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::TX, *txChild);
+        }
+        if (i % 5 == 0)
+            AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::PING, ++nPing);
+    }
+
+    // Block download
+    std::vector<CInv> vGetData;
+    for (int nHeight = chainActive.Height() - 9; nHeight <= chainActive.Height(); nHeight++)
+        vGetData.push_back(CInv(MSG_BLOCK, chainActive[nHeight]->GetBlockHash()));
+    AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::GETDATA, vGetData);
+    AddReplayMessage(vMessages, PROTOCOL_VERSION, NetMsgType::PING, ++nPing);
+
+    return vMessages;
+}
+
+static void ReplayCapture(CConnman& connman, NodeId id, const std::vector<CCapturedMessage>& vMessages)
+{
+    CService service;
+    Lookup("250.0.0.1", service, 8333, false);
+    CNode node(id, NODE_NETWORK, REPLAY_CHAIN_LENGTH, INVALID_SOCKET, CAddress(service, NODE_NETWORK), 0, 0, "", true);
+    GetNodeSignals().InitializeNode(&node, connman);
+
+    for (const CCapturedMessage& captured : vMessages) {
+        SetMockTime(captured.nTime / 1000000);
+
+        CMessageHeader hdr(Params().MessageStart(), captured.strCommand.c_str(), captured.vPayload.size());
+        uint256 hash = Hash(captured.vPayload.begin(), captured.vPayload.end());
+        memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+        CDataStream ssMsg(SER_NETWORK, INIT_PROTO_VERSION);
+        ssMsg << hdr;
+        ssMsg.write((const char*)captured.vPayload.data(), captured.vPayload.size());
+
+        LOCK(node.cs_vRecvMsg);
+        bool fComplete = false;
+        if (!node.ReceiveMsgBytes(&ssMsg[0], ssMsg.size(), fComplete))
+            node.fDisconnect = true;
+        while (!node.fDisconnect && (!node.vRecvGetData.empty() || (!node.vRecvMsg.empty() && node.vRecvMsg.front().complete())))
+            ProcessMessages(&node, connman);
+        if (node.fDisconnect)
+            break;
+    }
+
+    bool fUpdateConnectionTime = false;
+    GetNodeSignals().FinalizeNode(id, fUpdateConnectionTime);
+}
+
+static void P2PReplay(benchmark::State& state)
+{
+    // A capture that can't be read would replay nothing, and time that
+    std::vector<CCapturedMessage> vMessages;
+    std::string strCapture = GetArg("-replaycapture", "");
+    if (!strCapture.empty() && !ReadCapturedMessages(strCapture, vMessages)) {
+        std::cerr << "P2PReplay: cannot read " << strCapture << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    // The chain is mined in mock time, so the built-in capture can follow it
+    SetMockTime(REPLAY_START_TIME);
+    BenchChainSetup setup("replay");
+    std::vector<CTransactionRef> vCoinbase;
+    MineReplayChain(setup, vCoinbase);
+
+    if (strCapture.empty())
+        vMessages = MakeReplayCapture(vCoinbase);
+
+    CConnman connman(0x1337, 0x1337);
+    CConnman::Options connOptions;
+    connOptions.nSendBufferMaxSize = 1000 * DEFAULT_MAXSENDBUFFER;
+    connOptions.nMaxConnections = 1;
+    connman.Init(connOptions);
+    PeerLogicValidation peerLogic(&connman);
+    RegisterValidationInterface(&peerLogic);
+    RegisterNodeSignals(GetNodeSignals());
+    NodeId id = 0;
+    uint64_t nReplays = 0;
+    while (state.KeepRunning()) {
+        ReplayCapture(connman, id++, vMessages);
+        mempool.clear();
+        nReplays++;
+    }
+    UnregisterNodeSignals(GetNodeSignals());
+    UnregisterValidationInterface(&peerLogic);
+
+    // The time each kind of message took, from what ProcessMessages recorded,
+    // as comments between the benchmark results
+    CPeerMsgMetrics total;
+    std::map<NodeId, CPeerMsgMetrics> mapPeers;
+    connman.GetMsgMetrics(total, mapPeers);
+    std::cout << strprintf("# P2PReplay: %u messages replayed %u times\n", vMessages.size(), nReplays);
+    BOOST_FOREACH(const mapMsgCmdMetrics::value_type& item, total.mapRecv) {
+        const CLogHistogram& time = item.second.handlerTime;
+        if (time.nCount == 0)
+            continue;
+        std::cout << strprintf("# P2PReplay-%s: %u messages, mean %.2fus, max %uus, %.0f msgs/s\n",
+            item.first, time.nCount, (double)time.nSum / time.nCount, time.nMax,
+            time.nSum ? time.nCount * 1000000.0 / time.nSum : 0.0);
+    }
+    SetMockTime(0);
+}
+
+BENCHMARK(P2PReplay);
@@ -6,6 +6,8 @@
 
 #include "bench.h"
 #include "bloom.h"
+#include "crypto/common.h"
+#include "uint256.h"
 #include "utiltime.h"
 
 static void RollingBloom(benchmark::State& state)
@@ -41,3 +43,36 @@ static void RollingBloom(benchmark::State& state)
 }
 
 BENCHMARK(RollingBloom);
+
+// How filterInventoryKnown and recentRejects are used: uint256 keys, with
+// most lookups for hashes that were never inserted.
+template <typename Filter>
+static void RollingBloomLookups(benchmark::State& state)
+{
+    Filter filter(120000, 0.000001);
+    uint256 hash;
+    uint32_t count = 0;
+    uint64_t match = 0;
+    while (state.KeepRunning()) {
+        count++;
+        WriteLE32(hash.begin(), count);
+        filter.insert(hash);
+        WriteLE32(hash.begin(), count * 0x9e3779b9);
+        match += filter.contains(hash);
+        match += filter.contains(hash);
+        match += filter.contains(hash);
+    }
+}
+
+static void RollingBloomUint256(benchmark::State& state)
+{
+    RollingBloomLookups<CRollingBloomFilter>(state);
+}
+
+static void BlockedRollingBloomUint256(benchmark::State& state)
+{
+    RollingBloomLookups<CBlockedRollingBloomFilter>(state);
+}
+
+BENCHMARK(RollingBloomUint256);
+BENCHMARK(BlockedRollingBloomUint256);
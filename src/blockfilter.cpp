@@ -0,0 +1,310 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "hash.h"
+#include "primitives/transaction.h"
+#include "script/script.h"
+#include "streams.h"
+
+#include <algorithm>
+#include <map>
+
+/// SerType used to serialize parameters in GCS filter encoding.
+static const int GCS_SER_TYPE = SER_NETWORK;
+
+/// Protocol version used to serialize parameters in GCS filter encoding.
+static const int GCS_SER_VERSION = 0;
+
+static const std::map<BlockFilterType, std::string> g_filter_types = {
+    {BASIC, "basic"},
+};
+
+template <typename OStream>
+static void GolombRiceEncode(BitStreamWriter<OStream>& bitwriter, uint8_t nP, uint64_t x)
+{
+    // Write quotient as unary-encoded: q 1's followed by one 0.
+    uint64_t q = x >> nP;
+    while (q > 0) {
+        int nbits = q <= 64 ? static_cast<int>(q) : 64;
+        bitwriter.Write(~0ULL, nbits);
+        q -= nbits;
+    }
+    bitwriter.Write(0, 1);
+
+    // Write the remainder in P bits. Since the remainder is just the bottom
+    // P bits of x, there is no need to mask first.
+    bitwriter.Write(x, nP);
+}
+
+template <typename IStream>
+static uint64_t GolombRiceDecode(BitStreamReader<IStream>& bitreader, uint8_t nP)
+{
+    // Read unary-encoded quotient: q 1's followed by one 0.
+    uint64_t q = 0;
+    while (bitreader.Read(1) == 1) {
+        ++q;
+    }
+
+    uint64_t r = bitreader.Read(nP);
+
+    return (q << nP) + r;
+}
+
+// Map a value x that is uniformly distributed in the range [0, 2^64) to a
+// value uniformly distributed in [0, n) by returning the upper 64 bits of
+// x * n.
+//
+// See: https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
+static uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+    return (static_cast<unsigned __int128>(x) * static_cast<unsigned __int128>(n)) >> 64;
+#else
+    // To perform the calculation on 64-bit numbers without losing the
+    // result to overflow, split the numbers into the most significant and
+    // least significant 32 bits and perform multiplication piece-wise.
+    //
+    // See: https://stackoverflow.com/a/26855440
+    uint64_t x_hi = x >> 32;
+    uint64_t x_lo = x & 0xFFFFFFFF;
+    uint64_t n_hi = n >> 32;
+    uint64_t n_lo = n & 0xFFFFFFFF;
+
+    uint64_t ac = x_hi * n_hi;
+    uint64_t ad = x_hi * n_lo;
+    uint64_t bc = x_lo * n_hi;
+    uint64_t bd = x_lo * n_lo;
+
+    uint64_t mid34 = (bd >> 32) + (bc & 0xFFFFFFFF) + (ad & 0xFFFFFFFF);
+    uint64_t upper64 = ac + (bc >> 32) + (ad >> 32) + (mid34 >> 32);
+    return upper64;
+#endif
+}
+
+uint64_t GCSFilter::HashToRange(const Element& element) const
+{
+    uint64_t hash = CSipHasher(nSipHashK0, nSipHashK1)
+        .Write(element.data(), element.size())
+        .Finalize();
+    return MapIntoRange(hash, nF);
+}
+
+std::vector<uint64_t> GCSFilter::BuildHashedSet(const ElementSet& elements) const
+{
+    std::vector<uint64_t> hashed_elements;
+    hashed_elements.reserve(elements.size());
+    for (const Element& element : elements) {
+        hashed_elements.push_back(HashToRange(element));
+    }
+    std::sort(hashed_elements.begin(), hashed_elements.end());
+    return hashed_elements;
+}
+
+GCSFilter::GCSFilter(uint64_t nSipHashK0In, uint64_t nSipHashK1In, uint8_t nPIn, uint32_t nMIn)
+    : nSipHashK0(nSipHashK0In), nSipHashK1(nSipHashK1In), nP(nPIn), nM(nMIn), nN(0), nF(0)
+{}
+
+GCSFilter::GCSFilter(uint64_t nSipHashK0In, uint64_t nSipHashK1In, uint8_t nPIn, uint32_t nMIn,
+                     std::vector<unsigned char> vEncodedIn)
+    : GCSFilter(nSipHashK0In, nSipHashK1In, nPIn, nMIn)
+{
+    vEncoded = std::move(vEncodedIn);
+
+    VectorReader stream(GCS_SER_TYPE, GCS_SER_VERSION, vEncoded, 0);
+
+    uint64_t N = ReadCompactSize(stream);
+    nN = static_cast<uint32_t>(N);
+    if (nN != N) {
+        throw std::ios_base::failure("N must be <2^32");
+    }
+    nF = static_cast<uint64_t>(nN) * nM;
+
+    // Verify that the encoded filter contains exactly N elements. If it has too much or too little
+    // data, a std::ios_base::failure exception will be raised.
+    BitStreamReader<VectorReader> bitreader(stream);
+    for (uint64_t i = 0; i < nN; ++i) {
+        GolombRiceDecode(bitreader, nP);
+    }
+    if (!stream.empty()) {
+        throw std::ios_base::failure("encoded_filter contains excess data");
+    }
+}
+
+GCSFilter::GCSFilter(uint64_t nSipHashK0In, uint64_t nSipHashK1In, uint8_t nPIn, uint32_t nMIn,
+                     const ElementSet& elements)
+    : GCSFilter(nSipHashK0In, nSipHashK1In, nPIn, nMIn)
+{
+    size_t N = elements.size();
+    nN = static_cast<uint32_t>(N);
+    if (nN != N) {
+        throw std::invalid_argument("N must be <2^32");
+    }
+    nF = static_cast<uint64_t>(nN) * nM;
+
+    CVectorWriter stream(GCS_SER_TYPE, GCS_SER_VERSION, vEncoded, 0);
+
+    WriteCompactSize(stream, nN);
+
+    if (elements.empty()) {
+        return;
+    }
+
+    BitStreamWriter<CVectorWriter> bitwriter(stream);
+
+    uint64_t nLastValue = 0;
+    for (uint64_t value : BuildHashedSet(elements)) {
+        uint64_t delta = value - nLastValue;
+        GolombRiceEncode(bitwriter, nP, delta);
+        nLastValue = value;
+    }
+
+    bitwriter.Flush();
+}
+
+bool GCSFilter::MatchInternal(const uint64_t* pSortedElementHashes, size_t nSize) const
+{
+    VectorReader stream(GCS_SER_TYPE, GCS_SER_VERSION, vEncoded, 0);
+
+    // Seek forward by size of N
+    uint64_t N = ReadCompactSize(stream);
+    assert(N == nN);
+
+    BitStreamReader<VectorReader> bitreader(stream);
+
+    uint64_t nValue = 0;
+    size_t nHashesIndex = 0;
+    for (uint32_t i = 0; i < nN; ++i) {
+        uint64_t delta = GolombRiceDecode(bitreader, nP);
+        nValue += delta;
+
+        while (true) {
+            if (nHashesIndex == nSize) {
+                return false;
+            } else if (pSortedElementHashes[nHashesIndex] == nValue) {
+                return true;
+            } else if (pSortedElementHashes[nHashesIndex] > nValue) {
+                break;
+            }
+
+            nHashesIndex++;
+        }
+    }
+
+    return false;
+}
+
+bool GCSFilter::Match(const Element& element) const
+{
+    uint64_t nQuery = HashToRange(element);
+    return MatchInternal(&nQuery, 1);
+}
+
+bool GCSFilter::MatchAny(const ElementSet& elements) const
+{
+    const std::vector<uint64_t> queries = BuildHashedSet(elements);
+    return MatchInternal(queries.data(), queries.size());
+}
+
+const std::string& BlockFilterTypeName(BlockFilterType filterType)
+{
+    static std::string unknown_retval = "";
+    auto it = g_filter_types.find(filterType);
+    return it != g_filter_types.end() ? it->second : unknown_retval;
+}
+
+bool BlockFilterTypeByName(const std::string& name, BlockFilterType& filterType)
+{
+    for (const auto& entry : g_filter_types) {
+        if (entry.second == name) {
+            filterType = entry.first;
+            return true;
+        }
+    }
+    return false;
+}
+
+static GCSFilter::ElementSet BasicFilterElements(const CBlock& block,
+                                                 const CBlockUndo& blockUndo)
+{
+    GCSFilter::ElementSet elements;
+
+    for (const auto& tx : block.vtx) {
+        for (const CTxOut& txout : tx->vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN) continue;
+            elements.emplace(script.begin(), script.end());
+        }
+    }
+
+    for (const CTxUndo& txUndo : blockUndo.vtxundo) {
+        for (const CTxInUndo& prevout : txUndo.vprevout) {
+            const CScript& script = prevout.txout.scriptPubKey;
+            if (script.empty()) continue;
+            elements.emplace(script.begin(), script.end());
+        }
+    }
+
+    return elements;
+}
+
+BlockFilter::BlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn,
+                         std::vector<unsigned char> vFilter)
+    : filterType(filterTypeIn), hashBlock(hashBlockIn)
+{
+    uint8_t nP;
+    uint32_t nM;
+    if (!BuildParams(nP, nM)) {
+        throw std::invalid_argument("unknown filter_type");
+    }
+    filter = GCSFilter(hashBlock.GetUint64(0), hashBlock.GetUint64(1), nP, nM, std::move(vFilter));
+}
+
+BlockFilter::BlockFilter(BlockFilterType filterTypeIn, const CBlock& block, const CBlockUndo& blockUndo)
+    : filterType(filterTypeIn), hashBlock(block.GetHash())
+{
+    uint8_t nP;
+    uint32_t nM;
+    if (!BuildParams(nP, nM)) {
+        throw std::invalid_argument("unknown filter_type");
+    }
+    filter = GCSFilter(hashBlock.GetUint64(0), hashBlock.GetUint64(1), nP, nM,
+                       BasicFilterElements(block, blockUndo));
+}
+
+bool BlockFilter::BuildParams(uint8_t& nP, uint32_t& nM) const
+{
+    switch (filterType) {
+    case BASIC:
+        nP = BASIC_FILTER_P;
+        nM = BASIC_FILTER_M;
+        return true;
+    case INVALID:
+        return false;
+    }
+
+    return false;
+}
+
+uint256 BlockFilter::GetHash() const
+{
+    const std::vector<unsigned char>& data = GetEncodedFilter();
+
+    uint256 result;
+    CHash256().Write(data.data(), data.size()).Finalize(result.begin());
+    return result;
+}
+
+uint256 BlockFilter::ComputeHeader(const uint256& hashPrevHeader) const
+{
+    const uint256& hashFilter = GetHash();
+
+    uint256 result;
+    CHash256()
+        .Write(hashFilter.begin(), hashFilter.size())
+        .Write(hashPrevHeader.begin(), hashPrevHeader.size())
+        .Finalize(result.begin());
+    return result;
+}
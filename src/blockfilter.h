@@ -0,0 +1,159 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+#include "undo.h"
+
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * This implements a Golomb-coded set as defined in BIP 158. It is a
+ * compact, probabilistic data structure for testing set membership.
+ */
+class GCSFilter
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+private:
+    uint64_t nSipHashK0;
+    uint64_t nSipHashK1;
+    uint8_t nP;  //!< Golomb-Rice coding parameter
+    uint32_t nM; //!< Inverse false positive rate
+    uint32_t nN; //!< Number of elements in the filter
+    uint64_t nF; //!< Range of element hashes, F = N * M
+    std::vector<unsigned char> vEncoded;
+
+    /** Hash a data element to an integer in the range [0, N * M). */
+    uint64_t HashToRange(const Element& element) const;
+
+    std::vector<uint64_t> BuildHashedSet(const ElementSet& elements) const;
+
+    /** Helper method used to implement Match and MatchAny */
+    bool MatchInternal(const uint64_t* pSortedElementHashes, size_t nSize) const;
+
+public:
+
+    /** Constructs an empty filter. */
+    explicit GCSFilter(uint64_t nSipHashK0In = 0, uint64_t nSipHashK1In = 0, uint8_t nPIn = 0, uint32_t nMIn = 0);
+
+    /** Reconstructs an already-created filter from an encoding. */
+    GCSFilter(uint64_t nSipHashK0In, uint64_t nSipHashK1In, uint8_t nPIn, uint32_t nMIn,
+              std::vector<unsigned char> vEncodedIn);
+
+    /** Builds a new filter from the params and set of elements. */
+    GCSFilter(uint64_t nSipHashK0In, uint64_t nSipHashK1In, uint8_t nPIn, uint32_t nMIn,
+              const ElementSet& elements);
+
+    uint8_t GetP() const { return nP; }
+    uint32_t GetN() const { return nN; }
+    uint32_t GetM() const { return nM; }
+    const std::vector<unsigned char>& GetEncoded() const { return vEncoded; }
+
+    /**
+     * Checks if the element may be in the set. False positives are possible
+     * with probability 1/M.
+     */
+    bool Match(const Element& element) const;
+
+    /**
+     * Checks if any of the given elements may be in the set. False positives
+     * are possible with probability 1/M per element checked. This is more
+     * efficient that checking Match on multiple elements separately.
+     */
+    bool MatchAny(const ElementSet& elements) const;
+};
+
+static const uint8_t BASIC_FILTER_P = 19;
+static const uint32_t BASIC_FILTER_M = 784931;
+
+enum BlockFilterType : uint8_t
+{
+    BASIC = 0,
+    INVALID = 255,
+};
+
+/** Get the human-readable name for a filter type. Returns empty string for unknown types. */
+const std::string& BlockFilterTypeName(BlockFilterType filterType);
+
+/** Find a filter type by its human-readable name. */
+bool BlockFilterTypeByName(const std::string& name, BlockFilterType& filterType);
+
+/**
+ * Complete block filter struct as defined in BIP 157. Serialization matches
+ * payload of "cfilter" messages.
+ */
+class BlockFilter
+{
+private:
+    BlockFilterType filterType;
+    uint256 hashBlock;
+    GCSFilter filter;
+
+    bool BuildParams(uint8_t& nP, uint32_t& nM) const;
+
+public:
+
+    BlockFilter() : filterType(INVALID) {}
+
+    //! Reconstruct a BlockFilter from parts.
+    BlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn,
+                std::vector<unsigned char> vFilter);
+
+    //! Construct a new BlockFilter of the specified type from a block.
+    BlockFilter(BlockFilterType filterTypeIn, const CBlock& block, const CBlockUndo& blockUndo);
+
+    BlockFilterType GetFilterType() const { return filterType; }
+    const uint256& GetBlockHash() const { return hashBlock; }
+    const GCSFilter& GetFilter() const { return filter; }
+
+    const std::vector<unsigned char>& GetEncodedFilter() const
+    {
+        return filter.GetEncoded();
+    }
+
+    //! Compute the filter hash.
+    uint256 GetHash() const;
+
+    //! Compute the filter header given the previous one.
+    uint256 ComputeHeader(const uint256& hashPrevHeader) const;
+
+    template <typename Stream>
+    void Serialize(Stream& s) const {
+        s << static_cast<uint8_t>(filterType)
+          << hashBlock
+          << filter.GetEncoded();
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s) {
+        std::vector<unsigned char> vEncodedFilter;
+        uint8_t nFilterType;
+
+        s >> nFilterType
+          >> hashBlock
+          >> vEncodedFilter;
+
+        filterType = static_cast<BlockFilterType>(nFilterType);
+
+        uint8_t nP;
+        uint32_t nM;
+        if (!BuildParams(nP, nM)) {
+            throw std::ios_base::failure("unknown filter_type");
+        }
+        filter = GCSFilter(hashBlock.GetUint64(0), hashBlock.GetUint64(1), nP, nM,
+                           std::move(vEncodedFilter));
+    }
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
@@ -313,3 +313,184 @@ void CRollingBloomFilter::reset()
         *it = 0;
     }
 }
+
+/** Positions in a block of a rolling bloom filter: 8 words, two bits each */
+static const int ROLLING_BLOOM_BLOCK_POSITIONS = 256;
+
+/* The false positive rate of a blocked filter holding nElements in nBlocks
+ * blocks, probing nHashFuncs positions per key: the number of elements that
+ * land in the block of a key is Poisson distributed. */
+static double BlockedBloomFPRate(double nElements, uint32_t nBlocks, int nHashFuncs)
+{
+    double lambda = nElements / nBlocks;
+    if (lambda > 500)
+        return 1.0;
+    /* Chance that a given position of a block is still clear after one more element */
+    double q = pow(1.0 - 1.0 / ROLLING_BLOOM_BLOCK_POSITIONS, nHashFuncs);
+    double p = exp(-lambda), qj = 1.0;
+    double ret = 0;
+    for (int j = 0; j < lambda + 10 * sqrt(lambda) + 20; j++) {
+        if (j > 0) {
+            p *= lambda / j;
+            qj *= q;
+        }
+        ret += p * pow(1.0 - qj, nHashFuncs);
+    }
+    return ret;
+}
+
+/* The least number of blocks that keeps the false positive rate below fpRate */
+static uint32_t BlockedBloomBlocks(double nElements, double fpRate, int nHashFuncs)
+{
+    uint32_t nHigh = 1;
+    while (BlockedBloomFPRate(nElements, nHigh, nHashFuncs) > fpRate && nHigh < (1U << 26))
+        nHigh *= 2;
+    uint32_t nLow = nHigh / 2 + 1;
+    if (nHigh == 1)
+        return 1;
+    while (nLow < nHigh) {
+        uint32_t nMid = nLow + (nHigh - nLow) / 2;
+        if (BlockedBloomFPRate(nElements, nMid, nHashFuncs) > fpRate)
+            nLow = nMid + 1;
+        else
+            nHigh = nMid;
+    }
+    return nHigh;
+}
+
+CBlockedRollingBloomFilter::CBlockedRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    double logFpRate = log(fpRate);
+    /* In this rolling bloom filter, we'll store between 2 and 3 generations of nElements / 2 entries. */
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    /* The optimal number of hash functions for a plain bloom filter is
+     * log(fpRate) / log(0.5). A blocked one does best with somewhat fewer, so
+     * try fewer as long as that shrinks the filter. */
+    int nMaxHashFuncs = std::max(1, std::min((int)round(logFpRate / log(0.5)), 50));
+    nBlocks = 0;
+    for (int n = nMaxHashFuncs; n >= 1; n--) {
+        uint32_t nBlocksNeeded = BlockedBloomBlocks(nMaxElements, fpRate, n);
+        if (nBlocks != 0 && nBlocksNeeded >= nBlocks)
+            break;
+        nBlocks = nBlocksNeeded;
+        nHashFuncs = n;
+    }
+    data.clear();
+    /* For each data element we need to store 2 bits. If both bits are 0, the
+     * bit is treated as unset. If the bits are (01), (10), or (11), the bit is
+     * treated as set in generation 1, 2, or 3 respectively.
+     * These bits are stored in separate integers: position P of a block
+     * corresponds to bit (P & 63) of its words (P >> 6) * 2 and (P >> 6) * 2 + 1.
+     * Seven spare words let the blocks start on a 64-byte boundary. */
+    data.resize(nBlocks * 8 + 7);
+    reset();
+}
+
+/* Index of the first word of the first block, which starts on a cache line */
+static inline size_t RollingBloomBlockOffset(const std::vector<uint64_t>& data)
+{
+    return ((64 - ((uintptr_t)data.data() & 63)) & 63) / 8;
+}
+
+/* Probe positions of a key are drawn from its hash with the SplitMix64 generator */
+static inline uint64_t SplitMix64(uint64_t& nState)
+{
+    uint64_t z = (nState += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+const uint64_t* CBlockedRollingBloomFilter::GetBlock(uint64_t nHash, uint64_t (&mask)[4]) const
+{
+    mask[0] = mask[1] = mask[2] = mask[3] = 0;
+    uint64_t nState = nHash, nBits = 0;
+    for (int n = 0; n < nHashFuncs; n++) {
+        if (n % 8 == 0)
+            nBits = SplitMix64(nState);
+        int pos = nBits & 0xFF;
+        nBits >>= 8;
+        mask[pos >> 6] |= ((uint64_t)1) << (pos & 63);
+    }
+    return data.data() + RollingBloomBlockOffset(data) + (((nHash >> 32) * nBlocks) >> 32) * 8;
+}
+
+uint64_t* CBlockedRollingBloomFilter::GetBlock(uint64_t nHash, uint64_t (&mask)[4])
+{
+    return const_cast<uint64_t*>(static_cast<const CBlockedRollingBloomFilter*>(this)->GetBlock(nHash, mask));
+}
+
+void CBlockedRollingBloomFilter::insertHash(uint64_t nHash)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration) {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4) {
+            nGeneration = 1;
+        }
+        uint64_t nGenerationMask1 = -(uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = -(uint64_t)(nGeneration >> 1);
+        /* Wipe old entries that used this generation number. */
+        uint32_t nStart = RollingBloomBlockOffset(data);
+        for (uint32_t p = nStart; p < nStart + nBlocks * 8; p += 2) {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    uint64_t mask[4];
+    uint64_t* pBlock = GetBlock(nHash, mask);
+    uint64_t nGenerationMask1 = -(uint64_t)(nGeneration & 1);
+    uint64_t nGenerationMask2 = -(uint64_t)(nGeneration >> 1);
+    for (int i = 0; i < 4; i++) {
+        pBlock[2 * i] = (pBlock[2 * i] & ~mask[i]) | (mask[i] & nGenerationMask1);
+        pBlock[2 * i + 1] = (pBlock[2 * i + 1] & ~mask[i]) | (mask[i] & nGenerationMask2);
+    }
+}
+
+bool CBlockedRollingBloomFilter::containsHash(uint64_t nHash) const
+{
+    uint64_t mask[4];
+    const uint64_t* pBlock = GetBlock(nHash, mask);
+    /* A bit is set if it is set in either word of its pair; the key is absent if any of its bits isn't */
+    uint64_t nMissing = 0;
+    for (int i = 0; i < 4; i++) {
+        nMissing |= mask[i] & ~(pBlock[2 * i] | pBlock[2 * i + 1]);
+    }
+    return nMissing == 0;
+}
+
+void CBlockedRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    insertHash(CSipHasher(nTweak0, nTweak1).Write(vKey.data(), vKey.size()).Finalize());
+}
+
+void CBlockedRollingBloomFilter::insert(const uint256& hash)
+{
+    insertHash(SipHashUint256(nTweak0, nTweak1, hash));
+}
+
+bool CBlockedRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    return containsHash(CSipHasher(nTweak0, nTweak1).Write(vKey.data(), vKey.size()).Finalize());
+}
+
+bool CBlockedRollingBloomFilter::contains(const uint256& hash) const
+{
+    return containsHash(SipHashUint256(nTweak0, nTweak1, hash));
+}
+
+void CBlockedRollingBloomFilter::reset()
+{
+    nTweak0 = GetRand(std::numeric_limits<uint64_t>::max());
+    nTweak1 = GetRand(std::numeric_limits<uint64_t>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    for (std::vector<uint64_t>::iterator it = data.begin(); it != data.end(); it++) {
+        *it = 0;
+    }
+}
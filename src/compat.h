@@ -83,6 +83,18 @@ typedef u_int SOCKET;
 size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
+// Waits on a single socket use poll() where available, which unlike select()
+// is not limited to descriptors below FD_SETSIZE
+#if defined(__linux__)
+#define USE_POLL
+#endif
+
+// epoll lifts the FD_SETSIZE cap on connections, so outbound connects must
+// not wait with select() either
+#if defined(USE_POLL) && defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#define USE_EPOLL
+#endif
+
 bool static inline IsSelectableSocket(SOCKET s) {
 #ifdef WIN32
     return true;
@@ -0,0 +1,282 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "index/base.h"
+
+#include "chainparams.h"
+#include "init.h"
+#include "main.h"
+#include "tinyformat.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+static const char DB_BEST_BLOCK = 'B';
+
+static const int64_t SYNC_LOG_INTERVAL = 30; // seconds
+static const int64_t SYNC_LOCATOR_WRITE_INTERVAL = 30; // seconds
+
+template<typename... Args>
+static void FatalError(const char* fmt, const Args&... args)
+{
+    std::string strMessage = tfm::format(fmt, args...);
+    strMiscWarning = strMessage;
+    LogPrintf("*** %s\n", strMessage);
+    uiInterface.ThreadSafeMessageBox(
+        _("Error: A fatal internal error occurred, see debug.log for details"),
+        "", CClientUIInterface::MSG_ERROR);
+    StartShutdown();
+}
+
+BaseIndex::DB::DB(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool fObfuscate) :
+    CDBWrapper(path, nCacheSize, fMemory, fWipe, fObfuscate)
+{}
+
+bool BaseIndex::DB::ReadBestBlock(CBlockLocator& locator) const
+{
+    bool fSuccess = Read(DB_BEST_BLOCK, locator);
+    if (!fSuccess) {
+        locator.SetNull();
+    }
+    return fSuccess;
+}
+
+void BaseIndex::DB::WriteBestBlock(CDBBatch& batch, const CBlockLocator& locator)
+{
+    batch.Write(DB_BEST_BLOCK, locator);
+}
+
+BaseIndex::BaseIndex() : fSynced(false), pindexBest(NULL), fRegistered(false)
+{
+}
+
+BaseIndex::~BaseIndex()
+{
+    Stop();
+}
+
+bool BaseIndex::Init()
+{
+    CBlockLocator locator;
+    if (!GetDB().ReadBestBlock(locator)) {
+        locator.SetNull();
+    }
+
+    LOCK(cs_main);
+    if (locator.IsNull()) {
+        pindexBest = NULL;
+    } else {
+        pindexBest = FindForkInGlobalIndex(chainActive, locator);
+    }
+    fSynced = pindexBest.load() == chainActive.Tip();
+    return true;
+}
+
+static const CBlockIndex* NextSyncBlock(const CBlockIndex* pindexPrev)
+{
+    AssertLockHeld(cs_main);
+
+    if (!pindexPrev) {
+        return chainActive.Genesis();
+    }
+
+    const CBlockIndex* pindex = chainActive.Next(pindexPrev);
+    if (pindex) {
+        return pindex;
+    }
+
+    // pindexPrev is either the tip or was reorged out of the active chain.
+    if (pindexPrev == chainActive.Tip()) {
+        return NULL;
+    }
+    return chainActive.Next(chainActive.FindFork(pindexPrev));
+}
+
+void BaseIndex::ThreadSync()
+{
+    // Building an index is background work; leave the CPU to validation and
+    // the network threads whenever they need it.
+    ScheduleBatchPriority();
+
+    const CBlockIndex* pindex = pindexBest.load();
+    if (!fSynced) {
+        const Consensus::Params& consensusParams = Params().GetConsensus();
+
+        int64_t nLastLogTime = 0;
+        int64_t nLastLocatorWriteTime = GetTime();
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            {
+                LOCK(cs_main);
+                const CBlockIndex* pindexNext = NextSyncBlock(pindex);
+                if (!pindexNext) {
+                    // Caught up with the tip. As BlockConnected is invoked
+                    // with cs_main held, no block can slip in between here
+                    // and the callbacks taking over.
+                    pindexBest = pindex;
+                    fSynced = true;
+                    if (pindex) {
+                        WriteBestBlock(pindex);
+                    }
+                    break;
+                }
+                if (pindex && pindexNext->pprev != pindex && !Rewind(pindex, pindexNext->pprev)) {
+                    FatalError("%s: Failed to rewind index %s to a previous chain tip",
+                               __func__, GetName());
+                    return;
+                }
+                pindex = pindexNext;
+            }
+
+            int64_t nNow = GetTime();
+            if (nLastLogTime + SYNC_LOG_INTERVAL < nNow) {
+                LogPrintf("Syncing %s with block chain from height %d\n",
+                          GetName(), pindex->nHeight);
+                nLastLogTime = nNow;
+            }
+
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindex, consensusParams)) {
+                FatalError("%s: Failed to read block %s from disk",
+                           __func__, pindex->GetBlockHash().ToString());
+                return;
+            }
+            if (!WriteBlock(block, pindex)) {
+                FatalError("%s: Failed to write block %s to index database",
+                           __func__, pindex->GetBlockHash().ToString());
+                return;
+            }
+            pindexBest = pindex;
+
+            if (nLastLocatorWriteTime + SYNC_LOCATOR_WRITE_INTERVAL < nNow) {
+                // No need to handle errors here; the locator is rewritten
+                // periodically and on every chainstate flush.
+                LOCK(cs_main);
+                WriteBestBlock(pindex);
+                nLastLocatorWriteTime = nNow;
+            }
+        }
+    }
+
+    if (pindex) {
+        LogPrintf("%s is enabled at height %d\n", GetName(), pindex->nHeight);
+    } else {
+        LogPrintf("%s is enabled\n", GetName());
+    }
+}
+
+bool BaseIndex::WriteBestBlock(const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    CDBBatch batch(GetDB());
+    if (!CommitInternal(batch)) {
+        return error("%s: Failed to commit latest %s state", __func__, GetName());
+    }
+    GetDB().WriteBestBlock(batch, chainActive.GetLocator(pindex));
+    if (!GetDB().WriteBatch(batch)) {
+        return error("%s: Failed to write locator to disk", __func__);
+    }
+    return true;
+}
+
+bool BaseIndex::Rewind(const CBlockIndex* pindexCurrentTip, const CBlockIndex* pindexNewTip)
+{
+    assert(pindexCurrentTip == pindexBest.load() || !fSynced);
+    assert(pindexCurrentTip->GetAncestor(pindexNewTip->nHeight) == pindexNewTip);
+
+    // Entries written for the disconnected blocks are simply superseded by
+    // the blocks of the new chain, so only the best block has to move back.
+    pindexBest = pindexNewTip;
+    return WriteBestBlock(pindexNewTip);
+}
+
+void BaseIndex::BlockConnected(const CBlock& block, const CBlockIndex* pindex)
+{
+    if (!fSynced) {
+        return;
+    }
+
+    const CBlockIndex* pindexPrevBest = pindexBest.load();
+    if (!pindexPrevBest && pindex->pprev) {
+        FatalError("%s: First block connected to %s is not the genesis block (height %d)",
+                   __func__, GetName(), pindex->nHeight);
+        return;
+    }
+
+    if (pindexPrevBest && pindex->pprev != pindexPrevBest) {
+        // Blocks were disconnected since we last heard from validation. The
+        // fork point is the ancestor of the new block we have indexed.
+        const CBlockIndex* pindexFork = pindexPrevBest;
+        while (pindexFork && pindex->GetAncestor(pindexFork->nHeight) != pindexFork) {
+            pindexFork = pindexFork->pprev;
+        }
+        if (!pindexFork || pindexFork != pindex->pprev) {
+            FatalError("%s: Block %s does not connect to the chain known to %s",
+                       __func__, pindex->GetBlockHash().ToString(), GetName());
+            return;
+        }
+        if (!Rewind(pindexPrevBest, pindexFork)) {
+            FatalError("%s: Failed to rewind index %s to a previous chain tip",
+                       __func__, GetName());
+            return;
+        }
+    }
+
+    if (WriteBlock(block, pindex)) {
+        pindexBest = pindex;
+    } else {
+        FatalError("%s: Failed to write block %s to index",
+                   __func__, pindex->GetBlockHash().ToString());
+        return;
+    }
+}
+
+void BaseIndex::SetBestChain(const CBlockLocator& locator)
+{
+    if (!fSynced) {
+        return;
+    }
+
+    // The chainstate was flushed; persist how far this index got so it can
+    // resume from there after a restart.
+    const CBlockIndex* pindex = pindexBest.load();
+    if (pindex) {
+        LOCK(cs_main);
+        WriteBestBlock(pindex);
+    }
+}
+
+int BaseIndex::GetBestHeight() const
+{
+    const CBlockIndex* pindex = pindexBest.load();
+    return pindex ? pindex->nHeight : -1;
+}
+
+void BaseIndex::Start(boost::thread_group& threadGroup)
+{
+    // Need to register this CValidationInterface before running Init(), so
+    // that callbacks are not missed if Init sets fSynced to true.
+    RegisterValidationInterface(this);
+    fRegistered = true;
+    if (!Init()) {
+        FatalError("%s: %s failed to initialize", __func__, GetName());
+        return;
+    }
+
+    threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, GetName(),
+                                          boost::function<void()>(boost::bind(&BaseIndex::ThreadSync, this))));
+}
+
+void BaseIndex::Stop()
+{
+    if (fRegistered) {
+        UnregisterValidationInterface(this);
+        fRegistered = false;
+    }
+}
@@ -0,0 +1,109 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_BASE_H
+#define BITCOIN_INDEX_BASE_H
+
+#include "dbwrapper.h"
+#include "primitives/block.h"
+#include "validationinterface.h"
+
+#include <atomic>
+
+class CBlockIndex;
+
+namespace boost {
+class thread_group;
+} // namespace boost
+
+/**
+ * Base class for indices of blockchain data. This implements
+ * CValidationInterface and ensures blocks are indexed sequentially according
+ * to their position in the active chain. A newly enabled index is built by a
+ * background thread that reads historical blocks from disk while the node
+ * keeps running, after which it is kept up to date via BlockConnected
+ * notifications.
+ */
+class BaseIndex : public CValidationInterface
+{
+protected:
+    class DB : public CDBWrapper
+    {
+    public:
+        DB(const boost::filesystem::path& path, size_t nCacheSize,
+           bool fMemory = false, bool fWipe = false, bool fObfuscate = false);
+
+        /// Read block locator of the chain that the index is in sync with.
+        bool ReadBestBlock(CBlockLocator& locator) const;
+
+        /// Write block locator of the chain that the index is in sync with.
+        void WriteBestBlock(CDBBatch& batch, const CBlockLocator& locator);
+    };
+
+private:
+    /// Whether the index is in sync with the main chain. The flag is flipped
+    /// from false to true once, after which point this starts processing
+    /// CValidationInterface notifications to stay in sync.
+    std::atomic<bool> fSynced;
+
+    /// The last block in the chain that the index is in sync with.
+    std::atomic<const CBlockIndex*> pindexBest;
+
+    /// Whether this index is registered for CValidationInterface callbacks.
+    bool fRegistered;
+
+    /// Sync the index with the block index starting from the current best
+    /// block. Intended to be run in its own thread, at batch priority. Once
+    /// the index gets in sync, the fSynced flag is set and the BlockConnected
+    /// CValidationInterface callback takes over and the sync thread exits.
+    void ThreadSync();
+
+    /// Write the current chain block locator and other index state to the DB.
+    bool WriteBestBlock(const CBlockIndex* pindex);
+
+protected:
+    void BlockConnected(const CBlock& block, const CBlockIndex* pindex) override;
+
+    void SetBestChain(const CBlockLocator& locator) override;
+
+    /// Initialize internal state from the database and block index.
+    virtual bool Init();
+
+    /// Write update index entries for a newly connected block.
+    virtual bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) { return true; }
+
+    /// Virtual method called internally by WriteBestBlock that can be
+    /// overridden to atomically commit more index state along with the best
+    /// block locator.
+    virtual bool CommitInternal(CDBBatch& batch) { return true; }
+
+    /// Rewind index to an earlier chain tip during a chain reorg. The tip must
+    /// be an ancestor of the current best block.
+    virtual bool Rewind(const CBlockIndex* pindexCurrentTip, const CBlockIndex* pindexNewTip);
+
+    virtual DB& GetDB() const = 0;
+
+    /// Get the name of the index for display in logs.
+    virtual const char* GetName() const = 0;
+
+public:
+    BaseIndex();
+    /// Destructor unregisters the index from validation callbacks.
+    virtual ~BaseIndex();
+
+    /// Whether the background sync has caught up with the active chain.
+    bool IsSynced() const { return fSynced; }
+
+    /// Height of the last block the index has processed, or -1.
+    int GetBestHeight() const;
+
+    /// Initializes the index and starts the background sync thread in
+    /// threadGroup. The thread is stopped with the rest of the group.
+    void Start(boost::thread_group& threadGroup);
+
+    /// Stops receiving CValidationInterface callbacks.
+    void Stop();
+};
+
+#endif // BITCOIN_INDEX_BASE_H
@@ -0,0 +1,323 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "index/blockfilterindex.h"
+
+#include "clientversion.h"
+#include "main.h"
+#include "streams.h"
+#include "undo.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+/* The index database stores three items for each block: the disk location of
+ * the encoded filter, its hash, and the header. The entries are keyed by block
+ * hash, so entries for blocks that were disconnected in a reorg stay valid and
+ * do not need to be erased; lookups walk the active chain (or the ancestors of
+ * a given block) and only ever query blocks on it.
+ *
+ * The filters themselves are stored in flat files and referenced by the LevelDB
+ * entries. This minimizes the amount of data written to LevelDB and keeps the
+ * database values constant size. The disk location of the next block filter to
+ * be written (represented as a CDiskBlockPos) is stored under the DB_FILTER_POS
+ * key and committed atomically with the best block locator.
+ */
+static const char DB_BLOCK_HASH = 's';
+static const char DB_FILTER_POS = 'P';
+
+static const unsigned int MAX_FLTR_FILE_SIZE = 0x1000000; // 16 MiB
+/** The pre-allocation chunk size for fltr?????.dat files */
+static const unsigned int FLTR_FILE_CHUNK_SIZE = 0x100000; // 1 MiB
+
+std::unique_ptr<BlockFilterIndex> g_blockfilterindex;
+
+namespace {
+
+struct DBVal {
+    uint256 hash;
+    uint256 header;
+    CDiskBlockPos pos;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(hash);
+        READWRITE(header);
+        READWRITE(pos);
+    }
+};
+
+} // namespace
+
+BlockFilterIndex::BlockFilterIndex(BlockFilterType filterTypeIn,
+                                   size_t nCacheSize, bool fMemory, bool fWipe)
+    : filterType(filterTypeIn)
+{
+    const std::string& strFilterName = BlockFilterTypeName(filterTypeIn);
+    if (strFilterName.empty()) throw std::invalid_argument("unknown filter_type");
+
+    pathIndex = GetDataDir() / "indexes" / "blockfilter" / strFilterName;
+    boost::filesystem::create_directories(pathIndex);
+
+    db.reset(new BaseIndex::DB(pathIndex / "db", nCacheSize, fMemory, fWipe));
+}
+
+bool BlockFilterIndex::Init()
+{
+    {
+        LOCK(cs_filePos);
+        if (!db->Read(DB_FILTER_POS, nextFilterPos)) {
+            // Check that the cause of the read failure is that the key does
+            // not exist. Any other errors indicate database corruption or a
+            // disk failure, and starting the index would cause further
+            // corruption.
+            if (db->Exists(DB_FILTER_POS)) {
+                return error("%s: Cannot read current %s state; index may be corrupted",
+                             __func__, GetName());
+            }
+
+            // If the DB_FILTER_POS is not set, then initialize to the first
+            // location.
+            nextFilterPos.nFile = 0;
+            nextFilterPos.nPos = 0;
+        }
+    }
+    return BaseIndex::Init();
+}
+
+bool BlockFilterIndex::CommitInternal(CDBBatch& batch)
+{
+    LOCK(cs_filePos);
+    const CDiskBlockPos& pos = nextFilterPos;
+
+    // Flush current filter file to disk.
+    FILE* file = OpenFilterFile(pos);
+    if (!file) {
+        return error("%s: Failed to open filter file %d", __func__, pos.nFile);
+    }
+    FileCommit(file);
+    fclose(file);
+
+    batch.Write(DB_FILTER_POS, pos);
+    return true;
+}
+
+boost::filesystem::path BlockFilterIndex::GetFilterPosFilename(const CDiskBlockPos& pos) const
+{
+    return pathIndex / strprintf("fltr%05u.dat", pos.nFile);
+}
+
+FILE* BlockFilterIndex::OpenFilterFile(const CDiskBlockPos& pos, bool fReadOnly) const
+{
+    if (pos.IsNull())
+        return NULL;
+    boost::filesystem::path path = GetFilterPosFilename(pos);
+    FILE* file = fopen(path.string().c_str(), "rb+");
+    if (!file && !fReadOnly)
+        file = fopen(path.string().c_str(), "wb+");
+    if (!file) {
+        LogPrintf("Unable to open file %s\n", path.string());
+        return NULL;
+    }
+    if (pos.nPos) {
+        if (fseek(file, pos.nPos, SEEK_SET)) {
+            LogPrintf("Unable to seek to position %u of %s\n", pos.nPos, path.string());
+            fclose(file);
+            return NULL;
+        }
+    }
+    return file;
+}
+
+bool BlockFilterIndex::ReadFilterFromDisk(const CDiskBlockPos& pos, BlockFilter& filter) const
+{
+    CAutoFile filein(OpenFilterFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        return false;
+    }
+
+    uint256 hashBlock;
+    std::vector<unsigned char> vEncodedFilter;
+    try {
+        filein >> hashBlock >> vEncodedFilter;
+        filter = BlockFilter(GetFilterType(), hashBlock, std::move(vEncodedFilter));
+    }
+    catch (const std::exception& e) {
+        return error("%s: Failed to deserialize block filter from disk: %s", __func__, e.what());
+    }
+
+    return true;
+}
+
+size_t BlockFilterIndex::WriteFilterToDisk(CDiskBlockPos& pos, const BlockFilter& filter)
+{
+    assert(filter.GetFilterType() == GetFilterType());
+
+    size_t nDataSize =
+        GetSerializeSize(filter.GetBlockHash(), SER_DISK, CLIENT_VERSION) +
+        GetSerializeSize(filter.GetEncodedFilter(), SER_DISK, CLIENT_VERSION);
+
+    // If writing the filter would overflow the file, flush and move to the next one.
+    if (pos.nPos + nDataSize > MAX_FLTR_FILE_SIZE) {
+        FILE* fileLast = OpenFilterFile(pos);
+        if (!fileLast) {
+            LogPrintf("%s: Failed to open filter file %d\n", __func__, pos.nFile);
+            return 0;
+        }
+        if (!TruncateFile(fileLast, pos.nPos)) {
+            LogPrintf("%s: Failed to truncate filter file %d\n", __func__, pos.nFile);
+            fclose(fileLast);
+            return 0;
+        }
+        FileCommit(fileLast);
+        fclose(fileLast);
+
+        pos.nFile++;
+        pos.nPos = 0;
+    }
+
+    // Pre-allocate sufficient space for filter data.
+    unsigned int nOldChunks = (pos.nPos + FLTR_FILE_CHUNK_SIZE - 1) / FLTR_FILE_CHUNK_SIZE;
+    unsigned int nNewChunks = (pos.nPos + nDataSize + FLTR_FILE_CHUNK_SIZE - 1) / FLTR_FILE_CHUNK_SIZE;
+    if (nNewChunks > nOldChunks) {
+        if (!CheckDiskSpace(nNewChunks * FLTR_FILE_CHUNK_SIZE - pos.nPos)) {
+            LogPrintf("%s: out of disk space\n", __func__);
+            return 0;
+        }
+        FILE* file = OpenFilterFile(pos);
+        if (!file) {
+            LogPrintf("%s: Failed to open filter file %d\n", __func__, pos.nFile);
+            return 0;
+        }
+        AllocateFileRange(file, pos.nPos, nNewChunks * FLTR_FILE_CHUNK_SIZE - pos.nPos);
+        fclose(file);
+    }
+
+    CAutoFile fileout(OpenFilterFile(pos), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull()) {
+        LogPrintf("%s: Failed to open filter file %d\n", __func__, pos.nFile);
+        return 0;
+    }
+
+    fileout << filter.GetBlockHash() << filter.GetEncodedFilter();
+    return nDataSize;
+}
+
+bool BlockFilterIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    CBlockUndo blockUndo;
+    uint256 hashPrevHeader;
+
+    if (pindex->nHeight > 0) {
+        if (!UndoReadFromDisk(blockUndo, pindex->GetUndoPos(), pindex->pprev->GetBlockHash())) {
+            return false;
+        }
+
+        DBVal valPrev;
+        if (!db->Read(std::make_pair(DB_BLOCK_HASH, pindex->pprev->GetBlockHash()), valPrev)) {
+            return error("%s: previous block %s is not in the %s database",
+                         __func__, pindex->pprev->GetBlockHash().ToString(), GetName());
+        }
+        hashPrevHeader = valPrev.header;
+    }
+
+    BlockFilter filter(filterType, block, blockUndo);
+
+    DBVal value;
+    {
+        LOCK(cs_filePos);
+        size_t nBytesWritten = WriteFilterToDisk(nextFilterPos, filter);
+        if (nBytesWritten == 0) {
+            return false;
+        }
+        value.pos = nextFilterPos;
+        nextFilterPos.nPos += nBytesWritten;
+    }
+    value.hash = filter.GetHash();
+    value.header = filter.ComputeHeader(hashPrevHeader);
+
+    return db->Write(std::make_pair(DB_BLOCK_HASH, pindex->GetBlockHash()), value);
+}
+
+bool BlockFilterIndex::LookupFilter(const CBlockIndex* pindex, BlockFilter& filterOut) const
+{
+    DBVal entry;
+    if (!db->Read(std::make_pair(DB_BLOCK_HASH, pindex->GetBlockHash()), entry)) {
+        return false;
+    }
+
+    return ReadFilterFromDisk(entry.pos, filterOut);
+}
+
+bool BlockFilterIndex::LookupFilterHeader(const CBlockIndex* pindex, uint256& headerOut) const
+{
+    DBVal entry;
+    if (!db->Read(std::make_pair(DB_BLOCK_HASH, pindex->GetBlockHash()), entry)) {
+        return false;
+    }
+
+    headerOut = entry.header;
+    return true;
+}
+
+/** Read the index entries for the blocks from nStartHeight up to and including
+ *  pindexStop, in ascending height order. */
+static bool LookupRange(const CDBWrapper& db, int nStartHeight, const CBlockIndex* pindexStop,
+                        std::vector<DBVal>& results)
+{
+    if (nStartHeight < 0) {
+        return error("%s: start height (%d) is negative", __func__, nStartHeight);
+    }
+    if (nStartHeight > pindexStop->nHeight) {
+        return error("%s: start height (%d) is greater than stop height (%d)",
+                     __func__, nStartHeight, pindexStop->nHeight);
+    }
+
+    size_t nResults = pindexStop->nHeight - nStartHeight + 1;
+    results.resize(nResults);
+
+    const CBlockIndex* pindex = pindexStop;
+    for (size_t i = nResults; i > 0; --i, pindex = pindex->pprev) {
+        if (!db.Read(std::make_pair(DB_BLOCK_HASH, pindex->GetBlockHash()), results[i - 1])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BlockFilterIndex::LookupFilterRange(int nStartHeight, const CBlockIndex* pindexStop,
+                                         std::vector<BlockFilter>& filtersOut) const
+{
+    std::vector<DBVal> entries;
+    if (!LookupRange(*db, nStartHeight, pindexStop, entries)) {
+        return false;
+    }
+
+    filtersOut.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (!ReadFilterFromDisk(entries[i].pos, filtersOut[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool BlockFilterIndex::LookupFilterHashRange(int nStartHeight, const CBlockIndex* pindexStop,
+                                             std::vector<uint256>& hashesOut) const
+{
+    std::vector<DBVal> entries;
+    if (!LookupRange(*db, nStartHeight, pindexStop, entries)) {
+        return false;
+    }
+
+    hashesOut.clear();
+    hashesOut.reserve(entries.size());
+    for (const DBVal& entry : entries) {
+        hashesOut.push_back(entry.hash);
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_BLOCKFILTERINDEX_H
+#define BITCOIN_INDEX_BLOCKFILTERINDEX_H
+
+#include "blockfilter.h"
+#include "chain.h"
+#include "index/base.h"
+#include "sync.h"
+
+#include <memory>
+
+/**
+ * BlockFilterIndex is used to store and retrieve block filters, hashes, and
+ * headers for a range of blocks by height. An index is constructed for each
+ * supported filter type with its own database (ie. filter data for different
+ * types are stored in separate databases).
+ *
+ * The filters themselves are appended to flat files (fltrNNNNN.dat) next to
+ * the database, which records for every block the filter hash, the filter
+ * header and the position of the filter on disk.
+ */
+class BlockFilterIndex : public BaseIndex
+{
+private:
+    BlockFilterType filterType;
+    std::unique_ptr<BaseIndex::DB> db;
+
+    /// Directory holding the database and the filter files.
+    boost::filesystem::path pathIndex;
+
+    /// Guards nextFilterPos, which is advanced by WriteBlock and persisted by
+    /// CommitInternal.
+    mutable CCriticalSection cs_filePos;
+
+    /// Position in the flat files where the next filter will be written.
+    CDiskBlockPos nextFilterPos;
+
+    boost::filesystem::path GetFilterPosFilename(const CDiskBlockPos& pos) const;
+    FILE* OpenFilterFile(const CDiskBlockPos& pos, bool fReadOnly = false) const;
+    bool ReadFilterFromDisk(const CDiskBlockPos& pos, BlockFilter& filter) const;
+    /// Append a filter at pos, moving pos to the start of the next file first
+    /// if the filter does not fit. Returns the number of bytes written, or 0
+    /// on failure.
+    size_t WriteFilterToDisk(CDiskBlockPos& pos, const BlockFilter& filter);
+
+protected:
+    bool Init() override;
+
+    bool CommitInternal(CDBBatch& batch) override;
+
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) override;
+
+    BaseIndex::DB& GetDB() const override { return *db; }
+
+    const char* GetName() const override { return "blockfilterindex"; }
+
+public:
+    /** Constructs the index, which becomes available to be queried. */
+    explicit BlockFilterIndex(BlockFilterType filterTypeIn,
+                              size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+    BlockFilterType GetFilterType() const { return filterType; }
+
+    /** Get a single filter by block. */
+    bool LookupFilter(const CBlockIndex* pindex, BlockFilter& filterOut) const;
+
+    /** Get a single filter header by block. */
+    bool LookupFilterHeader(const CBlockIndex* pindex, uint256& headerOut) const;
+
+    /** Get a range of filters between two heights on a chain. */
+    bool LookupFilterRange(int nStartHeight, const CBlockIndex* pindexStop,
+                           std::vector<BlockFilter>& filtersOut) const;
+
+    /** Get a range of filter hashes between two heights on a chain. */
+    bool LookupFilterHashRange(int nStartHeight, const CBlockIndex* pindexStop,
+                               std::vector<uint256>& hashesOut) const;
+};
+
+/// The global basic block filter index, used to serve BIP 157 requests and
+/// the getblockfilter RPC. May be null.
+extern std::unique_ptr<BlockFilterIndex> g_blockfilterindex;
+
+#endif // BITCOIN_INDEX_BLOCKFILTERINDEX_H
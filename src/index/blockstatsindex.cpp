@@ -0,0 +1,239 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "index/blockstatsindex.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "consensus/consensus.h"
+#include "main.h"
+#include "policy/policy.h"
+#include "primitives/transaction.h"
+#include "undo.h"
+#include "util.h"
+
+#include <algorithm>
+
+static const char DB_BLOCK_STATS = 's';
+
+/** Approximate in-memory overhead of an unspent output next to its serialized size. */
+static const size_t PER_UTXO_OVERHEAD = sizeof(COutPoint) + sizeof(uint32_t) + sizeof(bool);
+
+std::unique_ptr<BlockStatsIndex> g_blockstatsindex;
+
+void CBlockStats::SetNull()
+{
+    hashBlock.SetNull();
+    nHeight = 0;
+    nTime = 0;
+    nMedianTime = 0;
+    nTxs = nIns = nOuts = 0;
+    nTotalSize = nTotalWeight = 0;
+    nSegwitTxs = nSegwitTotalSize = nSegwitTotalWeight = 0;
+    nTotalFee = nMinFee = nMaxFee = nAvgFee = nMedianFee = 0;
+    nMinFeeRate = nMaxFeeRate = nAvgFeeRate = 0;
+    for (int i = 0; i < NUM_GETBLOCKSTATS_PERCENTILES; i++) {
+        vFeeRatePercentiles[i] = 0;
+    }
+    nMinTxSize = nMaxTxSize = nAvgTxSize = nMedianTxSize = 0;
+    nSubsidy = nTotalOut = 0;
+    nUtxoIncrease = nUtxoSizeInc = 0;
+}
+
+template<typename T>
+static T CalculateTruncatedMedian(std::vector<T>& scores)
+{
+    size_t size = scores.size();
+    if (size == 0) {
+        return 0;
+    }
+
+    std::sort(scores.begin(), scores.end());
+    if (size % 2 == 0) {
+        return (scores[size / 2 - 1] + scores[size / 2]) / 2;
+    } else {
+        return scores[size / 2];
+    }
+}
+
+/** Feerate percentiles, weighted by transaction weight. Expects (feerate, weight) pairs. */
+static void CalculatePercentilesByWeight(CAmount result[NUM_GETBLOCKSTATS_PERCENTILES],
+                                         std::vector<std::pair<CAmount, int64_t> >& scores,
+                                         int64_t nTotalWeight)
+{
+    if (scores.empty()) {
+        return;
+    }
+
+    std::sort(scores.begin(), scores.end());
+
+    // 10th, 25th, 50th, 75th, and 90th percentile weight units.
+    const double weights[NUM_GETBLOCKSTATS_PERCENTILES] = {
+        nTotalWeight / 10.0, nTotalWeight / 4.0, nTotalWeight / 2.0, (nTotalWeight * 3.0) / 4.0, (nTotalWeight * 9.0) / 10.0
+    };
+
+    int64_t nNextPercentileIndex = 0;
+    int64_t nCumulativeWeight = 0;
+    for (const auto& element : scores) {
+        nCumulativeWeight += element.second;
+        while (nNextPercentileIndex < NUM_GETBLOCKSTATS_PERCENTILES && nCumulativeWeight >= weights[nNextPercentileIndex]) {
+            result[nNextPercentileIndex] = element.first;
+            ++nNextPercentileIndex;
+        }
+    }
+
+    // Fill any remaining percentiles with the last value.
+    for (int64_t i = nNextPercentileIndex; i < NUM_GETBLOCKSTATS_PERCENTILES; i++) {
+        result[i] = scores.back().first;
+    }
+}
+
+void ComputeBlockStats(const CBlock& block, const CBlockUndo& blockUndo,
+                       const CBlockIndex* pindex, CBlockStats& stats)
+{
+    stats.SetNull();
+    stats.hashBlock = pindex->GetBlockHash();
+    stats.nHeight = pindex->nHeight;
+    stats.nTime = pindex->GetBlockTime();
+    stats.nMedianTime = pindex->GetMedianTimePast();
+    stats.nTxs = block.vtx.size();
+    stats.nSubsidy = GetBlockSubsidy(pindex->nHeight, Params().GetConsensus());
+
+    stats.nMinFee = MAX_MONEY;
+    stats.nMinFeeRate = MAX_MONEY;
+    stats.nMinTxSize = MAX_BLOCK_SERIALIZED_SIZE;
+
+    std::vector<CAmount> vFees;
+    std::vector<std::pair<CAmount, int64_t> > vFeeRates;
+    std::vector<int64_t> vTxSizes;
+    int64_t nFeeWeight = 0;
+
+    for (size_t i = 0; i < block.vtx.size(); ++i) {
+        const CTransaction& tx = *block.vtx[i];
+        stats.nOuts += tx.vout.size();
+
+        CAmount nValueOut = 0;
+        for (const CTxOut& out : tx.vout) {
+            nValueOut += out.nValue;
+            if (!out.scriptPubKey.IsUnspendable()) {
+                stats.nUtxoIncrease++;
+                stats.nUtxoSizeInc += ::GetSerializeSize(out, SER_NETWORK, PROTOCOL_VERSION) + PER_UTXO_OVERHEAD;
+            }
+        }
+        if (tx.IsCoinBase()) {
+            continue;
+        }
+        stats.nTotalOut += nValueOut;
+
+        // Don't count the coinbase input.
+        stats.nIns += tx.vin.size();
+
+        int64_t nTxSize = tx.GetTotalSize();
+        int64_t nWeight = GetTransactionWeight(tx);
+        vTxSizes.push_back(nTxSize);
+        stats.nTotalSize += nTxSize;
+        stats.nTotalWeight += nWeight;
+        stats.nMinTxSize = std::min(stats.nMinTxSize, nTxSize);
+        stats.nMaxTxSize = std::max(stats.nMaxTxSize, nTxSize);
+
+        if (!tx.wit.IsNull()) {
+            stats.nSegwitTxs++;
+            stats.nSegwitTotalSize += nTxSize;
+            stats.nSegwitTotalWeight += nWeight;
+        }
+
+        // The undo entries of a block follow its non-coinbase transactions.
+        CAmount nValueIn = 0;
+        if (i - 1 < blockUndo.vtxundo.size()) {
+            for (const CTxInUndo& prevout : blockUndo.vtxundo[i - 1].vprevout) {
+                nValueIn += prevout.txout.nValue;
+                stats.nUtxoIncrease--;
+                stats.nUtxoSizeInc -= ::GetSerializeSize(prevout.txout, SER_NETWORK, PROTOCOL_VERSION) + PER_UTXO_OVERHEAD;
+            }
+        }
+
+        CAmount nFee = nValueIn - nValueOut;
+        int64_t nVSize = GetVirtualTransactionSize(tx);
+        CAmount nFeeRate = nVSize > 0 ? nFee / nVSize : 0;
+
+        vFees.push_back(nFee);
+        vFeeRates.push_back(std::make_pair(nFeeRate, nWeight));
+        nFeeWeight += nWeight;
+
+        stats.nTotalFee += nFee;
+        stats.nMinFee = std::min(stats.nMinFee, nFee);
+        stats.nMaxFee = std::max(stats.nMaxFee, nFee);
+        stats.nMinFeeRate = std::min(stats.nMinFeeRate, nFeeRate);
+        stats.nMaxFeeRate = std::max(stats.nMaxFeeRate, nFeeRate);
+    }
+
+    int64_t nTxsNoCoinbase = std::max<int64_t>(0, stats.nTxs - 1);
+    if (nTxsNoCoinbase == 0) {
+        stats.nMinFee = 0;
+        stats.nMinFeeRate = 0;
+        stats.nMinTxSize = 0;
+    } else {
+        stats.nAvgFee = stats.nTotalFee / nTxsNoCoinbase;
+        stats.nAvgTxSize = stats.nTotalSize / nTxsNoCoinbase;
+    }
+    if (nFeeWeight > 0) {
+        stats.nAvgFeeRate = (stats.nTotalFee * WITNESS_SCALE_FACTOR) / nFeeWeight;
+    }
+    stats.nMedianFee = CalculateTruncatedMedian(vFees);
+    stats.nMedianTxSize = CalculateTruncatedMedian(vTxSizes);
+    CalculatePercentilesByWeight(stats.vFeeRatePercentiles, vFeeRates, nFeeWeight);
+}
+
+/** Access to the block stats index database (indexes/blockstats/) */
+class BlockStatsIndex::DB : public BaseIndex::DB
+{
+public:
+    explicit DB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+    bool ReadStats(const uint256& hashBlock, CBlockStats& stats) const;
+
+    bool WriteStats(const CBlockStats& stats);
+};
+
+BlockStatsIndex::DB::DB(size_t nCacheSize, bool fMemory, bool fWipe) :
+    BaseIndex::DB(GetDataDir() / "indexes" / "blockstats", nCacheSize, fMemory, fWipe)
+{}
+
+bool BlockStatsIndex::DB::ReadStats(const uint256& hashBlock, CBlockStats& stats) const
+{
+    return Read(std::make_pair(DB_BLOCK_STATS, hashBlock), stats);
+}
+
+bool BlockStatsIndex::DB::WriteStats(const CBlockStats& stats)
+{
+    return Write(std::make_pair(DB_BLOCK_STATS, stats.hashBlock), stats);
+}
+
+BlockStatsIndex::BlockStatsIndex(size_t nCacheSize, bool fMemory, bool fWipe)
+    : db(new BlockStatsIndex::DB(nCacheSize, fMemory, fWipe))
+{}
+
+BlockStatsIndex::~BlockStatsIndex() {}
+
+bool BlockStatsIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    // Fees need the spent outputs. For a new tip ConnectBlock has just
+    // written the undo data, so this read is served from the OS cache.
+    CBlockUndo blockUndo;
+    if (pindex->nHeight > 0 &&
+        !UndoReadFromDisk(blockUndo, pindex->GetUndoPos(), pindex->pprev->GetBlockHash())) {
+        return false;
+    }
+
+    CBlockStats stats;
+    ComputeBlockStats(block, blockUndo, pindex, stats);
+    return db->WriteStats(stats);
+}
+
+BaseIndex::DB& BlockStatsIndex::GetDB() const { return *db; }
+
+bool BlockStatsIndex::LookupStats(const CBlockIndex* pindex, CBlockStats& stats) const
+{
+    return db->ReadStats(pindex->GetBlockHash(), stats);
+}
@@ -0,0 +1,144 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_BLOCKSTATSINDEX_H
+#define BITCOIN_INDEX_BLOCKSTATSINDEX_H
+
+#include "amount.h"
+#include "index/base.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <memory>
+
+class CBlockUndo;
+
+/** Number of feerate percentiles kept per block (10th, 25th, 50th, 75th and 90th). */
+static const int NUM_GETBLOCKSTATS_PERCENTILES = 5;
+
+/**
+ * Summary statistics of a single block. Fee related values only cover the
+ * non-coinbase transactions; feerates are in satoshis per virtual byte.
+ */
+struct CBlockStats
+{
+    uint256 hashBlock;
+    int nHeight;
+    int64_t nTime;
+    int64_t nMedianTime;
+
+    int64_t nTxs;
+    int64_t nIns;
+    int64_t nOuts;
+    int64_t nTotalSize;
+    int64_t nTotalWeight;
+    int64_t nSegwitTxs;
+    int64_t nSegwitTotalSize;
+    int64_t nSegwitTotalWeight;
+
+    CAmount nTotalFee;
+    CAmount nMinFee;
+    CAmount nMaxFee;
+    CAmount nAvgFee;
+    CAmount nMedianFee;
+    CAmount nMinFeeRate;
+    CAmount nMaxFeeRate;
+    CAmount nAvgFeeRate;
+    CAmount vFeeRatePercentiles[NUM_GETBLOCKSTATS_PERCENTILES];
+
+    int64_t nMinTxSize;
+    int64_t nMaxTxSize;
+    int64_t nAvgTxSize;
+    int64_t nMedianTxSize;
+
+    CAmount nSubsidy;
+    CAmount nTotalOut;
+    int64_t nUtxoIncrease;
+    int64_t nUtxoSizeInc;
+
+    CBlockStats() { SetNull(); }
+
+    void SetNull();
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(nTime);
+        READWRITE(nMedianTime);
+        READWRITE(nTxs);
+        READWRITE(nIns);
+        READWRITE(nOuts);
+        READWRITE(nTotalSize);
+        READWRITE(nTotalWeight);
+        READWRITE(nSegwitTxs);
+        READWRITE(nSegwitTotalSize);
+        READWRITE(nSegwitTotalWeight);
+        READWRITE(nTotalFee);
+        READWRITE(nMinFee);
+        READWRITE(nMaxFee);
+        READWRITE(nAvgFee);
+        READWRITE(nMedianFee);
+        READWRITE(nMinFeeRate);
+        READWRITE(nMaxFeeRate);
+        READWRITE(nAvgFeeRate);
+        for (int i = 0; i < NUM_GETBLOCKSTATS_PERCENTILES; i++) {
+            READWRITE(vFeeRatePercentiles[i]);
+        }
+        READWRITE(nMinTxSize);
+        READWRITE(nMaxTxSize);
+        READWRITE(nAvgTxSize);
+        READWRITE(nMedianTxSize);
+        READWRITE(nSubsidy);
+        READWRITE(nTotalOut);
+        READWRITE(nUtxoIncrease);
+        READWRITE(nUtxoSizeInc);
+    }
+};
+
+/**
+ * Compute the statistics of a connected block from the block itself and its
+ * undo data, which carries the spent outputs needed for the fees.
+ */
+void ComputeBlockStats(const CBlock& block, const CBlockUndo& blockUndo,
+                       const CBlockIndex* pindex, CBlockStats& stats);
+
+/**
+ * BlockStatsIndex keeps precomputed CBlockStats for every block of the active
+ * chain, so that per-block statistics can be served without reading blocks and
+ * looking up the outputs they spend. Entries are keyed by block hash.
+ */
+class BlockStatsIndex : public BaseIndex
+{
+protected:
+    class DB;
+
+private:
+    const std::unique_ptr<DB> db;
+
+protected:
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) override;
+
+    BaseIndex::DB& GetDB() const override;
+
+    const char* GetName() const override { return "blockstatsindex"; }
+
+public:
+    /// Constructs the index, which becomes available to be queried.
+    explicit BlockStatsIndex(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+    // Destructor is declared because this class contains a unique_ptr to an incomplete type.
+    virtual ~BlockStatsIndex();
+
+    /// Look up the statistics of a block. Returns false if the block has not
+    /// been indexed.
+    bool LookupStats(const CBlockIndex* pindex, CBlockStats& stats) const;
+};
+
+/// The global block statistics index, used by the getblockstats RPC. May be null.
+extern std::unique_ptr<BlockStatsIndex> g_blockstatsindex;
+
+#endif // BITCOIN_INDEX_BLOCKSTATSINDEX_H
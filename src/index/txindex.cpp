@@ -0,0 +1,96 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "index/txindex.h"
+
+#include "chain.h"
+#include "clientversion.h"
+#include "main.h"
+#include "streams.h"
+#include "txdb.h"
+#include "util.h"
+
+static const char DB_TXINDEX = 't';
+
+std::unique_ptr<TxIndex> g_txindex;
+
+/** Access to the txindex database (indexes/txindex/) */
+class TxIndex::DB : public BaseIndex::DB
+{
+public:
+    explicit DB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+    /// Read the disk location of the transaction data with the given hash. Returns false if the
+    /// transaction hash is not indexed.
+    bool ReadTxPos(const uint256& txid, CDiskTxPos& pos) const;
+
+    /// Write a batch of transaction positions to the DB.
+    bool WriteTxs(const std::vector<std::pair<uint256, CDiskTxPos> >& vPos);
+};
+
+TxIndex::DB::DB(size_t nCacheSize, bool fMemory, bool fWipe) :
+    BaseIndex::DB(GetDataDir() / "indexes" / "txindex", nCacheSize, fMemory, fWipe)
+{}
+
+bool TxIndex::DB::ReadTxPos(const uint256& txid, CDiskTxPos& pos) const
+{
+    return Read(std::make_pair(DB_TXINDEX, txid), pos);
+}
+
+bool TxIndex::DB::WriteTxs(const std::vector<std::pair<uint256, CDiskTxPos> >& vPos)
+{
+    CDBBatch batch(*this);
+    for (const auto& tuple : vPos) {
+        batch.Write(std::make_pair(DB_TXINDEX, tuple.first), tuple.second);
+    }
+    return WriteBatch(batch);
+}
+
+TxIndex::TxIndex(size_t nCacheSize, bool fMemory, bool fWipe)
+    : db(new TxIndex::DB(nCacheSize, fMemory, fWipe))
+{}
+
+TxIndex::~TxIndex() {}
+
+bool TxIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    vPos.reserve(block.vtx.size());
+    for (const auto& tx : block.vtx) {
+        vPos.push_back(std::make_pair(tx->GetHash(), pos));
+        pos.nTxOffset += ::GetSerializeSize(*tx, SER_DISK, CLIENT_VERSION);
+    }
+    return db->WriteTxs(vPos);
+}
+
+BaseIndex::DB& TxIndex::GetDB() const { return *db; }
+
+bool TxIndex::FindTx(const uint256& txid, uint256& hashBlock, CTransaction& tx) const
+{
+    CDiskTxPos postx;
+    if (!db->ReadTxPos(txid, postx)) {
+        return false;
+    }
+
+    CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        return error("%s: OpenBlockFile failed", __func__);
+    }
+    CBlockHeader header;
+    try {
+        file >> header;
+        if (fseek(file.Get(), postx.nTxOffset, SEEK_CUR)) {
+            return error("%s: fseek(...) failed", __func__);
+        }
+        file >> tx;
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+    if (tx.GetHash() != txid) {
+        return error("%s: txid mismatch", __func__);
+    }
+    hashBlock = header.GetHash();
+    return true;
+}
@@ -15,6 +15,8 @@
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
 #include "hash.h"
+#include "index/blockfilterindex.h"
+#include "index/txindex.h"
 #include "init.h"
 #include "merkleblock.h"
 #include "net.h"
@@ -60,7 +62,7 @@ using namespace std;
  * Global state
  */
 
-CCriticalSection cs_main;
+CCriticalSection cs_main(true);
 
 BlockMap mapBlockIndex;
 CChain chainActive;
@@ -71,7 +73,6 @@ CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
 std::atomic_bool fImporting(false);
 bool fReindex = false;
-bool fTxIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
@@ -82,6 +83,7 @@ size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
 bool fEnableReplacement = DEFAULT_ENABLE_REPLACEMENT;
+bool fTxReconciliation = DEFAULT_TXRECONCILIATION;
 
 
 CFeeRate minRelayTxFee = CFeeRate(DEFAULT_MIN_RELAY_TX_FEE);
@@ -93,7 +95,7 @@ FeeFilterRounder filterRounder(::minRelayTxFee);
 struct IteratorComparator
 {
     template<typename I>
-    bool operator()(const I& a, const I& b)
+    bool operator()(const I& a, const I& b) const
     {
         return &(*a) < &(*b);
     }
@@ -204,9 +206,12 @@ namespace {
      * million to make it highly unlikely for users to have issues with this
      * filter.
      *
-     * Memory used: 1.3 MB
+     * It is checked for every transaction announced by every peer, so it is a
+     * blocked filter, which is faster at the cost of some memory.
+     *
+     * Memory used: 2.2 MB
      */
-    std::unique_ptr<CRollingBloomFilter> recentRejects;
+    std::unique_ptr<CBlockedRollingBloomFilter> recentRejects;
     uint256 hashRecentRejectsChainTip;
 
     /** Blocks that are in flight, and that are in the queue to be downloaded. Protected by cs_main. */
@@ -1173,9 +1178,19 @@ std::string FormatStateMessage(const CValidationState &state)
         state.GetRejectCode());
 }
 
+/** Script verification flags transactions are accepted to the mempool with */
+static unsigned int GetMempoolScriptVerifyFlags()
+{
+    unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
+    if (!Params().RequireStandard()) {
+        scriptVerifyFlags = GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
+    }
+    return scriptVerifyFlags;
+}
+
 bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
                               bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
-                              std::vector<uint256>& vHashTxnToUncache)
+                              std::vector<uint256>& vHashTxnToUncache, bool fScriptChecks)
 {
     const uint256 hash = tx.GetHash();
     AssertLockHeld(cs_main);
@@ -1395,22 +1410,27 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
                 REJECT_HIGHFEE, "absurdly-high-fee",
                 strprintf("%d > %d", nFees, nAbsurdFee));
 
+        // Walking the mempool needs its lock, and so do the subsequent
+        // RemoveStaged() and addUnchecked() calls, which otherwise don't
+        // guarantee mempool consistency for us.
+        LOCK(pool.cs);
+
         // Calculate in-mempool ancestors, up to a limit.
-        CTxMemPool::setEntries setAncestors;
+        CTxMemPool::vecEntries vAncestors;
         size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
         size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
         size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
         size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
         std::string errString;
-        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+        if (!pool.CalculateMemPoolAncestors(entry, vAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
             return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
         }
 
         // A transaction that spends outputs that would be replaced by it is invalid. Now
         // that we have the set of all ancestors we can detect this
-        // pathological case by making sure setConflicts and setAncestors don't
+        // pathological case by making sure setConflicts and vAncestors don't
         // intersect.
-        BOOST_FOREACH(CTxMemPool::txiter ancestorIt, setAncestors)
+        BOOST_FOREACH(CTxMemPool::txiter ancestorIt, vAncestors)
         {
             const uint256 &hashAncestor = ancestorIt->GetTx().GetHash();
             if (setConflicts.count(hashAncestor))
@@ -1428,18 +1448,13 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         CAmount nConflictingFees = 0;
         size_t nConflictingSize = 0;
         uint64_t nConflictingCount = 0;
-        CTxMemPool::setEntries allConflicting;
-
-        // If we don't hold the lock allConflicting might be incomplete; the
-        // subsequent RemoveStaged() and addUnchecked() calls don't guarantee
-        // mempool consistency for us.
-        LOCK(pool.cs);
+        CTxMemPool::vecEntries allConflicting;
         if (setConflicts.size())
         {
             CFeeRate newFeeRate(nModifiedFees, nSize);
             set<uint256> setConflictsParents;
             const int maxDescendantsToVisit = 100;
-            CTxMemPool::setEntries setIterConflicting;
+            CTxMemPool::vecEntries vIterConflicting;
             BOOST_FOREACH(const uint256 &hashConflicting, setConflicts)
             {
                 CTxMemPool::txiter mi = pool.mapTx.find(hashConflicting);
@@ -1447,7 +1462,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
                     continue;
 
                 // Save these to avoid repeated lookups
-                setIterConflicting.insert(mi);
+                vIterConflicting.push_back(mi);
 
                 // Don't allow the replacement to reduce the feerate of the
                 // mempool.
@@ -1489,9 +1504,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
             if (nConflictingCount <= maxDescendantsToVisit) {
                 // If not too many to replace, then calculate the set of
                 // transactions that would have to be evicted
-                BOOST_FOREACH(CTxMemPool::txiter it, setIterConflicting) {
-                    pool.CalculateDescendants(it, allConflicting);
-                }
+                pool.CalculateDescendants(vIterConflicting, allConflicting);
                 BOOST_FOREACH(CTxMemPool::txiter it, allConflicting) {
                     nConflictingFees += it->GetModifiedFee();
                     nConflictingSize += it->GetTxSize();
@@ -1549,15 +1562,12 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
             }
         }
 
-        unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
-        if (!Params().RequireStandard()) {
-            scriptVerifyFlags = GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
-        }
+        unsigned int scriptVerifyFlags = GetMempoolScriptVerifyFlags();
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, txdata)) {
+        if (!CheckInputs(tx, state, view, fScriptChecks, scriptVerifyFlags, true, txdata)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
             // need to turn both off, and compare against just turning off CLEANSTACK
             // to see if the failure is specifically due to witness validation.
@@ -1578,7 +1588,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
+        if (!CheckInputs(tx, state, view, fScriptChecks, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
         {
             return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
                 __func__, hash.ToString(), FormatStateMessage(state));
@@ -1596,7 +1606,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         pool.RemoveStaged(allConflicting, false);
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+        pool.addUnchecked(hash, entry, vAncestors, !IsInitialBlockDownload());
 
         // trim mempool and check if tx was trimmed
         if (!fOverrideMempoolLimit) {
@@ -1612,10 +1622,10 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
 }
 
 bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+                        bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount nAbsurdFee, bool fScriptChecks)
 {
     std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache, fScriptChecks);
     if (!res) {
         BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
             pcoinsTip->Uncache(hashTx);
@@ -1646,25 +1656,10 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
         return true;
     }
 
-    if (fTxIndex) {
-        CDiskTxPos postx;
-        if (pblocktree->ReadTxIndex(hash, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-            if (file.IsNull())
-                return error("%s: OpenBlockFile failed", __func__);
-            CBlockHeader header;
-            try {
-                file >> header;
-                fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                file >> txOut;
-            } catch (const std::exception& e) {
-                return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-            }
-            hashBlock = header.GetHash();
-            if (txOut.GetHash() != hash)
-                return error("%s: txid mismatch", __func__);
-            return true;
-        }
+    // The index may still be catching up in the background; whatever it
+    // already covers is authoritative, anything else falls through.
+    if (g_txindex && g_txindex->FindTx(hash, hashBlock, txOut)) {
+        return true;
     }
 
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
@@ -2122,6 +2117,26 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     return true;
 }
 
+/** Abort with a message */
+bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
+{
+    strMiscWarning = strMessage;
+    LogPrintf("*** %s\n", strMessage);
+    uiInterface.ThreadSafeMessageBox(
+        userMessage.empty() ? _("Error: A fatal internal error occurred, see debug.log for details") : userMessage,
+        "", CClientUIInterface::MSG_ERROR);
+    StartShutdown();
+    return false;
+}
+
+bool AbortNode(CValidationState& state, const std::string& strMessage, const std::string& userMessage="")
+{
+    AbortNode(strMessage, userMessage);
+    return state.Error(strMessage);
+}
+
+} // anon namespace
+
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
     // Open history file to read
@@ -2149,26 +2164,6 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
     return true;
 }
 
-/** Abort with a message */
-bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
-{
-    strMiscWarning = strMessage;
-    LogPrintf("*** %s\n", strMessage);
-    uiInterface.ThreadSafeMessageBox(
-        userMessage.empty() ? _("Error: A fatal internal error occurred, see debug.log for details") : userMessage,
-        "", CClientUIInterface::MSG_ERROR);
-    StartShutdown();
-    return false;
-}
-
-bool AbortNode(CValidationState& state, const std::string& strMessage, const std::string& userMessage="")
-{
-    AbortNode(strMessage, userMessage);
-    return state.Error(strMessage);
-}
-
-} // anon namespace
-
 /**
  * Apply the undo operation of a CTxInUndo to the given chain state.
  * @param undo The undo object.
@@ -2465,9 +2460,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     CAmount nFees = 0;
     int nInputs = 0;
     int64_t nSigOpsCost = 0;
-    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
-    vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     std::vector<PrecomputedTransactionData> txdata;
     txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
@@ -2525,8 +2517,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
         UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
 
-        vPos.push_back(std::make_pair(tx.GetHash(), pos));
-        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
     int64_t nTime3 = GetTimeMicros(); nTimeConnect += nTime3 - nTime2;
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime3 - nTime2), 0.001 * (nTime3 - nTime2) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime3 - nTime2) / (nInputs-1), nTimeConnect * 0.000001);
@@ -2565,10 +2555,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
-            return AbortNode(state, "Failed to write transaction index");
-
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2762,8 +2748,49 @@ void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
 
 }
 
-/** Disconnect chainActive's tip. You probably want to call mempool.removeForReorg and manually re-limit mempool size after this, with cs_main held. */
-bool static DisconnectTip(CValidationState& state, const CChainParams& chainparams, bool fBare = false)
+/**
+ * Add the transactions of the blocks disconnected in a reorg back to the
+ * mempool, parents first, and update the state of their in-mempool
+ * descendants in one pass. Then remove what is no longer valid on the new tip
+ * and trim the mempool to its size limit. With fAddToMempool false, e.g. when
+ * the reorg failed half-way, the transactions and their in-mempool
+ * descendants are only removed. Leaves disconnectpool empty.
+ */
+static void UpdateMempoolForReorg(DisconnectedBlockTransactions& disconnectpool, bool fAddToMempool)
+{
+    AssertLockHeld(cs_main);
+    std::vector<uint256> vHashUpdate;
+    // Walk backwards, which gives the transactions in chain order
+    auto it = disconnectpool.queuedTx.get<insertion_order>().rbegin();
+    while (it != disconnectpool.queuedTx.get<insertion_order>().rend()) {
+        const CTransaction& tx = **it;
+        // ignore validation errors in resurrected transactions
+        CValidationState stateDummy;
+        if (!fAddToMempool || tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, true)) {
+            mempool.removeRecursive(tx);
+        } else if (mempool.exists(tx.GetHash())) {
+            vHashUpdate.push_back(tx.GetHash());
+        }
+        ++it;
+    }
+    disconnectpool.clear();
+    // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+    // no in-mempool children, which is generally not true when adding
+    // previously-confirmed transactions back to the mempool.
+    // UpdateTransactionsFromBlock finds descendants of any transactions in the
+    // disconnected blocks that were added back and cleans up the mempool state.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
+
+    mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+}
+
+/**
+ * Disconnect chainActive's tip. Its transactions are added to disconnectpool,
+ * unless it is NULL, for UpdateMempoolForReorg to add back to the mempool
+ * once the reorg is over, with cs_main held.
+ */
+bool static DisconnectTip(CValidationState& state, const CChainParams& chainparams, DisconnectedBlockTransactions* disconnectpool)
 {
     CBlockIndex *pindexDelete = chainActive.Tip();
     assert(pindexDelete);
@@ -2784,25 +2811,17 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
 
-    if (!fBare) {
-        // Resurrect mempool transactions from the disconnected block.
-        std::vector<uint256> vHashUpdate;
-        for (const auto& it : block.vtx) {
-            const CTransaction& tx = *it;
-            // ignore validation errors in resurrected transactions
-            CValidationState stateDummy;
-            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, true)) {
-                mempool.removeRecursive(tx);
-            } else if (mempool.exists(tx.GetHash())) {
-                vHashUpdate.push_back(tx.GetHash());
-            }
+    if (disconnectpool) {
+        // Save transactions to re-add to mempool at end of reorg
+        for (auto it = block.vtx.rbegin(); it != block.vtx.rend(); ++it) {
+            disconnectpool->addTransaction(*it);
+        }
+        while (disconnectpool->DynamicMemoryUsage() > MAX_DISCONNECTED_TX_POOL_SIZE * 1000) {
+            // Drop the earliest entry, and remove its children from the mempool.
+            auto it = disconnectpool->queuedTx.get<insertion_order>().begin();
+            mempool.removeRecursive(**it);
+            disconnectpool->removeEntry(it);
         }
-        // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
-        // no in-mempool children, which is generally not true when adding
-        // previously-confirmed transactions back to the mempool.
-        // UpdateTransactionsFromBlock finds descendants of any transactions in this
-        // block that were added back and cleans up the mempool state.
-        mempool.UpdateTransactionsFromBlock(vHashUpdate);
     }
 
     // Update chainActive and related variables.
@@ -2825,7 +2844,7 @@ static int64_t nTimePostConnect = 0;
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
  * corresponding to pindexNew, to bypass loading it again from disk.
  */
-bool static ConnectTip(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexNew, const CBlock* pblock, std::vector<CTransactionRef> &txConflicted, std::vector<std::tuple<CTransactionRef,CBlockIndex*,int>> &txChanged)
+bool static ConnectTip(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexNew, const CBlock* pblock, std::vector<CTransactionRef> &txConflicted, std::vector<std::tuple<CTransactionRef,CBlockIndex*,int>> &txChanged, DisconnectedBlockTransactions &disconnectpool)
 {
     assert(pindexNew->pprev == chainActive.Tip());
     // Read block from disk.
@@ -2862,9 +2881,12 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
     // Remove conflicting transactions from the mempool.;
     mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, &txConflicted, !IsInitialBlockDownload());
+    disconnectpool.removeForBlock(pblock->vtx);
     // Update chainActive & related variables.
     UpdateTip(pindexNew, chainparams);
 
+    GetMainSignals().BlockConnected(*pblock, pindexNew);
+
     for (unsigned int i=0; i < pblock->vtx.size(); i++)
         txChanged.emplace_back(pblock->vtx[i], pindexNew, i);
 
@@ -2956,9 +2978,14 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
 
     // Disconnect active blocks which are no longer in the best chain.
     bool fBlocksDisconnected = false;
+    DisconnectedBlockTransactions disconnectpool;
     while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
-        if (!DisconnectTip(state, chainparams))
+        if (!DisconnectTip(state, chainparams, &disconnectpool)) {
+            // This is likely a fatal error, but keep the mempool consistent,
+            // just in case. Only remove from the mempool in this case.
+            UpdateMempoolForReorg(disconnectpool, false);
             return false;
+        }
         fBlocksDisconnected = true;
     }
 
@@ -2981,7 +3008,7 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
 
         // Connect new blocks.
         BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
-            if (!ConnectTip(state, chainparams, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL, txConflicted, txChanged)) {
+            if (!ConnectTip(state, chainparams, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL, txConflicted, txChanged, disconnectpool)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
                     if (!state.CorruptionPossible())
@@ -2992,6 +3019,9 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
                     break;
                 } else {
                     // A system error occurred (disk space, database error, ...).
+                    // Make the mempool consistent with the current tip, just in case
+                    // any observers try to use it before shutdown.
+                    UpdateMempoolForReorg(disconnectpool, false);
                     return false;
                 }
             } else {
@@ -3006,8 +3036,9 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
     }
 
     if (fBlocksDisconnected) {
-        mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
-        LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        // The transactions of all disconnected blocks, less those confirmed
+        // again above, go back to the mempool in one batch.
+        UpdateMempoolForReorg(disconnectpool, true);
     }
     mempool.check(pcoinsTip);
 
@@ -3155,6 +3186,7 @@ bool InvalidateBlock(CValidationState& state, const CChainParams& chainparams, C
     setDirtyBlockIndex.insert(pindex);
     setBlockIndexCandidates.erase(pindex);
 
+    DisconnectedBlockTransactions disconnectpool;
     while (chainActive.Contains(pindex)) {
         CBlockIndex *pindexWalk = chainActive.Tip();
         pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
@@ -3162,13 +3194,14 @@ bool InvalidateBlock(CValidationState& state, const CChainParams& chainparams, C
         setBlockIndexCandidates.erase(pindexWalk);
         // ActivateBestChain considers blocks already in chainActive
         // unconditionally valid already, so force disconnect away from it.
-        if (!DisconnectTip(state, chainparams)) {
-            mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
+        if (!DisconnectTip(state, chainparams, &disconnectpool)) {
+            UpdateMempoolForReorg(disconnectpool, false);
             return false;
         }
     }
 
-    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    // Add the transactions of the disconnected blocks back to the mempool.
+    UpdateMempoolForReorg(disconnectpool, true);
 
     // The resulting new best tip may not be in setBlockIndexCandidates anymore, so
     // add it again.
@@ -3181,7 +3214,6 @@ bool InvalidateBlock(CValidationState& state, const CChainParams& chainparams, C
     }
 
     InvalidChainFound(pindex);
-    mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
     uiInterface.NotifyBlockTip(IsInitialBlockDownload(), pindex->pprev);
     return true;
 }
@@ -3791,6 +3823,23 @@ bool ProcessNewBlock(const CChainParams& chainparams, const CBlock* pblock, bool
     return true;
 }
 
+bool AcceptNewBlock(const CChainParams& chainparams, const CBlock* pblock, CBlockIndex** ppindex)
+{
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        // The block index is checked by ActivateBestChain later on
+        bool ret = AcceptBlock(*pblock, state, chainparams, ppindex, true, NULL, NULL);
+        if (!ret) {
+            GetMainSignals().BlockChecked(*pblock, state);
+            return error("%s: AcceptBlock FAILED", __func__);
+        }
+    }
+
+    NotifyHeaderTip();
+    return true;
+}
+
 bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     AssertLockHeld(cs_main);
@@ -4078,10 +4127,6 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     pblocktree->ReadReindexing(fReindexing);
     fReindex |= fReindexing;
 
-    // Check whether we have a transaction index
-    pblocktree->ReadFlag("txindex", fTxIndex);
-    LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
-
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -4225,7 +4270,7 @@ bool RewindBlockIndex(const CChainParams& params)
             // of the blockchain).
             break;
         }
-        if (!DisconnectTip(state, params, true)) {
+        if (!DisconnectTip(state, params, NULL)) {
             return error("RewindBlockIndex: unable to disconnect block at height %i", pindex->nHeight);
         }
         // Occasionally flush state to disk.
@@ -4332,9 +4377,6 @@ bool InitBlockIndex(const CChainParams& chainparams)
     if (chainActive.Genesis() != NULL)
         return true;
 
-    // Use the provided setting for -txindex in the new database
-    fTxIndex = GetBoolArg("-txindex", DEFAULT_TXINDEX);
-    pblocktree->WriteFlag("txindex", fTxIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -4718,7 +4760,7 @@ std::string GetWarnings(const std::string& strFor)
 
 PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn) : connman(connmanIn) {
     // Initialize global variables that cannot be constructed at startup.
-    recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
+    recentRejects.reset(new CBlockedRollingBloomFilter(120000, 0.000001));
 }
 
 void PeerLogicValidation::SyncTransaction(const CTransaction& tx, const CBlockIndex* pindex, int nPosInBlock) {
@@ -4883,6 +4925,36 @@ static void RelayAddress(const CAddress& addr, bool fReachable, CConnman& connma
     connman.ForEachNodeThen(std::move(sortfunc), std::move(pushfunc));
 }
 
+/** The send queue class of the response to a getdata for inv */
+static SendPriority GetDataSendPriority(const CInv& inv)
+{
+    AssertLockHeld(cs_main);
+    if (inv.type == MSG_TX || inv.type == MSG_WITNESS_TX)
+        return SEND_PRIORITY_TX;
+    // Blocks near the tip are still propagating and go out with the
+    // announcements; older ones are served after everything else.
+    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+    if (mi != mapBlockIndex.end() && mi->second->nHeight >= chainActive.Height() - MAX_BLOCKTXN_DEPTH)
+        return SEND_PRIORITY_ANNOUNCE;
+    return SEND_PRIORITY_BLOCK;
+}
+
+/** Announce transactions that came out of a reconciliation with pto */
+static void PushReconciledInventory(CNode* pto, const std::vector<uint256>& vTxid, CConnman& connman)
+{
+    CNetMsgMaker msgMaker(pto->GetSendVersion());
+    std::vector<CInv> vInv;
+    BOOST_FOREACH(const uint256& txid, vTxid) {
+        vInv.push_back(CInv(MSG_TX, txid));
+        if (vInv.size() == MAX_INV_SZ) {
+            connman.PushMessage(pto, msgMaker.Make(NetMsgType::INV, vInv), SEND_PRIORITY_TX);
+            vInv.clear();
+        }
+    }
+    if (!vInv.empty())
+        connman.PushMessage(pto, msgMaker.Make(NetMsgType::INV, vInv), SEND_PRIORITY_TX);
+}
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams, CConnman& connman)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -4893,7 +4965,8 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= nMaxSendBufferSize)
+        SendPriority nPriority = GetDataSendPriority(*it);
+        if (pfrom->GetSendSize(nPriority) >= nMaxSendBufferSize)
             break;
 
         const CInv &inv = *it;
@@ -4941,10 +5014,12 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                     CBlock block;
                     if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
                         assert(!"cannot load block from disk");
+                    // Full blocks are held to the upload rate limits even
+                    // when they go out with the announcements
                     if (inv.type == MSG_BLOCK)
-                        connman.PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block));
+                        connman.PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block), nPriority, true);
                     else if (inv.type == MSG_WITNESS_BLOCK)
-                        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, block));
+                        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, block), nPriority, true);
                     else if (inv.type == MSG_FILTERED_BLOCK)
                     {
                         bool sendMerkleBlock = false;
@@ -4957,16 +5032,20 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                             }
                         }
                         if (sendMerkleBlock) {
-                            connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
+                            std::vector<CSerializedNetMsg> vMsgs;
+                            vMsgs.push_back(msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                             // This avoids hurting performance by pointlessly requiring a round-trip
                             // Note that there is currently no way for a node to request any single transactions we didn't send here -
                             // they must either disconnect and retry or request the full block.
                             // Thus, the protocol spec specified allows for us to provide duplicate txn here,
                             // however we MUST always provide at least what the remote peer needs
+                            // The transactions are queued with the merkleblock so that nothing
+                            // more urgent is sent between them.
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                connman.PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *block.vtx[pair.first]));
+                                vMsgs.push_back(msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *block.vtx[pair.first]));
+                            connman.PushMessages(pfrom, std::move(vMsgs), nPriority);
                         }
                         // else
                             // no response
@@ -4983,7 +5062,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                             CBlockHeaderAndShortTxIDs cmpctblock(block, fPeerWantsWitness);
                             connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
                         } else
-                            connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, block));
+                            connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, block), nPriority, true);
                     }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
@@ -4994,7 +5073,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         // wait for other stuff first.
                         vector<CInv> vInv;
                         vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv));
+                        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv), nPriority);
                         pfrom->hashContinue.SetNull();
                     }
                 }
@@ -5052,6 +5131,190 @@ uint32_t GetFetchFlags(CNode* pfrom, CBlockIndex* pprev, const Consensus::Params
     return nFetchFlags;
 }
 
+/**
+ * Validation logic for compact filters request handling.
+ *
+ * May disconnect from the peer in the case of a bad request.
+ *
+ * @param[in]   pfrom           The peer that we received the request from
+ * @param[in]   nFilterType     The filter type the request is for. Must be basic filters.
+ * @param[in]   nStartHeight    The start height for the request
+ * @param[in]   hashStop        The stop_hash for the request
+ * @param[in]   nMaxHeightDiff  The maximum number of items permitted to request, as specified in BIP 157
+ * @param[out]  pindexStop      The CBlockIndex for the hashStop block, if the request can be serviced.
+ * @return                      True if the request can be serviced.
+ */
+static bool PrepareBlockFilterRequest(CNode* pfrom, uint8_t nFilterType, uint32_t nStartHeight,
+                                      const uint256& hashStop, uint32_t nMaxHeightDiff,
+                                      const CBlockIndex*& pindexStop)
+{
+    bool fSupportedFilterType =
+        (nFilterType == static_cast<uint8_t>(BASIC) &&
+         (pfrom->GetLocalServices() & NODE_COMPACT_FILTERS));
+    if (!fSupportedFilterType || !g_blockfilterindex) {
+        LogPrint("net", "peer %d requested unsupported block filter type: %d\n",
+                 pfrom->id, static_cast<int>(nFilterType));
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+
+        // Only serve filters for blocks in the active chain.
+        if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second)) {
+            LogPrint("net", "peer %d requested invalid block hash: %s\n",
+                     pfrom->id, hashStop.ToString());
+            pfrom->fDisconnect = true;
+            return false;
+        }
+        pindexStop = mi->second;
+    }
+
+    uint32_t nStopHeight = pindexStop->nHeight;
+    if (nStartHeight > nStopHeight) {
+        LogPrint("net", "peer %d sent invalid getcfilters/getcfheaders with "
+                 "start height %d and stop height %d\n",
+                 pfrom->id, nStartHeight, nStopHeight);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+    if (nStopHeight - nStartHeight >= nMaxHeightDiff) {
+        LogPrint("net", "peer %d requested too many cfilters/cfheaders: %d / %d\n",
+                 pfrom->id, nStopHeight - nStartHeight + 1, nMaxHeightDiff);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    // The index may still be catching up; such requests are ignored rather
+    // than punished, as the peer cannot know how far along we are.
+    if (g_blockfilterindex->GetBestHeight() < pindexStop->nHeight) {
+        LogPrint("net", "peer %d requested filters up to height %d, but the filter index is at height %d\n",
+                 pfrom->id, pindexStop->nHeight, g_blockfilterindex->GetBestHeight());
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Handle a cfilters request.
+ *
+ * May disconnect from the peer in the case of a bad request.
+ */
+static void ProcessGetCFilters(CNode* pfrom, CDataStream& vRecv, CConnman& connman)
+{
+    uint8_t nFilterType;
+    uint32_t nStartHeight;
+    uint256 hashStop;
+
+    vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+    const CBlockIndex* pindexStop;
+    if (!PrepareBlockFilterRequest(pfrom, nFilterType, nStartHeight, hashStop,
+                                   MAX_GETCFILTERS_SIZE, pindexStop)) {
+        return;
+    }
+
+    std::vector<BlockFilter> filters;
+    if (!g_blockfilterindex->LookupFilterRange(nStartHeight, pindexStop, filters)) {
+        LogPrint("net", "Failed to find block filter in index: filter_type=%s, start_height=%d, stop_hash=%s\n",
+                 BlockFilterTypeName(BASIC), nStartHeight, hashStop.ToString());
+        return;
+    }
+
+    CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    for (const BlockFilter& filter : filters) {
+        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::CFILTER, filter));
+    }
+}
+
+/**
+ * Handle a cfheaders request.
+ *
+ * May disconnect from the peer in the case of a bad request.
+ */
+static void ProcessGetCFHeaders(CNode* pfrom, CDataStream& vRecv, CConnman& connman)
+{
+    uint8_t nFilterType;
+    uint32_t nStartHeight;
+    uint256 hashStop;
+
+    vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+    const CBlockIndex* pindexStop;
+    if (!PrepareBlockFilterRequest(pfrom, nFilterType, nStartHeight, hashStop,
+                                   MAX_GETCFHEADERS_SIZE, pindexStop)) {
+        return;
+    }
+
+    uint256 hashPrevHeader;
+    if (nStartHeight > 0) {
+        const CBlockIndex* pindexPrev = pindexStop->GetAncestor(static_cast<int>(nStartHeight - 1));
+        if (!g_blockfilterindex->LookupFilterHeader(pindexPrev, hashPrevHeader)) {
+            LogPrint("net", "Failed to find block filter header in index: filter_type=%s, block_hash=%s\n",
+                     BlockFilterTypeName(BASIC), pindexPrev->GetBlockHash().ToString());
+            return;
+        }
+    }
+
+    std::vector<uint256> vFilterHashes;
+    if (!g_blockfilterindex->LookupFilterHashRange(nStartHeight, pindexStop, vFilterHashes)) {
+        LogPrint("net", "Failed to find block filter hashes in index: filter_type=%s, start_height=%d, stop_hash=%s\n",
+                 BlockFilterTypeName(BASIC), nStartHeight, hashStop.ToString());
+        return;
+    }
+
+    CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::CFHEADERS,
+                                             nFilterType,
+                                             pindexStop->GetBlockHash(),
+                                             hashPrevHeader,
+                                             vFilterHashes));
+}
+
+/**
+ * Handle a getcfcheckpt request.
+ *
+ * May disconnect from the peer in the case of a bad request.
+ */
+static void ProcessGetCFCheckPt(CNode* pfrom, CDataStream& vRecv, CConnman& connman)
+{
+    uint8_t nFilterType;
+    uint256 hashStop;
+
+    vRecv >> nFilterType >> hashStop;
+
+    const CBlockIndex* pindexStop;
+    if (!PrepareBlockFilterRequest(pfrom, nFilterType, /*nStartHeight=*/0, hashStop,
+                                   /*nMaxHeightDiff=*/std::numeric_limits<uint32_t>::max(),
+                                   pindexStop)) {
+        return;
+    }
+
+    std::vector<uint256> vHeaders(pindexStop->nHeight / CFCHECKPT_INTERVAL);
+
+    // Populate headers.
+    const CBlockIndex* pindex = pindexStop;
+    for (int i = vHeaders.size() - 1; i >= 0; i--) {
+        int nHeight = (i + 1) * CFCHECKPT_INTERVAL;
+        pindex = pindex->GetAncestor(nHeight);
+
+        if (!g_blockfilterindex->LookupFilterHeader(pindex, vHeaders[i])) {
+            LogPrint("net", "Failed to find block filter header in index: filter_type=%s, block_hash=%s\n",
+                     BlockFilterTypeName(BASIC), pindex->GetBlockHash().ToString());
+            return;
+        }
+    }
+
+    CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::CFCHECKPT,
+                                             nFilterType,
+                                             pindexStop->GetBlockHash(),
+                                             vHeaders));
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman& connman)
 {
     unsigned int nMaxSendBufferSize = connman.GetSendBufferSize();
@@ -5171,6 +5434,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
         }
 
+        // Offer transaction reconciliation to peers we relay transactions to;
+        // it has to be agreed on before verack.
+        bool fPeerRelayTxes;
+        {
+            LOCK(pfrom->cs_filter);
+            fPeerRelayTxes = pfrom->fRelayTxes;
+        }
+        if (fTxReconciliation && fRelayTxes && fPeerRelayTxes && !pfrom->fFeeler) {
+            uint64_t nReconSalt = GetRand(std::numeric_limits<uint64_t>::max());
+            {
+                LOCK(pfrom->cs_inventory);
+                pfrom->pTxReconState.reset(new CTxReconciliationState(nReconSalt));
+            }
+            connman.PushMessage(pfrom, CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::SENDIBLTRCN, TXRECONCILIATION_VERSION, nReconSalt));
+        }
+
         // Change version
         connman.PushMessage(pfrom, CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::VERACK));
         int nSendVersion = std::min(pfrom->nVersion, PROTOCOL_VERSION);
@@ -5268,6 +5547,27 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             nCMPCTBLOCKVersion = 1;
             connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion));
         }
+
+        {
+            // The peer didn't take up our offer of transaction reconciliation
+            LOCK(pfrom->cs_inventory);
+            if (pfrom->pTxReconState && !pfrom->pTxReconState->fEnabled)
+                pfrom->pTxReconState.reset();
+        }
+    }
+
+
+    else if (strCommand == NetMsgType::SENDIBLTRCN)
+    {
+        uint32_t nReconVersion = 0;
+        uint64_t nRemoteSalt = 0;
+        vRecv >> nReconVersion >> nRemoteSalt;
+        LOCK(pfrom->cs_inventory);
+        // Only honoured before the peer's verack, and if we offered it as well
+        if (pfrom->pTxReconState && !pfrom->pTxReconState->fEnabled && nReconVersion >= 1) {
+            pfrom->pTxReconState->Enable(!pfrom->fInbound, nRemoteSalt);
+            LogPrint("net", "transaction reconciliation enabled with peer=%d\n", pfrom->id);
+        }
     }
 
 
@@ -6145,7 +6445,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = connman.GetAddresses();
         FastRandomContext insecure_rand;
         BOOST_FOREACH(const CAddress &addr, vAddr)
@@ -6335,6 +6638,111 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
     }
 
+    else if (strCommand == NetMsgType::REQIBLT)
+    {
+        uint32_t nRemoteSetSize;
+        vRecv >> nRemoteSetSize;
+
+        LOCK(pfrom->cs_inventory);
+        CTxReconciliationState* pRecon = pfrom->pTxReconState.get();
+        if (!pRecon || !pRecon->fEnabled || pRecon->fInitiator) {
+            LogPrint("net", "unexpected reqiblt from peer=%d\n", pfrom->id);
+            return true;
+        }
+        // The peer gave up on the previous round; reconcile its transactions again.
+        BOOST_FOREACH(const PAIRTYPE(uint32_t, uint256)& item, pRecon->mapSketched)
+            pRecon->setLocal.insert(item.second);
+        pRecon->mapSketched.clear();
+
+        size_t nCells = CReconSketch::CellsForDifference(EstimateReconDifference(pRecon->setLocal.size(), nRemoteSetSize));
+        CReconSketch sketch = pRecon->MakeSketch(nCells, pRecon->mapSketched);
+        BOOST_FOREACH(const PAIRTYPE(uint32_t, uint256)& item, pRecon->mapSketched)
+            pRecon->setLocal.erase(item.second);
+        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::IBLT, sketch), SEND_PRIORITY_TX);
+    }
+
+
+    else if (strCommand == NetMsgType::IBLT)
+    {
+        CReconSketch sketch;
+        vRecv >> sketch;
+
+        std::vector<uint256> vAnnounce;
+        {
+            LOCK(pfrom->cs_inventory);
+            CTxReconciliationState* pRecon = pfrom->pTxReconState.get();
+            if (!pRecon || !pRecon->fEnabled || !pRecon->fInitiator || !pRecon->fRequestPending) {
+                LogPrint("net", "unexpected iblt from peer=%d\n", pfrom->id);
+                return true;
+            }
+            pRecon->fRequestPending = false;
+
+            if (sketch.IsValid()) {
+                // Subtracting the peer's sketch from ours leaves what only one
+                // of us has: we announce ours and ask for theirs.
+                std::map<uint32_t, uint256> mapLocal;
+                CReconSketch diff = pRecon->MakeSketch(sketch.GetCells(), mapLocal);
+                diff.Subtract(sketch);
+                std::vector<uint32_t> vOurs, vTheirs;
+                bool fSuccess = diff.Decode(vOurs, vTheirs);
+                if (fSuccess) {
+                    BOOST_FOREACH(uint32_t nShortId, vOurs) {
+                        std::map<uint32_t, uint256>::const_iterator it = mapLocal.find(nShortId);
+                        if (it != mapLocal.end())
+                            vAnnounce.push_back(it->second);
+                    }
+                } else {
+                    // Too many differences: fall back to announcing everything
+                    BOOST_FOREACH(const PAIRTYPE(uint32_t, uint256)& item, mapLocal)
+                        vAnnounce.push_back(item.second);
+                    vTheirs.clear();
+                }
+                BOOST_FOREACH(const PAIRTYPE(uint32_t, uint256)& item, mapLocal)
+                    pRecon->setLocal.erase(item.second);
+                LogPrint("net", "reconciliation with peer=%d %s: %u cells, %u ours, %u theirs\n", pfrom->id,
+                    fSuccess ? "succeeded" : "failed", sketch.GetCells(), vAnnounce.size(), vTheirs.size());
+                connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::IBLTDIFF, fSuccess, vTheirs), SEND_PRIORITY_TX);
+            }
+        }
+        if (!sketch.IsValid()) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 10);
+            return error("invalid sketch of %u cells from peer=%d", sketch.GetCells(), pfrom->id);
+        }
+        PushReconciledInventory(pfrom, vAnnounce, connman);
+    }
+
+
+    else if (strCommand == NetMsgType::IBLTDIFF)
+    {
+        bool fSuccess;
+        std::vector<uint32_t> vRequested;
+        vRecv >> fSuccess >> vRequested;
+
+        std::vector<uint256> vAnnounce;
+        {
+            LOCK(pfrom->cs_inventory);
+            CTxReconciliationState* pRecon = pfrom->pTxReconState.get();
+            if (!pRecon || !pRecon->fEnabled || pRecon->fInitiator) {
+                LogPrint("net", "unexpected ibltdiff from peer=%d\n", pfrom->id);
+                return true;
+            }
+            if (fSuccess) {
+                BOOST_FOREACH(uint32_t nShortId, vRequested) {
+                    std::map<uint32_t, uint256>::const_iterator it = pRecon->mapSketched.find(nShortId);
+                    if (it != pRecon->mapSketched.end())
+                        vAnnounce.push_back(it->second);
+                }
+            } else {
+                BOOST_FOREACH(const PAIRTYPE(uint32_t, uint256)& item, pRecon->mapSketched)
+                    vAnnounce.push_back(item.second);
+            }
+            pRecon->mapSketched.clear();
+        }
+        PushReconciledInventory(pfrom, vAnnounce, connman);
+    }
+
+
     else if (strCommand == NetMsgType::FEEFILTER) {
         CAmount newFeeFilter = 0;
         vRecv >> newFeeFilter;
@@ -6347,6 +6755,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
     }
 
+    else if (strCommand == NetMsgType::GETCFILTERS) {
+        ProcessGetCFilters(pfrom, vRecv, connman);
+    }
+
+    else if (strCommand == NetMsgType::GETCFHEADERS) {
+        ProcessGetCFHeaders(pfrom, vRecv, connman);
+    }
+
+    else if (strCommand == NetMsgType::GETCFCHECKPT) {
+        ProcessGetCFCheckPt(pfrom, vRecv, connman);
+    }
+
     else if (strCommand == NetMsgType::NOTFOUND) {
         // We do not care about the NOTFOUND message, but logging an Unknown Command
         // message would be undesirable as we transmit it ourselves.
@@ -6389,7 +6809,7 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman)
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= nMaxSendBufferSize)
+        if (pfrom->GetSendSize(SEND_PRIORITY_ADDR) >= nMaxSendBufferSize)
             break;
 
         // get next message
@@ -6440,6 +6860,8 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman)
 
         // Process message
         bool fRet = false;
+        int64_t nStart = GetTimeMicros();
+        int64_t nMainLockStart = GetLockHeldMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, chainparams, connman);
@@ -6476,6 +6898,7 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        connman.RecordRecvMsgMetrics(pfrom, strCommand, nMessageSize, GetTimeMicros() - nStart, GetLockHeldMicros() - nMainLockStart);
 
         if (!fRet)
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
@@ -6485,7 +6908,7 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
-        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+        pfrom->ReleaseRecvMsgs(it);
 
     return fOk;
 }
@@ -6586,27 +7009,29 @@ bool SendMessages(CNode* pto, CConnman& connman)
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
+                // Other peers' handlers relay addresses into vAddrToSend;
+                // take them out here and send without holding the lock.
+                LOCK(pto->cs_addrSend);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        connman.PushMessage(pto, msgMaker.Make(NetMsgType::ADDR, vAddr));
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddr.push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
+                // we only send the big addr message once
+                if (pto->vAddrToSend.capacity() > 40)
+                    pto->vAddrToSend.shrink_to_fit();
+            }
+            // receiver rejects addr messages larger than 1000
+            for (size_t nOffset = 0; nOffset < vAddr.size(); nOffset += 1000) {
+                vector<CAddress> vAddrBatch(vAddr.begin() + nOffset, vAddr.begin() + std::min(vAddr.size(), nOffset + 1000));
+                connman.PushMessage(pto, msgMaker.Make(NetMsgType::ADDR, vAddrBatch));
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                connman.PushMessage(pto, msgMaker.Make(NetMsgType::ADDR, vAddr));
-            // we only send the big addr message once
-            if (pto->vAddrToSend.capacity() > 40)
-                pto->vAddrToSend.shrink_to_fit();
         }
 
         // Start block sync
@@ -6782,6 +7207,11 @@ bool SendMessages(CNode* pto, CConnman& connman)
                 }
             }
             pto->vInventoryBlockToSend.clear();
+            // Announce blocks on their own, ahead of transaction relay.
+            if (!vInv.empty()) {
+                connman.PushMessage(pto, msgMaker.Make(NetMsgType::INV, vInv));
+                vInv.clear();
+            }
 
             // Check whether periodic sends should happen
             bool fSendTrickle = pto->fWhitelisted;
@@ -6823,7 +7253,7 @@ bool SendMessages(CNode* pto, CConnman& connman)
                     pto->filterInventoryKnown.insert(hash);
                     vInv.push_back(inv);
                     if (vInv.size() == MAX_INV_SZ) {
-                        connman.PushMessage(pto, msgMaker.Make(NetMsgType::INV, vInv));
+                        connman.PushMessage(pto, msgMaker.Make(NetMsgType::INV, vInv), SEND_PRIORITY_TX);
                         vInv.clear();
                     }
                 }
@@ -6872,8 +7302,12 @@ bool SendMessages(CNode* pto, CConnman& connman)
                         continue;
                     }
                     if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*txinfo.tx)) continue;
-                    // Send
-                    vInv.push_back(CInv(MSG_TX, hash));
+                    // Send, or leave it to the next reconciliation with the peer
+                    CTxReconciliationState* pRecon = pto->pTxReconState.get();
+                    if (pRecon && pRecon->fEnabled && pRecon->setLocal.size() < MAX_RECON_SET_SIZE)
+                        pRecon->setLocal.insert(hash);
+                    else
+                        vInv.push_back(CInv(MSG_TX, hash));
                     nRelayedTransactions++;
                     {
                         // Expire old relay messages
@@ -6889,15 +7323,28 @@ bool SendMessages(CNode* pto, CConnman& connman)
                         }
                     }
                     if (vInv.size() == MAX_INV_SZ) {
-                        connman.PushMessage(pto, msgMaker.Make(NetMsgType::INV, vInv));
+                        connman.PushMessage(pto, msgMaker.Make(NetMsgType::INV, vInv), SEND_PRIORITY_TX);
                         vInv.clear();
                     }
                     pto->filterInventoryKnown.insert(hash);
                 }
             }
+
+            // Ask peers we reconcile transactions with for a sketch of theirs every so often
+            CTxReconciliationState* pRecon = pto->pTxReconState.get();
+            if (pRecon && pRecon->fRequestPending && pRecon->nNextRequest + RECON_RESPONSE_TIMEOUT * 1000000 < nNow) {
+                // The peer will add what it sketched back to its set when asked again
+                LogPrint("net", "no sketch from peer=%d, requesting another\n", pto->id);
+                pRecon->fRequestPending = false;
+            }
+            if (pRecon && pRecon->fEnabled && pRecon->fInitiator && !pRecon->fRequestPending && pRecon->nNextRequest < nNow) {
+                connman.PushMessage(pto, msgMaker.Make(NetMsgType::REQIBLT, (uint32_t)pRecon->setLocal.size()), SEND_PRIORITY_TX);
+                pRecon->fRequestPending = true;
+                pRecon->nNextRequest = nNow + RECON_REQUEST_INTERVAL * 1000000;
+            }
         }
         if (!vInv.empty())
-            connman.PushMessage(pto, msgMaker.Make(NetMsgType::INV, vInv));
+            connman.PushMessage(pto, msgMaker.Make(NetMsgType::INV, vInv), SEND_PRIORITY_TX);
 
         // Detect whether we're stalling
         nNow = GetTimeMicros();
@@ -7015,7 +7462,76 @@ int VersionBitsTipStateSinceHeight(const Consensus::Params& params, Consensus::D
     return VersionBitsStateSinceHeight(chainActive.Tip(), params, pos, versionbitscache);
 }
 
-static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/**
+ * mempool.dat starts with the tip and the script verification flags the
+ * mempool was last validated against, followed by its entries, parents before
+ * children, each preceded by a non-zero byte, then a zero byte and the fee
+ * deltas of transactions that are not in the mempool. Version 1 files, which
+ * have an entry count instead, can still be loaded.
+ */
+static const uint64_t MEMPOOL_DUMP_VERSION = 2;
+static const uint64_t MEMPOOL_DUMP_VERSION_COUNTED = 1;
+/** Most transactions from mempool.dat read before accepting them */
+static const size_t MEMPOOL_LOAD_BATCH_SIZE = 1000;
+/** Most transactions whose scripts are verified under one hold of cs_main, per script checking thread */
+static const size_t MEMPOOL_LOAD_VERIFY_PER_THREAD = 10;
+
+namespace {
+struct CMempoolLoadEntry
+{
+    CTransactionRef tx;
+    int64_t nTime;
+};
+}
+
+/**
+ * Accept transactions read from mempool.dat, none of which spends another.
+ * If the tip and flags are still those their scripts were verified against,
+ * the script checks are skipped and the whole batch is accepted under one
+ * hold of cs_main. Otherwise cs_main is released every few transactions, and
+ * the scripts of those are first verified on the script check threads, which
+ * leaves their signatures in the cache for when each one is accepted.
+ */
+static void AcceptMempoolBatch(const std::vector<CMempoolLoadEntry>& vBatch, const uint256& hashDumpTip, unsigned int nDumpFlags,
+                               int64_t& count, int64_t& failed)
+{
+    size_t nNext = 0;
+    while (nNext < vBatch.size()) {
+        LOCK(cs_main);
+        const unsigned int nFlags = GetMempoolScriptVerifyFlags();
+        const bool fScriptsVerified = !hashDumpTip.IsNull() && chainActive.Tip()->GetBlockHash() == hashDumpTip && nDumpFlags == nFlags;
+        const size_t nEnd = fScriptsVerified ? vBatch.size() : std::min(vBatch.size(), nNext + MEMPOOL_LOAD_VERIFY_PER_THREAD * (nScriptCheckThreads + 1));
+
+        if (!fScriptsVerified && nScriptCheckThreads) {
+            LOCK(mempool.cs);
+            CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+            CCoinsViewCache view(&viewMemPool);
+            std::vector<PrecomputedTransactionData> vTxData;
+            vTxData.reserve(nEnd - nNext);
+            CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+            for (size_t i = nNext; i < nEnd; i++) {
+                CValidationState state;
+                std::vector<CScriptCheck> vChecks;
+                vTxData.emplace_back(*vBatch[i].tx);
+                if (CheckInputs(*vBatch[i].tx, state, view, true, nFlags, true, vTxData.back(), &vChecks)) {
+                    control.Add(vChecks);
+                }
+            }
+            // Failures are reported when the transactions are accepted below
+            control.Wait();
+        }
+
+        for (; nNext < nEnd; nNext++) {
+            CValidationState state;
+            AcceptToMemoryPoolWithTime(mempool, state, *vBatch[nNext].tx, true, NULL, vBatch[nNext].nTime, false, 0, !fScriptsVerified);
+            if (state.IsValid()) {
+                ++count;
+            } else {
+                ++failed;
+            }
+        }
+    }
+}
 
 bool LoadMempool(void)
 {
@@ -7031,41 +7547,73 @@ bool LoadMempool(void)
     int64_t skipped = 0;
     int64_t failed = 0;
     int64_t nNow = GetTime();
+    int64_t nStart = GetTimeMicros();
 
     try {
         uint64_t version;
         file >> version;
-        if (version != MEMPOOL_DUMP_VERSION) {
+        uint256 hashDumpTip;
+        unsigned int nDumpFlags = 0;
+        uint64_t num = 0;
+        if (version == MEMPOOL_DUMP_VERSION) {
+            file >> hashDumpTip;
+            file >> nDumpFlags;
+        } else if (version == MEMPOOL_DUMP_VERSION_COUNTED) {
+            file >> num;
+        } else {
             return false;
         }
-        uint64_t num;
-        file >> num;
+
+        // Transactions are accepted in batches, releasing cs_main in between.
+        // A batch ends before a transaction that spends one in it.
+        std::vector<CMempoolLoadEntry> vBatch;
+        std::set<uint256> setBatchTxids;
         double prioritydummy = 0;
-        while (num--) {
-            CTransaction tx;
-            int64_t nTime;
+        while (true) {
+            if (version == MEMPOOL_DUMP_VERSION) {
+                uint8_t fMore;
+                file >> fMore;
+                if (!fMore)
+                    break;
+            } else if (!num--) {
+                break;
+            }
+
+            CMempoolLoadEntry entry;
             int64_t nFeeDelta;
-            file >> tx;
-            file >> nTime;
+            entry.tx = MakeTransactionRef(CTransaction(deserialize, file));
+            file >> entry.nTime;
             file >> nFeeDelta;
 
+            const uint256& hash = entry.tx->GetHash();
             CAmount amountdelta = nFeeDelta;
             if (amountdelta) {
-                mempool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), prioritydummy, amountdelta);
+                mempool.PrioritiseTransaction(hash, hash.ToString(), prioritydummy, amountdelta);
             }
-            CValidationState state;
-            if (nTime + nExpiryTimeout > nNow) {
-                LOCK(cs_main);
-                AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime);
-                if (state.IsValid()) {
-                    ++count;
-                } else {
-                    ++failed;
-                }
-            } else {
+            if (entry.nTime + nExpiryTimeout <= nNow) {
                 ++skipped;
+                continue;
+            }
+
+            bool fSpendsBatch = false;
+            BOOST_FOREACH(const CTxIn& txin, entry.tx->vin) {
+                if (setBatchTxids.count(txin.prevout.hash)) {
+                    fSpendsBatch = true;
+                    break;
+                }
+            }
+            if (fSpendsBatch || vBatch.size() >= MEMPOOL_LOAD_BATCH_SIZE) {
+                AcceptMempoolBatch(vBatch, hashDumpTip, nDumpFlags, count, failed);
+                vBatch.clear();
+                setBatchTxids.clear();
             }
+            setBatchTxids.insert(hash);
+            vBatch.push_back(std::move(entry));
         }
+        AcceptMempoolBatch(vBatch, hashDumpTip, nDumpFlags, count, failed);
+        // The entries were added parents first, not in order of time
+        mempool.SortByEntryTime();
+
         std::map<uint256, CAmount> mapDeltas;
         file >> mapDeltas;
 
@@ -7077,7 +7625,7 @@ bool LoadMempool(void)
         return false;
     }
 
-    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired\n", count, failed, skipped);
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired (%.2fs)\n", count, failed, skipped, (GetTimeMicros() - nStart) * 0.000001);
     return true;
 }
 
@@ -7087,9 +7635,13 @@ void DumpMempool(void)
 
     std::map<uint256, CAmount> mapDeltas;
     std::vector<TxMempoolInfo> vinfo;
+    uint256 hashTip;
 
     {
-        LOCK(mempool.cs);
+        LOCK2(cs_main, mempool.cs);
+        if (chainActive.Tip()) {
+            hashTip = chainActive.Tip()->GetBlockHash();
+        }
         for (const auto &i : mempool.mapDeltas) {
             mapDeltas[i.first] = i.second.first;
         }
@@ -7108,14 +7660,17 @@ void DumpMempool(void)
 
         uint64_t version = MEMPOOL_DUMP_VERSION;
         file << version;
+        file << hashTip;
+        file << GetMempoolScriptVerifyFlags();
 
-        file << (uint64_t)vinfo.size();
         for (const auto& i : vinfo) {
+            file << (uint8_t)1;
             file << *(i.tx);
             file << (int64_t)i.nTime;
             file << (int64_t)i.nFeeDelta;
             mapDeltas.erase(i.tx->GetHash());
         }
+        file << (uint8_t)0;
 
         file << mapDeltas;
         FileCommit(file.Get());
@@ -26,6 +26,9 @@
 #include "validationinterface.h"
 
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <queue>
@@ -103,6 +106,8 @@ BlockAssembler::BlockAssembler(const CChainParams& _chainparams)
 
     // Whether we need to account for byte usage (in addition to weight usage)
     fNeedSizeAccounting = (nBlockMaxSize < MAX_BLOCK_SERIALIZED_SIZE-1000);
+
+    fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
 }
 
 void BlockAssembler::resetBlock()
@@ -121,9 +126,23 @@ void BlockAssembler::resetBlock()
 
     lastFewTxs = 0;
     blockFinished = false;
+
+    fLeftOutForRoom = false;
+}
+
+std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn, bool fTestValidity)
+{
+    LOCK2(cs_main, mempool.cs);
+    return AssembleBlock(scriptPubKeyIn, chainActive.Tip(), true, fTestValidity);
+}
+
+std::unique_ptr<CBlockTemplate> BlockAssembler::CreateEmptyBlock(const CScript& scriptPubKeyIn, CBlockIndex* pindexPrev)
+{
+    LOCK(cs_main);
+    return AssembleBlock(scriptPubKeyIn, pindexPrev, false, false);
 }
 
-std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
+std::unique_ptr<CBlockTemplate> BlockAssembler::AssembleBlock(const CScript& scriptPubKeyIn, CBlockIndex* pindexPrev, bool fAddTxs, bool fTestValidity)
 {
     resetBlock();
 
@@ -138,8 +157,6 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOpsCost.push_back(-1); // updated at end
 
-    LOCK2(cs_main, mempool.cs);
-    CBlockIndex* pindexPrev = chainActive.Tip();
     nHeight = pindexPrev->nHeight + 1;
 
     pblock->nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus());
@@ -163,8 +180,10 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     // transaction (which in most cases can be a no-op).
     fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus());
 
-    addPriorityTxs();
-    addPackageTxs();
+    if (fAddTxs) {
+        addPriorityTxs();
+        addPackageTxs();
+    }
 
     nLastBlockTx = nBlockTx;
     nLastBlockSize = nBlockSize;
@@ -193,7 +212,7 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(*pblock->vtx[0]);
 
     CValidationState state;
-    if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
+    if (fTestValidity && !TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
         throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
     }
 
@@ -202,26 +221,24 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
 
 bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
 {
-    BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
+    BOOST_FOREACH(const CTxMemPoolEntry* pparent, mempool.GetMemPoolParents(iter))
     {
-        if (!inBlock.count(parent)) {
+        if (!inBlock.count(pparent)) {
             return true;
         }
     }
     return false;
 }
 
-void BlockAssembler::onlyUnconfirmed(CTxMemPool::setEntries& testSet)
+void BlockAssembler::onlyUnconfirmed(CTxMemPool::vecEntries& testSet)
 {
-    for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end(); ) {
-        // Only test txs not already in the block
-        if (inBlock.count(*iit)) {
-            testSet.erase(iit++);
-        }
-        else {
-            iit++;
-        }
+    // Only test txs not already in the block
+    size_t nKeep = 0;
+    for (size_t i = 0; i < testSet.size(); i++) {
+        if (!inBlock.count(&*testSet[i]))
+            testSet[nKeep++] = testSet[i];
     }
+    testSet.resize(nKeep);
 }
 
 bool BlockAssembler::TestPackage(uint64_t packageSize, int64_t packageSigOpsCost)
@@ -239,7 +256,7 @@ bool BlockAssembler::TestPackage(uint64_t packageSize, int64_t packageSigOpsCost
 // - premature witness (in case segwit transactions are added to mempool before
 //   segwit activation)
 // - serialized size (in case -blockmaxsize is in use)
-bool BlockAssembler::TestPackageTransactions(const CTxMemPool::setEntries& package)
+bool BlockAssembler::TestPackageTransactions(const CTxMemPool::vecEntries& package)
 {
     uint64_t nPotentialBlockSize = nBlockSize; // only used with fNeedSizeAccounting
     BOOST_FOREACH (const CTxMemPool::txiter it, package) {
@@ -322,9 +339,8 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
     ++nBlockTx;
     nBlockSigOpsCost += iter->GetSigOpCost();
     nFees += iter->GetFee();
-    inBlock.insert(iter);
+    inBlock.insert(&*iter);
 
-    bool fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
     if (fPrintPriority) {
         double dPriority = iter->GetPriority(nHeight);
         CAmount dummy;
@@ -336,48 +352,53 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
     }
 }
 
-void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
-        indexed_modified_transaction_set &mapModifiedTx)
+void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::vecEntries& alreadyAdded,
+        mapTxPackages &mapPackages, std::vector<CTxPackage> &vHeap, uint64_t nGeneration)
 {
+    std::vector<const CTxPackage*> vShrunk;
+    CTxMemPool::vecEntries descendants;
     BOOST_FOREACH(const CTxMemPool::txiter it, alreadyAdded) {
-        CTxMemPool::setEntries descendants;
         mempool.CalculateDescendants(it, descendants);
-        // Insert all descendants (not yet in block) into the modified set
+        // Shrink the packages of all descendants not yet in block.
+        // A descendant of a newly added tx can only be in the block if it
+        // was added along with it.
         BOOST_FOREACH(CTxMemPool::txiter desc, descendants) {
-            if (alreadyAdded.count(desc))
+            if (inBlock.count(&*desc))
                 continue;
-            modtxiter mit = mapModifiedTx.find(desc);
-            if (mit == mapModifiedTx.end()) {
-                CTxMemPoolModifiedEntry modEntry(desc);
-                modEntry.nSizeWithAncestors -= it->GetTxSize();
-                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
-                modEntry.nSigOpCostWithAncestors -= it->GetSigOpCost();
-                mapModifiedTx.insert(modEntry);
-            } else {
-                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            mapTxPackages::iterator pit = mapPackages.find(&*desc);
+            if (pit == mapPackages.end())
+                pit = mapPackages.insert(std::make_pair(&*desc, CTxPackage(desc))).first;
+            CTxPackage& package = pit->second;
+            if (package.nGeneration != nGeneration) {
+                package.nGeneration = nGeneration;
+                vShrunk.push_back(&package);
             }
+            package.nSizeWithAncestors -= it->GetTxSize();
+            package.nModFeesWithAncestors -= it->GetModifiedFee();
+            package.nSigOpCostWithAncestors -= it->GetSigOpCost();
         }
     }
+
+    // Earlier copies of these packages stay in the heap until they reach
+    // the top, where their generation gives them away
+    BOOST_FOREACH(const CTxPackage* ppackage, vShrunk) {
+        vHeap.push_back(*ppackage);
+        std::push_heap(vHeap.begin(), vHeap.end(), CompareTxPackageForHeap());
+    }
 }
 
-// Skip entries in mapTx that are already in a block or are present
-// in mapModifiedTx (which implies that the mapTx ancestor state is
-// stale due to ancestor inclusion in the block)
-// Also skip transactions that we've already failed to add. This can happen if
-// we consider a transaction in mapModifiedTx and it fails: we can then
-// potentially consider it again while walking mapTx.  It's currently
-// guaranteed to fail again, but as a belt-and-suspenders check we put it in
-// failedTx and avoid re-evaluation, since the re-evaluation would be using
-// cached size/sigops/fee values that are not actually correct.
-bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx)
+// Skip entries in mapTx that are already in a block or have a package in
+// mapPackages (which implies that the mapTx ancestor state is stale due to
+// ancestor inclusion in the block)
+bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, const mapTxPackages &mapPackages)
 {
     assert (it != mempool.mapTx.end());
-    if (mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it))
+    if (inBlock.count(&*it) || mapPackages.count(&*it))
         return true;
     return false;
 }
 
-void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries)
+void BlockAssembler::SortForBlock(const CTxMemPool::vecEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries)
 {
     // Sort package by ancestor count
     // If a transaction A depends on transaction B, then A's ancestor count
@@ -394,117 +415,126 @@ void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, CTxMemP
 // for block inclusion, we need an alternate method of updating the feerate
 // of a transaction with its not-yet-selected ancestors as we go.
 // This is accomplished by walking the in-mempool descendants of selected
-// transactions and storing a temporary modified state in mapModifiedTxs.
-// Each time through the loop, we compare the best transaction in
-// mapModifiedTxs with the next transaction in the mempool to decide what
-// transaction package to work on next.
+// transactions and keeping their shrunk packages in mapPackages. Those
+// packages are candidates on a max-heap that is updated lazily: a package
+// that shrinks again is pushed anew rather than found and moved, and copies
+// with an outdated generation are dropped when they reach the top.
+// Each time through the loop, we compare the best package on the heap with
+// the next transaction in the mempool to decide what transaction package to
+// work on next.
 void BlockAssembler::addPackageTxs()
 {
-    // mapModifiedTx will store sorted packages after they are modified
-    // because some of their txs are already in the block
-    indexed_modified_transaction_set mapModifiedTx;
-    // Keep track of entries that failed inclusion, to avoid duplicate work
-    CTxMemPool::setEntries failedTx;
-
-    // Start by adding all descendants of previously added txs to mapModifiedTx
-    // and modifying them for their already included ancestors
-    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+    // mapPackages holds the packages of transactions with some of their
+    // ancestors in the block, vHeap the candidates drawn from them
+    mapTxPackages mapPackages;
+    std::vector<CTxPackage> vHeap;
+    uint64_t nGeneration = 1;
+
+    // Limit the number of attempts to add transactions to the block when it is
+    // close to full; this is just a simple heuristic to finish quickly if the
+    // mempool has a lot of entries.
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
+    // Start by shrinking the packages of all descendants of previously added
+    // txs for their already included ancestors
+    CTxMemPool::vecEntries alreadyAdded;
+    BOOST_FOREACH(const CTxMemPoolEntry* pentry, inBlock)
+        alreadyAdded.push_back(mempool.GetIter(pentry));
+    UpdatePackagesForAdded(alreadyAdded, mapPackages, vHeap, nGeneration);
 
     CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
-    CTxMemPool::txiter iter;
-    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty())
+    while (true)
     {
         // First try to find a new transaction in mapTx to evaluate.
         if (mi != mempool.mapTx.get<ancestor_score>().end() &&
-                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapPackages)) {
             ++mi;
             continue;
         }
 
-        // Now that mi is not stale, determine which transaction to evaluate:
-        // the next entry from mapTx, or the best from mapModifiedTx?
-        bool fUsingModified = false;
+        // Then make sure the top of the heap is up to date.
+        if (!vHeap.empty()) {
+            mapTxPackages::const_iterator pit = mapPackages.find(&*vHeap.front().iter);
+            if (pit == mapPackages.end() || pit->second.nGeneration != vHeap.front().nGeneration) {
+                std::pop_heap(vHeap.begin(), vHeap.end(), CompareTxPackageForHeap());
+                vHeap.pop_back();
+                continue;
+            }
+        }
 
-        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        // Now determine which package to evaluate: that of the next entry
+        // from mapTx, or the best from the heap?
+        bool fUsingHeap = false;
         if (mi == mempool.mapTx.get<ancestor_score>().end()) {
-            // We're out of entries in mapTx; use the entry from mapModifiedTx
-            iter = modit->iter;
-            fUsingModified = true;
+            if (vHeap.empty())
+                break;
+            // We're out of entries in mapTx; use the heap
+            fUsingHeap = true;
+        } else if (!vHeap.empty() &&
+                CompareTxPackage()(vHeap.front(), CTxPackage(mempool.mapTx.project<0>(mi)))) {
+            // The best package on the heap has higher score than the one
+            // from mapTx.
+            fUsingHeap = true;
+        }
+
+        CTxPackage package = fUsingHeap ? vHeap.front() : CTxPackage(mempool.mapTx.project<0>(mi));
+        if (fUsingHeap) {
+            // A package that fails is pushed again if it shrinks later
+            std::pop_heap(vHeap.begin(), vHeap.end(), CompareTxPackageForHeap());
+            vHeap.pop_back();
         } else {
-            // Try to compare the mapTx entry to the mapModifiedTx entry
-            iter = mempool.mapTx.project<0>(mi);
-            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
-                    CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
-                // The best entry in mapModifiedTx has higher score
-                // than the one from mapTx.
-                // Switch which transaction (package) to consider
-                iter = modit->iter;
-                fUsingModified = true;
-            } else {
-                // Either no entry in mapModifiedTx, or it's worse than mapTx.
-                // Increment mi for the next loop iteration.
-                ++mi;
-            }
+            ++mi;
         }
+        CTxMemPool::txiter iter = package.iter;
 
-        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // We skip mapTx entries that are inBlock, and mapPackages shouldn't
         // contain anything that is inBlock.
-        assert(!inBlock.count(iter));
-
-        uint64_t packageSize = iter->GetSizeWithAncestors();
-        CAmount packageFees = iter->GetModFeesWithAncestors();
-        int64_t packageSigOpsCost = iter->GetSigOpCostWithAncestors();
-        if (fUsingModified) {
-            packageSize = modit->nSizeWithAncestors;
-            packageFees = modit->nModFeesWithAncestors;
-            packageSigOpsCost = modit->nSigOpCostWithAncestors;
-        }
+        assert(!inBlock.count(&*iter));
 
-        if (packageFees < ::minRelayTxFee.GetFee(packageSize)) {
+        if (package.nModFeesWithAncestors < ::minRelayTxFee.GetFee(package.nSizeWithAncestors)) {
             // Everything else we might consider has a lower fee rate
             return;
         }
 
-        if (!TestPackage(packageSize, packageSigOpsCost)) {
-            if (fUsingModified) {
-                // Since we always look at the best entry in mapModifiedTx,
-                // we must erase failed entries so that we can consider the
-                // next best entry on the next loop iteration
-                mapModifiedTx.get<ancestor_score>().erase(modit);
-                failedTx.insert(iter);
+        if (!TestPackage(package.nSizeWithAncestors, package.nSigOpCostWithAncestors)) {
+            fLeftOutForRoom = true;
+            ++nConsecutiveFailed;
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockWeight > nBlockMaxWeight - 4000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
             }
             continue;
         }
 
-        CTxMemPool::setEntries ancestors;
+        CTxMemPool::vecEntries ancestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
         std::string dummy;
         mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
 
         onlyUnconfirmed(ancestors);
-        ancestors.insert(iter);
+        ancestors.push_back(iter);
 
         // Test if all tx's are Final
         if (!TestPackageTransactions(ancestors)) {
-            if (fUsingModified) {
-                mapModifiedTx.get<ancestor_score>().erase(modit);
-                failedTx.insert(iter);
-            }
             continue;
         }
 
+        // This transaction will make it in; reset the failed counter.
+        nConsecutiveFailed = 0;
+
         // Package can be added. Sort the entries in a valid order.
         vector<CTxMemPool::txiter> sortedEntries;
         SortForBlock(ancestors, iter, sortedEntries);
 
         for (size_t i=0; i<sortedEntries.size(); ++i) {
             AddToBlock(sortedEntries[i]);
-            // Erase from the modified set, if present
-            mapModifiedTx.erase(sortedEntries[i]);
+            // Forget its package, if it had one
+            mapPackages.erase(&*sortedEntries[i]);
         }
 
         // Update transactions that depend on each of these
-        UpdatePackagesForAdded(ancestors, mapModifiedTx);
+        UpdatePackagesForAdded(ancestors, mapPackages, vHeap, ++nGeneration);
     }
 }
 
@@ -548,7 +578,7 @@ void BlockAssembler::addPriorityTxs()
         vecPriority.pop_back();
 
         // If tx already in block, skip
-        if (inBlock.count(iter)) {
+        if (inBlock.count(&*iter)) {
             assert(false); // shouldn't happen for priority txs
             continue;
         }
@@ -576,8 +606,9 @@ void BlockAssembler::addPriorityTxs()
 
             // This tx was successfully added, so
             // add transactions that depend on this one to the priority queue to try again
-            BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter))
+            BOOST_FOREACH(const CTxMemPoolEntry* pchild, mempool.GetMemPoolChildren(iter))
             {
+                CTxMemPool::txiter child = mempool.GetIter(pchild);
                 waitPriIter wpiter = waitPriMap.find(child);
                 if (wpiter != waitPriMap.end()) {
                     vecPriority.push_back(TxCoinAgePriority(wpiter->second,child));
@@ -590,6 +621,218 @@ void BlockAssembler::addPriorityTxs()
     fNeedSizeAccounting = fSizeAccounting;
 }
 
+std::unique_ptr<CBlockTemplateCache> g_blocktemplatecache;
+
+CBlockTemplateCache::CBlockTemplateCache(const CChainParams& _chainparams, int64_t nMaxStalenessIn)
+    : chainparams(_chainparams), nMaxStaleness(nMaxStalenessIn), pindexPrev(NULL), nRemoved(0), nAppended(0), nLaggingSince(0), fPrioritised(false)
+{
+    mempool.NotifyEntryAdded.connect(boost::bind(&CBlockTemplateCache::TransactionAddedToMempool, this, _1));
+    mempool.NotifyEntryRemoved.connect(boost::bind(&CBlockTemplateCache::TransactionRemovedFromMempool, this, _1));
+    mempool.NotifyEntryPrioritised.connect(boost::bind(&CBlockTemplateCache::TransactionPrioritised, this, _1));
+}
+
+CBlockTemplateCache::~CBlockTemplateCache()
+{
+    mempool.NotifyEntryAdded.disconnect(boost::bind(&CBlockTemplateCache::TransactionAddedToMempool, this, _1));
+    mempool.NotifyEntryRemoved.disconnect(boost::bind(&CBlockTemplateCache::TransactionRemovedFromMempool, this, _1));
+    mempool.NotifyEntryPrioritised.disconnect(boost::bind(&CBlockTemplateCache::TransactionPrioritised, this, _1));
+}
+
+void CBlockTemplateCache::MarkLagging()
+{
+    if (nLaggingSince == 0)
+        nLaggingSince = GetTime();
+}
+
+void CBlockTemplateCache::TransactionAddedToMempool(CTransactionRef ptx)
+{
+    AssertLockHeld(mempool.cs);
+    LOCK(cs);
+    if (!pindexPrev)
+        return;
+
+    CTxMemPool::txiter it = mempool.mapTx.find(ptx->GetHash());
+    assert(it != mempool.mapTx.end());
+    // The same tests as BlockAssembler applies to a package of one. None of
+    // them can pass before the next tip, when the template is assembled anew.
+    // A transaction that doesn't pay enough on its own may still be worth
+    // including for a child's fees, which is noticed once the child comes.
+    if (!IsFinalTx(*ptx, nHeight, nLockTimeCutoff) || (!fIncludeWitness && !ptx->wit.IsNull()) ||
+        it->GetModifiedFee() < ::minRelayTxFee.GetFee(it->GetTxSize())) {
+        return;
+    }
+    BOOST_FOREACH(const CTxMemPoolEntry* pparent, mempool.GetMemPoolParents(it)) {
+        if (!mapTxIndex.count(pparent->GetTx().GetHash())) {
+            MarkLagging();
+            return;
+        }
+    }
+    uint64_t nTxSize = fNeedSizeAccounting ? ::GetSerializeSize(*ptx, SER_NETWORK, PROTOCOL_VERSION) : 0;
+    if (nBlockWeight + WITNESS_SCALE_FACTOR * it->GetTxSize() >= nBlockMaxWeight ||
+        nBlockSigOpsCost + it->GetSigOpCost() >= MAX_BLOCK_SIGOPS_COST ||
+        (fNeedSizeAccounting && nBlockSize + nTxSize >= nBlockMaxSize)) {
+        fMempoolLeftOut = true;
+        MarkLagging();
+        return;
+    }
+
+    CTemplateTx templateTx = {ptx, it->GetFee(), it->GetSigOpCost(), it->GetTxWeight(), nTxSize, false};
+    mapTxIndex[ptx->GetHash()] = vTx.size();
+    vTx.push_back(templateTx);
+    nBlockWeight += templateTx.nWeight;
+    nBlockSize += templateTx.nSize;
+    nBlockSigOpsCost += templateTx.nSigOpsCost;
+    nFees += templateTx.nFee;
+    nAppended++;
+}
+
+void CBlockTemplateCache::TransactionRemovedFromMempool(CTransactionRef ptx)
+{
+    LOCK(cs);
+    std::map<uint256, size_t>::iterator mi = mapTxIndex.find(ptx->GetHash());
+    if (mi == mapTxIndex.end())
+        return;
+
+    // The mempool removes a transaction's descendants along with it, except
+    // when it is mined, after which the template is assembled anew anyway.
+    CTemplateTx& templateTx = vTx[mi->second];
+    templateTx.fRemoved = true;
+    nBlockWeight -= templateTx.nWeight;
+    nBlockSize -= templateTx.nSize;
+    nBlockSigOpsCost -= templateTx.nSigOpsCost;
+    nFees -= templateTx.nFee;
+    mapTxIndex.erase(mi);
+    nRemoved++;
+    // Transactions the template had no room for may fit now
+    if (fMempoolLeftOut)
+        MarkLagging();
+}
+
+void CBlockTemplateCache::TransactionPrioritised(CTransactionRef ptx)
+{
+    LOCK(cs);
+    // A transaction left out for its fee may now be taken, along with
+    // descendants; one in the template may now be worth less than one left
+    // out. Only assembling the template anew tells, as before the cache.
+    fPrioritised = true;
+}
+
+bool CBlockTemplateCache::Assemble(const CScript& scriptPubKeyIn)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+    AssertLockHeld(cs);
+
+    BlockAssembler assembler(chainparams);
+    std::unique_ptr<CBlockTemplate> pnewtemplate = assembler.CreateNewBlock(scriptPubKeyIn);
+    if (!pnewtemplate)
+        return false;
+    const CBlock& block = pnewtemplate->block;
+
+    pindexPrev = chainActive.Tip();
+    header = block.GetBlockHeader();
+    scriptPubKey = scriptPubKeyIn;
+    nCoinbaseSigOpsCost = pnewtemplate->vTxSigOpsCost[0];
+    nHeight = pindexPrev->nHeight + 1;
+    nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                       ? pindexPrev->GetMedianTimePast()
+                       : block.GetBlockTime();
+    fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus());
+    nBlockMaxWeight = assembler.GetBlockMaxWeight();
+    nBlockMaxSize = assembler.GetBlockMaxSize();
+    fNeedSizeAccounting = assembler.NeedsSizeAccounting();
+    fMempoolLeftOut = assembler.LeftOutForRoom();
+
+    // The same room for the coinbase as BlockAssembler reserves
+    nBlockWeight = 4000;
+    nBlockSize = 1000;
+    nBlockSigOpsCost = 400;
+    nFees = 0;
+    vTx.clear();
+    mapTxIndex.clear();
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        uint64_t nTxSize = fNeedSizeAccounting ? ::GetSerializeSize(*block.vtx[i], SER_NETWORK, PROTOCOL_VERSION) : 0;
+        CTemplateTx templateTx = {block.vtx[i], pnewtemplate->vTxFees[i], pnewtemplate->vTxSigOpsCost[i], (uint64_t)GetTransactionWeight(*block.vtx[i]), nTxSize, false};
+        mapTxIndex[block.vtx[i]->GetHash()] = vTx.size();
+        vTx.push_back(templateTx);
+        nBlockWeight += templateTx.nWeight;
+        nBlockSize += templateTx.nSize;
+        nBlockSigOpsCost += templateTx.nSigOpsCost;
+        nFees += templateTx.nFee;
+    }
+    nRemoved = 0;
+    nAppended = 0;
+    nLaggingSince = 0;
+    fPrioritised = false;
+    return true;
+}
+
+std::unique_ptr<CBlockTemplate> CBlockTemplateCache::MakeTemplate()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs);
+
+    if (nRemoved > 0) {
+        size_t nKept = 0;
+        for (size_t i = 0; i < vTx.size(); i++) {
+            if (vTx[i].fRemoved)
+                continue;
+            mapTxIndex[vTx[i].tx->GetHash()] = nKept;
+            vTx[nKept++] = vTx[i];
+        }
+        vTx.resize(nKept);
+        nRemoved = 0;
+    }
+
+    std::unique_ptr<CBlockTemplate> pnewtemplate(new CBlockTemplate());
+    CBlock& block = pnewtemplate->block;
+    block.nVersion = header.nVersion;
+    block.hashPrevBlock = header.hashPrevBlock;
+    block.nTime = header.nTime;
+    block.nBits = header.nBits;
+    block.nNonce = 0;
+
+    CMutableTransaction coinbaseTx;
+    coinbaseTx.vin.resize(1);
+    coinbaseTx.vin[0].prevout.SetNull();
+    coinbaseTx.vout.resize(1);
+    coinbaseTx.vout[0].scriptPubKey = scriptPubKey;
+    coinbaseTx.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
+    coinbaseTx.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    block.vtx.reserve(vTx.size() + 1);
+    block.vtx.push_back(MakeTransactionRef(std::move(coinbaseTx)));
+    pnewtemplate->vTxFees.reserve(vTx.size() + 1);
+    pnewtemplate->vTxFees.push_back(-nFees);
+    pnewtemplate->vTxSigOpsCost.reserve(vTx.size() + 1);
+    pnewtemplate->vTxSigOpsCost.push_back(nCoinbaseSigOpsCost);
+    BOOST_FOREACH(const CTemplateTx& templateTx, vTx) {
+        block.vtx.push_back(templateTx.tx);
+        pnewtemplate->vTxFees.push_back(templateTx.nFee);
+        pnewtemplate->vTxSigOpsCost.push_back(templateTx.nSigOpsCost);
+    }
+    pnewtemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(block, pindexPrev, chainparams.GetConsensus());
+    UpdateTime(&block, chainparams.GetConsensus(), pindexPrev);
+    return pnewtemplate;
+}
+
+std::unique_ptr<CBlockTemplate> CBlockTemplateCache::Get(const CScript& scriptPubKeyIn)
+{
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
+    if (!pindexPrev || pindexPrev != chainActive.Tip() || scriptPubKey != scriptPubKeyIn || fPrioritised ||
+        (nLaggingSince != 0 && GetTime() - nLaggingSince >= nMaxStaleness)) {
+        if (!Assemble(scriptPubKeyIn))
+            return nullptr;
+    }
+    return MakeTemplate();
+}
+
+size_t CBlockTemplateCache::GetAppendedCount() const
+{
+    LOCK(cs);
+    return nAppended;
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -608,3 +851,52 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
     pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 }
+
+bool GrindBlockNonce(CBlockHeader& block, const Consensus::Params& consensusParams, uint32_t nMaxNonce, uint64_t& nMaxTries, int nThreads)
+{
+    // Starting threads takes much longer than a hash, so the first nonces are
+    // tried here. On regtest that is all it takes.
+    uint64_t nSerialEnd = std::min((uint64_t)nMaxNonce, (uint64_t)block.nNonce + GRIND_SERIAL_TRIES);
+    while (nMaxTries > 0 && block.nNonce < nSerialEnd) {
+        if (CheckProofOfWork(block.GetHash(), block.nBits, consensusParams))
+            return true;
+        ++block.nNonce;
+        --nMaxTries;
+    }
+    if (nMaxTries == 0 || block.nNonce >= nMaxNonce)
+        return false;
+
+    // The threads take chunks of the remaining nonces in turn and finish
+    // those below the lowest nonce found, so the one found is the one a
+    // single thread would have found.
+    const uint64_t nStart = block.nNonce;
+    const uint64_t nEnd = std::min((uint64_t)nMaxNonce, nStart + nMaxTries);
+    std::atomic<uint64_t> nNext(nStart);
+    std::atomic<uint64_t> nFound(nEnd);
+    auto search = [&]() {
+        CBlockHeader header(block);
+        while (true) {
+            uint64_t nChunk = nNext.fetch_add(GRIND_CHUNK_SIZE);
+            for (uint64_t n = nChunk; n < nChunk + GRIND_CHUNK_SIZE; n++) {
+                if (n >= nFound.load())
+                    return;
+                header.nNonce = n;
+                if (CheckProofOfWork(header.GetHash(), header.nBits, consensusParams)) {
+                    uint64_t nLowest = nFound.load();
+                    while (n < nLowest && !nFound.compare_exchange_weak(nLowest, n)) {}
+                    return;
+                }
+            }
+        }
+    };
+    std::vector<std::thread> vThreads;
+    for (int i = 1; i < nThreads; i++)
+        vThreads.emplace_back(search);
+    search();
+    BOOST_FOREACH(std::thread& thread, vThreads)
+        thread.join();
+
+    block.nNonce = nFound.load();
+    nMaxTries -= block.nNonce - nStart;
+    return block.nNonce < nEnd;
+}
@@ -7,22 +7,31 @@
 #define BITCOIN_MINER_H
 
 #include "primitives/block.h"
+#include "script/script.h"
 #include "txmempool.h"
 
 #include <stdint.h>
 #include <memory>
-#include "boost/multi_index_container.hpp"
-#include "boost/multi_index/ordered_index.hpp"
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 class CBlockIndex;
 class CChainParams;
 class CReserveKey;
-class CScript;
 class CWallet;
 
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Default for -blocktemplatestaleness, seconds a block template may lag behind the mempool */
+static const int64_t DEFAULT_BLOCK_TEMPLATE_STALENESS = 5;
+/** Default for -generatethreads, 0 meaning one per core */
+static const int DEFAULT_GENERATE_THREADS = 0;
+/** Nonces GrindBlockNonce tries in the calling thread before starting others */
+static const uint64_t GRIND_SERIAL_TRIES = 1000;
+/** Nonces a GrindBlockNonce thread takes at a time */
+static const uint64_t GRIND_CHUNK_SIZE = 256;
 
 struct CBlockTemplate
 {
@@ -32,48 +41,32 @@ struct CBlockTemplate
     std::vector<unsigned char> vchCoinbaseCommitment;
 };
 
-// Container for tracking updates to ancestor feerate as we include (parent)
-// transactions in a block
-struct CTxMemPoolModifiedEntry {
-    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+// Ancestor package of a mempool transaction, less the ancestors already in
+// the block, as tracked by addPackageTxs once some of them are
+struct CTxPackage {
+    CTxPackage(CTxMemPool::txiter entry)
     {
         iter = entry;
         nSizeWithAncestors = entry->GetSizeWithAncestors();
         nModFeesWithAncestors = entry->GetModFeesWithAncestors();
         nSigOpCostWithAncestors = entry->GetSigOpCostWithAncestors();
+        nGeneration = 0;
     }
 
     CTxMemPool::txiter iter;
     uint64_t nSizeWithAncestors;
     CAmount nModFeesWithAncestors;
     int64_t nSigOpCostWithAncestors;
-};
-
-/** Comparator for CTxMemPool::txiter objects.
- *  It simply compares the internal memory address of the CTxMemPoolEntry object
- *  pointed to. This means it has no meaning, and is only useful for using them
- *  as key in other indexes.
- */
-struct CompareCTxMemPoolIter {
-    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
-    {
-        return &(*a) < &(*b);
-    }
-};
-
-struct modifiedentry_iter {
-    typedef CTxMemPool::txiter result_type;
-    result_type operator() (const CTxMemPoolModifiedEntry &entry) const
-    {
-        return entry.iter;
-    }
+    // Bumped whenever the package shrinks, so that copies of it left in the
+    // candidate heap can be told to be stale
+    uint64_t nGeneration;
 };
 
 // This matches the calculation in CompareTxMemPoolEntryByAncestorFee,
-// except operating on CTxMemPoolModifiedEntry.
+// except operating on CTxPackage.
 // TODO: refactor to avoid duplication of this logic.
-struct CompareModifiedEntry {
-    bool operator()(const CTxMemPoolModifiedEntry &a, const CTxMemPoolModifiedEntry &b)
+struct CompareTxPackage {
+    bool operator()(const CTxPackage &a, const CTxPackage &b) const
     {
         double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
         double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
@@ -84,11 +77,20 @@ struct CompareModifiedEntry {
     }
 };
 
+// Reversed CompareTxPackage, so that the std heap functions keep the package
+// with the highest ancestor feerate at the front
+struct CompareTxPackageForHeap {
+    bool operator()(const CTxPackage &a, const CTxPackage &b) const
+    {
+        return CompareTxPackage()(b, a);
+    }
+};
+
 // A comparator that sorts transactions based on number of ancestors.
 // This is sufficient to sort an ancestor package in an order that is valid
 // to appear in a block.
 struct CompareTxIterByAncestorCount {
-    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b)
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
     {
         if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
             return a->GetCountWithAncestors() < b->GetCountWithAncestors();
@@ -96,39 +98,7 @@ struct CompareTxIterByAncestorCount {
     }
 };
 
-typedef boost::multi_index_container<
-    CTxMemPoolModifiedEntry,
-    boost::multi_index::indexed_by<
-        boost::multi_index::ordered_unique<
-            modifiedentry_iter,
-            CompareCTxMemPoolIter
-        >,
-        // sorted by modified ancestor fee rate
-        boost::multi_index::ordered_non_unique<
-            // Reuse same tag from CTxMemPool's similar index
-            boost::multi_index::tag<ancestor_score>,
-            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
-            CompareModifiedEntry
-        >
-    >
-> indexed_modified_transaction_set;
-
-typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
-typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
-
-struct update_for_parent_inclusion
-{
-    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
-
-    void operator() (CTxMemPoolModifiedEntry &e)
-    {
-        e.nModFeesWithAncestors -= iter->GetFee();
-        e.nSizeWithAncestors -= iter->GetTxSize();
-        e.nSigOpCostWithAncestors -= iter->GetSigOpCost();
-    }
-
-    CTxMemPool::txiter iter;
-};
+typedef std::unordered_map<const CTxMemPoolEntry*, CTxPackage> mapTxPackages;
 
 /** Generate a new block, without valid proof-of-work */
 class BlockAssembler
@@ -150,7 +120,7 @@ private:
     uint64_t nBlockTx;
     uint64_t nBlockSigOpsCost;
     CAmount nFees;
-    CTxMemPool::setEntries inBlock;
+    std::unordered_set<const CTxMemPoolEntry*> inBlock;
 
     // Chain context for the block
     int nHeight;
@@ -161,15 +131,30 @@ private:
     int lastFewTxs;
     bool blockFinished;
 
+    bool fLeftOutForRoom; //!< Whether a package paying enough was left out for lack of room
+
+    bool fPrintPriority;
+
 public:
     BlockAssembler(const CChainParams& chainparams);
     /** Construct a new block template with coinbase to scriptPubKeyIn */
-    std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn);
+    std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn, bool fTestValidity = true);
+    /** Construct a block holding only a coinbase to scriptPubKeyIn on top of
+      * pindexPrev, which needn't be the tip. It isn't checked with
+      * TestBlockValidity, which needs the tip. */
+    std::unique_ptr<CBlockTemplate> CreateEmptyBlock(const CScript& scriptPubKeyIn, CBlockIndex* pindexPrev);
+
+    unsigned int GetBlockMaxWeight() const { return nBlockMaxWeight; }
+    unsigned int GetBlockMaxSize() const { return nBlockMaxSize; }
+    bool NeedsSizeAccounting() const { return fNeedSizeAccounting; }
+    bool LeftOutForRoom() const { return fLeftOutForRoom; }
 
 private:
     // utility functions
     /** Clear the block's state and prepare for assembling a new block */
     void resetBlock();
+    /** Assemble a block on top of pindexPrev, with mempool transactions if fAddTxs */
+    std::unique_ptr<CBlockTemplate> AssembleBlock(const CScript& scriptPubKeyIn, CBlockIndex* pindexPrev, bool fAddTxs, bool fTestValidity);
     /** Add a tx to the block */
     void AddToBlock(CTxMemPool::txiter iter);
 
@@ -186,27 +171,113 @@ private:
     bool isStillDependent(CTxMemPool::txiter iter);
 
     // helper functions for addPackageTxs()
-    /** Remove confirmed (inBlock) entries from given set */
-    void onlyUnconfirmed(CTxMemPool::setEntries& testSet);
+    /** Remove confirmed (inBlock) entries from given list */
+    void onlyUnconfirmed(CTxMemPool::vecEntries& testSet);
     /** Test if a new package would "fit" in the block */
     bool TestPackage(uint64_t packageSize, int64_t packageSigOpsCost);
     /** Perform checks on each transaction in a package:
       * locktime, premature-witness, serialized size (if necessary)
       * These checks should always succeed, and they're here
       * only as an extra check in case of suboptimal node configuration */
-    bool TestPackageTransactions(const CTxMemPool::setEntries& package);
+    bool TestPackageTransactions(const CTxMemPool::vecEntries& package);
     /** Return true if given transaction from mapTx has already been evaluated,
       * or if the transaction's cached data in mapTx is incorrect. */
-    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx);
+    bool SkipMapTxEntry(CTxMemPool::txiter it, const mapTxPackages &mapPackages);
     /** Sort the package in an order that is valid to appear in a block */
-    void SortForBlock(const CTxMemPool::setEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries);
-    /** Add descendants of given transactions to mapModifiedTx with ancestor
-      * state updated assuming given transactions are inBlock. */
-    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
+    void SortForBlock(const CTxMemPool::vecEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries);
+    /** Shrink the packages of the descendants of given transactions by them,
+      * which must have been added to inBlock already, and push the shrunk
+      * packages onto the candidate heap with generation nGeneration. */
+    void UpdatePackagesForAdded(const CTxMemPool::vecEntries& alreadyAdded, mapTxPackages &mapPackages, std::vector<CTxPackage> &vHeap, uint64_t nGeneration);
 };
 
+/**
+ * Block template for the current tip, kept up to date as transactions enter
+ * and leave the mempool so that it needn't be assembled anew for every
+ * getblocktemplate call.
+ *
+ * A transaction entering the mempool is appended to the template if its
+ * in-mempool parents are all in it and it fits; one leaving the mempool is
+ * dropped from it, and all its descendants leave with it. A transaction that
+ * can't be taken in that way may deserve a place that only assembling the
+ * template from the whole mempool would find, so once the template has
+ * lagged like this for nMaxStaleness seconds it is assembled anew. That is
+ * also done on a new tip, and on the next call after a transaction in the
+ * mempool was prioritised, which can change what the whole template takes.
+ */
+class CBlockTemplateCache
+{
+private:
+    struct CTemplateTx
+    {
+        CTransactionRef tx;
+        CAmount nFee;
+        int64_t nSigOpsCost;
+        uint64_t nWeight;
+        uint64_t nSize;
+        bool fRemoved;
+    };
+
+    const CChainParams& chainparams;
+    const int64_t nMaxStaleness;
+
+    mutable CCriticalSection cs;
+    // Everything about the template but its transactions, as last assembled
+    const CBlockIndex* pindexPrev; //!< NULL until first assembled
+    CBlockHeader header;
+    CScript scriptPubKey;
+    int64_t nCoinbaseSigOpsCost;
+    int nHeight;
+    int64_t nLockTimeCutoff;
+    bool fIncludeWitness;
+    unsigned int nBlockMaxWeight, nBlockMaxSize;
+    bool fNeedSizeAccounting;
+    bool fMempoolLeftOut; //!< Whether the template had no room for mempool transactions it could take
+
+    // The transactions after the coinbase, in block order, and their totals
+    std::vector<CTemplateTx> vTx;
+    std::map<uint256, size_t> mapTxIndex; //!< Position in vTx of the transactions not removed
+    size_t nRemoved;
+    uint64_t nBlockWeight;
+    uint64_t nBlockSize;
+    int64_t nBlockSigOpsCost;
+    CAmount nFees;
+
+    size_t nAppended;
+    int64_t nLaggingSince; //!< When the template first missed a mempool change, or 0
+    bool fPrioritised; //!< Whether a fee delta changed since the template was last assembled
+
+    void TransactionAddedToMempool(CTransactionRef ptx);
+    void TransactionRemovedFromMempool(CTransactionRef ptx);
+    void TransactionPrioritised(CTransactionRef ptx);
+    void MarkLagging();
+    /** Assemble the template from the whole mempool */
+    bool Assemble(const CScript& scriptPubKeyIn);
+    /** Build a template from the transactions in vTx */
+    std::unique_ptr<CBlockTemplate> MakeTemplate();
+
+public:
+    CBlockTemplateCache(const CChainParams& chainparams, int64_t nMaxStaleness);
+    ~CBlockTemplateCache();
+
+    /** Return a template with coinbase to scriptPubKeyIn for the current tip */
+    std::unique_ptr<CBlockTemplate> Get(const CScript& scriptPubKeyIn);
+
+    /** Number of transactions appended since the template was last assembled */
+    size_t GetAppendedCount() const;
+};
+
+extern std::unique_ptr<CBlockTemplateCache> g_blocktemplatecache;
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
+/**
+ * Search the nonces from block.nNonce up to nMaxNonce for one that gives the
+ * block a valid proof of work, hashing at most nMaxTries times, on up to
+ * nThreads threads. Leaves block.nNonce at the nonce found or where the
+ * search stopped, and takes the hashes done off nMaxTries.
+ */
+bool GrindBlockNonce(CBlockHeader& block, const Consensus::Params& consensusParams, uint32_t nMaxNonce, uint64_t& nMaxTries, int nThreads);
 
 #endif // BITCOIN_MINER_H
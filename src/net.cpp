@@ -26,6 +26,13 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #endif
 
 #ifdef USE_UPNP
@@ -46,6 +53,20 @@
 // We add a random period time (0 to 1 seconds) to feeler connections to prevent synchronization.
 #define FEELER_SLEEP_WINDOW 1
 
+// Size of the buffer a single recv() call reads into
+static const int RECV_BUFFER_SIZE = 0x10000;
+
+// Receive straight into a message's payload once this much of it is outstanding
+static const unsigned int MIN_DIRECT_RECV_SIZE = 16 * 1024;
+
+// Number of payload buffers kept per peer for reuse, and the largest one kept
+static const size_t MAX_RECV_POOL_BUFFERS = 4;
+static const size_t MAX_RECV_POOL_BUFFER_SIZE = 64 * 1024;
+
+/** Bytes moved from a peer's send queues to the socket at a time. A message
+ *  queued later only waits for these (and at most one larger message). */
+static const size_t SEND_WINDOW_SIZE = 64 * 1024;
+
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -70,6 +91,7 @@ static const uint64_t RANDOMIZER_ID_LOCALHOSTNONCE = 0xd93e69e2bbfa5735ULL; // S
 //
 bool fDiscover = true;
 bool fListen = true;
+bool fCaptureMessages = DEFAULT_CAPTURE_MESSAGES;
 bool fRelayTxes = true;
 CCriticalSection cs_mapLocalHost;
 std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
@@ -360,7 +382,7 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool fCo
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (socketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -400,6 +422,9 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool fCo
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+#ifdef USE_EPOLL
+        AddSocketEvents(pnode);
+#endif
 
         return pnode;
     } else if (!proxyConnectionFailed) {
@@ -418,12 +443,27 @@ void CConnman::DumpBanlist()
     if (!BannedSetIsDirty())
         return;
 
-    int64_t nStart = GetTimeMillis();
-
-    CBanDB bandb;
     banmap_t banmap;
     SetBannedSetDirty(false);
     GetBanned(banmap);
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutexDumpData);
+        if (fDumpDataThread) {
+            // Leave the write to ThreadDumpData, replacing any older copy it hasn't got to yet
+            pBanlistToDump.reset(new banmap_t(std::move(banmap)));
+            condDumpData.notify_one();
+            return;
+        }
+    }
+    WriteBanlist(banmap);
+}
+
+void CConnman::WriteBanlist(const banmap_t& banmap)
+{
+    int64_t nStart = GetTimeMillis();
+
+    CBanDB bandb;
     if (!bandb.Write(banmap))
         SetBannedSetDirty(true);
 
@@ -431,6 +471,27 @@ void CConnman::DumpBanlist()
         banmap.size(), GetTimeMillis() - nStart);
 }
 
+void CConnman::ThreadDumpData()
+{
+    while (true) {
+        std::unique_ptr<CDataStream> pssPeers;
+        size_t nAddresses;
+        std::unique_ptr<banmap_t> pbanmap;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexDumpData);
+            while (!pPeersToDump && !pBanlistToDump)
+                condDumpData.wait(lock);
+            pssPeers = std::move(pPeersToDump);
+            nAddresses = nPeersToDump;
+            pbanmap = std::move(pBanlistToDump);
+        }
+        if (pssPeers)
+            WritePeers(*pssPeers, nAddresses);
+        if (pbanmap)
+            WriteBanlist(*pbanmap);
+    }
+}
+
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
@@ -451,6 +512,7 @@ void CConnman::ClearBanned()
     {
         LOCK(cs_setBanned);
         setBanned.clear();
+        banTrie.Clear();
         setBannedIsDirty = true;
     }
     DumpBanlist(); //store banlist to disk
@@ -460,19 +522,8 @@ void CConnman::ClearBanned()
 
 bool CConnman::IsBanned(CNetAddr ip)
 {
-    bool fResult = false;
-    {
-        LOCK(cs_setBanned);
-        for (banmap_t::iterator it = setBanned.begin(); it != setBanned.end(); it++)
-        {
-            CSubNet subNet = (*it).first;
-            CBanEntry banEntry = (*it).second;
-
-            if(subNet.Match(ip) && GetTime() < banEntry.nBanUntil)
-                fResult = true;
-        }
-    }
-    return fResult;
+    LOCK(cs_setBanned);
+    return GetTime() < banTrie.GetBanUntil(ip);
 }
 
 bool CConnman::IsBanned(CSubNet subnet)
@@ -510,6 +561,7 @@ void CConnman::Ban(const CSubNet& subNet, const BanReason &banReason, int64_t ba
         LOCK(cs_setBanned);
         if (setBanned[subNet].nBanUntil < banEntry.nBanUntil) {
             setBanned[subNet] = banEntry;
+            banTrie.Insert(subNet, banEntry.nBanUntil);
             setBannedIsDirty = true;
         }
         else
@@ -538,6 +590,7 @@ bool CConnman::Unban(const CSubNet &subNet) {
         LOCK(cs_setBanned);
         if (!setBanned.erase(subNet))
             return false;
+        RebuildBanTrie();
         setBannedIsDirty = true;
     }
     if(clientInterface)
@@ -556,6 +609,7 @@ void CConnman::SetBanned(const banmap_t &banMap)
 {
     LOCK(cs_setBanned);
     setBanned = banMap;
+    RebuildBanTrie();
     setBannedIsDirty = true;
 }
 
@@ -564,6 +618,7 @@ void CConnman::SweepBanned()
     int64_t now = GetTime();
 
     LOCK(cs_setBanned);
+    bool fErased = false;
     banmap_t::iterator it = setBanned.begin();
     while(it != setBanned.end())
     {
@@ -573,11 +628,80 @@ void CConnman::SweepBanned()
         {
             setBanned.erase(it++);
             setBannedIsDirty = true;
+            fErased = true;
             LogPrint("net", "%s: Removed banned node ip/subnet from banlist.dat: %s\n", __func__, subNet.ToString());
         }
         else
             ++it;
     }
+    if (fErased)
+        RebuildBanTrie();
+}
+
+void CConnman::RebuildBanTrie()
+{
+    AssertLockHeld(cs_setBanned);
+    banTrie.Clear();
+    for (banmap_t::const_iterator it = setBanned.begin(); it != setBanned.end(); ++it)
+        banTrie.Insert(it->first, it->second.nBanUntil);
+}
+
+void CBanTrie::Clear()
+{
+    vNodes.assign(1, Node());
+    vNodes[0].nChild[0] = vNodes[0].nChild[1] = 0;
+    vNodes[0].nBanUntil = 0;
+    vOther.clear();
+}
+
+/** Bit n of addr, counting from the most significant bit of its 16 bytes */
+static inline int GetAddressBit(const CNetAddr& addr, int n)
+{
+    return (addr.GetByte(15 - (n >> 3)) >> (7 - (n & 7))) & 1;
+}
+
+void CBanTrie::Insert(const CSubNet& subNet, int64_t nBanUntil)
+{
+    if (!subNet.IsValid())
+        return;
+    int nPrefixLength = subNet.GetPrefixLength();
+    if (nPrefixLength < 0) {
+        vOther.push_back(std::make_pair(subNet, nBanUntil));
+        return;
+    }
+    uint32_t nNode = 0;
+    for (int n = 0; n < nPrefixLength; n++) {
+        int nBit = GetAddressBit(subNet.GetNetwork(), n);
+        if (vNodes[nNode].nChild[nBit] == 0) {
+            Node node;
+            node.nChild[0] = node.nChild[1] = 0;
+            node.nBanUntil = 0;
+            vNodes[nNode].nChild[nBit] = vNodes.size();
+            vNodes.push_back(node);
+        }
+        nNode = vNodes[nNode].nChild[nBit];
+    }
+    vNodes[nNode].nBanUntil = std::max(vNodes[nNode].nBanUntil, nBanUntil);
+}
+
+int64_t CBanTrie::GetBanUntil(const CNetAddr& addr) const
+{
+    if (!addr.IsValid())
+        return 0;
+    // Every node on the path of addr is a subnet that contains it
+    int64_t nBanUntil = vNodes[0].nBanUntil;
+    uint32_t nNode = 0;
+    for (int n = 0; n < 128; n++) {
+        nNode = vNodes[nNode].nChild[GetAddressBit(addr, n)];
+        if (nNode == 0)
+            break;
+        nBanUntil = std::max(nBanUntil, vNodes[nNode].nBanUntil);
+    }
+    for (std::vector<std::pair<CSubNet, int64_t> >::const_iterator it = vOther.begin(); it != vOther.end(); ++it) {
+        if (it->first.Match(addr))
+            nBanUntil = std::max(nBanUntil, it->second);
+    }
+    return nBanUntil;
 }
 
 bool CConnman::BannedSetIsDirty()
@@ -659,8 +783,13 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
 
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
-            vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(Params().MessageStart(), SER_NETWORK, nRecvVersion));
+            vRecvMsg.back().complete()) {
+            vRecvMsg.emplace_back(Params().MessageStart(), SER_NETWORK, nRecvVersion);
+            if (!vRecvBufferPool.empty()) {
+                vRecvMsg.back().vRecv.SwapStorage(vRecvBufferPool.back());
+                vRecvBufferPool.pop_back();
+            }
+        }
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -683,23 +812,171 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
         nBytes -= handled;
 
         if (msg.complete()) {
+            RecordCompleteMessage(msg);
+            complete = true;
+        }
+    }
 
-            //store received bytes per message command
-            //to prevent a memory DOS, only allow valid commands
-            mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
-            if (i == mapRecvBytesPerMsgCmd.end())
-                i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
-            assert(i != mapRecvBytesPerMsgCmd.end());
-            i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+    return true;
+}
 
-            msg.nTime = GetTimeMicros();
-            complete = true;
+char* CNode::GetRecvPayloadBuffer(unsigned int& nSpace)
+{
+    nSpace = 0;
+    if (vRecvMsg.empty())
+        return NULL;
+
+    // Small messages are cheaper to pick up several at a time through the
+    // socket thread's buffer than with a recv() call each.
+    CNetMessage& msg = vRecvMsg.back();
+    if (!msg.in_data || msg.hdr.nMessageSize - msg.nDataPos < MIN_DIRECT_RECV_SIZE)
+        return NULL;
+    return msg.GetDataBuffer(nSpace);
+}
+
+void CNode::ReceivedPayloadBytes(unsigned int nBytes, bool& complete)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.DataReceived(nBytes);
+    complete = msg.complete();
+    if (complete)
+        RecordCompleteMessage(msg);
+}
+
+void CNode::RecordCompleteMessage(CNetMessage& msg)
+{
+    //store received bytes per message command
+    //to prevent a memory DOS, only allow valid commands
+    mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
+    if (i == mapRecvBytesPerMsgCmd.end())
+        i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(i != mapRecvBytesPerMsgCmd.end());
+    i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+
+    msg.nTime = GetTimeMicros();
+
+    if (fCaptureMessages)
+        CaptureMessage(msg);
+}
+
+void CNode::CaptureMessage(const CNetMessage& msg)
+{
+    if (!fileCapture) {
+        // One directory per address, shared by successive connections to it
+        std::string strDir = addr.ToString();
+        for (size_t i = 0; i < strDir.size(); i++) {
+            if (!isalnum((unsigned char)strDir[i]) && strDir[i] != '.')
+                strDir[i] = '_';
+        }
+        boost::filesystem::path pathDir = GetDataDir() / "message_capture" / strDir;
+        try {
+            boost::filesystem::create_directories(pathDir);
+        } catch (const boost::filesystem::filesystem_error& e) {
+            LogPrintf("Unable to create %s: %s\n", pathDir.string(), e.what());
         }
+        fileCapture = fopen((pathDir / "msgs_recv.dat").string().c_str(), "ab");
+        if (!fileCapture) {
+            LogPrintf("Unable to open %s, not capturing messages of peer=%d\n", (pathDir / "msgs_recv.dat").string(), id);
+            return;
+        }
+    }
+
+    CCapturedMessage captured;
+    captured.nTime = msg.nTime;
+    captured.strCommand = msg.hdr.GetCommand();
+    captured.vPayload.assign(msg.vRecv.begin(), msg.vRecv.end());
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << captured;
+    if (fwrite(&ss[0], 1, ss.size(), fileCapture) != ss.size()) {
+        LogPrintf("Failed to capture message of peer=%d\n", id);
+        fclose(fileCapture);
+        fileCapture = NULL;
     }
+}
 
+bool ReadCapturedMessages(const boost::filesystem::path& path, std::vector<CCapturedMessage>& vMessages)
+{
+    FILE *file = fopen(path.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: Failed to open file %s", __func__, path.string());
+
+    vMessages.clear();
+    try {
+        while (true) {
+            // A file still being written may end in a partial message.
+            if (fgetc(filein.Get()) == EOF)
+                break;
+            fseek(filein.Get(), -1, SEEK_CUR);
+            CCapturedMessage msg;
+            filein >> msg;
+            vMessages.push_back(std::move(msg));
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s ends in a partial message (%s)\n", __func__, path.string(), e.what());
+    }
     return true;
 }
 
+CLogHistogram::CLogHistogram() : nCount(0), nSum(0), nMax(0)
+{
+    memset(vBuckets, 0, sizeof(vBuckets));
+}
+
+void CLogHistogram::Add(uint64_t nValue)
+{
+    int nBucket = 0;
+    while (nValue >> nBucket && nBucket < BUCKETS - 1)
+        nBucket++;
+    vBuckets[nBucket]++;
+    nCount++;
+    nSum += nValue;
+    nMax = std::max(nMax, nValue);
+}
+
+void CLogHistogram::Add(const CLogHistogram& other)
+{
+    for (int i = 0; i < BUCKETS; i++)
+        vBuckets[i] += other.vBuckets[i];
+    nCount += other.nCount;
+    nSum += other.nSum;
+    nMax = std::max(nMax, other.nMax);
+}
+
+void CMsgMetrics::Add(uint64_t nBytes, int64_t nHandlerMicros, int64_t nMainLockMicros)
+{
+    bytes.Add(nBytes);
+    handlerTime.Add(std::max(nHandlerMicros, (int64_t)0));
+    mainLockTime.Add(std::max(nMainLockMicros, (int64_t)0));
+}
+
+void CMsgMetrics::Add(const CMsgMetrics& other)
+{
+    bytes.Add(other.bytes);
+    handlerTime.Add(other.handlerTime);
+    mainLockTime.Add(other.mainLockTime);
+}
+
+void CPeerMsgMetrics::Add(const CPeerMsgMetrics& other)
+{
+    BOOST_FOREACH(const mapMsgCmdMetrics::value_type& item, other.mapRecv)
+        mapRecv[item.first].Add(item.second);
+    send.Add(other.send);
+}
+
+void CNode::ReleaseRecvMsgs(std::deque<CNetMessage>::iterator itEnd)
+{
+    for (std::deque<CNetMessage>::iterator it = vRecvMsg.begin(); it != itEnd && vRecvBufferPool.size() < MAX_RECV_POOL_BUFFERS; ++it) {
+        CSerializeData vch;
+        it->vRecv.SwapStorage(vch);
+        if (vch.capacity() > 0 && vch.capacity() <= MAX_RECV_POOL_BUFFER_SIZE) {
+            vch.clear();
+            vRecvBufferPool.push_back(std::move(vch));
+        }
+    }
+    vRecvMsg.erase(vRecvMsg.begin(), itEnd);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -741,13 +1018,30 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
         vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
     }
 
-    hasher.Write((const unsigned char*)pch, nCopy);
     memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+    DataReceived(nCopy);
 
     return nCopy;
 }
 
+char* CNetMessage::GetDataBuffer(unsigned int& nSpace)
+{
+    assert(in_data && nDataPos < hdr.nMessageSize);
+    if (vRecv.size() == nDataPos) {
+        // Allocate up to 256 KiB ahead, but never more than the total message size.
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + 256 * 1024));
+    }
+    nSpace = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
+
+void CNetMessage::DataReceived(unsigned int nBytes)
+{
+    assert(nDataPos + nBytes <= vRecv.size());
+    hasher.Write((const unsigned char*)&vRecv[nDataPos], nBytes);
+    nDataPos += nBytes;
+}
+
 const uint256& CNetMessage::GetMessageHash() const
 {
     assert(complete());
@@ -764,14 +1058,97 @@ const uint256& CNetMessage::GetMessageHash() const
 
 
 
+#ifndef WIN32
+/** Maximum number of queued buffers handed to a single sendmsg() call */
+static const size_t MAX_SEND_IOV = 64;
+
 // requires LOCK(cs_vSend)
-size_t SocketSendData(CNode *pnode)
+size_t SocketSendData(CNode *pnode, CUploadShaper* pshaper)
 {
-    auto it = pnode->vSendMsg.begin();
     size_t nSentSize = 0;
 
-    while (it != pnode->vSendMsg.end()) {
-        const auto &data = *it;
+    while (!pnode->vSendMsg.empty() || pnode->FillSendMsg(pshaper)) {
+        // Gather the queued buffers (typically a header followed by its
+        // payload) so that one call sends as many of them as the socket takes.
+        struct iovec iov[MAX_SEND_IOV];
+        size_t nIov = 0;
+        size_t nBatchSize = 0;
+        size_t nOffset = pnode->nSendOffset;
+        auto it = pnode->vSendMsg.begin();
+        for (; it != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; ++it) {
+            assert(it->size() > nOffset);
+            iov[nIov].iov_base = const_cast<unsigned char*>(it->data()) + nOffset;
+            iov[nIov].iov_len = it->size() - nOffset;
+            nBatchSize += iov[nIov].iov_len;
+            nOffset = 0;
+            nIov++;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+
+        int nFlags = MSG_NOSIGNAL | MSG_DONTWAIT;
+#ifdef MSG_MORE
+        // More buffers follow right away; let the kernel coalesce the tail
+        // of this batch with the next one instead of sending a short segment.
+        if (it != pnode->vSendMsg.end())
+            nFlags |= MSG_MORE;
+#endif
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msg, nFlags);
+        if (nBytes > 0) {
+            pnode->nLastSend = GetTime();
+            pnode->nSendBytes += nBytes;
+            nSentSize += nBytes;
+
+            // Drop the buffers that went out completely and remember how far
+            // into the first remaining one we got.
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                const auto &data = pnode->vSendMsg.front();
+                size_t nRemaining = data.size() - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
+                pnode->nSendOffset = 0;
+                pnode->nSendSize -= data.size();
+                pnode->vSendMsg.pop_front();
+            }
+
+            if ((size_t)nBytes < nBatchSize) {
+                // could not send the full batch; the socket buffer is full
+                break;
+            }
+        } else {
+            if (nBytes < 0) {
+                // error
+                int nErr = WSAGetLastError();
+                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                {
+                    LogPrintf("socket send error %s\n", NetworkErrorString(nErr));
+                    pnode->CloseSocketDisconnect();
+                }
+            }
+            // couldn't send anything at all
+            break;
+        }
+    }
+
+    if (pnode->vSendMsg.empty())
+        assert(pnode->nSendOffset == 0);
+    return nSentSize;
+}
+#else
+// requires LOCK(cs_vSend)
+size_t SocketSendData(CNode *pnode, CUploadShaper* pshaper)
+{
+    size_t nSentSize = 0;
+
+    while (!pnode->vSendMsg.empty() || pnode->FillSendMsg(pshaper)) {
+        const auto &data = pnode->vSendMsg.front();
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -782,7 +1159,7 @@ size_t SocketSendData(CNode *pnode)
             if (pnode->nSendOffset == data.size()) {
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
-                it++;
+                pnode->vSendMsg.pop_front();
             } else {
                 // could not send full message; stop sending more
                 break;
@@ -802,13 +1179,109 @@ size_t SocketSendData(CNode *pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty())
         assert(pnode->nSendOffset == 0);
-        assert(pnode->nSendSize == 0);
-    }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
     return nSentSize;
 }
+#endif
+
+bool CNode::FillSendMsg(CUploadShaper* pshaper)
+{
+    int64_t nNow = pshaper ? GetTimeMicros() : 0;
+    size_t nWindow = 0;
+    for (int i = 0; i < SEND_PRIORITY_COUNT && nWindow < SEND_WINDOW_SIZE; i++) {
+        SendPriority nPriority = (SendPriority)i;
+        std::deque<CSendBatch>& queue = vSendQueue[i];
+        // Shaped batches held back in a class that is otherwise never held
+        // back are passed over, keeping their order among themselves
+        bool fShapedHeld = false;
+        std::deque<CSendBatch>::iterator it = queue.begin();
+        while (it != queue.end() && nWindow < SEND_WINDOW_SIZE) {
+            if (it->fShaped && fShapedHeld) {
+                ++it;
+                continue;
+            }
+            size_t nSize = 0;
+            BOOST_FOREACH(const std::vector<unsigned char>& buf, it->vBuffers)
+                nSize += buf.size();
+            if (pshaper && !pshaper->MaySend(this, nPriority, it->fShaped, nSize, nNow)) {
+                if (!it->fShaped || IsShapedSendPriority(nPriority))
+                    break;
+                fShapedHeld = true;
+                ++it;
+                continue;
+            }
+            BOOST_FOREACH(std::vector<unsigned char>& buf, it->vBuffers) {
+                if (!buf.empty())
+                    vSendMsg.push_back(std::move(buf));
+            }
+            if (pshaper)
+                pshaper->Consume(this, nPriority, nSize);
+            nSendQueueSize[i] -= nSize;
+            nWindow += nSize;
+            it = queue.erase(it);
+        }
+    }
+    return !vSendMsg.empty();
+}
+
+void CTokenBucket::SetRate(int64_t nRateIn)
+{
+    nRate = nRateIn;
+    nTokens = nRate;
+    nLastRefill = 0;
+}
+
+bool CTokenBucket::MaySend(int64_t nTimeMicros, int64_t nBytes)
+{
+    if (!nRate)
+        return true;
+    if (nTimeMicros > nLastRefill) {
+        // Time past filling the bucket doesn't count, which also keeps the
+        // multiplication from overflowing after a long idle time. The time
+        // worth less than a token is carried over to the next refill.
+        int64_t nElapsed = nTimeMicros - nLastRefill;
+        int64_t nTimeToFill = ((nRate - nTokens) * 1000000 + nRate - 1) / nRate;
+        if (nElapsed >= nTimeToFill) {
+            nTokens = nRate;
+            nLastRefill = nTimeMicros;
+        } else {
+            int64_t nAdd = nElapsed * nRate / 1000000;
+            nTokens += nAdd;
+            nLastRefill += nAdd * 1000000 / nRate;
+        }
+    }
+    return nTokens >= std::min(nBytes, nRate);
+}
+
+void CUploadShaper::SetRates(int64_t nTotalRate, int64_t nPeerRateIn, const uint64_t (&vClassRate)[SEND_PRIORITY_COUNT])
+{
+    LOCK(cs);
+    bucketTotal.SetRate(nTotalRate);
+    for (int i = 0; i < SEND_PRIORITY_COUNT; i++)
+        vBucketClass[i].SetRate(vClassRate[i]);
+    nPeerRate = nPeerRateIn;
+}
+
+bool CUploadShaper::MaySend(CNode* pnode, SendPriority nPriority, bool fShaped, size_t nBytes, int64_t nTimeMicros)
+{
+    if (!IsShapedSendPriority(nPriority) && !fShaped)
+        return true;
+    if (pnode->uploadBucket.GetRate() != nPeerRate)
+        pnode->uploadBucket.SetRate(nPeerRate);
+    if (!pnode->uploadBucket.MaySend(nTimeMicros, nBytes))
+        return false;
+    LOCK(cs);
+    return bucketTotal.MaySend(nTimeMicros, nBytes) && vBucketClass[nPriority].MaySend(nTimeMicros, nBytes);
+}
+
+void CUploadShaper::Consume(CNode* pnode, SendPriority nPriority, size_t nBytes)
+{
+    pnode->uploadBucket.Consume(nBytes);
+    LOCK(cs);
+    bucketTotal.Consume(nBytes);
+    vBucketClass[nPriority].Consume(nBytes);
+}
 
 struct NodeEvictionCandidate
 {
@@ -990,7 +1463,7 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (socketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1037,11 +1510,17 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
     }
+#ifdef USE_EPOLL
+    AddSocketEvents(pnode);
+#endif
 }
 
 void CConnman::ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+#ifdef USE_EPOLL
+    bool fMoreWork = false;
+#endif
     while (true)
     {
         //
@@ -1112,209 +1591,408 @@ void CConnman::ThreadSocketHandler()
                 clientInterface->NotifyNumConnectionsChanged(nPrevNodeCount);
         }
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+#ifdef USE_EPOLL
+        if (socketEventsMode == SOCKETEVENTS_EPOLL) {
+            SocketHandlerEpoll(fMoreWork);
+            continue;
         }
+#endif
+        SocketHandlerSelect();
+    }
+}
+
+void CConnman::SocketHandlerSelect()
+{
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
 
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = std::max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, select() for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
             {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend) {
-                        if (!pnode->vSendMsg.empty()) {
-                            FD_SET(pnode->hSocket, &fdsetSend);
-                            continue;
-                        }
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend) {
+                    if (!pnode->vSendMsg.empty()) {
+                        FD_SET(pnode->hSocket, &fdsetSend);
+                        continue;
                     }
                 }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= GetReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
+            }
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && (
+                    pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                    pnode->GetTotalRecvSize() <= GetReceiveFloodSize()))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
             }
         }
+    }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
         {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
         }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec/1000);
+    }
+
+    //
+    // Accept new connections
+    //
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+    {
+        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+        {
+            AcceptConnection(hListenSocket);
+        }
+    }
+
+    //
+    // Service each socket
+    //
+    std::vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        boost::this_thread::interruption_point();
 
         //
-        // Accept new connections
+        // Receive
         //
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                AcceptConnection(hListenSocket);
-            }
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
+                SocketRecvData(pnode);
         }
 
         //
-        // Service each socket
+        // Send
         //
-        std::vector<CNode*> vNodesCopy;
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+            // Messages held back by the upload rate limits don't wait for the
+            // socket; retry them every time round.
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend && (FD_ISSET(pnode->hSocket, &fdsetSend) || (pnode->vSendMsg.empty() && pnode->nSendSize > 0))) {
+                size_t nBytes = SocketSendData(pnode, &uploadShaper);
+                if (nBytes)
+                    RecordBytesSent(nBytes);
+            }
         }
+
+        InactivityCheck(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
-        {
-            boost::this_thread::interruption_point();
+            pnode->Release();
+    }
+}
 
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            bool notify = false;
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
-                                pnode->CloseSocketDisconnect();
-                            if(notify)
-                                messageHandlerCondition.notify_one();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+#ifdef USE_EPOLL
+/** Upper bound on the events collected by a single epoll_wait call */
+static const int MAX_EPOLL_EVENTS = 256;
+
+// Peer sockets are registered edge-triggered: readiness is reported once per
+// transition and remembered in the node's fSocketReadable/fSocketWritable
+// flags until a read or write runs into EWOULDBLOCK. Unlike select() this
+// needs no per-iteration scan of every socket and no FD_SETSIZE limit.
+void CConnman::AddSocketEvents(CNode* pnode)
+{
+    if (socketEventsMode != SOCKETEVENTS_EPOLL)
+        return;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("epoll_ctl failed to add socket for peer=%d: %s\n", pnode->id, NetworkErrorString(errno));
+        pnode->CloseSocketDisconnect();
+    }
+}
+
+void CConnman::WakeSocketHandler()
+{
+    if (socketEventsMode != SOCKETEVENTS_EPOLL)
+        return;
+
+    uint64_t nValue = 1;
+    if (write(wakeupfd, &nValue, sizeof(nValue)) != sizeof(nValue) && errno != EAGAIN) {
+        LogPrint("net", "failed to write to wakeup eventfd: %s\n", NetworkErrorString(errno));
+    }
+}
+
+void CConnman::ServiceSocketSoon(CNode* pnode, bool fWake)
+{
+    if (socketEventsMode != SOCKETEVENTS_EPOLL)
+        return;
+
+    {
+        LOCK(cs_setNodesQueued);
+        setNodesQueued.insert(pnode);
+    }
+    if (fWake)
+        WakeSocketHandler();
+}
+
+void CConnman::SocketHandlerEpoll(bool& fMoreWork)
+{
+    // Don't sleep if a previous read filled the whole buffer; the socket
+    // will not report readiness again until it has been drained.
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nEvents = epoll_wait(epollfd, events, MAX_EPOLL_EVENTS, fMoreWork ? 0 : 50);
+    boost::this_thread::interruption_point();
+
+    if (nEvents < 0) {
+        if (errno != EINTR)
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+        nEvents = 0;
+        if (!fMoreWork)
+            MilliSleep(50);
+    }
+
+    //
+    // Collect the nodes with work: those reported ready, those left with work
+    // last time, and those other threads queued data for
+    //
+    std::set<CNode*> setNodes;
+    setNodes.swap(setNodesPending);
+    {
+        LOCK(cs_setNodesQueued);
+        setNodes.insert(setNodesQueued.begin(), setNodesQueued.end());
+        setNodesQueued.clear();
+    }
+    for (int i = 0; i < nEvents; i++) {
+        void* ptr = events[i].data.ptr;
+        if (ptr == &wakeupfd) {
+            uint64_t nValue;
+            while (read(wakeupfd, &nValue, sizeof(nValue)) == sizeof(nValue)) {}
+            continue;
+        }
+        bool fListenSocket = false;
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+            if (ptr == &hListenSocket) {
+                fListenSocket = true;
+                if (hListenSocket.socket != INVALID_SOCKET)
+                    AcceptConnection(hListenSocket);
+                break;
             }
+        }
+        if (fListenSocket)
+            continue;
 
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend) {
-                    size_t nBytes = SocketSendData(pnode);
-                    if (nBytes)
-                        RecordBytesSent(nBytes);
-                }
+        // Nodes are only deleted by this thread, so the pointer is still valid.
+        CNode* pnode = static_cast<CNode*>(ptr);
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            pnode->fSocketReadable = true;
+        if (events[i].events & EPOLLOUT)
+            pnode->fSocketWritable = true;
+        setNodes.insert(pnode);
+    }
+
+    //
+    // Service the sockets with work
+    //
+    fMoreWork = false;
+    std::vector<CNode*> vNodesCopy(setNodes.begin(), setNodes.end());
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        boost::this_thread::interruption_point();
+
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+
+        // As in select mode, drain the send queue before receiving more.
+        // Messages held back by the upload rate limits are retried every time
+        // round and don't keep us from receiving.
+        bool fSendPending = false;
+        if (pnode->fSocketWritable) {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend && pnode->nSendSize > 0) {
+                size_t nBytes = SocketSendData(pnode, &uploadShaper);
+                if (nBytes)
+                    RecordBytesSent(nBytes);
+                fSendPending = !pnode->vSendMsg.empty();
+                if (fSendPending)
+                    pnode->fSocketWritable = false;
             }
+        }
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (pnode->fSocketReadable && !fSendPending) {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv && (
+                pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                pnode->GetTotalRecvSize() <= GetReceiveFloodSize()))
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
+                // A short read means the socket buffer was emptied and a new
+                // edge will be reported once more data arrives.
+                if (SocketRecvData(pnode))
+                    fMoreWork = true;
+                else
+                    pnode->fSocketReadable = false;
             }
         }
+
+        // Data left to read, or to send once the rate limits allow it, won't
+        // be reported again
+        if (pnode->hSocket != INVALID_SOCKET &&
+            (pnode->fSocketReadable || (pnode->fSocketWritable && pnode->nSendSize > 0)))
+            setNodesPending.insert(pnode);
+    }
+
+    // Timeouts only need checking about once a second, not for every event
+    int64_t nNow = GetTime();
+    {
+        LOCK(cs_vNodes);
+        if (nNow != nLastInactivityCheck) {
+            nLastInactivityCheck = nNow;
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                InactivityCheck(pnode);
+        }
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+}
+#endif
+
+// requires LOCK(cs_vRecvMsg)
+bool CConnman::SocketRecvData(CNode* pnode)
+{
+    // The rest of a large payload is read straight into the message being
+    // assembled. Everything else goes through a buffer on the stack, which
+    // can pick up several small messages and headers in one call.
+    // typical socket buffer is 8K-64K
+    char pchBuf[RECV_BUFFER_SIZE];
+    unsigned int nSpace = 0;
+    char* pchPayload = pnode->GetRecvPayloadBuffer(nSpace);
+    size_t nWant = pchPayload ? nSpace : sizeof(pchBuf);
+    int nBytes = recv(pnode->hSocket, pchPayload ? pchPayload : pchBuf, nWant, MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        bool notify = false;
+        if (pchPayload)
+            pnode->ReceivedPayloadBytes(nBytes, notify);
+        else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
+            pnode->CloseSocketDisconnect();
+        if(notify)
+            messageHandlerCondition.notify_one();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        RecordBytesRecv(nBytes);
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    // A full read means more data may still be waiting on the socket
+    return nBytes > 0 && (size_t)nBytes == nWant;
+}
+
+void CConnman::InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
         }
     }
 }
@@ -1532,14 +2210,36 @@ void CConnman::ThreadDNSAddressSeed()
 
 
 void CConnman::DumpAddresses()
+{
+    // Only serializing into memory holds up addrman; the disk write can
+    // happen elsewhere.
+    int64_t nStart = GetTimeMillis();
+    std::unique_ptr<CDataStream> pssPeers(new CDataStream(SER_DISK, CLIENT_VERSION));
+    CAddrDB::Snapshot(addrman, *pssPeers);
+    size_t nAddresses = addrman.size();
+    LogPrint("net", "Took snapshot of %d addresses  %dms\n", nAddresses, GetTimeMillis() - nStart);
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutexDumpData);
+        if (fDumpDataThread) {
+            pPeersToDump = std::move(pssPeers);
+            nPeersToDump = nAddresses;
+            condDumpData.notify_one();
+            return;
+        }
+    }
+    WritePeers(*pssPeers, nAddresses);
+}
+
+void CConnman::WritePeers(CDataStream& ssPeers, size_t nAddresses)
 {
     int64_t nStart = GetTimeMillis();
 
     CAddrDB adb;
-    adb.Write(addrman);
+    adb.WriteSnapshot(ssPeers);
 
     LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
-           addrman.size(), GetTimeMillis() - nStart);
+           nAddresses, GetTimeMillis() - nStart);
 }
 
 void CConnman::DumpData()
@@ -1820,11 +2520,12 @@ bool CConnman::OpenNetworkConnection(const CAddress& addrConnect, bool fCountFai
 }
 
 
-void CConnman::ThreadMessageHandler()
+// Messages of a peer are handled by whichever worker claims the peer first
+// (fInMessageHandler), which keeps them in order while other workers carry on
+// with other peers. Most handlers only take cs_main around the code that
+// needs it, so a peer stuck in validation no longer holds up the rest.
+void CConnman::ThreadMessageHandler(int nWorker)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
-
     while (true)
     {
         std::vector<CNode*> vNodesCopy;
@@ -1838,11 +2539,19 @@ void CConnman::ThreadMessageHandler()
 
         bool fSleep = true;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Start each worker at a different peer so they don't all contend
+        // for the same nodes.
+        size_t nNodes = vNodesCopy.size();
+        size_t nStart = nNodes ? (nWorker * nNodes / nMessageHandlerThreads) : 0;
+        for (size_t i = 0; i < nNodes; i++)
         {
+            CNode* pnode = vNodesCopy[(nStart + i) % nNodes];
             if (pnode->fDisconnect)
                 continue;
 
+            if (pnode->fInMessageHandler.exchange(true))
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1851,7 +2560,10 @@ void CConnman::ThreadMessageHandler()
                     if (!GetNodeSignals().ProcessMessages(pnode, *this))
                         pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < GetSendBufferSize())
+                    // Historical blocks queued behind the rest don't hold up
+                    // other responses, only serving more of them.
+                    SendPriority nPriority = pnode->vRecvGetData.empty() ? SEND_PRIORITY_ADDR : SEND_PRIORITY_BLOCK;
+                    if (pnode->GetSendSize(nPriority) < GetSendBufferSize())
                     {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
@@ -1860,14 +2572,26 @@ void CConnman::ThreadMessageHandler()
                     }
                 }
             }
-            boost::this_thread::interruption_point();
 
             // Send messages
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend) {
+                    int64_t nProcessStart = GetTimeMicros();
+                    int64_t nMainLockStart = GetLockHeldMicros();
                     GetNodeSignals().SendMessages(pnode, *this);
+                    int64_t nMainLockMicros = GetLockHeldMicros() - nMainLockStart;
+                    int64_t nHandlerMicros = GetTimeMicros() - nProcessStart;
+                    {
+                        LOCK(pnode->cs_msgMetrics);
+                        pnode->msgMetrics.send.Add(0, nHandlerMicros, nMainLockMicros);
+                    }
+                    LOCK(cs_msgMetrics);
+                    msgMetricsTotal.send.Add(0, nHandlerMicros, nMainLockMicros);
+                }
             }
+
+            pnode->fInMessageHandler = false;
             boost::this_thread::interruption_point();
         }
 
@@ -1877,8 +2601,10 @@ void CConnman::ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
+        if (fSleep) {
+            boost::unique_lock<boost::mutex> lock(messageHandlerMutex);
             messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        }
     }
 }
 
@@ -2061,6 +2787,8 @@ CConnman::CConnman(uint64_t nSeed0In, uint64_t nSeed1In) : nSeed0(nSeed0In), nSe
 {
     fNetworkActive = true;
     setBannedIsDirty = false;
+    fDumpDataThread = false;
+    nPeersToDump = 0;
     fAddressesInitialized = false;
     nLastNodeId = 0;
     nSendBufferMaxSize = 0;
@@ -2070,6 +2798,13 @@ CConnman::CConnman(uint64_t nSeed0In, uint64_t nSeed1In) : nSeed0(nSeed0In), nSe
     nMaxOutbound = 0;
     nBestHeight = 0;
     clientInterface = NULL;
+    socketEventsMode = SOCKETEVENTS_SELECT;
+    nMessageHandlerThreads = 1;
+#ifdef USE_EPOLL
+    epollfd = -1;
+    wakeupfd = -1;
+    nLastInactivityCheck = 0;
+#endif
 }
 
 NodeId CConnman::GetNewNodeId()
@@ -2077,13 +2812,8 @@ NodeId CConnman::GetNewNodeId()
     return nLastNodeId.fetch_add(1, std::memory_order_relaxed);
 }
 
-bool CConnman::Start(boost::thread_group& threadGroup, CScheduler& scheduler, std::string& strNodeError, Options connOptions)
+void CConnman::Init(const Options& connOptions)
 {
-    nTotalBytesRecv = 0;
-    nTotalBytesSent = 0;
-    nMaxOutboundTotalBytesSentInCycle = 0;
-    nMaxOutboundCycleStartTime = 0;
-
     nRelevantServices = connOptions.nRelevantServices;
     nLocalServices = connOptions.nLocalServices;
     nMaxConnections = connOptions.nMaxConnections;
@@ -2096,6 +2826,46 @@ bool CConnman::Start(boost::thread_group& threadGroup, CScheduler& scheduler, st
     nMaxOutboundLimit = connOptions.nMaxOutboundLimit;
     nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
 
+    socketEventsMode = connOptions.socketEventsMode;
+    nMessageHandlerThreads = std::max(1, std::min(connOptions.nMessageHandlerThreads, MAX_MSGHAND_THREADS));
+    uploadShaper.SetRates(connOptions.nMaxUploadRate, connOptions.nMaxPeerUploadRate, connOptions.vMaxClassUploadRate);
+}
+
+bool CConnman::Start(boost::thread_group& threadGroup, CScheduler& scheduler, std::string& strNodeError, Options connOptions)
+{
+    nTotalBytesRecv = 0;
+    nTotalBytesSent = 0;
+    nMaxOutboundTotalBytesSentInCycle = 0;
+    nMaxOutboundCycleStartTime = 0;
+
+    Init(connOptions);
+
+#ifdef USE_EPOLL
+    if (socketEventsMode == SOCKETEVENTS_EPOLL) {
+        epollfd = epoll_create1(EPOLL_CLOEXEC);
+        wakeupfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollfd == -1 || wakeupfd == -1) {
+            strNodeError = strprintf(_("Unable to set up epoll socket events: %s"), NetworkErrorString(errno));
+            return false;
+        }
+        // Listening sockets and the wakeup eventfd are level-triggered.
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &wakeupfd;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, wakeupfd, &event) != 0) {
+            strNodeError = strprintf(_("Unable to set up epoll socket events: %s"), NetworkErrorString(errno));
+            return false;
+        }
+        BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket) {
+            event.data.ptr = &hListenSocket;
+            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0) {
+                strNodeError = strprintf(_("Unable to set up epoll socket events: %s"), NetworkErrorString(errno));
+                return false;
+            }
+        }
+    }
+#endif
+
     SetBestHeight(connOptions.nBestHeight);
 
     clientInterface = connOptions.uiInterface;
@@ -2161,7 +2931,19 @@ bool CConnman::Start(boost::thread_group& threadGroup, CScheduler& scheduler, st
         threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "opencon", boost::function<void()>(boost::bind(&CConnman::ThreadOpenConnections, this))));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&CConnman::ThreadMessageHandler, this))));
+    for (int i = 0; i < nMessageHandlerThreads; i++) {
+        std::string strThreadName = i == 0 ? "msghand" : strprintf("msghand%d", i);
+        threadGroup.create_thread([this, i, strThreadName] {
+            TraceThread(strThreadName.c_str(), boost::function<void()>(boost::bind(&CConnman::ThreadMessageHandler, this, i)));
+        });
+    }
+
+    // Write peers.dat and banlist.dat off the scheduler and RPC threads
+    {
+        boost::unique_lock<boost::mutex> lock(mutexDumpData);
+        fDumpDataThread = true;
+    }
+    threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "dumpdata", boost::function<void()>(boost::bind(&CConnman::ThreadDumpData, this))));
 
     // Dump network addresses
     scheduler.scheduleEvery(boost::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL);
@@ -2191,6 +2973,17 @@ void CConnman::Stop()
         for (int i=0; i<(nMaxOutbound + nMaxFeeler); i++)
             semOutbound->post();
 
+    {
+        // ThreadDumpData has been stopped; what it didn't get to is written below
+        boost::unique_lock<boost::mutex> lock(mutexDumpData);
+        fDumpDataThread = false;
+        pPeersToDump.reset();
+        if (pBanlistToDump) {
+            pBanlistToDump.reset();
+            SetBannedSetDirty(true);
+        }
+    }
+
     if (fAddressesInitialized)
     {
         DumpData();
@@ -2218,6 +3011,15 @@ void CConnman::Stop()
     vhListenSocket.clear();
     delete semOutbound;
     semOutbound = NULL;
+
+#ifdef USE_EPOLL
+    if (epollfd != -1)
+        close(epollfd);
+    if (wakeupfd != -1)
+        close(wakeupfd);
+    epollfd = -1;
+    wakeupfd = -1;
+#endif
 }
 
 void CConnman::DeleteNode(CNode* pnode)
@@ -2227,6 +3029,13 @@ void CConnman::DeleteNode(CNode* pnode)
     GetNodeSignals().FinalizeNode(pnode->GetId(), fUpdateConnectionTime);
     if(fUpdateConnectionTime)
         addrman.Connected(pnode->addr);
+#ifdef USE_EPOLL
+    {
+        LOCK(cs_setNodesQueued);
+        setNodesQueued.erase(pnode);
+    }
+    setNodesPending.erase(pnode);
+#endif
     delete pnode;
 }
 
@@ -2316,6 +3125,33 @@ void CConnman::GetNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+void CConnman::GetMsgMetrics(CPeerMsgMetrics& total, std::map<NodeId, CPeerMsgMetrics>& mapPeers)
+{
+    {
+        LOCK(cs_msgMetrics);
+        total = msgMetricsTotal;
+    }
+    mapPeers.clear();
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes) {
+        LOCK(pnode->cs_msgMetrics);
+        mapPeers[pnode->GetId()] = pnode->msgMetrics;
+    }
+}
+
+void CConnman::RecordRecvMsgMetrics(CNode* pnode, const std::string& strCommand, uint64_t nBytes, int64_t nHandlerMicros, int64_t nMainLockMicros)
+{
+    // Like the byte counts, only valid commands get their own entry, so a
+    // peer can't make the maps grow.
+    const std::string& strKey = pnode->mapRecvBytesPerMsgCmd.count(strCommand) ? strCommand : NET_MESSAGE_COMMAND_OTHER;
+    {
+        LOCK(pnode->cs_msgMetrics);
+        pnode->msgMetrics.mapRecv[strKey].Add(nBytes, nHandlerMicros, nMainLockMicros);
+    }
+    LOCK(cs_msgMetrics);
+    msgMetricsTotal.mapRecv[strKey].Add(nBytes, nHandlerMicros, nMainLockMicros);
+}
+
 bool CConnman::DisconnectAddress(const CNetAddr& netAddr)
 {
     if (CNode* pnode = FindNode(netAddr)) {
@@ -2503,6 +3339,7 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nSendVersion(0)
 {
     nServices = NODE_NONE;
+    fileCapture = NULL;
     nServicesExpected = NODE_NONE;
     hSocket = hSocketIn;
     nRecvVersion = INIT_PROTO_VERSION;
@@ -2521,9 +3358,14 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     fFeeler = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fInMessageHandler = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    for (int i = 0; i < SEND_PRIORITY_COUNT; i++)
+        nSendQueueSize[i] = 0;
+    fSocketReadable = false;
+    fSocketWritable = false;
     hashContinue = uint256();
     nStartingHeight = -1;
     filterInventoryKnown.reset();
@@ -2561,6 +3403,9 @@ CNode::~CNode()
 {
     CloseSocket(hSocket);
 
+    if (fileCapture)
+        fclose(fileCapture);
+
     if (pfilter)
         delete pfilter;
 }
@@ -2599,21 +3444,67 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+static SendPriority GetDefaultSendPriority(const std::string& strCommand)
+{
+    if (strCommand == NetMsgType::BLOCKTXN)
+        return SEND_PRIORITY_BLOCKTXN;
+    // A notfound goes with the transactions, so it follows those sent before it
+    if (strCommand == NetMsgType::TX || strCommand == NetMsgType::NOTFOUND)
+        return SEND_PRIORITY_TX;
+    if (strCommand == NetMsgType::ADDR)
+        return SEND_PRIORITY_ADDR;
+    if (strCommand == NetMsgType::BLOCK || strCommand == NetMsgType::MERKLEBLOCK)
+        return SEND_PRIORITY_BLOCK;
+    return SEND_PRIORITY_ANNOUNCE;
+}
+
 void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
 {
-    size_t nMessageSize = msg.data.size();
-    size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
-    LogPrint("net", "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->id);
+    SendPriority nPriority = GetDefaultSendPriority(msg.command);
+    // A pong tells the peer that everything it asked for before its ping has
+    // been answered, so it must not overtake the replies still queued
+    if (msg.command == NetMsgType::PONG) {
+        LOCK(pnode->cs_vSend);
+        nPriority = pnode->GetBarrierSendPriority(nPriority);
+    }
+    PushMessage(pnode, std::move(msg), nPriority);
+}
 
-    std::vector<unsigned char> serializedHeader;
-    serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
-    uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
-    CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), nMessageSize);
-    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg, SendPriority nPriority, bool fShaped)
+{
+    std::vector<CSerializedNetMsg> vMsgs;
+    vMsgs.push_back(std::move(msg));
+    PushMessages(pnode, std::move(vMsgs), nPriority, fShaped);
+}
 
-    CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
+void CConnman::PushMessages(CNode* pnode, std::vector<CSerializedNetMsg>&& vMsgs, SendPriority nPriority, bool fShaped)
+{
+    if (vMsgs.empty())
+        return;
+    CSendBatch batch;
+    batch.fShaped = fShaped;
+    std::vector<std::vector<unsigned char>>& vBuffers = batch.vBuffers;
+    vBuffers.reserve(2 * vMsgs.size());
+    for (CSerializedNetMsg& msg : vMsgs) {
+        size_t nMessageSize = msg.data.size();
+        LogPrint("net", "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->id);
+
+        std::vector<unsigned char> serializedHeader;
+        serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
+        uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
+        CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), nMessageSize);
+        memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+
+        CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
+        vBuffers.push_back(std::move(serializedHeader));
+        vBuffers.push_back(std::move(msg.data));
+    }
 
     size_t nBytesSent = 0;
+#ifdef USE_EPOLL
+    bool fServiceSocket = false;
+    bool fWakeSocketHandler = false;
+#endif
     {
         LOCK(pnode->cs_vSend);
         if(pnode->hSocket == INVALID_SOCKET) {
@@ -2621,20 +3512,36 @@ void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
         }
         bool optimisticSend(pnode->vSendMsg.empty());
 
-        //log total amount of bytes per command
-        pnode->mapSendBytesPerMsgCmd[msg.command] += nTotalSize;
+        size_t nTotalSize = 0;
+        for (size_t i = 0; i < vMsgs.size(); i++) {
+            size_t nMsgSize = vBuffers[2 * i].size() + vBuffers[2 * i + 1].size();
+            //log total amount of bytes per command
+            pnode->mapSendBytesPerMsgCmd[vMsgs[i].command] += nMsgSize;
+            nTotalSize += nMsgSize;
+        }
         pnode->nSendSize += nTotalSize;
+        pnode->nSendQueueSize[nPriority] += nTotalSize;
 
-        pnode->vSendMsg.push_back(std::move(serializedHeader));
-        if (nMessageSize)
-            pnode->vSendMsg.push_back(std::move(msg.data));
+        pnode->vSendQueue[nPriority].push_back(std::move(batch));
 
         // If write queue empty, attempt "optimistic write"
         if (optimisticSend == true)
-            nBytesSent = SocketSendData(pnode);
+            nBytesSent = SocketSendData(pnode, &uploadShaper);
+
+#ifdef USE_EPOLL
+        // Data left behind on a socket believed writable will not produce a
+        // new readiness edge, so the socket thread has to look at the node by
+        // itself: right away, unless the rate limits hold the data back.
+        fServiceSocket = pnode->nSendSize > 0 && pnode->fSocketWritable;
+        fWakeSocketHandler = fServiceSocket && !pnode->vSendMsg.empty();
+#endif
     }
     if (nBytesSent)
         RecordBytesSent(nBytesSent);
+#ifdef USE_EPOLL
+    if (fServiceSocket)
+        ServiceSocketSoon(pnode, fWakeSocketHandler);
+#endif
 }
 
 bool CConnman::ForNode(NodeId id, std::function<bool(CNode* pnode)> func)
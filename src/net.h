@@ -18,6 +18,7 @@
 #include "random.h"
 #include "streams.h"
 #include "sync.h"
+#include "txreconciliation.h"
 #include "uint256.h"
 
 #include <atomic>
@@ -73,17 +74,54 @@ static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
 /** The default for -maxuploadtarget. 0 = Unlimited */
 static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** The default for -maxuploadrate and the per-peer and per-class upload rates (in kB/s): no limit */
+static const uint64_t DEFAULT_MAX_UPLOAD_RATE = 0;
 /** The default timeframe for -maxuploadtarget. 1 day. */
 static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
 /** Default for blocks only*/
 static const bool DEFAULT_BLOCKSONLY = false;
 
+/** -msghandthreads default */
+static const int DEFAULT_MSGHAND_THREADS = 2;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHAND_THREADS = 16;
+
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** Default for -capturemessages */
+static const bool DEFAULT_CAPTURE_MESSAGES = false;
 
 static const ServiceFlags REQUIRED_SERVICES = NODE_NETWORK;
 
+/** Classes of outgoing messages, in the order a peer's send queues are drained */
+enum SendPriority {
+    SEND_PRIORITY_ANNOUNCE = 0, //! block announcements, compact blocks and control messages
+    SEND_PRIORITY_BLOCKTXN,     //! responses to getblocktxn
+    SEND_PRIORITY_TX,           //! transaction relay
+    SEND_PRIORITY_ADDR,         //! address relay
+    SEND_PRIORITY_BLOCK,        //! historical block serving
+    SEND_PRIORITY_COUNT
+};
+
+/** Whether the upload rate limits hold back all messages of class nPriority */
+inline bool IsShapedSendPriority(SendPriority nPriority)
+{
+    return nPriority >= SEND_PRIORITY_TX;
+}
+
+/** Mechanisms ThreadSocketHandler can use to wait for socket readiness */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT = 0,
+    SOCKETEVENTS_EPOLL = 1,
+};
+/** -socketevents default */
+#ifdef USE_EPOLL
+static const SocketEventsMode DEFAULT_SOCKETEVENTS = SOCKETEVENTS_EPOLL;
+#else
+static const SocketEventsMode DEFAULT_SOCKETEVENTS = SOCKETEVENTS_SELECT;
+#endif
+
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
 
@@ -115,6 +153,153 @@ struct CSerializedNetMsg
 };
 
 
+/**
+ * Binary prefix trie over the 128 bits of addresses (IPv4 ones in their
+ * IPv4-mapped form), holding how long each banned subnet is banned for.
+ * Finding the bans that cover an address takes one step per address bit
+ * instead of a pass over the banlist. Subnets whose netmask isn't a prefix
+ * are kept aside and matched one by one.
+ */
+class CBanTrie
+{
+public:
+    CBanTrie() { Clear(); }
+
+    void Clear();
+    //! Record that subNet is banned until nBanUntil (or longer, if it already was)
+    void Insert(const CSubNet& subNet, int64_t nBanUntil);
+    //! The latest time until which a subnet containing addr is banned, or 0
+    int64_t GetBanUntil(const CNetAddr& addr) const;
+    size_t GetNodeCount() const { return vNodes.size(); }
+
+private:
+    struct Node
+    {
+        //! Indexes of the children for bit values 0 and 1, 0 if absent (the root is never a child)
+        uint32_t nChild[2];
+        int64_t nBanUntil;
+    };
+    std::vector<Node> vNodes;
+    std::vector<std::pair<CSubNet, int64_t> > vOther;
+};
+
+/**
+ * Token bucket shaping a byte rate. It holds up to one second worth of
+ * bytes. Sending may start once the bucket holds the bytes to send, or is
+ * full for more than that, so larger messages still go out, only less often.
+ */
+class CTokenBucket
+{
+public:
+    CTokenBucket() : nRate(0), nTokens(0), nLastRefill(0) {}
+
+    //! Set the rate in bytes per second, 0 for no limit
+    void SetRate(int64_t nRateIn);
+    int64_t GetRate() const { return nRate; }
+
+    //! Whether sending nBytes may start at nTimeMicros
+    bool MaySend(int64_t nTimeMicros, int64_t nBytes);
+    void Consume(int64_t nBytes)
+    {
+        if (nRate)
+            nTokens -= nBytes;
+    }
+
+private:
+    int64_t nRate;
+    int64_t nTokens;
+    int64_t nLastRefill;
+};
+
+/** Header and payload buffers of messages queued to go out back to back */
+struct CSendBatch
+{
+    std::vector<std::vector<unsigned char>> vBuffers;
+    //! Held to the upload rate limits even in a class that otherwise isn't
+    bool fShaped;
+
+    CSendBatch() : fShaped(false) {}
+};
+
+/**
+ * Upload rate limits shared by the peers of a CConnman: a total, one per peer
+ * and one per send class. Block announcements, compact blocks and blocktxn
+ * responses are never held back, but their bytes count against the limits.
+ * Full blocks sent with the announcements are held back like the rest,
+ * without holding up the announcements queued behind them.
+ */
+class CUploadShaper
+{
+public:
+    CUploadShaper() : nPeerRate(0) {}
+
+    //! Set the limits in bytes per second, 0 for no limit
+    void SetRates(int64_t nTotalRate, int64_t nPeerRateIn, const uint64_t (&vClassRate)[SEND_PRIORITY_COUNT]);
+
+    //! Whether nBytes of class nPriority may be handed to pnode's socket,
+    //! fShaped if they are subject to the limits even in a class that isn't
+    // requires LOCK(pnode->cs_vSend)
+    bool MaySend(CNode* pnode, SendPriority nPriority, bool fShaped, size_t nBytes, int64_t nTimeMicros);
+    //! Account for a message of nBytes handed to pnode's socket
+    // requires LOCK(pnode->cs_vSend)
+    void Consume(CNode* pnode, SendPriority nPriority, size_t nBytes);
+
+private:
+    CCriticalSection cs;
+    CTokenBucket bucketTotal;
+    CTokenBucket vBucketClass[SEND_PRIORITY_COUNT];
+    std::atomic<int64_t> nPeerRate;
+};
+
+/**
+ * Distribution of non-negative values in power-of-two buckets: bucket 0
+ * counts zeros, bucket i values in [2^(i-1), 2^i), and the last bucket
+ * everything larger.
+ */
+class CLogHistogram
+{
+public:
+    static const int BUCKETS = 26;
+
+    uint64_t vBuckets[BUCKETS];
+    uint64_t nCount;
+    uint64_t nSum;
+    uint64_t nMax;
+
+    CLogHistogram();
+
+    void Add(uint64_t nValue);
+    void Add(const CLogHistogram& other);
+};
+
+/** What handling messages of one kind cost */
+class CMsgMetrics
+{
+public:
+    CLogHistogram bytes;
+    //! Wall time in the handler, in microseconds
+    CLogHistogram handlerTime;
+    //! Part of it spent holding cs_main, in microseconds
+    CLogHistogram mainLockTime;
+
+    void Add(uint64_t nBytes, int64_t nHandlerMicros, int64_t nMainLockMicros);
+    void Add(const CMsgMetrics& other);
+};
+
+typedef std::map<std::string, CMsgMetrics> mapMsgCmdMetrics;
+
+/** Message handling cost of a peer, or of all peers */
+class CPeerMsgMetrics
+{
+public:
+    //! ProcessMessage, by command
+    mapMsgCmdMetrics mapRecv;
+    //! SendMessages (without bytes)
+    CMsgMetrics send;
+
+    void Add(const CPeerMsgMetrics& other);
+};
+
 class CConnman
 {
 public:
@@ -139,9 +324,16 @@ public:
         unsigned int nReceiveFloodSize = 0;
         uint64_t nMaxOutboundTimeframe = 0;
         uint64_t nMaxOutboundLimit = 0;
+        SocketEventsMode socketEventsMode = DEFAULT_SOCKETEVENTS;
+        int nMessageHandlerThreads = 1;
+        uint64_t nMaxUploadRate = 0;
+        uint64_t nMaxPeerUploadRate = 0;
+        uint64_t vMaxClassUploadRate[SEND_PRIORITY_COUNT] = {};
     };
     CConnman(uint64_t seed0, uint64_t seed1);
     ~CConnman();
+    //! Apply options without starting any threads (Start does this too)
+    void Init(const Options& options);
     bool Start(boost::thread_group& threadGroup, CScheduler& scheduler, std::string& strNodeError, Options options);
     void Stop();
     bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
@@ -153,6 +345,10 @@ public:
     bool ForNode(NodeId id, std::function<bool(CNode* pnode)> func);
 
     void PushMessage(CNode* pnode, CSerializedNetMsg&& msg);
+    /** Queue msg in class nPriority; fShaped to hold it to the upload rate limits even if the class isn't */
+    void PushMessage(CNode* pnode, CSerializedNetMsg&& msg, SendPriority nPriority, bool fShaped = false);
+    /** Queue vMsgs to go out back to back, with nothing sent in between */
+    void PushMessages(CNode* pnode, std::vector<CSerializedNetMsg>&& vMsgs, SendPriority nPriority, bool fShaped = false);
 
     template<typename Callable>
     bool ForEachNodeContinueIf(Callable&& func)
@@ -279,6 +475,9 @@ public:
 
     size_t GetNodeCount(NumConnections num);
     void GetNodeStats(std::vector<CNodeStats>& vstats);
+    //! Message handling cost of all peers since startup, and of those connected now
+    void GetMsgMetrics(CPeerMsgMetrics& total, std::map<NodeId, CPeerMsgMetrics>& mapPeers);
+    void RecordRecvMsgMetrics(CNode* pnode, const std::string& strCommand, uint64_t nBytes, int64_t nHandlerMicros, int64_t nMainLockMicros);
     bool DisconnectAddress(const CNetAddr& addr);
     bool DisconnectNode(const std::string& node);
     bool DisconnectNode(NodeId id);
@@ -329,11 +528,22 @@ private:
     };
 
     void ThreadOpenAddedConnections();
+    void ThreadDumpData();
     void ProcessOneShot();
     void ThreadOpenConnections();
-    void ThreadMessageHandler();
+    void ThreadMessageHandler(int nWorker);
     void AcceptConnection(const ListenSocket& hListenSocket);
     void ThreadSocketHandler();
+    void SocketHandlerSelect();
+#ifdef USE_EPOLL
+    void SocketHandlerEpoll(bool& fMoreWork);
+    void AddSocketEvents(CNode* pnode);
+    void WakeSocketHandler();
+    /** Have the socket thread look at pnode without waiting for an event on its socket */
+    void ServiceSocketSoon(CNode* pnode, bool fWake);
+#endif
+    bool SocketRecvData(CNode* pnode);
+    void InactivityCheck(CNode* pnode);
     void ThreadDNSAddressSeed();
 
     uint64_t CalculateKeyedNetGroup(const CAddress& ad);
@@ -357,9 +567,13 @@ private:
     void SetBannedSetDirty(bool dirty=true);
     //!clean unused entries (if bantime has expired)
     void SweepBanned();
+    //!rebuild banTrie from setBanned, requires LOCK(cs_setBanned)
+    void RebuildBanTrie();
     void DumpAddresses();
     void DumpData();
     void DumpBanlist();
+    void WritePeers(CDataStream& ssPeers, size_t nAddresses);
+    void WriteBanlist(const banmap_t& banmap);
 
     unsigned int GetReceiveFloodSize() const;
 
@@ -373,6 +587,10 @@ private:
     uint64_t nTotalBytesRecv;
     uint64_t nTotalBytesSent;
 
+    // Message handling cost of all peers since startup
+    CCriticalSection cs_msgMetrics;
+    CPeerMsgMetrics msgMetricsTotal;
+
     // outbound limit & stats
     uint64_t nMaxOutboundTotalBytesSentInCycle;
     uint64_t nMaxOutboundCycleStartTime;
@@ -390,8 +608,16 @@ private:
     std::vector<ListenSocket> vhListenSocket;
     std::atomic<bool> fNetworkActive;
     banmap_t setBanned;
+    CBanTrie banTrie; // protected by cs_setBanned
     CCriticalSection cs_setBanned;
     bool setBannedIsDirty;
+    /** Snapshots of addrman and the banlist waiting for ThreadDumpData to write them */
+    std::unique_ptr<CDataStream> pPeersToDump;
+    size_t nPeersToDump;
+    std::unique_ptr<banmap_t> pBanlistToDump;
+    bool fDumpDataThread;
+    boost::condition_variable condDumpData;
+    boost::mutex mutexDumpData;
     bool fAddressesInitialized;
     CAddrMan addrman;
     std::deque<std::string> vOneShots;
@@ -403,6 +629,8 @@ private:
     mutable CCriticalSection cs_vNodes;
     std::atomic<NodeId> nLastNodeId;
     boost::condition_variable messageHandlerCondition;
+    boost::mutex messageHandlerMutex;
+    int nMessageHandlerThreads;
 
     /** Services this instance offers */
     ServiceFlags nLocalServices;
@@ -417,6 +645,25 @@ private:
     std::atomic<int> nBestHeight;
     CClientUIInterface* clientInterface;
 
+    /** Upload rate limits, enforced as messages are handed to the sockets */
+    CUploadShaper uploadShaper;
+
+    /** How ThreadSocketHandler waits for socket events */
+    SocketEventsMode socketEventsMode;
+#ifdef USE_EPOLL
+    /** epoll instance watching the listening and peer sockets */
+    int epollfd;
+    /** eventfd used to interrupt epoll_wait when data is queued for sending */
+    int wakeupfd;
+    /** Nodes other threads queued data for since the socket thread last looked */
+    CCriticalSection cs_setNodesQueued;
+    std::set<CNode*> setNodesQueued;
+    /** Nodes the socket thread has work left for without a new event, only used by that thread */
+    std::set<CNode*> setNodesPending;
+    /** Time of the last inactivity check of all nodes by the socket thread */
+    int64_t nLastInactivityCheck;
+#endif
+
     /** SipHasher seeds for deterministic randomness */
     const uint64_t nSeed0, nSeed1;
 };
@@ -425,7 +672,7 @@ void Discover(boost::thread_group& threadGroup);
 void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
-size_t SocketSendData(CNode *pnode);
+size_t SocketSendData(CNode *pnode, CUploadShaper* pshaper = NULL);
 
 struct CombinerAll
 {
@@ -484,6 +731,7 @@ CAddress GetLocalAddress(const CNetAddr *paddrPeer, ServiceFlags nLocalServices)
 
 extern bool fDiscover;
 extern bool fListen;
+extern bool fCaptureMessages;
 extern bool fRelayTxes;
 
 extern limitedmap<uint256, int64_t> mapAlreadyAskedFor;
@@ -500,6 +748,33 @@ extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 typedef std::map<std::string, uint64_t> mapMsgCmdSize; //command, total bytes
 
+/**
+ * A message received from a peer, as -capturemessages appends it to
+ * message_capture/<peer address>/msgs_recv.dat in the data directory.
+ */
+class CCapturedMessage
+{
+public:
+    //! When the message was complete, in microseconds
+    int64_t nTime;
+    std::string strCommand;
+    std::vector<unsigned char> vPayload;
+
+    CCapturedMessage() : nTime(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nTime);
+        READWRITE(LIMITED_STRING(strCommand, CMessageHeader::COMMAND_SIZE));
+        READWRITE(vPayload);
+    }
+};
+
+/** Read the messages of a -capturemessages file */
+bool ReadCapturedMessages(const boost::filesystem::path& path, std::vector<CCapturedMessage>& vMessages);
+
 class CNodeStats
 {
 public:
@@ -571,6 +846,11 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    // Receive payload bytes in place: GetDataBuffer returns where the next
+    // bytes go and how many fit, DataReceived accounts for those written.
+    char* GetDataBuffer(unsigned int& nSpace);
+    void DataReceived(unsigned int nBytes);
 };
 
 
@@ -583,14 +863,33 @@ public:
     ServiceFlags nServices;
     ServiceFlags nServicesExpected;
     SOCKET hSocket;
-    size_t nSendSize; // total size of all vSendMsg entries
+    size_t nSendSize; // total size of all vSendMsg and vSendQueue entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
+    // Buffers handed to the socket, in order. Refilled from vSendQueue once
+    // sent, so it only holds what a more urgent message has to wait for. May
+    // be empty while vSendQueue is not when the upload rate limits hold
+    // messages back.
     std::deque<std::vector<unsigned char>> vSendMsg;
+    // Messages waiting to be moved to vSendMsg, per SendPriority, and the
+    // number of bytes queued in each. Each entry holds the header and payload
+    // buffers of one message, or of several that must not be split up.
+    std::deque<CSendBatch> vSendQueue[SEND_PRIORITY_COUNT];
+    size_t nSendQueueSize[SEND_PRIORITY_COUNT];
+    // This peer's share of the upload rate limits, protected by cs_vSend
+    CTokenBucket uploadBucket;
     CCriticalSection cs_vSend;
+    // Readiness as last reported by an edge-triggered event backend. Readable
+    // is only touched by the socket thread; writable is also read by senders.
+    bool fSocketReadable;
+    std::atomic_bool fSocketWritable;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
+    // Payload storage of processed messages, reused for new ones so that
+    // busy peers don't allocate (and wipe on free) a buffer per message.
+    // Protected by cs_vRecvMsg.
+    std::vector<CSerializeData> vRecvBufferPool;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
@@ -615,6 +914,9 @@ public:
     const bool fInbound;
     bool fSuccessfullyConnected;
     std::atomic_bool fDisconnect;
+    // Set while a message handler thread is processing or sending messages
+    // for this node, so that a peer is only ever handled by one thread.
+    std::atomic_bool fInMessageHandler;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in its version message that we should not relay tx invs
@@ -633,6 +935,9 @@ protected:
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
 
+    CCriticalSection cs_msgMetrics;
+    CPeerMsgMetrics msgMetrics;
+
 public:
     uint256 hashContinue;
     int nStartingHeight;
@@ -640,6 +945,9 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    // Protects vAddrToSend and addrKnown, which other peers' message
+    // handlers fill through address relay.
+    CCriticalSection cs_addrSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
@@ -663,6 +971,10 @@ public:
     std::vector<uint256> vBlockHashesToAnnounce;
     // Used for BIP35 mempool sending, also protected by cs_inventory
     bool fSendMempool;
+    // Transaction reconciliation, if offered to this peer. Once enabled,
+    // transactions are announced through it instead of setInventoryTxToSend.
+    // Also protected by cs_inventory
+    std::unique_ptr<CTxReconciliationState> pTxReconState;
 
     // Last time a "MEMPOOL" request was serviced.
     std::atomic<int64_t> timeLastMempoolReq;
@@ -695,6 +1007,11 @@ private:
     CNode(const CNode&);
     void operator=(const CNode&);
 
+    void RecordCompleteMessage(CNetMessage& msg);
+    void CaptureMessage(const CNetMessage& msg);
+
+    //! -capturemessages file, opened at the first message
+    FILE* fileCapture;
 
     const uint64_t nLocalHostNonce;
     // Services offered to this peer
@@ -730,9 +1047,51 @@ public:
         return total;
     }
 
+    // Bytes queued for sending that a message of class nPriority would be
+    // sent after. Like nSendSize, may be read without holding cs_vSend.
+    size_t GetSendSize(SendPriority nPriority) const
+    {
+        size_t nSize = nSendSize;
+        size_t nBehind = 0;
+        for (int i = nPriority + 1; i < SEND_PRIORITY_COUNT; i++)
+            nBehind += nSendQueueSize[i];
+        return nSize > nBehind ? nSize - nBehind : 0;
+    }
+
+    // The least urgent class with messages queued, or nPriority if that is
+    // less urgent. A message queued in it goes out after all of them.
+    // requires LOCK(cs_vSend)
+    SendPriority GetBarrierSendPriority(SendPriority nPriority) const
+    {
+        for (int i = SEND_PRIORITY_COUNT - 1; i > nPriority; i--) {
+            if (!vSendQueue[i].empty())
+                return (SendPriority)i;
+        }
+        return nPriority;
+    }
+
+    // Move queued messages to vSendMsg, most urgent first and as far as the
+    // upload rate limits in pshaper (if any) allow. Returns whether vSendMsg
+    // has anything to send.
+    // requires LOCK(cs_vSend)
+    bool FillSendMsg(CUploadShaper* pshaper = NULL);
+
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete);
 
+    // Where the socket may be read into directly: the outstanding payload of
+    // a large message being received. Returns NULL if there is none.
+    // requires LOCK(cs_vRecvMsg)
+    char* GetRecvPayloadBuffer(unsigned int& nSpace);
+
+    // Account for nBytes read into the buffer from GetRecvPayloadBuffer.
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedPayloadBytes(unsigned int nBytes, bool& complete);
+
+    // Drop processed messages up to itEnd, keeping their storage for reuse.
+    // requires LOCK(cs_vRecvMsg)
+    void ReleaseRecvMsgs(std::deque<CNetMessage>::iterator itEnd);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -775,6 +1134,7 @@ public:
 
     void AddAddressKnown(const CAddress& _addr)
     {
+        LOCK(cs_addrSend);
         addrKnown.insert(_addr.GetKey());
     }
 
@@ -783,6 +1143,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrSend);
         if (_addr.IsValid() && !addrKnown.contains(_addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand.rand32() % vAddrToSend.size()] = _addr;
@@ -112,6 +112,10 @@ class CSubNet
 
         bool Match(const CNetAddr &addr) const;
 
+        const CNetAddr& GetNetwork() const { return network; }
+        //! Number of leading one bits of the netmask over all 128 bits of the address, or -1 if it has other bits set
+        int GetPrefixLength() const;
+
         std::string ToString() const;
         bool IsValid() const;
 
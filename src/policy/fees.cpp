@@ -13,14 +13,13 @@
 #include "txmempool.h"
 #include "util.h"
 
+#include <algorithm>
+
 void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
                                 unsigned int maxConfirms, double _decay)
 {
     decay = _decay;
-    for (unsigned int i = 0; i < defaultBuckets.size(); i++) {
-        buckets.push_back(defaultBuckets[i]);
-        bucketMap[defaultBuckets[i]] = i;
-    }
+    buckets = defaultBuckets;
     confAvg.resize(maxConfirms);
     curBlockConf.resize(maxConfirms);
     unconfTxs.resize(maxConfirms);
@@ -40,14 +39,20 @@ void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
 // Zero out the data for the current block
 void TxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        oldUnconfTxs[j] += unconfTxs[nBlockHeight%unconfTxs.size()][j];
-        unconfTxs[nBlockHeight%unconfTxs.size()][j] = 0;
-        for (unsigned int i = 0; i < curBlockConf.size(); i++)
-            curBlockConf[i][j] = 0;
-        curBlockTxCt[j] = 0;
-        curBlockVal[j] = 0;
-    }
+    std::vector<int>& unconfTxsNow = unconfTxs[nBlockHeight%unconfTxs.size()];
+    for (unsigned int j = 0; j < buckets.size(); j++)
+        oldUnconfTxs[j] += unconfTxsNow[j];
+    std::fill(unconfTxsNow.begin(), unconfTxsNow.end(), 0);
+    for (unsigned int i = 0; i < curBlockConf.size(); i++)
+        std::fill(curBlockConf[i].begin(), curBlockConf[i].end(), 0);
+    std::fill(curBlockTxCt.begin(), curBlockTxCt.end(), 0);
+    std::fill(curBlockVal.begin(), curBlockVal.end(), 0);
+}
+
+unsigned int TxConfirmStats::BucketIndex(double val) const
+{
+    // The first bucket whose upper bound is at least val
+    return std::lower_bound(buckets.begin(), buckets.end(), val) - buckets.begin();
 }
 
 
@@ -56,19 +61,26 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
     // blocksToConfirm is 1-based
     if (blocksToConfirm < 1)
         return;
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++) {
-        curBlockConf[i - 1][bucketindex]++;
-    }
+    unsigned int bucketindex = BucketIndex(val);
+    // Counted for every Y >= blocksToConfirm by UpdateMovingAverages
+    if ((size_t)blocksToConfirm <= curBlockConf.size())
+        curBlockConf[blocksToConfirm - 1][bucketindex]++;
     curBlockTxCt[bucketindex]++;
     curBlockVal[bucketindex] += val;
 }
 
 void TxConfirmStats::UpdateMovingAverages()
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        for (unsigned int i = 0; i < confAvg.size(); i++)
+    // Txs confirmed within Y blocks are those confirmed in exactly 1 to Y
+    for (unsigned int i = 1; i < curBlockConf.size(); i++) {
+        for (unsigned int j = 0; j < buckets.size(); j++)
+            curBlockConf[i][j] += curBlockConf[i - 1][j];
+    }
+    for (unsigned int i = 0; i < confAvg.size(); i++) {
+        for (unsigned int j = 0; j < buckets.size(); j++)
             confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
+    }
+    for (unsigned int j = 0; j < buckets.size(); j++) {
         avg[j] = avg[j] * decay + curBlockVal[j];
         txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
     }
@@ -173,7 +185,7 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     return median;
 }
 
-void TxConfirmStats::Write(CAutoFile& fileout)
+void TxConfirmStats::Write(CDataStream& fileout)
 {
     fileout << decay;
     fileout << buckets;
@@ -182,7 +194,7 @@ void TxConfirmStats::Write(CAutoFile& fileout)
     fileout << confAvg;
 }
 
-void TxConfirmStats::Read(CAutoFile& filein)
+void TxConfirmStats::Read(CDataStream& filein)
 {
     // Read data file into temporary variables and do some very basic sanity checking
     std::vector<double> fileBuckets;
@@ -221,7 +233,6 @@ void TxConfirmStats::Read(CAutoFile& filein)
     avg = fileAvg;
     confAvg = fileConfAvg;
     txCtAvg = fileTxCtAvg;
-    bucketMap.clear();
 
     // Resize the current block variables which aren't stored in the data file
     // to match the number of confirms and buckets
@@ -238,16 +249,13 @@ void TxConfirmStats::Read(CAutoFile& filein)
     }
     oldUnconfTxs.resize(buckets.size());
 
-    for (unsigned int i = 0; i < buckets.size(); i++)
-        bucketMap[buckets[i]] = i;
-
     LogPrint("estimatefee", "Reading estimates: %u buckets counting confirms up to %u blocks\n",
              numBuckets, maxConfirms);
 }
 
 unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
 {
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
+    unsigned int bucketindex = BucketIndex(val);
     unsigned int blockIndex = nBlockHeight % unconfTxs.size();
     unconfTxs[blockIndex][bucketindex]++;
     return bucketindex;
@@ -283,7 +291,7 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
 
 void CBlockPolicyEstimator::removeTx(uint256 hash)
 {
-    std::map<uint256, TxStatsInfo>::iterator pos = mapMemPoolTxs.find(hash);
+    auto pos = mapMemPoolTxs.find(hash);
     if (pos == mapMemPoolTxs.end()) {
         LogPrint("estimatefee", "Blockpolicy error mempool tx %s not found for removeTx\n",
                  hash.ToString().c_str());
@@ -293,11 +301,14 @@ void CBlockPolicyEstimator::removeTx(uint256 hash)
     unsigned int bucketIndex = pos->second.bucketIndex;
 
     feeStats.removeTx(entryHeight, nBestSeenHeight, bucketIndex);
-    mapMemPoolTxs.erase(hash);
+    mapMemPoolTxs.erase(pos);
+    // Only transactions that entered before the last block count towards answers
+    if (entryHeight != nBestSeenHeight)
+        fAnswersStale = true;
 }
 
 CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
-    : nBestSeenHeight(0)
+    : nBestSeenHeight(0), fAnswersStale(true)
 {
     minTrackedFee = _minRelayFee < CFeeRate(MIN_FEERATE) ? CFeeRate(MIN_FEERATE) : _minRelayFee;
     std::vector<double> vfeelist;
@@ -339,8 +350,11 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
     // Feerates are stored and reported as BTC-per-kb:
     CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
 
-    mapMemPoolTxs[hash].blockHeight = txHeight;
-    mapMemPoolTxs[hash].bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
+    TxStatsInfo& info = mapMemPoolTxs[hash];
+    info.blockHeight = txHeight;
+    info.bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
+    if (txHeight != nBestSeenHeight)
+        fAnswersStale = true;
 }
 
 void CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry)
@@ -381,6 +395,7 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
         return;
     }
     nBestSeenHeight = nBlockHeight;
+    fAnswersStale = true;
 
     // Only want to be updating estimates when our blockchain is synced,
     // otherwise we'll miscalculate how many blocks its taking to get included.
@@ -401,13 +416,38 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
              entries.size(), mapMemPoolTxs.size());
 }
 
+void CBlockPolicyEstimator::UpdateAnswers()
+{
+    if (!fAnswersStale)
+        return;
+    unsigned int nMaxConfirms = feeStats.GetMaxConfirms();
+    vMedianByTarget.resize(nMaxConfirms);
+    vSmartMedianByTarget.resize(nMaxConfirms);
+    vSmartTarget.resize(nMaxConfirms);
+    for (unsigned int i = 0; i < nMaxConfirms; i++)
+        vMedianByTarget[i] = feeStats.EstimateMedianVal(i + 1, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    // Without an answer up to the highest target, the search ends there
+    double median = -1;
+    int nTarget = nMaxConfirms;
+    for (int i = nMaxConfirms - 1; i >= 0; i--) {
+        if (vMedianByTarget[i] >= 0) {
+            median = vMedianByTarget[i];
+            nTarget = i + 1;
+        }
+        vSmartMedianByTarget[i] = median;
+        vSmartTarget[i] = nTarget;
+    }
+    fAnswersStale = false;
+}
+
 CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 {
     // Return failure if trying to analyze a target we're not tracking
     if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
         return CFeeRate(0);
 
-    double median = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    UpdateAnswers();
+    double median = vMedianByTarget[confTarget - 1];
 
     if (median < 0)
         return CFeeRate(0);
@@ -416,6 +456,45 @@ CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 }
 
 CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool)
+{
+    if (answerFoundAtTarget)
+        *answerFoundAtTarget = confTarget;
+    // Return failure if trying to analyze a target we're not tracking
+    if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
+        return CFeeRate(0);
+
+    UpdateAnswers();
+    double median = vSmartMedianByTarget[confTarget - 1];
+
+    if (answerFoundAtTarget)
+        *answerFoundAtTarget = vSmartTarget[confTarget - 1];
+
+    // If mempool is limiting txs , return at least the min feerate from the mempool
+    CAmount minPoolFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFeePerK();
+    if (minPoolFee > 0 && minPoolFee > median)
+        return CFeeRate(minPoolFee);
+
+    if (median < 0)
+        return CFeeRate(0);
+
+    return CFeeRate(median);
+}
+
+CFeeRate CBlockPolicyEstimator::estimateFeeSearch(int confTarget)
+{
+    // Return failure if trying to analyze a target we're not tracking
+    if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
+        return CFeeRate(0);
+
+    double median = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+
+    if (median < 0)
+        return CFeeRate(0);
+
+    return CFeeRate(median);
+}
+
+CFeeRate CBlockPolicyEstimator::estimateSmartFeeSearch(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool)
 {
     if (answerFoundAtTarget)
         *answerFoundAtTarget = confTarget;
@@ -460,13 +539,13 @@ double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int *answerF
     return -1;
 }
 
-void CBlockPolicyEstimator::Write(CAutoFile& fileout)
+void CBlockPolicyEstimator::Write(CDataStream& fileout)
 {
     fileout << nBestSeenHeight;
     feeStats.Write(fileout);
 }
 
-void CBlockPolicyEstimator::Read(CAutoFile& filein, int nFileVersion)
+void CBlockPolicyEstimator::Read(CDataStream& filein, int nFileVersion)
 {
     int nFileBestSeenHeight;
     filein >> nFileBestSeenHeight;
@@ -476,6 +555,7 @@ void CBlockPolicyEstimator::Read(CAutoFile& filein, int nFileVersion)
         TxConfirmStats priStats;
         priStats.Read(filein);
     }
+    fAnswersStale = true;
 }
 
 FeeFilterRounder::FeeFilterRounder(const CFeeRate& minIncrementalFee)
@@ -6,14 +6,16 @@
 #define BITCOIN_POLICYESTIMATOR_H
 
 #include "amount.h"
+#include "coins.h"
 #include "uint256.h"
 #include "random.h"
 
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
-class CAutoFile;
+class CDataStream;
 class CFeeRate;
 class CTxMemPoolEntry;
 class CTxMemPool;
@@ -57,6 +59,11 @@ class CTxMemPool;
  * the number of transactions we've seen in that feerate bucket when calculating
  * an estimate for any number of confirmations below the number of blocks
  * they've been outstanding.
+ *
+ * The answers for every target only change when a block comes in or an old
+ * unconfirmed transaction leaves the mempool, so they are kept in a table
+ * that is recomputed on the first request after such a change, and estimate
+ * requests are lookups in it.
  */
 
 /**
@@ -72,7 +79,6 @@ class TxConfirmStats
 private:
     //Define the buckets we will group transactions into
     std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive)
-    std::map<double, unsigned int> bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
 
     // For each bucket X:
     // Count the total # of txs in each bucket
@@ -84,7 +90,8 @@ private:
     // Count the total # of txs confirmed within Y blocks in each bucket
     // Track the historical moving average of theses totals over blocks
     std::vector<std::vector<double> > confAvg; // confAvg[Y][X]
-    // and calculate the totals for the current block to update the moving averages
+    // and count the txs confirmed in exactly Y blocks in the current block,
+    // which are summed up into the moving averages
     std::vector<std::vector<int> > curBlockConf; // curBlockConf[Y][X]
 
     // Sum the total feerate of all tx's in each bucket
@@ -151,17 +158,20 @@ public:
     double EstimateMedianVal(int confTarget, double sufficientTxVal,
                              double minSuccess, bool requireGreater, unsigned int nBlockHeight);
 
+    /** Bucket index of a feerate */
+    unsigned int BucketIndex(double val) const;
+
     /** Return the max number of confirms we're tracking */
     unsigned int GetMaxConfirms() { return confAvg.size(); }
 
     /** Write state of estimation data to a file*/
-    void Write(CAutoFile& fileout);
+    void Write(CDataStream& fileout);
 
     /**
      * Read saved state of estimation data from a file and replace all internal data structures and
      * variables with this state.
      */
-    void Read(CAutoFile& filein);
+    void Read(CDataStream& filein);
 };
 
 
@@ -223,6 +233,11 @@ public:
      */
     CFeeRate estimateSmartFee(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool);
 
+    /** estimateFee and estimateSmartFee searching the stats on every call,
+     *  as they did before the answer table; kept as a reference for tests. */
+    CFeeRate estimateFeeSearch(int confTarget);
+    CFeeRate estimateSmartFeeSearch(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool);
+
     /** Return a priority estimate.
      *  DEPRECATED
      *  Returns -1
@@ -238,10 +253,10 @@ public:
     double estimateSmartPriority(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool);
 
     /** Write estimation data to a file */
-    void Write(CAutoFile& fileout);
+    void Write(CDataStream& fileout);
 
     /** Read estimation data from a file */
-    void Read(CAutoFile& filein, int nFileVersion);
+    void Read(CDataStream& filein, int nFileVersion);
 
 private:
     CFeeRate minTrackedFee;    //!< Passed to constructor to avoid dependency on main
@@ -254,10 +269,19 @@ private:
     };
 
     // map of txids to information about that transaction
-    std::map<uint256, TxStatsInfo> mapMemPoolTxs;
+    std::unordered_map<uint256, TxStatsInfo, SaltedTxidHasher> mapMemPoolTxs;
 
     /** Classes to track historical data on transaction confirmations */
     TxConfirmStats feeStats;
+
+    // Answers for each target, indexed by target - 1
+    std::vector<double> vMedianByTarget;    //!< Median feerate at the target, or -1
+    std::vector<double> vSmartMedianByTarget; //!< ... at the lowest target from it that has one
+    std::vector<int> vSmartTarget;          //!< ... and that target
+    bool fAnswersStale;                     //!< Stats changed since the answers were computed
+
+    /** Recompute the answer table if the stats changed */
+    void UpdateAnswers();
 };
 
 class FeeFilterRounder
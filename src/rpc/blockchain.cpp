@@ -4,11 +4,14 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "amount.h"
+#include "blockfilter.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "coins.h"
 #include "consensus/validation.h"
+#include "index/blockfilterindex.h"
+#include "index/blockstatsindex.h"
 #include "main.h"
 #include "policy/policy.h"
 #include "primitives/transaction.h"
@@ -20,6 +23,7 @@
 #include "utilstrencodings.h"
 #include "hash.h"
 
+#include <set>
 #include <stdint.h>
 
 #include <univalue.h>
@@ -349,10 +353,9 @@ std::string EntryDescriptionString()
            "       ... ]\n";
 }
 
-void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
+void entryToJSON(UniValue &info, const CTxMemPoolSnapshotEntry &snapshotEntry)
 {
-    AssertLockHeld(mempool.cs);
-
+    const CTxMemPoolEntry& e = snapshotEntry.entry;
     info.push_back(Pair("size", (int)e.GetTxSize()));
     info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
     info.push_back(Pair("modifiedfee", ValueFromAmount(e.GetModifiedFee())));
@@ -366,13 +369,9 @@ void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
     info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
     info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
     info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
-    const CTransaction& tx = e.GetTx();
     set<string> setDepends;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-    {
-        if (mempool.exists(txin.prevout.hash))
-            setDepends.insert(txin.prevout.hash.ToString());
-    }
+    BOOST_FOREACH(const uint256& hashParent, snapshotEntry.vParents)
+        setDepends.insert(hashParent.ToString());
 
     UniValue depends(UniValue::VARR);
     BOOST_FOREACH(const string& dep, setDepends)
@@ -385,32 +384,51 @@ void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
 
 UniValue mempoolToJSON(bool fVerbose = false)
 {
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot = mempool.GetSnapshot();
     if (fVerbose)
     {
-        LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
+        for (size_t i = 0; i < snapshot->size(); i++)
         {
-            const uint256& hash = e.GetTx().GetHash();
+            const CTxMemPoolSnapshotEntry& e = (*snapshot)[i];
             UniValue info(UniValue::VOBJ);
             entryToJSON(info, e);
-            o.push_back(Pair(hash.ToString(), info));
+            o.push_back(Pair(e.entry.GetTx().GetHash().ToString(), info));
         }
         return o;
     }
     else
     {
-        vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
-
         UniValue a(UniValue::VARR);
-        BOOST_FOREACH(const uint256& hash, vtxid)
-            a.push_back(hash.ToString());
+        for (size_t i = 0; i < snapshot->size(); i++)
+            a.push_back((*snapshot)[i].entry.GetTx().GetHash().ToString());
 
         return a;
     }
 }
 
+/** Entries of a snapshot as txids, or as entries keyed by txid if fVerbose */
+static UniValue snapshotEntriesToJSON(const CTxMemPoolSnapshot& snapshot, const std::vector<size_t>& vIndices, bool fVerbose)
+{
+    if (!fVerbose) {
+        UniValue o(UniValue::VARR);
+        BOOST_FOREACH(size_t nIndex, vIndices) {
+            o.push_back(snapshot[nIndex].entry.GetTx().GetHash().ToString());
+        }
+
+        return o;
+    } else {
+        UniValue o(UniValue::VOBJ);
+        BOOST_FOREACH(size_t nIndex, vIndices) {
+            const CTxMemPoolSnapshotEntry& e = snapshot[nIndex];
+            UniValue info(UniValue::VOBJ);
+            entryToJSON(info, e);
+            o.push_back(Pair(e.entry.GetTx().GetHash().ToString(), info));
+        }
+        return o;
+    }
+}
+
 UniValue getrawmempool(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() > 1)
@@ -474,36 +492,13 @@ UniValue getmempoolancestors(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
-
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot = mempool.GetSnapshot();
+    size_t nIndex;
+    if (!snapshot->Find(hash, nIndex)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
     }
 
-    CTxMemPool::setEntries setAncestors;
-    uint64_t noLimit = std::numeric_limits<uint64_t>::max();
-    std::string dummy;
-    mempool.CalculateMemPoolAncestors(*it, setAncestors, noLimit, noLimit, noLimit, noLimit, dummy, false);
-
-    if (!fVerbose) {
-        UniValue o(UniValue::VARR);
-        BOOST_FOREACH(CTxMemPool::txiter ancestorIt, setAncestors) {
-            o.push_back(ancestorIt->GetTx().GetHash().ToString());
-        }
-
-        return o;
-    } else {
-        UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH(CTxMemPool::txiter ancestorIt, setAncestors) {
-            const CTxMemPoolEntry &e = *ancestorIt;
-            const uint256& _hash = e.GetTx().GetHash();
-            UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
-            o.push_back(Pair(_hash.ToString(), info));
-        }
-        return o;
-    }
+    return snapshotEntriesToJSON(*snapshot, snapshot->CalculateAncestors(nIndex), fVerbose);
 }
 
 UniValue getmempooldescendants(const JSONRPCRequest& request)
@@ -538,36 +533,13 @@ UniValue getmempooldescendants(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
-
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot = mempool.GetSnapshot();
+    size_t nIndex;
+    if (!snapshot->Find(hash, nIndex)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
     }
 
-    CTxMemPool::setEntries setDescendants;
-    mempool.CalculateDescendants(it, setDescendants);
-    // CTxMemPool::CalculateDescendants will include the given tx
-    setDescendants.erase(it);
-
-    if (!fVerbose) {
-        UniValue o(UniValue::VARR);
-        BOOST_FOREACH(CTxMemPool::txiter descendantIt, setDescendants) {
-            o.push_back(descendantIt->GetTx().GetHash().ToString());
-        }
-
-        return o;
-    } else {
-        UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH(CTxMemPool::txiter descendantIt, setDescendants) {
-            const CTxMemPoolEntry &e = *descendantIt;
-            const uint256& _hash = e.GetTx().GetHash();
-            UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
-            o.push_back(Pair(_hash.ToString(), info));
-        }
-        return o;
-    }
+    return snapshotEntriesToJSON(*snapshot, snapshot->CalculateDescendants(nIndex), fVerbose);
 }
 
 UniValue getmempoolentry(const JSONRPCRequest& request)
@@ -590,16 +562,18 @@ UniValue getmempoolentry(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
-
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+    CTxMemPoolSnapshot::EntryRef snapshotEntry;
+    {
+        LOCK(mempool.cs);
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+        }
+        snapshotEntry = mempool.GetSnapshotEntry(it);
     }
 
-    const CTxMemPoolEntry &e = *it;
     UniValue info(UniValue::VOBJ);
-    entryToJSON(info, e);
+    entryToJSON(info, *snapshotEntry);
     return info;
 }
 
@@ -687,6 +661,269 @@ UniValue getblockheader(const JSONRPCRequest& request)
     return blockheaderToJSON(pblockindex);
 }
 
+UniValue getblockfilter(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw runtime_error(
+            "getblockfilter \"blockhash\" ( \"filtertype\" )\n"
+            "\nRetrieve a BIP 157 content filter for a particular block.\n"
+            "\nArguments:\n"
+            "1. \"blockhash\"     (string, required) The hash of the block\n"
+            "2. \"filtertype\"    (string, optional, default=\"basic\") The type name of the filter\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"filter\" : \"hex\",  (string) the hex-encoded filter data\n"
+            "  \"header\" : \"hex\"   (string) the hex-encoded filter header\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\" \"basic\"")
+            + HelpExampleRpc("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\", \"basic\"")
+        );
+
+    uint256 hashBlock(ParseHashV(request.params[0], "blockhash"));
+    std::string strFilterTypeName = "basic";
+    if (request.params.size() > 1) {
+        strFilterTypeName = request.params[1].get_str();
+    }
+
+    BlockFilterType filterType;
+    if (!BlockFilterTypeByName(strFilterTypeName, filterType)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown filtertype");
+    }
+
+    if (!g_blockfilterindex || g_blockfilterindex->GetFilterType() != filterType) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Index is not enabled for filtertype " + strFilterTypeName);
+    }
+
+    const CBlockIndex* pblockindex;
+    bool fBlockWasConnected;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi == mapBlockIndex.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        }
+        pblockindex = mi->second;
+        fBlockWasConnected = pblockindex->IsValid(BLOCK_VALID_SCRIPTS);
+    }
+
+    bool fIndexReady = g_blockfilterindex->IsSynced();
+
+    BlockFilter filter;
+    uint256 hashFilterHeader;
+    if (!g_blockfilterindex->LookupFilter(pblockindex, filter) ||
+        !g_blockfilterindex->LookupFilterHeader(pblockindex, hashFilterHeader)) {
+        int nErrCode;
+        std::string strErrMsg = "Filter not found.";
+
+        if (!fBlockWasConnected) {
+            nErrCode = RPC_INVALID_ADDRESS_OR_KEY;
+            strErrMsg += " Block was not connected to active chain.";
+        } else if (!fIndexReady) {
+            nErrCode = RPC_MISC_ERROR;
+            strErrMsg += " Block filters are still in the process of being indexed.";
+        } else {
+            nErrCode = RPC_INTERNAL_ERROR;
+            strErrMsg += " This error is unexpected and indicates index corruption.";
+        }
+
+        throw JSONRPCError(nErrCode, strErrMsg);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("filter", HexStr(filter.GetEncodedFilter())));
+    ret.push_back(Pair("header", hashFilterHeader.GetHex()));
+    return ret;
+}
+
+static UniValue BlockStatsToJSON(const CBlockStats& stats, const std::set<std::string>& setStats)
+{
+    UniValue feerate_percentiles(UniValue::VARR);
+    for (int i = 0; i < NUM_GETBLOCKSTATS_PERCENTILES; i++) {
+        feerate_percentiles.push_back(stats.vFeeRatePercentiles[i]);
+    }
+
+    UniValue ret_all(UniValue::VOBJ);
+    ret_all.push_back(Pair("avgfee", stats.nAvgFee));
+    ret_all.push_back(Pair("avgfeerate", stats.nAvgFeeRate));
+    ret_all.push_back(Pair("avgtxsize", stats.nAvgTxSize));
+    ret_all.push_back(Pair("blockhash", stats.hashBlock.GetHex()));
+    ret_all.push_back(Pair("feerate_percentiles", feerate_percentiles));
+    ret_all.push_back(Pair("height", stats.nHeight));
+    ret_all.push_back(Pair("ins", stats.nIns));
+    ret_all.push_back(Pair("maxfee", stats.nMaxFee));
+    ret_all.push_back(Pair("maxfeerate", stats.nMaxFeeRate));
+    ret_all.push_back(Pair("maxtxsize", stats.nMaxTxSize));
+    ret_all.push_back(Pair("medianfee", stats.nMedianFee));
+    ret_all.push_back(Pair("mediantime", stats.nMedianTime));
+    ret_all.push_back(Pair("mediantxsize", stats.nMedianTxSize));
+    ret_all.push_back(Pair("minfee", stats.nMinFee));
+    ret_all.push_back(Pair("minfeerate", stats.nMinFeeRate));
+    ret_all.push_back(Pair("mintxsize", stats.nMinTxSize));
+    ret_all.push_back(Pair("outs", stats.nOuts));
+    ret_all.push_back(Pair("subsidy", stats.nSubsidy));
+    ret_all.push_back(Pair("swtotal_size", stats.nSegwitTotalSize));
+    ret_all.push_back(Pair("swtotal_weight", stats.nSegwitTotalWeight));
+    ret_all.push_back(Pair("swtxs", stats.nSegwitTxs));
+    ret_all.push_back(Pair("time", stats.nTime));
+    ret_all.push_back(Pair("total_out", stats.nTotalOut));
+    ret_all.push_back(Pair("total_size", stats.nTotalSize));
+    ret_all.push_back(Pair("total_weight", stats.nTotalWeight));
+    ret_all.push_back(Pair("totalfee", stats.nTotalFee));
+    ret_all.push_back(Pair("txs", stats.nTxs));
+    ret_all.push_back(Pair("utxo_increase", stats.nUtxoIncrease));
+    ret_all.push_back(Pair("utxo_size_inc", stats.nUtxoSizeInc));
+
+    if (setStats.empty()) {
+        return ret_all;
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    for (const std::string& stat : setStats) {
+        const UniValue& value = ret_all[stat];
+        if (value.isNull()) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Invalid selected statistic %s", stat));
+        }
+        ret.push_back(Pair(stat, value));
+    }
+    return ret;
+}
+
+UniValue getblockstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 3)
+        throw runtime_error(
+            "getblockstats hash_or_height ( stats endheight )\n"
+            "\nCompute per block statistics for a given window. All amounts are in satoshis.\n"
+            "Statistics are served from the block statistics index, which must be enabled with -blockstatsindex.\n"
+            "\nArguments:\n"
+            "1. \"hash_or_height\"     (string or numeric, required) The block hash or height of the target block\n"
+            "2. \"stats\"              (array,  optional) Values to plot, by default all values (see result below)\n"
+            "    [\n"
+            "      \"height\",         (string, optional) Selected statistic\n"
+            "      \"time\",           (string, optional) Selected statistic\n"
+            "      ,...\n"
+            "    ]\n"
+            "3. endheight            (numeric, optional) If given, return an array with the statistics of all\n"
+            "                        blocks of the active chain from the target block up to this height\n"
+            "\nResult:\n"
+            "{                           (json object)\n"
+            "  \"avgfee\": xxxxx,          (numeric) Average fee in the block\n"
+            "  \"avgfeerate\": xxxxx,      (numeric) Average feerate (in satoshis per virtual byte)\n"
+            "  \"avgtxsize\": xxxxx,       (numeric) Average transaction size\n"
+            "  \"blockhash\": xxxxx,       (string) The block hash (to check for potential reorgs)\n"
+            "  \"feerate_percentiles\": [  (array of numeric) Feerates at the 10th, 25th, 50th, 75th, and 90th percentile weight unit (in satoshis per virtual byte)\n"
+            "      \"10th_percentile_feerate\",  (numeric) The 10th percentile feerate\n"
+            "      \"25th_percentile_feerate\",  (numeric) The 25th percentile feerate\n"
+            "      \"50th_percentile_feerate\",  (numeric) The 50th percentile feerate\n"
+            "      \"75th_percentile_feerate\",  (numeric) The 75th percentile feerate\n"
+            "      \"90th_percentile_feerate\",  (numeric) The 90th percentile feerate\n"
+            "  ],\n"
+            "  \"height\": xxxxx,          (numeric) The height of the block\n"
+            "  \"ins\": xxxxx,             (numeric) The number of inputs (excluding coinbase)\n"
+            "  \"maxfee\": xxxxx,          (numeric) Maximum fee in the block\n"
+            "  \"maxfeerate\": xxxxx,      (numeric) Maximum feerate (in satoshis per virtual byte)\n"
+            "  \"maxtxsize\": xxxxx,       (numeric) Maximum transaction size\n"
+            "  \"medianfee\": xxxxx,       (numeric) Truncated median fee in the block\n"
+            "  \"mediantime\": xxxxx,      (numeric) The block median time past\n"
+            "  \"mediantxsize\": xxxxx,    (numeric) Truncated median transaction size\n"
+            "  \"minfee\": xxxxx,          (numeric) Minimum fee in the block\n"
+            "  \"minfeerate\": xxxxx,      (numeric) Minimum feerate (in satoshis per virtual byte)\n"
+            "  \"mintxsize\": xxxxx,       (numeric) Minimum transaction size\n"
+            "  \"outs\": xxxxx,            (numeric) The number of outputs\n"
+            "  \"subsidy\": xxxxx,         (numeric) The block subsidy\n"
+            "  \"swtotal_size\": xxxxx,    (numeric) Total size of all segwit transactions\n"
+            "  \"swtotal_weight\": xxxxx,  (numeric) Total weight of all segwit transactions\n"
+            "  \"swtxs\": xxxxx,           (numeric) The number of segwit transactions\n"
+            "  \"time\": xxxxx,            (numeric) The block time\n"
+            "  \"total_out\": xxxxx,       (numeric) Total amount in all outputs (excluding coinbase and thus reward [ie subsidy + totalfee])\n"
+            "  \"total_size\": xxxxx,      (numeric) Total size of all non-coinbase transactions\n"
+            "  \"total_weight\": xxxxx,    (numeric) Total weight of all non-coinbase transactions\n"
+            "  \"totalfee\": xxxxx,        (numeric) The fee total\n"
+            "  \"txs\": xxxxx,             (numeric) The number of transactions (including coinbase)\n"
+            "  \"utxo_increase\": xxxxx,   (numeric) The increase/decrease in the number of unspent outputs\n"
+            "  \"utxo_size_inc\": xxxxx,   (numeric) The increase/decrease in size for the utxo index (not discounting op_return and similar)\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockstats", "1000 '[\"minfeerate\",\"avgfeerate\"]'")
+            + HelpExampleCli("getblockstats", "1000 '[\"totalfee\"]' 1010")
+            + HelpExampleRpc("getblockstats", "1000, [\"minfeerate\",\"avgfeerate\"]")
+        );
+
+    if (!g_blockstatsindex) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Block statistics index is not enabled, start with -blockstatsindex");
+    }
+
+    std::set<std::string> setStats;
+    if (request.params.size() > 1 && !request.params[1].isNull()) {
+        const UniValue& stats_univalue = request.params[1].get_array();
+        for (unsigned int i = 0; i < stats_univalue.size(); i++) {
+            setStats.insert(stats_univalue[i].get_str());
+        }
+    }
+
+    std::vector<const CBlockIndex*> vBlocks;
+    {
+        LOCK(cs_main);
+
+        // bitcoin-cli passes a height as a string, as it cannot tell it from a hash
+        const UniValue& target = request.params[0];
+        int nTargetHeight;
+        const CBlockIndex* pindex;
+        if (target.isNum() || (target.isStr() && ParseInt32(target.get_str(), &nTargetHeight))) {
+            if (target.isNum()) {
+                nTargetHeight = target.get_int();
+            }
+            const int nCurrentTip = chainActive.Height();
+            if (nTargetHeight < 0) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Target block height %d is negative", nTargetHeight));
+            }
+            if (nTargetHeight > nCurrentTip) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Target block height %d after current tip %d", nTargetHeight, nCurrentTip));
+            }
+            pindex = chainActive[nTargetHeight];
+        } else {
+            const uint256 hash = ParseHashV(target, "hash_or_height");
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
+            if (mi == mapBlockIndex.end()) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+            }
+            pindex = mi->second;
+        }
+        vBlocks.push_back(pindex);
+
+        if (request.params.size() > 2) {
+            const int nEndHeight = request.params[2].get_int();
+            if (!chainActive.Contains(pindex)) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "A range can only start at a block of the active chain");
+            }
+            if (nEndHeight < pindex->nHeight || nEndHeight > chainActive.Height()) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("End height %d out of range", nEndHeight));
+            }
+            for (int nHeight = pindex->nHeight + 1; nHeight <= nEndHeight; nHeight++) {
+                vBlocks.push_back(chainActive[nHeight]);
+            }
+        }
+    }
+
+    UniValue ret(UniValue::VARR);
+    for (const CBlockIndex* pindex : vBlocks) {
+        CBlockStats stats;
+        if (!g_blockstatsindex->LookupStats(pindex, stats)) {
+            if (!g_blockstatsindex->IsSynced()) {
+                throw JSONRPCError(RPC_MISC_ERROR, strprintf("Block statistics for height %d are still in the process of being indexed", pindex->nHeight));
+            }
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, strprintf("No statistics for block %s", pindex->GetBlockHash().GetHex()));
+        }
+        ret.push_back(BlockStatsToJSON(stats, setStats));
+    }
+
+    if (request.params.size() > 2) {
+        return ret;
+    }
+    return ret[0];
+}
+
 UniValue getblock(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
@@ -1218,39 +1455,85 @@ UniValue getchaintips(const JSONRPCRequest& request)
     return res;
 }
 
-UniValue mempoolInfoToJSON()
+UniValue mempoolFeeHistogramToJSON()
+{
+    std::vector<CFeeHistogramBucket> vBuckets = mempool.GetFeeHistogram();
+    UniValue buckets(UniValue::VARR);
+    CAmount nTotalFees = 0;
+    for (size_t i = 0; i < vBuckets.size(); i++) {
+        UniValue bucket(UniValue::VOBJ);
+        bucket.push_back(Pair("from", vBuckets[i].nFeeRateFrom));
+        if (i + 1 < vBuckets.size())
+            bucket.push_back(Pair("to", vBuckets[i + 1].nFeeRateFrom));
+        bucket.push_back(Pair("count", vBuckets[i].nCount));
+        bucket.push_back(Pair("size", vBuckets[i].nSize));
+        bucket.push_back(Pair("fees", ValueFromAmount(vBuckets[i].nFees)));
+        buckets.push_back(bucket);
+        nTotalFees += vBuckets[i].nFees;
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("fee_rate_groups", buckets));
+    ret.push_back(Pair("total_fees", ValueFromAmount(nTotalFees)));
+    return ret;
+}
+
+UniValue mempoolInfoToJSON(bool fFeeHistogram = false)
 {
     UniValue ret(UniValue::VOBJ);
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
     ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("snapshotusage", (int64_t) mempool.SnapshotMemoryUsage()));
     size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
     ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
+    if (fFeeHistogram)
+        ret.push_back(Pair("fee_histogram", mempoolFeeHistogramToJSON()));
 
     return ret;
 }
 
 UniValue getmempoolinfo(const JSONRPCRequest& request)
 {
-    if (request.fHelp || request.params.size() != 0)
+    if (request.fHelp || request.params.size() > 1)
         throw runtime_error(
-            "getmempoolinfo\n"
+            "getmempoolinfo ( fee_histogram )\n"
             "\nReturns details on the active state of the TX memory pool.\n"
+            "\nArguments:\n"
+            "1. fee_histogram    (boolean, optional, default=false) Also return the transactions by modified feerate\n"
             "\nResult:\n"
             "{\n"
             "  \"size\": xxxxx,               (numeric) Current tx count\n"
             "  \"bytes\": xxxxx,              (numeric) Sum of all tx sizes\n"
             "  \"usage\": xxxxx,              (numeric) Total memory usage for the mempool\n"
+            "  \"snapshotusage\": xxxxx,      (numeric) Memory usage of the last snapshot the mempool RPCs read, not counted in usage\n"
             "  \"maxmempool\": xxxxx,         (numeric) Maximum memory usage for the mempool\n"
-            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted\n"
+            "  \"mempoolminfee\": xxxxx,      (numeric) Minimum fee for tx to be accepted\n"
+            "  \"fee_histogram\": {           (json object) Only with fee_histogram set\n"
+            "    \"fee_rate_groups\": [       (array) Feerate ranges, from low to high\n"
+            "      {\n"
+            "        \"from\": xx,            (numeric) Lowest feerate of the range, in satoshis per byte\n"
+            "        \"to\": xx,              (numeric) Feerate the next range starts at, absent for the last one\n"
+            "        \"count\": xx,           (numeric) Number of transactions in the range\n"
+            "        \"size\": xx,            (numeric) Their total virtual size\n"
+            "        \"fees\": x.xxx          (numeric) Their total modified fees in " + CURRENCY_UNIT + "\n"
+            "      }, ...\n"
+            "    ],\n"
+            "    \"total_fees\": x.xxx        (numeric) Modified fees of all transactions in " + CURRENCY_UNIT + "\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
-            + HelpExampleRpc("getmempoolinfo", "")
+            + HelpExampleCli("getmempoolinfo", "true")
+            + HelpExampleRpc("getmempoolinfo", "true")
         );
 
-    return mempoolInfoToJSON();
+    bool fFeeHistogram = false;
+    if (request.params.size() > 0)
+        fFeeHistogram = request.params[0].get_bool();
+
+    return mempoolInfoToJSON(fFeeHistogram);
 }
 
 UniValue preciousblock(const JSONRPCRequest& request)
@@ -1374,7 +1657,9 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getblockcount",          &getblockcount,          true  },
     { "blockchain",         "getblock",               &getblock,               true  },
     { "blockchain",         "getblockhash",           &getblockhash,           true  },
+    { "blockchain",         "getblockfilter",         &getblockfilter,         true  },
     { "blockchain",         "getblockheader",         &getblockheader,         true  },
+    { "blockchain",         "getblockstats",          &getblockstats,          true  },
     { "blockchain",         "getchaintips",           &getchaintips,           true  },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
     { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    true  },
@@ -96,12 +96,26 @@ UniValue getnetworkhashps(const JSONRPCRequest& request)
     return GetNetworkHashPS(request.params.size() > 0 ? request.params[0].get_int() : 120, request.params.size() > 1 ? request.params[1].get_int() : -1);
 }
 
+// Connect the blocks generateBlocks stored, up to pindexLast
+static void ConnectGeneratedBlocks(CBlockIndex* pindexLast)
+{
+    CValidationState state;
+    if (!ActivateBestChain(state, Params()))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "ActivateBestChain failed");
+    LOCK(cs_main);
+    if (!chainActive.Contains(pindexLast))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "ProcessNewBlock, block not accepted");
+}
+
 UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nGenerate, uint64_t nMaxTries, bool keepScript)
 {
     static const int nInnerLoopCount = 0x10000;
     int nHeightStart = 0;
     int nHeightEnd = 0;
     int nHeight = 0;
+    int nThreads = GetArg("-generatethreads", DEFAULT_GENERATE_THREADS);
+    if (nThreads <= 0)
+        nThreads = std::max(1, GetNumCores());
 
     {   // Don't keep cs_main locked
         LOCK(cs_main);
@@ -111,28 +125,44 @@ UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nG
     }
     unsigned int nExtraNonce = 0;
     UniValue blockHashes(UniValue::VARR);
+    // Blocks are stored as they are found, but only connected once the next
+    // one may take transactions from the mempool, and at the end. While the
+    // mempool is empty, each block is built on top of the last one stored,
+    // so a run of empty blocks is connected by one ActivateBestChain call.
+    // Templates aren't checked with TestBlockValidity, connecting them does
+    // that.
+    CBlockIndex* pindexLast = NULL;
     while (nHeight < nHeightEnd)
     {
-        std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(coinbaseScript->reserveScript));
+        if (pindexLast && mempool.size() > 0) {
+            ConnectGeneratedBlocks(pindexLast);
+            pindexLast = NULL;
+        }
+        std::unique_ptr<CBlockTemplate> pblocktemplate;
+        if (pindexLast)
+            pblocktemplate = BlockAssembler(Params()).CreateEmptyBlock(coinbaseScript->reserveScript, pindexLast);
+        else
+            pblocktemplate = BlockAssembler(Params()).CreateNewBlock(coinbaseScript->reserveScript, false);
         if (!pblocktemplate.get())
             throw JSONRPCError(RPC_INTERNAL_ERROR, "Couldn't create new block");
         CBlock *pblock = &pblocktemplate->block;
         {
             LOCK(cs_main);
-            IncrementExtraNonce(pblock, chainActive.Tip(), nExtraNonce);
-        }
-        while (nMaxTries > 0 && pblock->nNonce < nInnerLoopCount && !CheckProofOfWork(pblock->GetHash(), pblock->nBits, Params().GetConsensus())) {
-            ++pblock->nNonce;
-            --nMaxTries;
-        }
-        if (nMaxTries == 0) {
-            break;
+            IncrementExtraNonce(pblock, pindexLast ? pindexLast : chainActive.Tip(), nExtraNonce);
         }
-        if (pblock->nNonce == nInnerLoopCount) {
+        if (!GrindBlockNonce(*pblock, Params().GetConsensus(), nInnerLoopCount, nMaxTries, nThreads)) {
+            if (nMaxTries == 0) {
+                break;
+            }
             continue;
         }
-        if (!ProcessNewBlock(Params(), pblock, true, NULL, NULL))
+        CBlockIndex* pindexNew = NULL;
+        if (!AcceptNewBlock(Params(), pblock, &pindexNew)) {
+            if (pindexLast)
+                ConnectGeneratedBlocks(pindexLast);
             throw JSONRPCError(RPC_INTERNAL_ERROR, "ProcessNewBlock, block not accepted");
+        }
+        pindexLast = pindexNew;
         ++nHeight;
         blockHashes.push_back(pblock->GetHash().GetHex());
 
@@ -142,6 +172,8 @@ UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nG
             coinbaseScript->KeepScript();
         }
     }
+    if (pindexLast)
+        ConnectGeneratedBlocks(pindexLast);
     return blockHashes;
 }
 
@@ -519,29 +551,16 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
     }
 
     // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static std::unique_ptr<CBlockTemplate> pblocktemplate;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = nullptr;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-
-        // Create new block
-        CScript scriptDummy = CScript() << OP_TRUE;
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+    CScript scriptDummy = CScript() << OP_TRUE;
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    if (g_blocktemplatecache)
+        pblocktemplate = g_blocktemplatecache->Get(scriptDummy);
+    else
         pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
+    if (!pblocktemplate)
+        throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
     const Consensus::Params& consensusParams = Params().GetConsensus();
 
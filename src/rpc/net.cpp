@@ -365,6 +365,110 @@ UniValue getnettotals(const JSONRPCRequest& request)
     return obj;
 }
 
+static UniValue LogHistogramToJSON(const CLogHistogram& histogram)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("sum", histogram.nSum));
+    obj.push_back(Pair("max", histogram.nMax));
+    int nBuckets = CLogHistogram::BUCKETS;
+    while (nBuckets > 0 && histogram.vBuckets[nBuckets - 1] == 0)
+        nBuckets--;
+    UniValue buckets(UniValue::VARR);
+    for (int i = 0; i < nBuckets; i++)
+        buckets.push_back(histogram.vBuckets[i]);
+    obj.push_back(Pair("buckets", buckets));
+    return obj;
+}
+
+static UniValue MsgMetricsToJSON(const CMsgMetrics& metrics, bool fBytes)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("count", metrics.handlerTime.nCount));
+    if (fBytes)
+        obj.push_back(Pair("bytes", LogHistogramToJSON(metrics.bytes)));
+    obj.push_back(Pair("time_us", LogHistogramToJSON(metrics.handlerTime)));
+    obj.push_back(Pair("cs_main_us", LogHistogramToJSON(metrics.mainLockTime)));
+    return obj;
+}
+
+static void PushPeerMsgMetrics(UniValue& obj, const CPeerMsgMetrics& metrics)
+{
+    UniValue recv(UniValue::VOBJ);
+    BOOST_FOREACH(const mapMsgCmdMetrics::value_type& item, metrics.mapRecv)
+        recv.push_back(Pair(item.first, MsgMetricsToJSON(item.second, true)));
+    obj.push_back(Pair("recv", recv));
+    obj.push_back(Pair("sendmessages", MsgMetricsToJSON(metrics.send, false)));
+}
+
+UniValue getmessagemetrics(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 0)
+        throw runtime_error(
+            "getmessagemetrics\n"
+            "\nReturns what handling P2P messages has cost, by command, for all peers since startup\n"
+            "and for each connected peer. Every measure is a histogram whose buckets count the\n"
+            "values that are 0, 1, 2-3, 4-7, ... (the last bucket also counts anything larger),\n"
+            "with empty buckets at the end left out.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"total\": {                 (json object) All peers since startup\n"
+            "    \"recv\": {                (json object) Received messages, by command\n"
+            "      \"command\": {\n"
+            "        \"count\": n,           (numeric) Messages handled\n"
+            "        \"bytes\": {            (json object) Payload size\n"
+            "          \"sum\": n,\n"
+            "          \"max\": n,\n"
+            "          \"buckets\": [n,...]\n"
+            "        },\n"
+            "        \"time_us\": { ... },   (json object) Wall time in the handler, in microseconds\n"
+            "        \"cs_main_us\": { ... } (json object) Part of it spent holding cs_main, in microseconds\n"
+            "      }, ...\n"
+            "    },\n"
+            "    \"sendmessages\": {        (json object) Passes preparing messages to send, as above without bytes\n"
+            "      ...\n"
+            "    }\n"
+            "  },\n"
+            "  \"peers\": [\n"
+            "    {\n"
+            "      \"id\": n,                (numeric) Peer index\n"
+            "      \"addr\": \"host:port\",    (string) The ip address and port of the peer\n"
+            "      \"recv\": { ... },         (json object) As in total\n"
+            "      \"sendmessages\": { ... }  (json object) As in total\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmessagemetrics", "")
+            + HelpExampleRpc("getmessagemetrics", "")
+        );
+    if(!g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    CPeerMsgMetrics total;
+    std::map<NodeId, CPeerMsgMetrics> mapPeers;
+    g_connman->GetMsgMetrics(total, mapPeers);
+    vector<CNodeStats> vstats;
+    g_connman->GetNodeStats(vstats);
+
+    UniValue obj(UniValue::VOBJ);
+    UniValue totalObj(UniValue::VOBJ);
+    PushPeerMsgMetrics(totalObj, total);
+    obj.push_back(Pair("total", totalObj));
+    UniValue peers(UniValue::VARR);
+    BOOST_FOREACH(const CNodeStats& stats, vstats) {
+        std::map<NodeId, CPeerMsgMetrics>::const_iterator it = mapPeers.find(stats.nodeid);
+        if (it == mapPeers.end())
+            continue;
+        UniValue peer(UniValue::VOBJ);
+        peer.push_back(Pair("id", stats.nodeid));
+        peer.push_back(Pair("addr", stats.addrName));
+        PushPeerMsgMetrics(peer, it->second);
+        peers.push_back(peer);
+    }
+    obj.push_back(Pair("peers", peers));
+    return obj;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -598,6 +702,7 @@ static const CRPCCommand commands[] =
     { "network",            "getconnectioncount",     &getconnectioncount,     true  },
     { "network",            "ping",                   &ping,                   true  },
     { "network",            "getpeerinfo",            &getpeerinfo,            true  },
+    { "network",            "getmessagemetrics",      &getmessagemetrics,      true  },
     { "network",            "addnode",                &addnode,                true  },
     { "network",            "disconnectnode",         &disconnectnode,         true  },
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true  },
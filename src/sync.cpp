@@ -6,12 +6,54 @@
 
 #include "util.h"
 #include "utilstrencodings.h"
+#include "utiltime.h"
 
 #include <stdio.h>
 
 #include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 
+/** Time the current thread has held critical sections that are timed */
+struct LockHoldTime {
+    //! Number of timed locks held, counting recursive ones
+    int nDepth;
+    //! When the current hold began
+    int64_t nSince;
+    //! Microseconds of holds that have ended
+    int64_t nTotal;
+
+    LockHoldTime() : nDepth(0), nSince(0), nTotal(0) {}
+};
+
+static boost::thread_specific_ptr<LockHoldTime> lockholdtime;
+
+static LockHoldTime& GetLockHoldTime()
+{
+    if (lockholdtime.get() == NULL)
+        lockholdtime.reset(new LockHoldTime);
+    return *lockholdtime;
+}
+
+void CCriticalSection::TimedHoldStarted()
+{
+    LockHoldTime& hold = GetLockHoldTime();
+    if (hold.nDepth++ == 0)
+        hold.nSince = GetTimeMicros();
+}
+
+void CCriticalSection::TimedHoldEnded()
+{
+    LockHoldTime& hold = GetLockHoldTime();
+    if (hold.nDepth > 0 && --hold.nDepth == 0)
+        hold.nTotal += GetTimeMicros() - hold.nSince;
+}
+
+int64_t GetLockHeldMicros()
+{
+    LockHoldTime& hold = GetLockHoldTime();
+    return hold.nTotal + (hold.nDepth > 0 ? GetTimeMicros() - hold.nSince : 0);
+}
+
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 {
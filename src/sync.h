@@ -13,6 +13,8 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/recursive_mutex.hpp>
 
+#include <stdint.h>
+
 
 ////////////////////////////////////////////////
 //                                            //
@@ -91,12 +93,51 @@ void static inline DeleteLock(void* cs) {}
  */
 class CCriticalSection : public AnnotatedMixin<boost::recursive_mutex>
 {
+private:
+    //! Whether the time this lock is held counts towards GetLockHeldMicros()
+    const bool fTimeHolds;
+
 public:
+    explicit CCriticalSection(bool fTimeHoldsIn = false) : fTimeHolds(fTimeHoldsIn) {}
+
     ~CCriticalSection() {
         DeleteLock((void*)this);
     }
+
+    void lock() EXCLUSIVE_LOCK_FUNCTION()
+    {
+        AnnotatedMixin<boost::recursive_mutex>::lock();
+        if (fTimeHolds)
+            TimedHoldStarted();
+    }
+
+    void unlock() UNLOCK_FUNCTION()
+    {
+        if (fTimeHolds)
+            TimedHoldEnded();
+        AnnotatedMixin<boost::recursive_mutex>::unlock();
+    }
+
+    bool try_lock() EXCLUSIVE_TRYLOCK_FUNCTION(true)
+    {
+        if (!AnnotatedMixin<boost::recursive_mutex>::try_lock())
+            return false;
+        if (fTimeHolds)
+            TimedHoldStarted();
+        return true;
+    }
+
+    static void TimedHoldStarted();
+    static void TimedHoldEnded();
 };
 
+/**
+ * Microseconds the calling thread has spent holding critical sections
+ * constructed with fTimeHoldsIn, so far. Take the difference of two calls
+ * to see how long the code in between kept them.
+ */
+int64_t GetLockHeldMicros();
+
 typedef CCriticalSection CDynamicCriticalSection;
 /** Wrapped boost mutex: supports waiting but not recursive locking */
 typedef AnnotatedMixin<boost::mutex> CWaitableCriticalSection;
@@ -6,9 +6,13 @@
 #include <string>
 #include <boost/test/unit_test.hpp>
 
+#include "clientversion.h"
 #include "hash.h"
 #include "netbase.h"
 #include "random.h"
+#include "streams.h"
+#include "utilstrencodings.h"
+#include "utiltime.h"
 
 using namespace std;
 
@@ -205,9 +209,9 @@ BOOST_AUTO_TEST_CASE(addrman_select)
     BOOST_CHECK(addrman.size() == 7);
 
     // Test 12: Select pulls from new and tried regardless of port number.
-    BOOST_CHECK(addrman.Select().ToString() == "250.4.6.6:8333");
-    BOOST_CHECK(addrman.Select().ToString() == "250.3.2.2:9999");
-    BOOST_CHECK(addrman.Select().ToString() == "250.3.3.3:9999");
+    BOOST_CHECK(addrman.Select().ToString() == "250.4.4.4:8333");
+    BOOST_CHECK(addrman.Select().ToString() == "250.4.5.5:7777");
+    BOOST_CHECK(addrman.Select().ToString() == "250.3.1.1:8333");
     BOOST_CHECK(addrman.Select().ToString() == "250.4.4.4:8333");
 }
 
@@ -542,4 +546,73 @@ BOOST_AUTO_TEST_CASE(caddrinfo_get_new_bucket)
     //  than 64 buckets.
     BOOST_CHECK(buckets.size() > 64);
 }
+
+static CService BenchmarkAddress(int n)
+{
+    return ResolveService(strprintf("%d.%d.%d.1", 250 + (n >> 16), (n >> 8) & 0xff, n & 0xff), 8333);
+}
+
+//! Average time of a Select() in microseconds
+static double BenchmarkSelect(CAddrMan& addrman, int nSelects)
+{
+    int nInvalid = 0;
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nSelects; i++) {
+        if (!addrman.Select().IsValid())
+            nInvalid++;
+    }
+    double dTime = (GetTimeMicros() - nStart) * 1.0 / nSelects;
+    BOOST_CHECK_EQUAL(nInvalid, 0);
+    return dTime;
+}
+
+BOOST_AUTO_TEST_CASE(addrman_benchmark)
+{
+    // Run with --log_level=message to see the timings.
+    static const int N_ADDRESSES = 120000;
+    static const int N_SELECTS = 100000;
+
+    // Nearly empty tables
+    CAddrMan sparse;
+    for (int i = 0; i < 20; i++) {
+        sparse.Add(CAddress(BenchmarkAddress(i * 4099), NODE_NONE), ResolveIP(strprintf("252.%d.1.1", i)));
+        if (i % 4 == 0)
+            sparse.Good(BenchmarkAddress(i * 4099));
+    }
+    BOOST_CHECK_EQUAL(sparse.size(), 20U);
+    double dSelectSparse = BenchmarkSelect(sparse, N_SELECTS);
+    BOOST_TEST_MESSAGE(strprintf("Select from %u addresses: %.2fus", sparse.size(), dSelectSparse));
+
+    // Full new table, sparse tried table
+    CAddrMan addrman;
+    int64_t nStart = GetTimeMicros();
+    std::vector<CAddress> vAddr;
+    for (int i = 0; i < N_ADDRESSES; i++) {
+        vAddr.push_back(CAddress(BenchmarkAddress(i), NODE_NONE));
+        if (vAddr.size() == 100) {
+            addrman.Add(vAddr, ResolveIP(strprintf("252.%d.%d.1", (i / 100) & 0xff, i / 25600)));
+            vAddr.clear();
+        }
+    }
+    for (int i = 0; i < N_ADDRESSES; i += 40)
+        addrman.Good(BenchmarkAddress(i));
+    BOOST_TEST_MESSAGE(strprintf("Add %d addresses and mark %d good: %dms", N_ADDRESSES, N_ADDRESSES / 40, (GetTimeMicros() - nStart) / 1000));
+    BOOST_CHECK(addrman.size() > 40000);
+    double dSelect = BenchmarkSelect(addrman, N_SELECTS);
+    BOOST_TEST_MESSAGE(strprintf("Select from %u addresses: %.2fus", addrman.size(), dSelect));
+
+    nStart = GetTimeMicros();
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers << addrman;
+    BOOST_TEST_MESSAGE(strprintf("Serialize %u addresses (%u bytes): %dms", addrman.size(), ssPeers.size(), (GetTimeMicros() - nStart) / 1000));
+
+    nStart = GetTimeMicros();
+    CAddrMan addrman2;
+    ssPeers >> addrman2;
+    BOOST_TEST_MESSAGE(strprintf("Deserialize %u addresses: %dms", addrman2.size(), (GetTimeMicros() - nStart) / 1000));
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+    dSelect = BenchmarkSelect(addrman2, N_SELECTS);
+    BOOST_TEST_MESSAGE(strprintf("Select from %u deserialized addresses: %.2fus", addrman2.size(), dSelect));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,310 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "consensus/merkle.h"
+#include "index/blockfilterindex.h"
+#include "main.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+#include "undo.h"
+#include "utilstrencodings.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilter_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(gcsfilter_test)
+{
+    GCSFilter::ElementSet included_elements, excluded_elements;
+    for (int i = 0; i < 100; ++i) {
+        GCSFilter::Element element1(32);
+        element1[0] = i;
+        included_elements.insert(std::move(element1));
+
+        GCSFilter::Element element2(32);
+        element2[1] = i;
+        excluded_elements.insert(std::move(element2));
+    }
+
+    GCSFilter filter(0, 0, 10, 1 << 10, included_elements);
+    for (const auto& element : included_elements) {
+        BOOST_CHECK(filter.Match(element));
+
+        auto insertion = excluded_elements.insert(element);
+        BOOST_CHECK(filter.MatchAny(excluded_elements));
+        excluded_elements.erase(insertion.first);
+    }
+
+    // Decoding the encoding yields a filter answering the same queries.
+    GCSFilter filter2(0, 0, 10, 1 << 10, filter.GetEncoded());
+    BOOST_CHECK_EQUAL(filter2.GetN(), 100U);
+    for (const auto& element : included_elements) {
+        BOOST_CHECK(filter2.Match(element));
+    }
+
+    // Trailing or missing data is rejected.
+    std::vector<unsigned char> vTooLong = filter.GetEncoded();
+    vTooLong.push_back(0);
+    BOOST_CHECK_THROW(GCSFilter(0, 0, 10, 1 << 10, vTooLong), std::ios_base::failure);
+    std::vector<unsigned char> vTooShort = filter.GetEncoded();
+    vTooShort.pop_back();
+    BOOST_CHECK_THROW(GCSFilter(0, 0, 10, 1 << 10, vTooShort), std::ios_base::failure);
+
+    // The empty filter matches nothing.
+    GCSFilter filterEmpty(0, 0, 10, 1 << 10, GCSFilter::ElementSet());
+    BOOST_CHECK_EQUAL(filterEmpty.GetEncoded().size(), 1U);
+    BOOST_CHECK(!filterEmpty.MatchAny(included_elements));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_basic_test)
+{
+    CScript included_scripts[5], excluded_scripts[3];
+
+    // First two are outputs on a single transaction.
+    included_scripts[0] << std::vector<unsigned char>(0, 65) << OP_CHECKSIG;
+    included_scripts[1] << OP_DUP << OP_HASH160 << std::vector<unsigned char>(1, 20) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    // Third is an output on in a second transaction.
+    included_scripts[2] << OP_1 << std::vector<unsigned char>(2, 33) << OP_1 << OP_CHECKMULTISIG;
+
+    // Last two are spent by a single transaction.
+    included_scripts[3] << OP_0 << std::vector<unsigned char>(3, 32);
+    included_scripts[4] << OP_4 << OP_ADD << OP_8 << OP_EQUAL;
+
+    // OP_RETURN output is not included.
+    excluded_scripts[0] << OP_RETURN << std::vector<unsigned char>(4, 40);
+
+    // Script spent by a transaction in the block, but not in the undo data, is
+    // not included.
+    excluded_scripts[1] << OP_0 << std::vector<unsigned char>(5, 33);
+
+    // Empty script is not included.
+    excluded_scripts[2] = CScript();
+
+    CMutableTransaction tx_1;
+    tx_1.vout.push_back(CTxOut(100, included_scripts[0]));
+    tx_1.vout.push_back(CTxOut(200, included_scripts[1]));
+    tx_1.vout.push_back(CTxOut(0, excluded_scripts[0]));
+
+    CMutableTransaction tx_2;
+    tx_2.vout.push_back(CTxOut(300, included_scripts[2]));
+    tx_2.vout.push_back(CTxOut(0, excluded_scripts[2]));
+
+    CBlock block;
+    block.vtx.push_back(MakeTransactionRef(tx_1));
+    block.vtx.push_back(MakeTransactionRef(tx_2));
+
+    CBlockUndo block_undo;
+    block_undo.vtxundo.push_back(CTxUndo());
+    block_undo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(500, included_scripts[3])));
+    block_undo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(600, included_scripts[4])));
+    block_undo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(700, excluded_scripts[2])));
+
+    BlockFilter block_filter(BASIC, block, block_undo);
+    const GCSFilter& filter = block_filter.GetFilter();
+
+    for (const CScript& script : included_scripts) {
+        BOOST_CHECK(filter.Match(GCSFilter::Element(script.begin(), script.end())));
+    }
+    for (const CScript& script : excluded_scripts) {
+        BOOST_CHECK(!filter.Match(GCSFilter::Element(script.begin(), script.end())));
+    }
+
+    // Test serialization/unserialization.
+    BlockFilter block_filter2;
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << block_filter;
+    stream >> block_filter2;
+
+    BOOST_CHECK_EQUAL(block_filter.GetFilterType(), block_filter2.GetFilterType());
+    BOOST_CHECK(block_filter.GetBlockHash() == block_filter2.GetBlockHash());
+    BOOST_CHECK(block_filter.GetEncodedFilter() == block_filter2.GetEncodedFilter());
+
+    // Headers chain over the filter hashes.
+    uint256 hashPrevHeader = uint256S("0x01");
+    BOOST_CHECK(block_filter.ComputeHeader(hashPrevHeader) != block_filter.ComputeHeader(uint256()));
+    BOOST_CHECK(block_filter.ComputeHeader(hashPrevHeader) == block_filter2.ComputeHeader(hashPrevHeader));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_bip158_vectors)
+{
+    // Testnet genesis block, from the BIP 158 test vectors
+    const CBlock& genesis = Params(CBaseChainParams::TESTNET).GenesisBlock();
+    BOOST_CHECK_EQUAL(genesis.GetHash().GetHex(), "000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943");
+    BlockFilter genesis_filter(BASIC, genesis, CBlockUndo());
+    BOOST_CHECK_EQUAL(HexStr(genesis_filter.GetEncodedFilter()), "019dfca8");
+    BOOST_CHECK_EQUAL(genesis_filter.ComputeHeader(uint256()).GetHex(),
+                      "21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750");
+
+    // A block with spent outputs, duplicate scripts and scripts that are left
+    // out, checked against an independent implementation of BIP 158
+    CScript p2pkh = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript p2wpkh = CScript() << OP_0 << std::vector<unsigned char>(20, 2);
+    CScript p2sh = CScript() << OP_HASH160 << std::vector<unsigned char>(20, 3) << OP_EQUAL;
+
+    CMutableTransaction tx_1;
+    tx_1.vout.push_back(CTxOut(100, p2pkh));
+    tx_1.vout.push_back(CTxOut(0, CScript() << OP_RETURN << std::vector<unsigned char>(4, 4)));
+    tx_1.vout.push_back(CTxOut(200, p2pkh));
+
+    CMutableTransaction tx_2;
+    tx_2.vin.resize(3);
+    tx_2.vout.push_back(CTxOut(300, p2wpkh));
+    tx_2.vout.push_back(CTxOut(0, CScript()));
+
+    CBlock block;
+    block.nVersion = 1;
+    block.nTime = 1231006505;
+    block.vtx.push_back(MakeTransactionRef(tx_1));
+    block.vtx.push_back(MakeTransactionRef(tx_2));
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+
+    CBlockUndo block_undo;
+    block_undo.vtxundo.push_back(CTxUndo());
+    block_undo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(400, p2sh)));
+    block_undo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(500, p2pkh)));
+    block_undo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(600, CScript())));
+
+    BlockFilter block_filter(BASIC, block, block_undo);
+    BOOST_CHECK_EQUAL(block.GetHash().GetHex(), "ceff78f8538052ffc1476ea3ec1728348b0f3ad2a1b9ff0a6596f93518e38ae6");
+    BOOST_CHECK_EQUAL(HexStr(block_filter.GetEncodedFilter()), "03ead5f67720415910");
+    BOOST_CHECK_EQUAL(block_filter.ComputeHeader(genesis_filter.ComputeHeader(uint256())).GetHex(),
+                      "c928f2800f2e95538955f51384ae8a4f754245e15d2d6d98df2840ca5c47c604");
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_type_names)
+{
+    BOOST_CHECK_EQUAL(BlockFilterTypeName(BASIC), "basic");
+    BOOST_CHECK_EQUAL(BlockFilterTypeName(static_cast<BlockFilterType>(255)), "");
+
+    BlockFilterType filter_type;
+    BOOST_CHECK(BlockFilterTypeByName("basic", filter_type));
+    BOOST_CHECK_EQUAL(filter_type, BASIC);
+
+    BOOST_CHECK(!BlockFilterTypeByName("unknown", filter_type));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+static bool CheckFilterLookups(BlockFilterIndex& filter_index, const CBlockIndex* pindex,
+                               uint256& last_header)
+{
+    BlockFilter expected_filter;
+    CBlock block;
+    CBlockUndo block_undo;
+    if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus())) {
+        return false;
+    }
+    if (pindex->nHeight > 0 &&
+        !UndoReadFromDisk(block_undo, pindex->GetUndoPos(), pindex->pprev->GetBlockHash())) {
+        return false;
+    }
+    expected_filter = BlockFilter(BASIC, block, block_undo);
+
+    BlockFilter filter;
+    uint256 filter_header;
+    std::vector<BlockFilter> filters;
+    std::vector<uint256> filter_hashes;
+
+    BOOST_CHECK(filter_index.LookupFilter(pindex, filter));
+    BOOST_CHECK(filter_index.LookupFilterHeader(pindex, filter_header));
+    BOOST_CHECK(filter_index.LookupFilterRange(pindex->nHeight, pindex, filters));
+    BOOST_CHECK(filter_index.LookupFilterHashRange(pindex->nHeight, pindex, filter_hashes));
+
+    BOOST_CHECK_EQUAL(filters.size(), 1U);
+    BOOST_CHECK_EQUAL(filter_hashes.size(), 1U);
+
+    BOOST_CHECK(filter.GetHash() == expected_filter.GetHash());
+    BOOST_CHECK(filter_header == expected_filter.ComputeHeader(last_header));
+    BOOST_CHECK(filters[0].GetHash() == expected_filter.GetHash());
+    BOOST_CHECK(filter_hashes[0] == expected_filter.GetHash());
+
+    last_header = filter_header;
+    return true;
+}
+
+BOOST_FIXTURE_TEST_SUITE(blockfilterindex_tests, TestChain100Setup)
+
+BOOST_AUTO_TEST_CASE(blockfilterindex_initial_sync)
+{
+    BlockFilterIndex filter_index(BASIC, 1 << 20, true);
+
+    uint256 last_header;
+
+    // Filter should not be found in the index before it is started.
+    {
+        LOCK(cs_main);
+
+        BlockFilter filter;
+        uint256 filter_header;
+        std::vector<BlockFilter> filters;
+        std::vector<uint256> filter_hashes;
+
+        for (const CBlockIndex* pindex = chainActive.Genesis(); pindex; pindex = chainActive.Next(pindex)) {
+            BOOST_CHECK(!filter_index.LookupFilter(pindex, filter));
+            BOOST_CHECK(!filter_index.LookupFilterHeader(pindex, filter_header));
+            BOOST_CHECK(!filter_index.LookupFilterRange(pindex->nHeight, pindex, filters));
+            BOOST_CHECK(!filter_index.LookupFilterHashRange(pindex->nHeight, pindex, filter_hashes));
+        }
+    }
+
+    // The index should sync the existing chain in the background.
+    boost::thread_group indexThreads;
+    filter_index.Start(indexThreads);
+
+    int64_t nTimeStart = GetTimeMillis();
+    while (!filter_index.IsSynced()) {
+        BOOST_REQUIRE(nTimeStart + 10000 > GetTimeMillis());
+        MilliSleep(100);
+    }
+    indexThreads.join_all();
+    BOOST_CHECK_EQUAL(filter_index.GetBestHeight(), chainActive.Height());
+
+    // Check that filter index has all blocks that were in the chain before it started.
+    {
+        LOCK(cs_main);
+        const CBlockIndex* pindex;
+        for (pindex = chainActive.Genesis(); pindex; pindex = chainActive.Next(pindex)) {
+            BOOST_CHECK(CheckFilterLookups(filter_index, pindex, last_header));
+        }
+
+        // A range lookup returns one filter per block, in height order.
+        std::vector<BlockFilter> filters;
+        std::vector<uint256> filter_hashes;
+        BOOST_CHECK(filter_index.LookupFilterRange(0, chainActive.Tip(), filters));
+        BOOST_CHECK(filter_index.LookupFilterHashRange(0, chainActive.Tip(), filter_hashes));
+        BOOST_CHECK_EQUAL(filters.size(), static_cast<size_t>(chainActive.Height() + 1));
+        BOOST_CHECK_EQUAL(filter_hashes.size(), filters.size());
+        for (size_t i = 0; i < filters.size(); ++i) {
+            BOOST_CHECK(filters[i].GetBlockHash() == chainActive[i]->GetBlockHash());
+            BOOST_CHECK(filter_hashes[i] == filters[i].GetHash());
+        }
+        BOOST_CHECK(!filter_index.LookupFilterRange(chainActive.Height() + 1, chainActive.Tip(), filters));
+    }
+
+    // Check that new blocks get indexed.
+    for (int i = 0; i < 10; i++) {
+        CScript coinbase_script_pub_key = GetScriptForRawPubKey(coinbaseKey.GetPubKey());
+        std::vector<CMutableTransaction> no_txns;
+        const CBlock& block = CreateAndProcessBlock(no_txns, coinbase_script_pub_key);
+
+        LOCK(cs_main);
+        BOOST_CHECK(filter_index.IsSynced());
+        const CBlockIndex* pindex = chainActive.Tip();
+        BOOST_CHECK(pindex->GetBlockHash() == block.GetHash());
+        BOOST_CHECK(CheckFilterLookups(filter_index, pindex, last_header));
+    }
+    BOOST_CHECK_EQUAL(filter_index.GetBestHeight(), chainActive.Height());
+
+    filter_index.Stop();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,152 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "index/blockstatsindex.h"
+#include "key.h"
+#include "main.h"
+#include "policy/policy.h"
+#include "script/sign.h"
+#include "script/standard.h"
+#include "test/test_bitcoin.h"
+#include "utiltime.h"
+
+#include <univalue.h>
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+extern UniValue CallRPC(std::string args);
+
+BOOST_AUTO_TEST_SUITE(blockstatsindex_tests)
+
+BOOST_FIXTURE_TEST_CASE(blockstatsindex_initial_sync, TestChain100Setup)
+{
+    BlockStatsIndex stats_index(1 << 20, true);
+
+    CBlockStats stats;
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(!stats_index.LookupStats(chainActive.Tip(), stats));
+    }
+
+    // The index should sync the existing chain in the background.
+    boost::thread_group indexThreads;
+    stats_index.Start(indexThreads);
+
+    int64_t nTimeStart = GetTimeMillis();
+    while (!stats_index.IsSynced()) {
+        BOOST_REQUIRE(nTimeStart + 10000 > GetTimeMillis());
+        MilliSleep(100);
+    }
+    indexThreads.join_all();
+    BOOST_CHECK_EQUAL(stats_index.GetBestHeight(), chainActive.Height());
+
+    {
+        LOCK(cs_main);
+        for (const CBlockIndex* pindex = chainActive.Genesis(); pindex; pindex = chainActive.Next(pindex)) {
+            BOOST_CHECK(stats_index.LookupStats(pindex, stats));
+            BOOST_CHECK(stats.hashBlock == pindex->GetBlockHash());
+            BOOST_CHECK_EQUAL(stats.nHeight, pindex->nHeight);
+            BOOST_CHECK_EQUAL(stats.nTxs, 1);
+            BOOST_CHECK_EQUAL(stats.nIns, 0);
+            BOOST_CHECK_EQUAL(stats.nTotalFee, 0);
+            BOOST_CHECK_EQUAL(stats.nSubsidy, GetBlockSubsidy(pindex->nHeight, Params().GetConsensus()));
+        }
+    }
+
+    // Spend a mature coinbase with a known fee in a new block.
+    const CAmount nFee = 10000;
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(2);
+    spend.vout[0].nValue = coinbaseTxns[0].vout[0].nValue / 2;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    spend.vout[1].nValue = coinbaseTxns[0].vout[0].nValue - spend.vout[0].nValue - nFee;
+    spend.vout[1].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+
+    std::vector<CMutableTransaction> txns;
+    txns.push_back(spend);
+    const CBlock block = CreateAndProcessBlock(txns, scriptPubKey);
+
+    LOCK(cs_main);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    BOOST_CHECK(stats_index.IsSynced());
+    BOOST_CHECK(stats_index.LookupStats(chainActive.Tip(), stats));
+
+    const CTransaction tx(spend);
+    int64_t nUtxoIncrease = -1;
+    for (const auto& blocktx : block.vtx) {
+        for (const CTxOut& out : blocktx->vout) {
+            if (!out.scriptPubKey.IsUnspendable()) nUtxoIncrease++;
+        }
+    }
+
+    BOOST_CHECK_EQUAL(stats.nTxs, 2);
+    BOOST_CHECK_EQUAL(stats.nIns, 1);
+    BOOST_CHECK_EQUAL(stats.nOuts, block.vtx[0]->vout.size() + 2);
+    BOOST_CHECK_EQUAL(stats.nTotalFee, nFee);
+    BOOST_CHECK_EQUAL(stats.nMinFee, nFee);
+    BOOST_CHECK_EQUAL(stats.nMaxFee, nFee);
+    BOOST_CHECK_EQUAL(stats.nMedianFee, nFee);
+    BOOST_CHECK_EQUAL(stats.nAvgFee, nFee);
+    BOOST_CHECK_EQUAL(stats.nTotalOut, tx.GetValueOut());
+    BOOST_CHECK_EQUAL(stats.nTotalSize, tx.GetTotalSize());
+    BOOST_CHECK_EQUAL(stats.nMinTxSize, tx.GetTotalSize());
+    BOOST_CHECK_EQUAL(stats.nMaxTxSize, tx.GetTotalSize());
+    BOOST_CHECK_EQUAL(stats.nUtxoIncrease, nUtxoIncrease);
+
+    const CAmount nFeeRate = nFee / GetVirtualTransactionSize(tx);
+    BOOST_CHECK_EQUAL(stats.nMinFeeRate, nFeeRate);
+    BOOST_CHECK_EQUAL(stats.nMaxFeeRate, nFeeRate);
+    for (int i = 0; i < NUM_GETBLOCKSTATS_PERCENTILES; i++) {
+        BOOST_CHECK_EQUAL(stats.vFeeRatePercentiles[i], nFeeRate);
+    }
+
+    stats_index.Stop();
+}
+
+BOOST_FIXTURE_TEST_CASE(getblockstats_hash_or_height, TestChain100Setup)
+{
+    g_blockstatsindex.reset(new BlockStatsIndex(1 << 20, true));
+    boost::thread_group indexThreads;
+    g_blockstatsindex->Start(indexThreads);
+    int64_t nTimeStart = GetTimeMillis();
+    while (!g_blockstatsindex->IsSynced()) {
+        BOOST_REQUIRE(nTimeStart + 10000 > GetTimeMillis());
+        MilliSleep(100);
+    }
+    indexThreads.join_all();
+
+    // The target block can be given by height or by hash, as bitcoin-cli passes either
+    uint256 hashBlock;
+    {
+        LOCK(cs_main);
+        hashBlock = chainActive[5]->GetBlockHash();
+    }
+    UniValue r;
+    BOOST_CHECK_NO_THROW(r = CallRPC("getblockstats 5"));
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "blockhash").get_str(), hashBlock.GetHex());
+    BOOST_CHECK_NO_THROW(r = CallRPC("getblockstats " + hashBlock.GetHex()));
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "height").get_int(), 5);
+    BOOST_CHECK_NO_THROW(r = CallRPC("getblockstats " + hashBlock.GetHex() + " [\"height\"] 7"));
+    BOOST_CHECK_EQUAL(r.get_array().size(), 3U);
+    BOOST_CHECK_THROW(CallRPC("getblockstats -1"), std::runtime_error);
+    BOOST_CHECK_THROW(CallRPC("getblockstats 1000"), std::runtime_error);
+    BOOST_CHECK_THROW(CallRPC("getblockstats nothex"), std::runtime_error);
+
+    g_blockstatsindex->Stop();
+    g_blockstatsindex.reset();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -545,4 +545,53 @@ BOOST_AUTO_TEST_CASE(rolling_bloom)
     }
 }
 
+BOOST_AUTO_TEST_CASE(blocked_rolling_bloom)
+{
+    // Like CRollingBloomFilter, the last 100 entries are always remembered,
+    // with about 1% false positives:
+    CBlockedRollingBloomFilter rb1(100, 0.01);
+    static const int DATASIZE=399;
+    std::vector<unsigned char> data[DATASIZE];
+    for (int i = 0; i < DATASIZE; i++) {
+        data[i] = RandomData();
+        if (i >= 100)
+            BOOST_CHECK(rb1.contains(data[i-100]));
+        rb1.insert(data[i]);
+        BOOST_CHECK(rb1.contains(data[i]));
+    }
+    unsigned int nHits = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (rb1.contains(RandomData()))
+            ++nHits;
+    }
+    BOOST_TEST_MESSAGE("BlockedRollingBloomFilter got " << nHits << " false positives (~100 expected)");
+    BOOST_CHECK(nHits > 25);
+    BOOST_CHECK(nHits < 175);
+    rb1.reset();
+    BOOST_CHECK(!rb1.contains(data[DATASIZE-1]));
+
+    // uint256 keys are the same as their bytes
+    CBlockedRollingBloomFilter rb(1000, 0.000001);
+    std::vector<uint256> hashes;
+    for (int i = 0; i < 1000; i++) {
+        hashes.push_back(GetRandHash());
+        if (i % 2)
+            rb.insert(hashes.back());
+        else
+            rb.insert(std::vector<unsigned char>(hashes.back().begin(), hashes.back().end()));
+    }
+    for (int i = 0; i < 1000; i++) {
+        BOOST_CHECK(rb.contains(hashes[i]));
+        BOOST_CHECK(rb.contains(std::vector<unsigned char>(hashes[i].begin(), hashes[i].end())));
+    }
+
+    // One in a million false positive rate holds with all probes in one block
+    nHits = 0;
+    for (int i = 0; i < 100000; i++) {
+        if (rb.contains(GetRandHash()))
+            ++nHits;
+    }
+    BOOST_CHECK(nHits < 3);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
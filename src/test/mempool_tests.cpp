@@ -2,6 +2,8 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "arith_uint256.h"
+#include "memusage.h"
 #include "policy/policy.h"
 #include "txmempool.h"
 #include "util.h"
@@ -9,6 +11,7 @@
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
+#include <algorithm>
 #include <list>
 #include <vector>
 
@@ -114,9 +117,32 @@ void CheckSort(CTxMemPool &pool, std::vector<std::string> &sortedOrder)
     }
 }
 
+// The mempool keeps no index on mining score, check the comparator instead
+void CheckSortByScore(CTxMemPool &pool, std::vector<std::string> &sortedOrder)
+{
+    BOOST_CHECK_EQUAL(pool.size(), sortedOrder.size());
+    std::vector<CTxMemPoolEntry> vEntries(pool.mapTx.begin(), pool.mapTx.end());
+    std::sort(vEntries.begin(), vEntries.end(), CompareTxMemPoolEntryByScore());
+    for (size_t i = 0; i < vEntries.size(); i++) {
+        BOOST_CHECK_EQUAL(vEntries[i].GetTx().GetHash().ToString(), sortedOrder[i]);
+    }
+}
+
+static CTxMemPool::vecEntries ToVecEntries(const CTxMemPool::setEntries& setEntries)
+{
+    return CTxMemPool::vecEntries(setEntries.begin(), setEntries.end());
+}
+
+//! Whether a traversal found exactly the expected entries, each once
+static bool SameEntries(const CTxMemPool::vecEntries& vEntries, const CTxMemPool::setEntries& setExpected)
+{
+    return vEntries.size() == setExpected.size() && CTxMemPool::setEntries(vEntries.begin(), vEntries.end()) == setExpected;
+}
+
 BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
 {
     CTxMemPool pool(CFeeRate(0));
+    LOCK(pool.cs);
     TestMemPoolEntryHelper entry;
     entry.hadNoDependencies = true;
 
@@ -191,12 +217,12 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     tx7.vout[1].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
     tx7.vout[1].nValue = 1 * COIN;
 
-    CTxMemPool::setEntries setAncestorsCalculated;
+    CTxMemPool::vecEntries vAncestorsCalculated;
     std::string dummy;
-    BOOST_CHECK_EQUAL(pool.CalculateMemPoolAncestors(entry.Fee(2000000LL).FromTx(tx7), setAncestorsCalculated, 100, 1000000, 1000, 1000000, dummy), true);
-    BOOST_CHECK(setAncestorsCalculated == setAncestors);
+    BOOST_CHECK_EQUAL(pool.CalculateMemPoolAncestors(entry.Fee(2000000LL).FromTx(tx7), vAncestorsCalculated, 100, 1000000, 1000, 1000000, dummy), true);
+    BOOST_CHECK(SameEntries(vAncestorsCalculated, setAncestors));
 
-    pool.addUnchecked(tx7.GetHash(), entry.FromTx(tx7), setAncestors);
+    pool.addUnchecked(tx7.GetHash(), entry.FromTx(tx7), ToVecEntries(setAncestors));
     BOOST_CHECK_EQUAL(pool.size(), 7);
 
     // Now tx6 should be sorted higher (high fee child): tx7, tx6, tx2, ...
@@ -214,7 +240,7 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     tx8.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
     tx8.vout[0].nValue = 10 * COIN;
     setAncestors.insert(pool.mapTx.find(tx7.GetHash()));
-    pool.addUnchecked(tx8.GetHash(), entry.Fee(0LL).Time(2).FromTx(tx8), setAncestors);
+    pool.addUnchecked(tx8.GetHash(), entry.Fee(0LL).Time(2).FromTx(tx8), ToVecEntries(setAncestors));
 
     // Now tx8 should be sorted low, but tx6/tx both high
     sortedOrder.insert(sortedOrder.begin(), tx8.GetHash().ToString());
@@ -228,7 +254,7 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     tx9.vout.resize(1);
     tx9.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
     tx9.vout[0].nValue = 1 * COIN;
-    pool.addUnchecked(tx9.GetHash(), entry.Fee(0LL).Time(3).FromTx(tx9), setAncestors);
+    pool.addUnchecked(tx9.GetHash(), entry.Fee(0LL).Time(3).FromTx(tx9), ToVecEntries(setAncestors));
 
     // tx9 should be sorted low
     BOOST_CHECK_EQUAL(pool.size(), 9);
@@ -250,11 +276,10 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     tx10.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
     tx10.vout[0].nValue = 10 * COIN;
 
-    setAncestorsCalculated.clear();
-    BOOST_CHECK_EQUAL(pool.CalculateMemPoolAncestors(entry.Fee(200000LL).Time(4).FromTx(tx10), setAncestorsCalculated, 100, 1000000, 1000, 1000000, dummy), true);
-    BOOST_CHECK(setAncestorsCalculated == setAncestors);
+    BOOST_CHECK_EQUAL(pool.CalculateMemPoolAncestors(entry.Fee(200000LL).Time(4).FromTx(tx10), vAncestorsCalculated, 100, 1000000, 1000, 1000000, dummy), true);
+    BOOST_CHECK(SameEntries(vAncestorsCalculated, setAncestors));
 
-    pool.addUnchecked(tx10.GetHash(), entry.FromTx(tx10), setAncestors);
+    pool.addUnchecked(tx10.GetHash(), entry.FromTx(tx10), ToVecEntries(setAncestors));
 
     /**
      *  tx8 and tx9 should both now be sorted higher
@@ -286,7 +311,7 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
 
     pool.removeRecursive(pool.mapTx.find(tx9.GetHash())->GetTx());
     pool.removeRecursive(pool.mapTx.find(tx8.GetHash())->GetTx());
-    /* Now check the sort on the mining score index.
+    /* Now check the sort by mining score.
      * Final order should be:
      *
      * tx7 (2M)
@@ -314,7 +339,7 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
         sortedOrder.push_back(tx3.GetHash().ToString());
         sortedOrder.push_back(tx6.GetHash().ToString());
     }
-    CheckSort<mining_score>(pool, sortedOrder);
+    CheckSortByScore(pool, sortedOrder);
 }
 
 BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
@@ -575,4 +600,425 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolLinksUsageTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    // vTxHashes keeps its capacity when emptied
+    auto PoolUsage = [&pool]() { return pool.DynamicMemoryUsage() - memusage::DynamicUsage(pool.vTxHashes); };
+    const size_t nEmptyUsage = PoolUsage();
+
+    // A parent with more children than fit in its links without allocating,
+    // and a child spending all of them
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(10);
+    for (int i = 0; i < 10; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    pool.addUnchecked(txParent.GetHash(), entry.Time(100).FromTx(txParent));
+    const size_t nParentUsage = PoolUsage();
+
+    CMutableTransaction txSweep;
+    txSweep.vout.resize(1);
+    txSweep.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txSweep.vout[0].nValue = 10000LL;
+    std::vector<CTransactionRef> vChildren;
+    for (int i = 0; i < 10; i++) {
+        CMutableTransaction txChild;
+        txChild.vin.resize(1);
+        txChild.vin[0].scriptSig = CScript() << OP_11;
+        txChild.vin[0].prevout = COutPoint(txParent.GetHash(), i);
+        txChild.vout.resize(1);
+        txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild.vout[0].nValue = 11000LL;
+        pool.addUnchecked(txChild.GetHash(), entry.Time(200 + i).FromTx(txChild));
+        vChildren.push_back(MakeTransactionRef(txChild));
+        txSweep.vin.push_back(CTxIn(COutPoint(txChild.GetHash(), 0), CScript() << OP_11));
+    }
+    pool.addUnchecked(txSweep.GetHash(), entry.Time(300).FromTx(txSweep));
+    BOOST_CHECK_EQUAL(pool.size(), 12U);
+    {
+        LOCK(pool.cs);
+        CTxMemPool::txiter parentit = pool.mapTx.find(txParent.GetHash());
+        CTxMemPool::txiter sweepit = pool.mapTx.find(txSweep.GetHash());
+        BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(parentit).size(), 10U);
+        BOOST_CHECK_EQUAL(pool.GetMemPoolParents(sweepit).size(), 10U);
+        BOOST_CHECK(pool.GetMemPoolParents(parentit).empty());
+        BOOST_CHECK_EQUAL(sweepit->GetCountWithAncestors(), 12U);
+    }
+
+    // Taking the links apart gives back exactly what they were accounted for
+    pool.removeRecursive(*vChildren[0]);
+    BOOST_CHECK_EQUAL(pool.size(), 10U);
+    for (int i = 1; i < 10; i++)
+        pool.removeRecursive(*vChildren[i]);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    {
+        LOCK(pool.cs);
+        BOOST_CHECK(pool.GetMemPoolChildren(pool.mapTx.find(txParent.GetHash())).empty());
+    }
+    // The parent's children vector stays allocated
+    BOOST_CHECK(PoolUsage() > nParentUsage);
+    pool.removeRecursive(txParent);
+    BOOST_CHECK_EQUAL(PoolUsage(), nEmptyUsage);
+
+    // Expiry walks the transactions in the order they were added
+    pool.addUnchecked(txParent.GetHash(), entry.Time(100).FromTx(txParent));
+    pool.addUnchecked(vChildren[0]->GetHash(), entry.Time(200).FromTx(*vChildren[0]));
+    pool.addUnchecked(vChildren[1]->GetHash(), entry.Time(300).FromTx(*vChildren[1]));
+    BOOST_CHECK_EQUAL(pool.Expire(150), 3);
+    pool.addUnchecked(vChildren[2]->GetHash(), entry.Time(100).FromTx(*vChildren[2]));
+    pool.addUnchecked(vChildren[3]->GetHash(), entry.Time(300).FromTx(*vChildren[3]));
+    pool.addUnchecked(vChildren[4]->GetHash(), entry.Time(200).FromTx(*vChildren[4]));
+    BOOST_CHECK_EQUAL(pool.Expire(250), 1);
+    BOOST_CHECK(!pool.exists(vChildren[2]->GetHash()));
+    BOOST_CHECK(pool.exists(vChildren[4]->GetHash()));
+    BOOST_CHECK_EQUAL(pool.Expire(350), 2);
+    BOOST_CHECK_EQUAL(PoolUsage(), nEmptyUsage);
+
+    // ... unless they are sorted by time after
+    pool.addUnchecked(vChildren[2]->GetHash(), entry.Time(100).FromTx(*vChildren[2]));
+    pool.addUnchecked(vChildren[3]->GetHash(), entry.Time(300).FromTx(*vChildren[3]));
+    pool.addUnchecked(vChildren[4]->GetHash(), entry.Time(200).FromTx(*vChildren[4]));
+    pool.SortByEntryTime();
+    BOOST_CHECK_EQUAL(pool.Expire(250), 2);
+    BOOST_CHECK(pool.exists(vChildren[3]->GetHash()));
+    BOOST_CHECK_EQUAL(pool.Expire(350), 1);
+    BOOST_CHECK_EQUAL(PoolUsage(), nEmptyUsage);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSnapshotTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // A chain of three, and an unrelated transaction
+    CMutableTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_11;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    CMutableTransaction tx2 = tx1;
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    CMutableTransaction tx3 = tx1;
+    tx3.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    CMutableTransaction txOther = tx1;
+    txOther.vin[0].scriptSig = CScript() << OP_12;
+
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(1000).FromTx(tx1));
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(2000).FromTx(tx2));
+    pool.addUnchecked(txOther.GetHash(), entry.Fee(5000).FromTx(txOther));
+
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot = pool.GetSnapshot();
+    BOOST_CHECK_EQUAL(snapshot->size(), 3U);
+    // Taken again only once the pool changed
+    BOOST_CHECK(pool.GetSnapshot() == snapshot);
+    size_t n1, n2, nOther;
+    BOOST_CHECK(snapshot->Find(tx1.GetHash(), n1));
+    BOOST_CHECK(snapshot->Find(tx2.GetHash(), n2));
+    BOOST_CHECK(snapshot->Find(txOther.GetHash(), nOther));
+    BOOST_CHECK(!snapshot->Find(tx3.GetHash(), n1));
+    BOOST_CHECK_EQUAL((*snapshot)[n1].entry.GetCountWithDescendants(), 2U);
+    BOOST_CHECK((*snapshot)[n1].vParents.empty());
+    BOOST_CHECK((*snapshot)[n2].vParents == std::vector<uint256>(1, tx1.GetHash()));
+    // Without the links into the pool
+    BOOST_CHECK((*snapshot)[n2].entry.vParents.empty());
+
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(3000).FromTx(tx3));
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot2 = pool.GetSnapshot();
+    BOOST_CHECK(snapshot2 != snapshot);
+    BOOST_CHECK_EQUAL(snapshot2->size(), 4U);
+    // The old snapshot is unchanged
+    BOOST_CHECK_EQUAL(snapshot->size(), 3U);
+    BOOST_CHECK_EQUAL((*snapshot)[n1].entry.GetCountWithDescendants(), 2U);
+    size_t n3;
+    BOOST_CHECK(snapshot2->Find(tx1.GetHash(), n1));
+    BOOST_CHECK(snapshot2->Find(tx3.GetHash(), n3));
+    BOOST_CHECK(snapshot2->Find(txOther.GetHash(), nOther));
+    BOOST_CHECK_EQUAL((*snapshot2)[n1].entry.GetCountWithDescendants(), 3U);
+    BOOST_CHECK_EQUAL((*snapshot2)[n3].entry.GetCountWithAncestors(), 3U);
+    // An entry that did not change is shared between them
+    size_t nOtherOld;
+    BOOST_CHECK(snapshot->Find(txOther.GetHash(), nOtherOld));
+    BOOST_CHECK(&(*snapshot2)[nOther] == &(*snapshot)[nOtherOld]);
+
+    std::vector<size_t> vAncestors = snapshot2->CalculateAncestors(n3);
+    BOOST_CHECK_EQUAL(vAncestors.size(), 2U);
+    BOOST_CHECK(std::find(vAncestors.begin(), vAncestors.end(), n1) != vAncestors.end());
+    std::vector<size_t> vDescendants = snapshot2->CalculateDescendants(n1);
+    BOOST_CHECK_EQUAL(vDescendants.size(), 2U);
+    BOOST_CHECK(std::find(vDescendants.begin(), vDescendants.end(), n3) != vDescendants.end());
+    BOOST_CHECK(snapshot2->CalculateAncestors(nOther).empty());
+    BOOST_CHECK(snapshot2->CalculateDescendants(nOther).empty());
+
+    // Prioritising a transaction shows up in the next snapshot
+    pool.PrioritiseTransaction(tx3.GetHash(), tx3.GetHash().ToString(), 0, 500);
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot3 = pool.GetSnapshot();
+    BOOST_CHECK(snapshot3 != snapshot2);
+    BOOST_CHECK(snapshot3->Find(tx3.GetHash(), n3));
+    BOOST_CHECK_EQUAL((*snapshot3)[n3].entry.GetModifiedFee(), 3500);
+
+    // Removing the head of the chain takes the parent off the next one
+    pool.removeForBlock(std::vector<CTransactionRef>(1, MakeTransactionRef(tx1)), 1);
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot4 = pool.GetSnapshot();
+    BOOST_CHECK_EQUAL(snapshot4->size(), 3U);
+    BOOST_CHECK(snapshot4->Find(tx2.GetHash(), n2));
+    BOOST_CHECK((*snapshot4)[n2].vParents.empty());
+    BOOST_CHECK_EQUAL((*snapshot4)[n2].entry.GetCountWithAncestors(), 1U);
+
+    // The last snapshot is not counted towards the pool's memory usage, so
+    // trimming the pool to its usage keeps both the snapshot and the pool
+    size_t nSnapshotUsage = pool.SnapshotMemoryUsage();
+    BOOST_CHECK(nSnapshotUsage > 0);
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    BOOST_CHECK(pool.GetSnapshot() == snapshot4);
+    BOOST_CHECK_EQUAL(pool.SnapshotMemoryUsage(), nSnapshotUsage);
+
+    // A transaction that leaves the pool is then only kept by the snapshot
+    BOOST_CHECK(snapshot4->Find(txOther.GetHash(), nOther));
+    size_t nOtherUsage = (*snapshot4)[nOther].entry.DynamicMemoryUsage();
+    size_t nPoolUsage = pool.DynamicMemoryUsage();
+    pool.removeRecursive(txOther);
+    BOOST_CHECK(pool.DynamicMemoryUsage() + nOtherUsage <= nPoolUsage);
+    BOOST_CHECK_EQUAL(pool.SnapshotMemoryUsage(), nSnapshotUsage + nOtherUsage);
+    BOOST_CHECK(pool.GetSnapshot()->size() == 2U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSnapshotReleaseTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    int64_t nNow = GetTime();
+    SetMockTime(nNow);
+
+    CMutableTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_11;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    CMutableTransaction tx2 = tx1;
+    tx2.vin[0].scriptSig = CScript() << OP_12;
+    CMutableTransaction tx3 = tx1;
+    tx3.vin[0].scriptSig = CScript() << OP_13;
+
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(1000).FromTx(tx1));
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(2000).FromTx(tx2));
+
+    // Nothing but the pool's own reference keeps the snapshot, the entry
+    // copies and a transaction that left the pool alive
+    std::weak_ptr<const CTxMemPoolSnapshot> weakSnapshot = pool.GetSnapshot();
+    std::weak_ptr<const CTxMemPoolSnapshotEntry> weakEntry;
+    {
+        LOCK(pool.cs);
+        weakEntry = pool.GetSnapshotEntry(pool.mapTx.find(tx1.GetHash()));
+    }
+    std::weak_ptr<const CTransaction> weakTx;
+    {
+        std::shared_ptr<const CTxMemPoolSnapshot> snapshot = weakSnapshot.lock();
+        size_t n2;
+        BOOST_CHECK(snapshot->Find(tx2.GetHash(), n2));
+        weakTx = (*snapshot)[n2].entry.GetSharedTx();
+    }
+    pool.removeRecursive(tx2);
+    BOOST_CHECK(!weakSnapshot.expired());
+    BOOST_CHECK(!weakEntry.expired());
+    BOOST_CHECK(!weakTx.expired());
+    BOOST_CHECK(pool.SnapshotMemoryUsage() > 0);
+
+    // The next change after the stale snapshot got too old releases all of it
+    SetMockTime(nNow + CTxMemPool::SNAPSHOT_STALE_AGE + 1);
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(3000).FromTx(tx3));
+    BOOST_CHECK(weakSnapshot.expired());
+    BOOST_CHECK(weakEntry.expired());
+    BOOST_CHECK(weakTx.expired());
+    BOOST_CHECK_EQUAL(pool.SnapshotMemoryUsage(), 0U);
+
+    // A snapshot the pool did not change since is kept however old it is
+    weakSnapshot = pool.GetSnapshot();
+    SetMockTime(nNow + 3 * CTxMemPool::SNAPSHOT_STALE_AGE);
+    BOOST_CHECK(pool.GetSnapshot() == weakSnapshot.lock());
+    SetMockTime(0);
+}
+
+//! The fee histogram bucket a feerate in satoshis per byte falls in
+static const CFeeHistogramBucket& FeeHistogramBucket(const std::vector<CFeeHistogramBucket>& vBuckets, CAmount nFeeRate)
+{
+    size_t i = 0;
+    while (i + 1 < vBuckets.size() && vBuckets[i + 1].nFeeRateFrom <= nFeeRate)
+        i++;
+    return vBuckets[i];
+}
+
+BOOST_AUTO_TEST_CASE(MempoolFeeHistogramTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    std::vector<CFeeHistogramBucket> vEmpty = pool.GetFeeHistogram();
+    BOOST_CHECK(!vEmpty.empty());
+    BOOST_CHECK_EQUAL(vEmpty[0].nFeeRateFrom, 0);
+    BOOST_FOREACH(const CFeeHistogramBucket& bucket, vEmpty)
+        BOOST_CHECK_EQUAL(bucket.nCount, 0U);
+
+    CMutableTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_11;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    CMutableTransaction tx2 = tx1;
+    tx2.vin[0].scriptSig = CScript() << OP_12;
+    CMutableTransaction tx3 = tx1;
+    tx3.vin[0].scriptSig = CScript() << OP_13;
+    const CAmount nSize = ::GetSerializeSize(tx1, SER_NETWORK, PROTOCOL_VERSION);
+
+    // Two at 5 satoshis per byte, one at 50
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(5 * nSize).FromTx(tx1));
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(5 * nSize).FromTx(tx2));
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(50 * nSize).FromTx(tx3));
+    std::vector<CFeeHistogramBucket> vBuckets = pool.GetFeeHistogram();
+    BOOST_CHECK_EQUAL(FeeHistogramBucket(vBuckets, 5).nCount, 2U);
+    BOOST_CHECK_EQUAL(FeeHistogramBucket(vBuckets, 5).nSize, 2U * nSize);
+    BOOST_CHECK_EQUAL(FeeHistogramBucket(vBuckets, 5).nFees, 10 * nSize);
+    BOOST_CHECK_EQUAL(FeeHistogramBucket(vBuckets, 50).nCount, 1U);
+    BOOST_CHECK_EQUAL(FeeHistogramBucket(vBuckets, 50).nFees, 50 * nSize);
+
+    // Prioritising moves a transaction to the bucket of its modified feerate
+    pool.PrioritiseTransaction(tx2.GetHash(), tx2.GetHash().ToString(), 0, 45 * nSize);
+    vBuckets = pool.GetFeeHistogram();
+    BOOST_CHECK_EQUAL(FeeHistogramBucket(vBuckets, 5).nCount, 1U);
+    BOOST_CHECK_EQUAL(FeeHistogramBucket(vBuckets, 50).nCount, 2U);
+    BOOST_CHECK_EQUAL(FeeHistogramBucket(vBuckets, 50).nFees, 100 * nSize);
+
+    // A negative modified fee counts in the lowest bucket
+    pool.PrioritiseTransaction(tx1.GetHash(), tx1.GetHash().ToString(), 0, -10 * nSize);
+    vBuckets = pool.GetFeeHistogram();
+    BOOST_CHECK_EQUAL(vBuckets[0].nCount, 1U);
+    BOOST_CHECK_EQUAL(vBuckets[0].nFees, -5 * nSize);
+    BOOST_CHECK_EQUAL(FeeHistogramBucket(vBuckets, 5).nCount, 0U);
+
+    // Leaving the mempool takes out the modified fee
+    pool.removeRecursive(tx2);
+    pool.removeRecursive(tx1);
+    vBuckets = pool.GetFeeHistogram();
+    BOOST_CHECK_EQUAL(vBuckets[0].nCount, 0U);
+    BOOST_CHECK_EQUAL(vBuckets[0].nFees, 0);
+    BOOST_CHECK_EQUAL(FeeHistogramBucket(vBuckets, 50).nCount, 1U);
+    BOOST_CHECK_EQUAL(FeeHistogramBucket(vBuckets, 50).nSize, (uint64_t)nSize);
+    BOOST_CHECK_EQUAL(FeeHistogramBucket(vBuckets, 50).nFees, 50 * nSize);
+
+    pool.clear();
+    BOOST_CHECK_EQUAL(FeeHistogramBucket(pool.GetFeeHistogram(), 50).nCount, 0U);
+}
+
+static CMutableTransaction TraversalTx(const std::vector<COutPoint>& vPrevouts, size_t nOutputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(vPrevouts.size());
+    for (size_t i = 0; i < vPrevouts.size(); i++) {
+        tx.vin[i].prevout = vPrevouts[i];
+        tx.vin[i].scriptSig = CScript() << OP_11;
+    }
+    tx.vout.resize(nOutputs);
+    for (size_t i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = COIN;
+    }
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolTraversalTest)
+{
+    static const int N_PACKAGES = 10;
+    static const int CHAIN_LENGTH = 25;
+    static const int FAN_OUT = 23;
+
+    CTxMemPool pool(CFeeRate(0));
+    LOCK(pool.cs);
+    TestMemPoolEntryHelper entry;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+
+    // Each package is a chain of CHAIN_LENGTH transactions, and a fan: a
+    // parent with FAN_OUT children which are all spent by one transaction.
+    std::vector<CTransactionRef> vChainRoots, vChainTips, vFanRoots, vFanSweeps;
+    for (int n = 0; n < N_PACKAGES; n++) {
+        CMutableTransaction tx = TraversalTx(std::vector<COutPoint>(1, COutPoint(ArithToUint256(arith_uint256(2 * n + 1)), 0)), 1);
+        vChainRoots.push_back(MakeTransactionRef(tx));
+        pool.addUnchecked(tx.GetHash(), entry.Fee(1000).FromTx(tx));
+        for (int i = 1; i < CHAIN_LENGTH; i++) {
+            tx = TraversalTx(std::vector<COutPoint>(1, COutPoint(tx.GetHash(), 0)), 1);
+            pool.addUnchecked(tx.GetHash(), entry.Fee(1000 + i).FromTx(tx));
+        }
+        vChainTips.push_back(MakeTransactionRef(tx));
+
+        CMutableTransaction txFan = TraversalTx(std::vector<COutPoint>(1, COutPoint(ArithToUint256(arith_uint256(2 * n + 2)), 0)), FAN_OUT);
+        vFanRoots.push_back(MakeTransactionRef(txFan));
+        pool.addUnchecked(txFan.GetHash(), entry.Fee(1000).FromTx(txFan));
+        std::vector<COutPoint> vSweep;
+        for (int i = 0; i < FAN_OUT; i++) {
+            CMutableTransaction txChild = TraversalTx(std::vector<COutPoint>(1, COutPoint(txFan.GetHash(), i)), 1);
+            pool.addUnchecked(txChild.GetHash(), entry.Fee(2000).FromTx(txChild));
+            vSweep.push_back(COutPoint(txChild.GetHash(), 0));
+        }
+        CMutableTransaction txSweep = TraversalTx(vSweep, 1);
+        vFanSweeps.push_back(MakeTransactionRef(txSweep));
+        pool.addUnchecked(txSweep.GetHash(), entry.Fee(5000).FromTx(txSweep));
+    }
+    const size_t nPoolSize = pool.size();
+    BOOST_CHECK_EQUAL(nPoolSize, (size_t)N_PACKAGES * (CHAIN_LENGTH + FAN_OUT + 2));
+
+    CTxMemPool::txiter tip = pool.mapTx.find(vChainTips[0]->GetHash());
+    BOOST_CHECK_EQUAL(tip->GetCountWithAncestors(), (uint64_t)CHAIN_LENGTH);
+    CTxMemPool::txiter sweep = pool.mapTx.find(vFanSweeps[0]->GetHash());
+    BOOST_CHECK_EQUAL(sweep->GetCountWithAncestors(), (uint64_t)FAN_OUT + 2);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(vFanRoots[0]->GetHash())->GetCountWithDescendants(), (uint64_t)FAN_OUT + 2);
+
+    // Every entry is visited once per walk, however many paths lead to it:
+    // the sweep reaches the fan root through each of its FAN_OUT parents.
+    CTxMemPool::vecEntries vAncestors;
+    pool.CalculateMemPoolAncestors(*sweep, vAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+    BOOST_CHECK_EQUAL(vAncestors.size(), (size_t)FAN_OUT + 1);
+    BOOST_CHECK_EQUAL(CTxMemPool::setEntries(vAncestors.begin(), vAncestors.end()).size(), vAncestors.size());
+    BOOST_CHECK(std::find(vAncestors.begin(), vAncestors.end(), pool.mapTx.find(vFanRoots[0]->GetHash())) != vAncestors.end());
+    BOOST_CHECK(std::find(vAncestors.begin(), vAncestors.end(), sweep) == vAncestors.end());
+
+    // Ancestors of every entry
+    size_t nAncestors = 0;
+    for (CTxMemPool::txiter it = pool.mapTx.begin(); it != pool.mapTx.end(); it++) {
+        pool.CalculateMemPoolAncestors(*it, vAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        BOOST_CHECK_EQUAL(vAncestors.size() + 1, it->GetCountWithAncestors());
+        nAncestors += vAncestors.size() + 1;
+    }
+    BOOST_CHECK_EQUAL(nAncestors, (size_t)N_PACKAGES * (CHAIN_LENGTH * (CHAIN_LENGTH + 1) / 2 + 1 + 2 * FAN_OUT + FAN_OUT + 2));
+
+    // Descendants of every package root, which include the root
+    size_t nDescendants = 0;
+    CTxMemPool::vecEntries vDescendants;
+    for (int n = 0; n < N_PACKAGES; n++) {
+        pool.CalculateDescendants(pool.mapTx.find(vChainRoots[n]->GetHash()), vDescendants);
+        BOOST_CHECK_EQUAL(vDescendants.size(), (size_t)CHAIN_LENGTH);
+        nDescendants += vDescendants.size();
+        pool.CalculateDescendants(pool.mapTx.find(vFanRoots[n]->GetHash()), vDescendants);
+        BOOST_CHECK_EQUAL(CTxMemPool::setEntries(vDescendants.begin(), vDescendants.end()).size(), (size_t)FAN_OUT + 2);
+        nDescendants += vDescendants.size();
+    }
+    BOOST_CHECK_EQUAL(nDescendants, nPoolSize);
+
+    // Confirm the chain roots, which updates all their descendants, then
+    // evict the fans with their descendants.
+    pool.removeForBlock(vChainRoots, 1);
+    BOOST_CHECK_EQUAL(pool.size(), nPoolSize - N_PACKAGES);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(vChainTips[0]->GetHash())->GetCountWithAncestors(), (uint64_t)CHAIN_LENGTH - 1);
+    for (int n = 0; n < N_PACKAGES; n++)
+        pool.removeRecursive(*vFanRoots[n]);
+    BOOST_CHECK_EQUAL(pool.size(), (size_t)N_PACKAGES * (CHAIN_LENGTH - 1));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
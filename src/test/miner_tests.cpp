@@ -9,6 +9,7 @@
 #include "consensus/validation.h"
 #include "main.h"
 #include "miner.h"
+#include "pow.h"
 #include "pubkey.h"
 #include "script/standard.h"
 #include "txmempool.h"
@@ -179,6 +180,102 @@ void TestPackageSelection(const CChainParams& chainparams, CScript scriptPubKey,
     BOOST_CHECK(pblocktemplate->block.vtx[8]->GetHash() == hashLowFeeTx2);
 }
 
+// Test that the block template cache follows the mempool between assemblies.
+// Like TestPackageSelection it reuses the chain of CreateNewBlock_validity.
+void TestBlockTemplateCache(const CChainParams& chainparams, CScript scriptPubKey, std::vector<CTransactionRef>& txFirst)
+{
+    TestMemPoolEntryHelper entry;
+    SetMockTime(GetTime());
+    CBlockTemplateCache cache(chainparams, 60);
+    std::unique_ptr<CBlockTemplate> pblocktemplate = cache.Get(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+    const CAmount nSubsidy = GetBlockSubsidy(chainActive.Height() + 1, chainparams.GetConsensus());
+
+    // A transaction and its child are appended as they come
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vin[0].prevout.hash = txFirst[0]->GetHash();
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 5000000000LL - 10000;
+    CTransaction txParent(tx);
+    mempool.addUnchecked(txParent.GetHash(), entry.Fee(10000).Time(GetTime()).SpendsCoinbase(true).FromTx(tx));
+    tx.vin[0].prevout.hash = txParent.GetHash();
+    tx.vout[0].nValue = 5000000000LL - 10000 - 20000;
+    CTransaction txChild(tx);
+    mempool.addUnchecked(txChild.GetHash(), entry.Fee(20000).Time(GetTime()).FromTx(tx));
+
+    pblocktemplate = cache.Get(scriptPubKey);
+    BOOST_CHECK_EQUAL(cache.GetAppendedCount(), 2);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == txParent.GetHash());
+    BOOST_CHECK(pblocktemplate->block.vtx[2]->GetHash() == txChild.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -30000);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0]->GetValueOut(), nSubsidy + 30000);
+    pblocktemplate->block.hashMerkleRoot = BlockMerkleRoot(pblocktemplate->block);
+    CValidationState state;
+    BOOST_CHECK(TestBlockValidity(state, chainparams, pblocktemplate->block, chainActive.Tip(), false, false));
+
+    // Both leave the template when the parent leaves the mempool
+    mempool.removeRecursive(txParent);
+    pblocktemplate = cache.Get(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0]->GetValueOut(), nSubsidy);
+
+    // A free transaction isn't appended, nor is a child paying for it, until
+    // the template has lagged long enough to be assembled anew
+    tx.vin[0].prevout.hash = txFirst[1]->GetHash();
+    tx.vout[0].nValue = 5000000000LL;
+    CTransaction txFree(tx);
+    mempool.addUnchecked(txFree.GetHash(), entry.Fee(0).Time(GetTime()).SpendsCoinbase(true).FromTx(tx));
+    tx.vin[0].prevout.hash = txFree.GetHash();
+    tx.vout[0].nValue = 5000000000LL - 50000;
+    mempool.addUnchecked(tx.GetHash(), entry.Fee(50000).Time(GetTime()).FromTx(tx));
+    pblocktemplate = cache.Get(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+    SetMockTime(GetTime() + 59);
+    BOOST_CHECK_EQUAL(cache.Get(scriptPubKey)->block.vtx.size(), 1);
+    SetMockTime(GetTime() + 1);
+    pblocktemplate = cache.Get(scriptPubKey);
+    BOOST_CHECK_EQUAL(cache.GetAppendedCount(), 0);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == txFree.GetHash());
+    BOOST_CHECK(pblocktemplate->block.vtx[2]->GetHash() == tx.GetHash());
+
+    // A free transaction that could never be mined on its own doesn't make
+    // the template lag when others leave it
+    tx.vin[0].prevout.hash = txFirst[2]->GetHash();
+    tx.vout[0].nValue = 5000000000LL;
+    mempool.addUnchecked(tx.GetHash(), entry.Fee(0).Time(GetTime()).SpendsCoinbase(true).FromTx(tx));
+    mempool.removeRecursive(txFree);
+    tx.vin[0].prevout.hash = txFirst[3]->GetHash();
+    tx.vout[0].nValue = 5000000000LL - 10000;
+    mempool.addUnchecked(tx.GetHash(), entry.Fee(10000).Time(GetTime()).SpendsCoinbase(true).FromTx(tx));
+    SetMockTime(GetTime() + 60);
+    pblocktemplate = cache.Get(scriptPubKey);
+    BOOST_CHECK_EQUAL(cache.GetAppendedCount(), 1);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+
+    // Prioritising a transaction that was left out for its fee takes it into
+    // the next template, without waiting for the template to lag
+    tx.vin[0].prevout.hash = txFirst[0]->GetHash();
+    tx.vout[0].nValue = 5000000000LL;
+    uint256 hashPrioritised = tx.GetHash();
+    mempool.addUnchecked(hashPrioritised, entry.Fee(0).Time(GetTime()).SpendsCoinbase(true).FromTx(tx));
+    pblocktemplate = cache.Get(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    mempool.PrioritiseTransaction(hashPrioritised, hashPrioritised.ToString(), 0.0, 100000);
+    pblocktemplate = cache.Get(scriptPubKey);
+    BOOST_CHECK_EQUAL(cache.GetAppendedCount(), 0);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == hashPrioritised);
+    mempool.ClearPrioritisation(hashPrioritised);
+
+    SetMockTime(0);
+    mempool.clear();
+}
+
 // NOTE: These tests rely on CreateNewBlock doing its own self-validation!
 BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 {
@@ -485,8 +582,47 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     mempool.clear();
 
     TestPackageSelection(chainparams, scriptPubKey, txFirst);
+    mempool.clear();
+
+    TestBlockTemplateCache(chainparams, scriptPubKey, txFirst);
 
     fCheckpointsEnabled = true;
 }
 
+BOOST_AUTO_TEST_CASE(GrindBlockNonce_threads)
+{
+    // About one hash in 4096 meets this target, so the search outlasts the
+    // nonces tried before starting threads
+    const Consensus::Params& params = Params(CBaseChainParams::REGTEST).GetConsensus();
+    CBlockHeader header;
+    header.nVersion = 4;
+    header.nTime = 1500000000;
+    header.nBits = 0x1f0fffff;
+
+    CBlockHeader serial(header);
+    uint64_t nMaxTries = 1000000;
+    BOOST_CHECK(GrindBlockNonce(serial, params, 0x100000, nMaxTries, 1));
+    BOOST_CHECK(CheckProofOfWork(serial.GetHash(), serial.nBits, params));
+    BOOST_CHECK_EQUAL(nMaxTries, 1000000 - serial.nNonce);
+    BOOST_CHECK(serial.nNonce > GRIND_SERIAL_TRIES);
+
+    // Threads find the same nonce, the lowest
+    CBlockHeader parallel(header);
+    nMaxTries = 1000000;
+    BOOST_CHECK(GrindBlockNonce(parallel, params, 0x100000, nMaxTries, 4));
+    BOOST_CHECK_EQUAL(parallel.nNonce, serial.nNonce);
+    BOOST_CHECK_EQUAL(nMaxTries, 1000000 - serial.nNonce);
+
+    // Running out of tries or nonces just short of it
+    parallel = header;
+    nMaxTries = serial.nNonce;
+    BOOST_CHECK(!GrindBlockNonce(parallel, params, 0x100000, nMaxTries, 4));
+    BOOST_CHECK_EQUAL(nMaxTries, 0);
+    BOOST_CHECK_EQUAL(parallel.nNonce, serial.nNonce);
+    parallel = header;
+    nMaxTries = 1000000;
+    BOOST_CHECK(!GrindBlockNonce(parallel, params, serial.nNonce, nMaxTries, 4));
+    BOOST_CHECK_EQUAL(nMaxTries, 1000000 - serial.nNonce);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
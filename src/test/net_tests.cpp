@@ -4,6 +4,7 @@
 #include "addrman.h"
 #include "test/test_bitcoin.h"
 #include <string>
+#include <boost/filesystem/operations.hpp>
 #include <boost/test/unit_test.hpp>
 #include "hash.h"
 #include "serialize.h"
@@ -11,6 +12,8 @@
 #include "net.h"
 #include "netbase.h"
 #include "chainparams.h"
+#include "test/test_random.h"
+#include "test/testutil.h"
 
 using namespace std;
 
@@ -174,4 +177,557 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+static CDataStream MakeMessageHeader(const char* pszCommand, const std::vector<unsigned char>& vPayload)
+{
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, vPayload.size());
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    CDataStream ssHeader(SER_NETWORK, INIT_PROTO_VERSION);
+    ssHeader << hdr;
+    return ssHeader;
+}
+
+BOOST_AUTO_TEST_CASE(cnode_receive_in_place)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, 0, "", false);
+    LOCK(node.cs_vRecvMsg);
+
+    std::vector<unsigned char> vPayload(100000);
+    for (size_t i = 0; i < vPayload.size(); i++)
+        vPayload[i] = (unsigned char)(i * 13);
+
+    // The header and the start of the payload arrive through the regular path.
+    CDataStream ssFirst = MakeMessageHeader(NetMsgType::BLOCK, vPayload);
+    ssFirst.write((const char*)vPayload.data(), 1000);
+    bool complete = false;
+    BOOST_CHECK(node.ReceiveMsgBytes(&ssFirst[0], ssFirst.size(), complete));
+    BOOST_CHECK(!complete);
+
+    // Most of the rest is written straight into the message's storage.
+    size_t nPos = 1000;
+    unsigned int nSpace = 0;
+    char* pch;
+    while ((pch = node.GetRecvPayloadBuffer(nSpace)) != NULL) {
+        BOOST_CHECK(nSpace > 0);
+        unsigned int nCopy = std::min<size_t>(std::min<unsigned int>(nSpace, 30000), vPayload.size() - nPos);
+        memcpy(pch, &vPayload[nPos], nCopy);
+        node.ReceivedPayloadBytes(nCopy, complete);
+        nPos += nCopy;
+    }
+    BOOST_CHECK(nPos > 1000);
+    if (nPos < vPayload.size()) {
+        BOOST_CHECK(!complete);
+        BOOST_CHECK(node.ReceiveMsgBytes((const char*)&vPayload[nPos], vPayload.size() - nPos, complete));
+    }
+    BOOST_CHECK(complete);
+
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    const CNetMessage& msg = node.vRecvMsg.front();
+    BOOST_CHECK(msg.complete());
+    BOOST_CHECK(msg.GetMessageHash() == Hash(vPayload.begin(), vPayload.end()));
+    BOOST_REQUIRE_EQUAL(msg.vRecv.size(), vPayload.size());
+    BOOST_CHECK(memcmp(&msg.vRecv[0], vPayload.data(), vPayload.size()) == 0);
+
+    // Storage too large for the pool is not kept.
+    node.ReleaseRecvMsgs(node.vRecvMsg.end());
+    BOOST_CHECK(node.vRecvMsg.empty());
+    BOOST_CHECK(node.vRecvBufferPool.empty());
+
+    // Small payload buffers are handed on to the next message.
+    std::vector<unsigned char> vPing(8, 0x42);
+    CDataStream ssPing = MakeMessageHeader(NetMsgType::PING, vPing);
+    ssPing.write((const char*)vPing.data(), vPing.size());
+    BOOST_CHECK(node.ReceiveMsgBytes(&ssPing[0], ssPing.size(), complete));
+    BOOST_CHECK(complete);
+    BOOST_CHECK(node.GetRecvPayloadBuffer(nSpace) == NULL);
+    node.ReleaseRecvMsgs(node.vRecvMsg.end());
+    BOOST_CHECK_EQUAL(node.vRecvBufferPool.size(), 1U);
+
+    BOOST_CHECK(node.ReceiveMsgBytes(&ssPing[0], ssPing.size(), complete));
+    BOOST_CHECK(complete);
+    BOOST_CHECK(node.vRecvBufferPool.empty());
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    BOOST_CHECK(node.vRecvMsg.front().GetMessageHash() == Hash(vPing.begin(), vPing.end()));
+}
+
+BOOST_AUTO_TEST_CASE(token_bucket)
+{
+    CTokenBucket bucket;
+    BOOST_CHECK(bucket.MaySend(0, 1000000));
+    bucket.Consume(1000000);
+    BOOST_CHECK(bucket.MaySend(0, 1000000));
+
+    bucket.SetRate(1000);
+    int64_t nTime = 1000000;
+    BOOST_CHECK(bucket.MaySend(nTime, 600));
+    bucket.Consume(600);
+    // Sending waits until the bucket holds the bytes to send.
+    BOOST_CHECK(!bucket.MaySend(nTime, 600));
+    BOOST_CHECK(bucket.MaySend(nTime, 400));
+    BOOST_CHECK(bucket.MaySend(nTime + 200000, 600));
+    // A message larger than the bucket goes out once it is full, leaving a debt.
+    BOOST_CHECK(!bucket.MaySend(nTime + 200000, 5000));
+    BOOST_CHECK(bucket.MaySend(nTime + 800000, 5000));
+    bucket.Consume(5000);
+    BOOST_CHECK(!bucket.MaySend(nTime + 800000, 1));
+    BOOST_CHECK(!bucket.MaySend(nTime + 4800000, 1));
+    BOOST_CHECK(bucket.MaySend(nTime + 4900000, 100));
+    BOOST_CHECK(!bucket.MaySend(nTime + 4900000, 101));
+    // Idle time refills at most one second worth.
+    BOOST_CHECK(bucket.MaySend(nTime + 100000000, 1000));
+    bucket.Consume(1000);
+    BOOST_CHECK(!bucket.MaySend(nTime + 100000000, 1));
+}
+
+static void QueueTestMsg(CNode& node, SendPriority nPriority, size_t nSize, bool fShaped = false)
+{
+    std::vector<unsigned char> vHeader(CMessageHeader::HEADER_SIZE), vPayload(nSize);
+    node.nSendSize += vHeader.size() + vPayload.size();
+    node.nSendQueueSize[nPriority] += vHeader.size() + vPayload.size();
+    node.vSendQueue[nPriority].emplace_back();
+    node.vSendQueue[nPriority].back().fShaped = fShaped;
+    node.vSendQueue[nPriority].back().vBuffers.push_back(std::move(vHeader));
+    node.vSendQueue[nPriority].back().vBuffers.push_back(std::move(vPayload));
+}
+
+BOOST_AUTO_TEST_CASE(upload_shaper)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, 0, "", false);
+    LOCK(node.cs_vSend);
+
+    // 10 kB/s per peer and 1 kB/s for transaction relay.
+    CUploadShaper shaper;
+    uint64_t vClassRate[SEND_PRIORITY_COUNT] = {};
+    vClassRate[SEND_PRIORITY_TX] = 1000;
+    shaper.SetRates(0, 10000, vClassRate);
+
+    QueueTestMsg(node, SEND_PRIORITY_TX, 3000);
+    QueueTestMsg(node, SEND_PRIORITY_TX, 100);
+    QueueTestMsg(node, SEND_PRIORITY_BLOCK, 9000);
+    QueueTestMsg(node, SEND_PRIORITY_BLOCK, 100);
+
+    // The first transaction overdraws the full tx class, and leaves the peer
+    // too few tokens for the block.
+    BOOST_CHECK(node.FillSendMsg(&shaper));
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 2U);
+    BOOST_CHECK_EQUAL(node.vSendQueue[SEND_PRIORITY_TX].size(), 1U);
+    BOOST_CHECK_EQUAL(node.vSendQueue[SEND_PRIORITY_BLOCK].size(), 2U);
+    node.vSendMsg.clear();
+    BOOST_CHECK(!node.FillSendMsg(&shaper));
+
+    // Announcements go out regardless, and count.
+    QueueTestMsg(node, SEND_PRIORITY_ANNOUNCE, 100);
+    BOOST_CHECK(node.FillSendMsg(&shaper));
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 2U);
+    BOOST_CHECK_EQUAL(node.nSendQueueSize[SEND_PRIORITY_TX], 100 + CMessageHeader::HEADER_SIZE);
+    BOOST_CHECK_EQUAL(node.GetSendSize(SEND_PRIORITY_ANNOUNCE), node.nSendSize - (9200 + 3 * CMessageHeader::HEADER_SIZE));
+
+    // A full block sent with them is held back like the block class, but
+    // the announcements behind it still go out, ahead of later full blocks.
+    node.vSendMsg.clear();
+    QueueTestMsg(node, SEND_PRIORITY_ANNOUNCE, 9000, true);
+    QueueTestMsg(node, SEND_PRIORITY_ANNOUNCE, 100);
+    QueueTestMsg(node, SEND_PRIORITY_ANNOUNCE, 10, true);
+    BOOST_CHECK(node.FillSendMsg(&shaper));
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 2U);
+    BOOST_CHECK_EQUAL(node.vSendMsg[1].size(), 100U);
+    BOOST_CHECK_EQUAL(node.vSendQueue[SEND_PRIORITY_ANNOUNCE].size(), 2U);
+    BOOST_CHECK_EQUAL(node.vSendQueue[SEND_PRIORITY_ANNOUNCE].front().vBuffers[1].size(), 9000U);
+
+    // Without limits everything is handed over, in order.
+    node.vSendMsg.clear();
+    BOOST_CHECK(node.FillSendMsg());
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 10U);
+    BOOST_CHECK_EQUAL(node.vSendMsg[1].size(), 9000U);
+    BOOST_CHECK_EQUAL(node.vSendMsg[3].size(), 10U);
+    for (int i = 0; i < SEND_PRIORITY_COUNT; i++)
+        BOOST_CHECK(node.vSendQueue[i].empty());
+}
+
+BOOST_AUTO_TEST_CASE(send_queue_batch)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, 0, "", false);
+    LOCK(node.cs_vSend);
+
+    // A merkleblock and its transactions, larger together than the send
+    // window, go out in one piece.
+    QueueTestMsg(node, SEND_PRIORITY_BLOCK, 40000);
+    std::vector<std::vector<unsigned char>>& vBatch = node.vSendQueue[SEND_PRIORITY_BLOCK].back().vBuffers;
+    for (int i = 0; i < 2; i++) {
+        vBatch.push_back(std::vector<unsigned char>(CMessageHeader::HEADER_SIZE));
+        vBatch.push_back(std::vector<unsigned char>(40000));
+        node.nSendSize += CMessageHeader::HEADER_SIZE + 40000;
+        node.nSendQueueSize[SEND_PRIORITY_BLOCK] += CMessageHeader::HEADER_SIZE + 40000;
+    }
+    QueueTestMsg(node, SEND_PRIORITY_BLOCK, 100);
+    BOOST_CHECK(node.FillSendMsg());
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 6U);
+    BOOST_CHECK_EQUAL(node.vSendQueue[SEND_PRIORITY_BLOCK].size(), 1U);
+
+    // An announcement queued meanwhile comes after all of it, and before
+    // what was queued behind it.
+    QueueTestMsg(node, SEND_PRIORITY_ANNOUNCE, 50);
+    BOOST_CHECK(node.FillSendMsg());
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 10U);
+    BOOST_CHECK_EQUAL(node.vSendMsg[5].size(), 40000U);
+    BOOST_CHECK_EQUAL(node.vSendMsg[7].size(), 50U);
+    BOOST_CHECK_EQUAL(node.vSendMsg[9].size(), 100U);
+}
+
+#ifndef WIN32
+static void ReadAll(int fd, std::vector<unsigned char>& vRead)
+{
+    unsigned char buf[4096];
+    ssize_t nBytes;
+    while ((nBytes = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        vRead.insert(vRead.end(), buf, buf + nBytes);
+}
+
+BOOST_AUTO_TEST_CASE(socket_send_data_batches)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, fds[0], addr, 0, 0, "", false);
+
+    // More buffers than a single sendmsg() call takes.
+    std::vector<unsigned char> vExpected;
+    LOCK(node.cs_vSend);
+    for (int i = 0; i < 200; i++) {
+        std::vector<unsigned char> data(i + 1, (unsigned char)i);
+        vExpected.insert(vExpected.end(), data.begin(), data.end());
+        node.nSendSize += data.size();
+        node.vSendMsg.push_back(data);
+    }
+    BOOST_CHECK_EQUAL(SocketSendData(&node), vExpected.size());
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+
+    std::vector<unsigned char> vRead;
+    ReadAll(fds[1], vRead);
+    BOOST_CHECK(vRead == vExpected);
+
+    // A buffer larger than the socket can take is sent in pieces, resuming
+    // at the right offset and continuing with the buffers behind it.
+    vExpected.clear();
+    vRead.clear();
+    for (int i = 0; i < 3; i++) {
+        std::vector<unsigned char> data(i == 0 ? 4 * 1024 * 1024 : 100);
+        for (size_t j = 0; j < data.size(); j++)
+            data[j] = (unsigned char)(j * 7 + i);
+        vExpected.insert(vExpected.end(), data.begin(), data.end());
+        node.nSendSize += data.size();
+        node.vSendMsg.push_back(data);
+    }
+    size_t nSent = SocketSendData(&node);
+    BOOST_CHECK(nSent > 0);
+    BOOST_CHECK(nSent < vExpected.size());
+    BOOST_CHECK_EQUAL(node.nSendOffset, nSent);
+    // nSendSize only drops once a buffer has been sent completely
+    BOOST_CHECK_EQUAL(node.nSendSize, vExpected.size());
+
+    while (!node.vSendMsg.empty()) {
+        ReadAll(fds[1], vRead);
+        SocketSendData(&node);
+    }
+    ReadAll(fds[1], vRead);
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK_EQUAL(node.nSendBytes, vRead.size() + 200 * 201 / 2);
+    BOOST_CHECK(vRead == vExpected);
+
+    close(fds[1]);
+}
+
+static CSerializedNetMsg MakeTestMsg(const char* pszCommand, size_t nSize)
+{
+    CSerializedNetMsg msg;
+    msg.command = pszCommand;
+    msg.data.assign(nSize, 0x55);
+    return msg;
+}
+
+BOOST_AUTO_TEST_CASE(send_queue_priorities)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, fds[0], addr, 0, 0, "", false);
+    CConnman connman(0x1337, 0x1337);
+    const size_t nHeader = CMessageHeader::HEADER_SIZE;
+
+    // A large historical block fills the socket; everything after it queues.
+    connman.PushMessage(&node, MakeTestMsg(NetMsgType::BLOCK, 2000000));
+    BOOST_CHECK(node.nSendBytes > 0);
+    BOOST_CHECK(node.nSendSize > 0);
+    connman.PushMessage(&node, MakeTestMsg(NetMsgType::BLOCK, 1000));
+    connman.PushMessage(&node, MakeTestMsg(NetMsgType::TX, 200));
+    connman.PushMessage(&node, MakeTestMsg(NetMsgType::BLOCKTXN, 300));
+    connman.PushMessage(&node, MakeTestMsg(NetMsgType::HEADERS, 100));
+    connman.PushMessage(&node, MakeTestMsg(NetMsgType::BLOCK, 400), SEND_PRIORITY_ANNOUNCE);
+
+    BOOST_CHECK_EQUAL(node.nSendQueueSize[SEND_PRIORITY_ANNOUNCE], 500 + 2 * nHeader);
+    BOOST_CHECK_EQUAL(node.nSendQueueSize[SEND_PRIORITY_BLOCKTXN], 300 + nHeader);
+    BOOST_CHECK_EQUAL(node.nSendQueueSize[SEND_PRIORITY_TX], 200 + nHeader);
+    BOOST_CHECK_EQUAL(node.nSendQueueSize[SEND_PRIORITY_BLOCK], 1000 + nHeader);
+    BOOST_CHECK_EQUAL(node.GetSendSize(SEND_PRIORITY_BLOCK), node.nSendSize);
+    BOOST_CHECK_EQUAL(node.GetSendSize(SEND_PRIORITY_TX), node.nSendSize - 1000 - nHeader);
+    BOOST_CHECK_EQUAL(node.GetSendSize(SEND_PRIORITY_ANNOUNCE), node.nSendSize - 1500 - 3 * nHeader);
+
+    std::vector<unsigned char> vRead;
+    while (node.nSendSize > 0) {
+        ReadAll(fds[1], vRead);
+        LOCK(node.cs_vSend);
+        SocketSendData(&node);
+    }
+    ReadAll(fds[1], vRead);
+    for (int i = 0; i < SEND_PRIORITY_COUNT; i++)
+        BOOST_CHECK_EQUAL(node.nSendQueueSize[i], 0U);
+
+    // The block being sent is finished first, then the rest goes by class.
+    std::vector<std::pair<std::string, unsigned int>> vExpected = {
+        {NetMsgType::BLOCK, 2000000}, {NetMsgType::HEADERS, 100}, {NetMsgType::BLOCK, 400},
+        {NetMsgType::BLOCKTXN, 300}, {NetMsgType::TX, 200}, {NetMsgType::BLOCK, 1000}};
+    std::vector<std::pair<std::string, unsigned int>> vReceived;
+    CDataStream ss(vRead, SER_NETWORK, INIT_PROTO_VERSION);
+    while (!ss.empty()) {
+        CMessageHeader hdr(Params().MessageStart());
+        ss >> hdr;
+        vReceived.emplace_back(hdr.GetCommand(), hdr.nMessageSize);
+        ss.ignore(hdr.nMessageSize);
+    }
+    BOOST_CHECK(vReceived == vExpected);
+
+    close(fds[1]);
+}
+
+BOOST_AUTO_TEST_CASE(send_queue_pong)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, fds[0], addr, 0, 0, "", false);
+    CConnman connman(0x1337, 0x1337);
+
+    // Replies to a getdata, then a pong for the ping that followed it.
+    connman.PushMessage(&node, MakeTestMsg(NetMsgType::BLOCK, 2000000));
+    BOOST_CHECK(node.nSendSize > 0);
+    connman.PushMessage(&node, MakeTestMsg(NetMsgType::MERKLEBLOCK, 500));
+    connman.PushMessage(&node, MakeTestMsg(NetMsgType::TX, 200));
+    connman.PushMessage(&node, MakeTestMsg(NetMsgType::PONG, 8));
+    connman.PushMessage(&node, MakeTestMsg(NetMsgType::HEADERS, 100));
+    BOOST_CHECK_EQUAL(node.vSendQueue[SEND_PRIORITY_BLOCK].size(), 2U);
+
+    std::vector<unsigned char> vRead;
+    while (node.nSendSize > 0) {
+        ReadAll(fds[1], vRead);
+        LOCK(node.cs_vSend);
+        SocketSendData(&node);
+    }
+    ReadAll(fds[1], vRead);
+
+    // The pong comes after all the replies; a later announcement doesn't wait.
+    std::vector<std::string> vExpected = {
+        NetMsgType::BLOCK, NetMsgType::HEADERS, NetMsgType::TX, NetMsgType::MERKLEBLOCK, NetMsgType::PONG};
+    std::vector<std::string> vReceived;
+    CDataStream ss(vRead, SER_NETWORK, INIT_PROTO_VERSION);
+    while (!ss.empty()) {
+        CMessageHeader hdr(Params().MessageStart());
+        ss >> hdr;
+        vReceived.push_back(hdr.GetCommand());
+        ss.ignore(hdr.nMessageSize);
+    }
+    BOOST_CHECK(vReceived == vExpected);
+
+    // With nothing queued, a pong goes out with the announcements.
+    {
+        LOCK(node.cs_vSend);
+        BOOST_CHECK_EQUAL(node.GetBarrierSendPriority(SEND_PRIORITY_ANNOUNCE), SEND_PRIORITY_ANNOUNCE);
+    }
+
+    close(fds[1]);
+}
+#endif
+
+static CNetAddr RandomBanTestAddress()
+{
+    // Few distinct leading bits, so that subnets overlap
+    uint8_t ip[16];
+    for (int i = 0; i < 16; i++)
+        ip[i] = insecure_rand();
+    CNetAddr addr;
+    if (insecure_rand() % 2) {
+        ip[0] = 10 + ip[0] % 2;
+        addr.SetRaw(NET_IPV4, ip);
+    } else {
+        ip[0] = 0x20;
+        ip[1] = 0x01 + ip[1] % 2;
+        addr.SetRaw(NET_IPV6, ip);
+    }
+    return addr;
+}
+
+BOOST_AUTO_TEST_CASE(ban_trie)
+{
+    CSubNet subNet;
+    BOOST_CHECK(LookupSubNet("1.2.3.0/24", subNet));
+    BOOST_CHECK_EQUAL(subNet.GetPrefixLength(), 96 + 24);
+    BOOST_CHECK(LookupSubNet("2001:db8::/32", subNet));
+    BOOST_CHECK_EQUAL(subNet.GetPrefixLength(), 32);
+    BOOST_CHECK(LookupSubNet("1.2.3.4/255.0.255.0", subNet));
+    BOOST_CHECK_EQUAL(subNet.GetPrefixLength(), -1);
+
+    // The trie finds the same bans as matching every subnet
+    seed_insecure_rand(true);
+    CBanTrie trie;
+    std::vector<std::pair<CSubNet, int64_t> > vBans;
+    for (int i = 0; i < 2000; i++) {
+        CNetAddr addr = RandomBanTestAddress();
+        int nBits = addr.IsIPv4() ? 4 + insecure_rand() % 29 : 12 + insecure_rand() % 117;
+        vBans.push_back(std::make_pair(CSubNet(addr, nBits), 1 + insecure_rand() % 1000));
+    }
+    BOOST_CHECK(LookupSubNet("10.0.0.0/255.0.0.255", subNet));
+    vBans.push_back(std::make_pair(subNet, 2000));
+    for (size_t i = 0; i < vBans.size(); i++)
+        trie.Insert(vBans[i].first, vBans[i].second);
+
+    for (int i = 0; i < 5000; i++) {
+        CNetAddr addr = RandomBanTestAddress();
+        int64_t nExpected = 0;
+        for (size_t j = 0; j < vBans.size(); j++) {
+            if (vBans[j].first.Match(addr))
+                nExpected = std::max(nExpected, vBans[j].second);
+        }
+        BOOST_CHECK_EQUAL(trie.GetBanUntil(addr), nExpected);
+    }
+    BOOST_CHECK_EQUAL(trie.GetBanUntil(CNetAddr()), 0);
+
+    trie.Clear();
+    BOOST_CHECK_EQUAL(trie.GetNodeCount(), 1U);
+    BOOST_CHECK_EQUAL(trie.GetBanUntil(vBans[0].first.GetNetwork()), 0);
+}
+
+BOOST_AUTO_TEST_CASE(msg_metrics)
+{
+    CLogHistogram histogram;
+    histogram.Add(0);
+    histogram.Add(1);
+    histogram.Add(2);
+    histogram.Add(3);
+    histogram.Add(4);
+    histogram.Add(std::numeric_limits<uint64_t>::max());
+    BOOST_CHECK_EQUAL(histogram.vBuckets[0], 1U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[1], 1U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[2], 2U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[3], 1U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[CLogHistogram::BUCKETS - 1], 1U);
+    BOOST_CHECK_EQUAL(histogram.nCount, 6U);
+    BOOST_CHECK_EQUAL(histogram.nMax, std::numeric_limits<uint64_t>::max());
+
+    CPeerMsgMetrics peer1, peer2;
+    peer1.mapRecv["tx"].Add(250, 100, 40);
+    peer2.mapRecv["tx"].Add(300, -5, 0);
+    peer2.mapRecv["ping"].Add(8, 1, 0);
+    peer2.send.Add(0, 2000, 1500);
+    peer1.Add(peer2);
+    BOOST_CHECK_EQUAL(peer1.mapRecv.size(), 2U);
+    BOOST_CHECK_EQUAL(peer1.mapRecv["tx"].bytes.nSum, 550U);
+    BOOST_CHECK_EQUAL(peer1.mapRecv["tx"].handlerTime.nCount, 2U);
+    BOOST_CHECK_EQUAL(peer1.mapRecv["tx"].handlerTime.vBuckets[0], 1U);
+    BOOST_CHECK_EQUAL(peer1.mapRecv["tx"].mainLockTime.nMax, 40U);
+    BOOST_CHECK_EQUAL(peer1.send.mainLockTime.nSum, 1500U);
+
+    // Only the time a timed lock is held is counted
+    CCriticalSection csTimed(true), csUntimed;
+    int64_t nStart = GetLockHeldMicros();
+    {
+        LOCK(csUntimed);
+        MilliSleep(20);
+    }
+    BOOST_CHECK_EQUAL(GetLockHeldMicros(), nStart);
+    {
+        LOCK(csTimed);
+        {
+            LOCK(csTimed);
+            MilliSleep(10);
+        }
+        MilliSleep(10);
+        BOOST_CHECK(GetLockHeldMicros() - nStart >= 20000);
+    }
+    int64_t nHeld = GetLockHeldMicros() - nStart;
+    BOOST_CHECK(nHeld >= 20000);
+    MilliSleep(10);
+    BOOST_CHECK_EQUAL(GetLockHeldMicros() - nStart, nHeld);
+}
+
+BOOST_AUTO_TEST_CASE(capture_messages)
+{
+    boost::filesystem::path pathTemp = GetTempPath() / strprintf("test_bitcoin_capture_%lu_%i", (unsigned long)GetTime(), (int)GetRand(100000));
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    ClearDatadirCache();
+    fCaptureMessages = true;
+
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    std::vector<std::pair<std::string, std::vector<unsigned char>>> vSent;
+    vSent.push_back(std::make_pair(std::string(NetMsgType::VERACK), std::vector<unsigned char>()));
+    vSent.push_back(std::make_pair(std::string(NetMsgType::PING), std::vector<unsigned char>(8, 0x42)));
+    vSent.push_back(std::make_pair(std::string(NetMsgType::TX), std::vector<unsigned char>(5000, 0x17)));
+    {
+        CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, 0, "", true);
+        LOCK(node.cs_vRecvMsg);
+        for (size_t i = 0; i < vSent.size(); i++) {
+            CDataStream ssMsg = MakeMessageHeader(vSent[i].first.c_str(), vSent[i].second);
+            ssMsg.write((const char*)vSent[i].second.data(), vSent[i].second.size());
+            bool complete = false;
+            BOOST_CHECK(node.ReceiveMsgBytes(&ssMsg[0], ssMsg.size(), complete));
+            BOOST_CHECK(complete);
+        }
+    }
+    fCaptureMessages = DEFAULT_CAPTURE_MESSAGES;
+
+    // Messages come back in the order they were received, with their times
+    boost::filesystem::path pathCapture = pathTemp / "message_capture" / "1.192.176.160_7777" / "msgs_recv.dat";
+    std::vector<CCapturedMessage> vCaptured;
+    BOOST_CHECK(ReadCapturedMessages(pathCapture, vCaptured));
+    BOOST_REQUIRE_EQUAL(vCaptured.size(), vSent.size());
+    for (size_t i = 0; i < vSent.size(); i++) {
+        BOOST_CHECK_EQUAL(vCaptured[i].strCommand, vSent[i].first);
+        BOOST_CHECK(vCaptured[i].vPayload == vSent[i].second);
+        BOOST_CHECK(vCaptured[i].nTime > 0);
+        if (i > 0)
+            BOOST_CHECK(vCaptured[i].nTime >= vCaptured[i - 1].nTime);
+    }
+
+    // A partial message at the end, as left by a node that is still running, is skipped
+    boost::filesystem::resize_file(pathCapture, boost::filesystem::file_size(pathCapture) - 10);
+    BOOST_CHECK(ReadCapturedMessages(pathCapture, vCaptured));
+    BOOST_CHECK_EQUAL(vCaptured.size(), vSent.size() - 1);
+    BOOST_CHECK(!ReadCapturedMessages(pathTemp / "nonexistent.dat", vCaptured));
+
+    mapArgs.erase("-datadir");
+    ClearDatadirCache();
+    boost::filesystem::remove_all(pathTemp);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 
 #include "netbase.h"
 #include "test/test_bitcoin.h"
+#include "util.h"
 
 #include <string>
 
@@ -286,4 +287,46 @@ BOOST_AUTO_TEST_CASE(netbase_getgroup)
 
 }
 
+#ifdef USE_POLL
+BOOST_AUTO_TEST_CASE(netbase_connect_beyond_fd_setsize)
+{
+    // With epoll the connection count is not capped at FD_SETSIZE, so an
+    // outbound connect must work on a descriptor select() could not take
+    if (RaiseFileDescriptorLimit(FD_SETSIZE + 64) < FD_SETSIZE + 64) {
+        BOOST_TEST_MESSAGE("Skipping, not enough file descriptors available");
+        return;
+    }
+
+    SOCKET hListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListenSocket != INVALID_SOCKET);
+    struct sockaddr_in sockaddr = {};
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sockaddr);
+    BOOST_REQUIRE(bind(hListenSocket, (struct sockaddr*)&sockaddr, len) == 0);
+    BOOST_REQUIRE(listen(hListenSocket, 1) == 0);
+    BOOST_REQUIRE(getsockname(hListenSocket, (struct sockaddr*)&sockaddr, &len) == 0);
+    CService addrListen;
+    BOOST_REQUIRE(addrListen.SetSockAddr((struct sockaddr*)&sockaddr));
+
+    // Use up the descriptors below FD_SETSIZE
+    std::vector<int> vFill;
+    int fd;
+    while ((fd = dup(hListenSocket)) != -1 && fd < FD_SETSIZE)
+        vFill.push_back(fd);
+    BOOST_REQUIRE(fd != -1);
+    vFill.push_back(fd);
+
+    SOCKET hSocket = INVALID_SOCKET;
+    BOOST_CHECK(ConnectSocket(addrListen, hSocket, 5000));
+    BOOST_CHECK(hSocket != INVALID_SOCKET && !IsSelectableSocket(hSocket));
+    if (hSocket != INVALID_SOCKET)
+        CloseSocket(hSocket);
+
+    for (int fdFill : vFill)
+        close(fdFill);
+    CloseSocket(hListenSocket);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,8 +2,10 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "policy/policy.h"
 #include "policy/fees.h"
+#include "streams.h"
 #include "txmempool.h"
 #include "uint256.h"
 #include "util.h"
@@ -189,4 +191,77 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
 }
 
+//! Whether the answer table agrees with searching the stats, for every target
+static bool SameAsSearch(CBlockPolicyEstimator& estimator, const CTxMemPool& pool)
+{
+    for (unsigned int i = 0; i <= MAX_BLOCK_CONFIRMS + 1; i++) {
+        if (!(estimator.estimateFee(i) == estimator.estimateFeeSearch(i)))
+            return false;
+        int answerFound, answerFoundSearch;
+        if (!(estimator.estimateSmartFee(i, &answerFound, pool) == estimator.estimateSmartFeeSearch(i, &answerFoundSearch, pool)))
+            return false;
+        if (answerFound != answerFoundSearch)
+            return false;
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(BlockPolicyAnswerTable)
+{
+    CTxMemPool mpool(CFeeRate(1000));
+    CBlockPolicyEstimator estimator(CFeeRate(1000));
+    TestMemPoolEntryHelper entry;
+    entry.HadNoDependencies(true);
+    FastRandomContext rand(true);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0LL;
+
+    // Transactions that wait a random number of blocks, some of them leaving
+    // the mempool unconfirmed between blocks
+    std::vector<CTxMemPoolEntry> vMempool;
+    BOOST_CHECK(SameAsSearch(estimator, mpool));
+    for (unsigned int nHeight = 1; nHeight <= 300; nHeight++) {
+        for (int k = 0; k < 20; k++) {
+            tx.vin[0].prevout.n = 100 * nHeight + k;
+            CTxMemPoolEntry e = entry.Fee(1000 + rand.rand32() % 100000).Height(nHeight - 1).FromTx(tx);
+            estimator.processTransaction(e, true);
+            vMempool.push_back(e);
+        }
+        if (nHeight % 7 == 0) {
+            estimator.removeTx(vMempool.front().GetTx().GetHash());
+            vMempool.erase(vMempool.begin());
+            BOOST_CHECK(SameAsSearch(estimator, mpool));
+        }
+        // Confirm the higher feerate transactions more often
+        std::vector<CTxMemPoolEntry> vBlock, vStay;
+        BOOST_FOREACH(const CTxMemPoolEntry& e, vMempool) {
+            if (rand.rand32() % 200000 < (uint32_t)e.GetFee())
+                vBlock.push_back(e);
+            else
+                vStay.push_back(e);
+        }
+        BOOST_FOREACH(const CTxMemPoolEntry& e, vBlock)
+            estimator.removeTx(e.GetTx().GetHash());
+        estimator.processBlock(nHeight, vBlock, true);
+        vMempool.swap(vStay);
+        BOOST_CHECK(SameAsSearch(estimator, mpool));
+    }
+    BOOST_CHECK(estimator.estimateFee(MAX_BLOCK_CONFIRMS) > CFeeRate(0));
+
+    // The answers survive writing and reading the estimates, which leave out
+    // the transactions in the mempool
+    BOOST_FOREACH(const CTxMemPoolEntry& e, vMempool)
+        estimator.removeTx(e.GetTx().GetHash());
+    BOOST_CHECK(SameAsSearch(estimator, mpool));
+    CDataStream ssEstimates(SER_DISK, CLIENT_VERSION);
+    estimator.Write(ssEstimates);
+    CBlockPolicyEstimator estimatorRead(CFeeRate(1000));
+    estimatorRead.Read(ssEstimates, CLIENT_VERSION);
+    for (unsigned int i = 1; i <= MAX_BLOCK_CONFIRMS; i++)
+        BOOST_CHECK(estimatorRead.estimateFee(i) == estimator.estimateFee(i));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
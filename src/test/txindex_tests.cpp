@@ -0,0 +1,95 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "index/txindex.h"
+#include "main.h"
+#include "random.h"
+#include "script/standard.h"
+#include "test/test_bitcoin.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(txindex_tests)
+
+BOOST_FIXTURE_TEST_CASE(txindex_initial_sync, TestChain100Setup)
+{
+    TxIndex txindex(1 << 20, true);
+
+    CTransaction txDisk;
+    uint256 hashBlock;
+
+    // Transaction should not be found in the index before it is started.
+    for (const auto& txn : coinbaseTxns) {
+        BOOST_CHECK(!txindex.FindTx(txn.GetHash(), hashBlock, txDisk));
+    }
+
+    // The index should sync the existing chain in the background.
+    boost::thread_group indexThreads;
+    txindex.Start(indexThreads);
+
+    int64_t nTimeStart = GetTimeMillis();
+    while (!txindex.IsSynced()) {
+        BOOST_REQUIRE(nTimeStart + 10000 > GetTimeMillis());
+        MilliSleep(100);
+    }
+    indexThreads.join_all();
+    BOOST_CHECK_EQUAL(txindex.GetBestHeight(), chainActive.Height());
+
+    // Check that txindex has all txs that were in the chain before it started.
+    for (const auto& txn : coinbaseTxns) {
+        if (!txindex.FindTx(txn.GetHash(), hashBlock, txDisk)) {
+            BOOST_ERROR("FindTx failed");
+        } else if (txDisk.GetHash() != txn.GetHash()) {
+            BOOST_ERROR("Read incorrect tx");
+        }
+    }
+
+    // Check that new transactions in new blocks make it into the index.
+    for (int i = 0; i < 10; i++) {
+        CScript coinbaseScriptPubKey = GetScriptForRawPubKey(coinbaseKey.GetPubKey());
+        std::vector<CMutableTransaction> noTxns;
+        const CBlock& block = CreateAndProcessBlock(noTxns, coinbaseScriptPubKey);
+        const CTransaction& txn = *block.vtx[0];
+
+        BOOST_CHECK(txindex.IsSynced());
+        if (!txindex.FindTx(txn.GetHash(), hashBlock, txDisk)) {
+            BOOST_ERROR("FindTx failed");
+        } else if (txDisk.GetHash() != txn.GetHash()) {
+            BOOST_ERROR("Read incorrect tx");
+        } else {
+            BOOST_CHECK(hashBlock == block.GetHash());
+        }
+    }
+    BOOST_CHECK_EQUAL(txindex.GetBestHeight(), chainActive.Height());
+
+    txindex.Stop();
+}
+
+BOOST_FIXTURE_TEST_CASE(txindex_erase_legacy, BasicTestingSetup)
+{
+    CBlockTreeDB blocktree(1 << 20, true);
+    std::vector<uint256> vTxids;
+    for (int i = 0; i < 3; i++) {
+        vTxids.push_back(GetRandHash());
+        blocktree.Write(std::make_pair('t', vTxids.back()), CDiskTxPos());
+    }
+    blocktree.WriteFlag("txindex", true);
+    blocktree.WriteFlag("prunedblockfiles", false);
+
+    BOOST_CHECK(blocktree.EraseLegacyTxIndex());
+    for (const uint256& txid : vTxids) {
+        BOOST_CHECK(!blocktree.Exists(std::make_pair('t', txid)));
+    }
+    bool fValue;
+    BOOST_CHECK(!blocktree.ReadFlag("txindex", fValue));
+    BOOST_CHECK(blocktree.ReadFlag("prunedblockfiles", fValue));
+
+    // Nothing is left to erase afterwards
+    BOOST_CHECK(blocktree.EraseLegacyTxIndex());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,151 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txreconciliation.h"
+
+#include "clientversion.h"
+#include "random.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+#include "test/test_random.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txreconciliation_tests, BasicTestingSetup)
+
+// Sketch the two sets and check the difference decodes to exactly the ids only one side has
+static bool ReconcileIds(const std::vector<uint32_t>& vShared, const std::vector<uint32_t>& vOnlyA, const std::vector<uint32_t>& vOnlyB, size_t nCells)
+{
+    CReconSketch a(nCells), b(nCells);
+    for (uint32_t id : vShared) {
+        a.Add(id);
+        b.Add(id);
+    }
+    for (uint32_t id : vOnlyA)
+        a.Add(id);
+    for (uint32_t id : vOnlyB)
+        b.Add(id);
+    a.Subtract(b);
+
+    std::vector<uint32_t> vAdded, vSubtracted;
+    if (!a.Decode(vAdded, vSubtracted))
+        return false;
+    std::vector<uint32_t> vExpectA(vOnlyA), vExpectB(vOnlyB);
+    std::sort(vAdded.begin(), vAdded.end());
+    std::sort(vSubtracted.begin(), vSubtracted.end());
+    std::sort(vExpectA.begin(), vExpectA.end());
+    std::sort(vExpectB.begin(), vExpectB.end());
+    BOOST_CHECK(vAdded == vExpectA);
+    BOOST_CHECK(vSubtracted == vExpectB);
+    return true;
+}
+
+static std::vector<uint32_t> RandomIds(size_t n)
+{
+    std::vector<uint32_t> v;
+    for (size_t i = 0; i < n; i++)
+        v.push_back(insecure_rand());
+    return v;
+}
+
+BOOST_AUTO_TEST_CASE(sketch_decode)
+{
+    seed_insecure_rand(true);
+
+    // Identical sets leave nothing to decode
+    BOOST_CHECK(ReconcileIds(RandomIds(500), {}, {}, 30));
+
+    // Ample room for the difference
+    BOOST_CHECK(ReconcileIds(RandomIds(1000), RandomIds(10), RandomIds(15), 150));
+
+    // A difference much larger than the sketch can't be decoded
+    BOOST_CHECK(!ReconcileIds(RandomIds(100), RandomIds(100), RandomIds(100), 6));
+
+    // Sizing the sketch for the difference works nearly always
+    int nSuccess = 0;
+    for (int i = 0; i < 100; i++) {
+        size_t nOnlyA = insecure_rand() % 40, nOnlyB = insecure_rand() % 40;
+        if (ReconcileIds(RandomIds(200), RandomIds(nOnlyA), RandomIds(nOnlyB), CReconSketch::CellsForDifference(nOnlyA + nOnlyB)))
+            nSuccess++;
+    }
+    BOOST_CHECK(nSuccess >= 90);
+}
+
+BOOST_AUTO_TEST_CASE(sketch_size)
+{
+    BOOST_CHECK_EQUAL(CReconSketch(10).GetCells(), 12U);
+    BOOST_CHECK(CReconSketch(10).IsValid());
+    BOOST_CHECK(!CReconSketch().IsValid());
+    BOOST_CHECK(!CReconSketch(MAX_RECON_SKETCH_CELLS + 1).IsValid());
+    BOOST_CHECK_EQUAL(CReconSketch::CellsForDifference(1000000), MAX_RECON_SKETCH_CELLS);
+    for (size_t d = 0; d < 100; d++)
+        BOOST_CHECK(CReconSketch::CellsForDifference(d) % 3 == 0 && CReconSketch::CellsForDifference(d) > d);
+
+    // Sketches survive serialization
+    CReconSketch sketch(30);
+    for (uint32_t id : RandomIds(5))
+        sketch.Add(id);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << sketch;
+    CReconSketch sketch2;
+    ss >> sketch2;
+    BOOST_CHECK_EQUAL(sketch2.GetCells(), 30U);
+    std::vector<uint32_t> vAdded, vSubtracted;
+    BOOST_CHECK(sketch2.Decode(vAdded, vSubtracted));
+    BOOST_CHECK_EQUAL(vAdded.size(), 5U);
+    BOOST_CHECK(vSubtracted.empty());
+}
+
+BOOST_AUTO_TEST_CASE(short_ids)
+{
+    CTxReconciliationState a(1234), b(5678), c(9999);
+    a.Enable(true, 5678);
+    b.Enable(false, 1234);
+    c.Enable(false, 1234);
+    BOOST_CHECK(a.fInitiator && !b.fInitiator);
+
+    // Both ends of a connection agree on short ids, other connections don't
+    int nSameAsOther = 0;
+    for (int i = 0; i < 100; i++) {
+        uint256 txid = GetRandHash();
+        BOOST_CHECK_EQUAL(a.GetShortId(txid), b.GetShortId(txid));
+        if (a.GetShortId(txid) == c.GetShortId(txid))
+            nSameAsOther++;
+    }
+    BOOST_CHECK(nSameAsOther < 5);
+
+    // Reconcile whole states the way peers do
+    for (int i = 0; i < 300; i++) {
+        uint256 txid = GetRandHash();
+        a.setLocal.insert(txid);
+        b.setLocal.insert(txid);
+    }
+    std::vector<uint256> vOnlyA, vOnlyB;
+    for (int i = 0; i < 20; i++) {
+        vOnlyA.push_back(GetRandHash());
+        a.setLocal.insert(vOnlyA.back());
+    }
+    for (int i = 0; i < 7; i++) {
+        vOnlyB.push_back(GetRandHash());
+        b.setLocal.insert(vOnlyB.back());
+    }
+    size_t nCells = CReconSketch::CellsForDifference(EstimateReconDifference(b.setLocal.size(), a.setLocal.size()));
+    std::map<uint32_t, uint256> mapA, mapB;
+    CReconSketch sketchB = b.MakeSketch(nCells, mapB);
+    CReconSketch diff = a.MakeSketch(sketchB.GetCells(), mapA);
+    diff.Subtract(sketchB);
+    std::vector<uint32_t> vOurs, vTheirs;
+    BOOST_CHECK(diff.Decode(vOurs, vTheirs));
+    BOOST_CHECK_EQUAL(vOurs.size(), vOnlyA.size());
+    BOOST_CHECK_EQUAL(vTheirs.size(), vOnlyB.size());
+    for (uint32_t id : vOurs)
+        BOOST_CHECK(std::find(vOnlyA.begin(), vOnlyA.end(), mapA[id]) != vOnlyA.end());
+    for (uint32_t id : vTheirs)
+        BOOST_CHECK(std::find(vOnlyB.begin(), vOnlyB.end(), mapB[id]) != vOnlyB.end());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
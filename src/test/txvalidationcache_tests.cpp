@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "chainparams.h"
 #include "consensus/validation.h"
 #include "key.h"
 #include "main.h"
@@ -10,6 +11,7 @@
 #include "txmempool.h"
 #include "random.h"
 #include "script/standard.h"
+#include "streams.h"
 #include "test/test_bitcoin.h"
 #include "utiltime.h"
 
@@ -83,4 +85,180 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+BOOST_FIXTURE_TEST_CASE(mempool_dump_load, TestChain100Setup)
+{
+    // Transactions written by DumpMempool should come back with LoadMempool,
+    // along with their fee deltas, both when the tip is still the one their
+    // scripts were verified against and when it has moved on.
+
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // Mature two more coinbases
+    for (int i = 0; i < 2; i++)
+        CreateAndProcessBlock(std::vector<CMutableTransaction>(), scriptPubKey);
+
+    // Spends of three coinbases, and a child of the first one:
+    std::vector<CMutableTransaction> txs;
+    txs.resize(4);
+    for (int i = 0; i < 4; i++)
+    {
+        txs[i].vin.resize(1);
+        txs[i].vin[0].prevout.hash = i < 3 ? coinbaseTxns[i].GetHash() : txs[0].GetHash();
+        txs[i].vin[0].prevout.n = 0;
+        txs[i].vout.resize(1);
+        txs[i].vout[0].nValue = i < 3 ? 11*CENT : 10*CENT;
+        txs[i].vout[0].scriptPubKey = scriptPubKey;
+
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, txs[i], 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        txs[i].vin[0].scriptSig << vchSig;
+        BOOST_CHECK(ToMemPool(txs[i]));
+    }
+    double prioritydummy = 0;
+    mempool.PrioritiseTransaction(txs[3].GetHash(), txs[3].GetHash().ToString(), prioritydummy, 5000);
+
+    for (int nRound = 0; nRound < 2; nRound++)
+    {
+        DumpMempool();
+        mempool.clear();
+        {
+            LOCK(mempool.cs);
+            mempool.mapDeltas.clear();
+        }
+        if (nRound == 1) {
+            CreateAndProcessBlock(std::vector<CMutableTransaction>(), scriptPubKey);
+        }
+
+        BOOST_CHECK(LoadMempool());
+        BOOST_CHECK_EQUAL(mempool.size(), txs.size());
+        for (unsigned int i = 0; i < txs.size(); i++)
+            BOOST_CHECK(mempool.exists(txs[i].GetHash()));
+        CAmount nFeeDelta = 0;
+        mempool.ApplyDeltas(txs[3].GetHash(), prioritydummy, nFeeDelta);
+        BOOST_CHECK_EQUAL(nFeeDelta, 5000);
+    }
+    mempool.clear();
+}
+
+//! Write txs to mempool.dat in the given format, with no tip for version 2
+static void WriteMempoolFile(uint64_t nVersion, const std::vector<CMutableTransaction>& txs)
+{
+    CAutoFile file(fopen((GetDataDir() / "mempool.dat").string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    file << nVersion;
+    if (nVersion == 1) {
+        file << (uint64_t)txs.size();
+    } else {
+        file << uint256();
+        file << (unsigned int)0;
+    }
+    BOOST_FOREACH(const CMutableTransaction& tx, txs) {
+        if (nVersion != 1)
+            file << (uint8_t)1;
+        file << CTransaction(tx);
+        file << (int64_t)GetTime();
+        file << (int64_t)0;
+    }
+    if (nVersion != 1)
+        file << (uint8_t)0;
+    file << std::map<uint256, CAmount>();
+}
+
+BOOST_FIXTURE_TEST_CASE(mempool_load_untrusted, TestChain100Setup)
+{
+    // Version 1 files still load, and transactions whose scripts were not
+    // verified against the current tip are checked again.
+
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // Mature three more coinbases
+    for (int i = 0; i < 3; i++)
+        CreateAndProcessBlock(std::vector<CMutableTransaction>(), scriptPubKey);
+
+    // Spends of three coinbases, the last one with a bad signature
+    std::vector<CMutableTransaction> txs;
+    txs.resize(3);
+    for (int i = 0; i < 3; i++)
+    {
+        txs[i].vin.resize(1);
+        txs[i].vin[0].prevout.hash = coinbaseTxns[i].GetHash();
+        txs[i].vin[0].prevout.n = 0;
+        txs[i].vout.resize(1);
+        txs[i].vout[0].nValue = 11*CENT;
+        txs[i].vout[0].scriptPubKey = scriptPubKey;
+
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, txs[i], 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        if (i == 2)
+            vchSig[vchSig.size() / 2] ^= 1;
+        txs[i].vin[0].scriptSig << vchSig;
+    }
+
+    WriteMempoolFile(1, std::vector<CMutableTransaction>(txs.begin(), txs.begin() + 2));
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+    BOOST_CHECK(mempool.exists(txs[0].GetHash()));
+    BOOST_CHECK(mempool.exists(txs[1].GetHash()));
+    mempool.clear();
+
+    WriteMempoolFile(2, txs);
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+    BOOST_CHECK(!mempool.exists(txs[2].GetHash()));
+    mempool.clear();
+}
+
+BOOST_FIXTURE_TEST_CASE(mempool_reorg, TestChain100Setup)
+{
+    // The transactions of all blocks disconnected in a reorg should be back
+    // in the mempool afterwards, linked to their in-mempool descendants.
+
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // A chain of three spends of a coinbase, the first two confirmed in
+    // separate blocks and the third in the mempool:
+    std::vector<CMutableTransaction> txs;
+    txs.resize(3);
+    for (int i = 0; i < 3; i++)
+    {
+        txs[i].vin.resize(1);
+        txs[i].vin[0].prevout.hash = i == 0 ? coinbaseTxns[0].GetHash() : txs[i-1].GetHash();
+        txs[i].vin[0].prevout.n = 0;
+        txs[i].vout.resize(1);
+        txs[i].vout[0].nValue = (49 - i) * COIN;
+        txs[i].vout[0].scriptPubKey = scriptPubKey;
+
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, txs[i], 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        txs[i].vin[0].scriptSig << vchSig;
+        if (i < 2) {
+            CreateAndProcessBlock(std::vector<CMutableTransaction>(1, txs[i]), scriptPubKey);
+        } else {
+            BOOST_CHECK(ToMemPool(txs[i]));
+        }
+    }
+    BOOST_CHECK_EQUAL(chainActive.Height(), 102);
+
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params(), chainActive[101]));
+    }
+    BOOST_CHECK_EQUAL(chainActive.Height(), 100);
+    BOOST_CHECK_EQUAL(mempool.size(), 3);
+    {
+        LOCK(mempool.cs);
+        CTxMemPool::txiter it = mempool.mapTx.find(txs[0].GetHash());
+        BOOST_CHECK(it != mempool.mapTx.end() && it->GetCountWithDescendants() == 3);
+        it = mempool.mapTx.find(txs[2].GetHash());
+        BOOST_CHECK(it != mempool.mapTx.end() && it->GetCountWithAncestors() == 3);
+    }
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -25,8 +25,8 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  bool poolHasNoInputsOf, CAmount _inChainInputValue,
                                  bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp):
     tx(MakeTransactionRef(_tx)), nFee(_nFee), nTime(_nTime), entryPriority(_entryPriority), entryHeight(_entryHeight),
-    hadNoDependencies(poolHasNoInputsOf), inChainInputValue(_inChainInputValue),
-    spendsCoinbase(_spendsCoinbase), sigOpCost(_sigOpsCost), lockPoints(lp)
+    hadNoDependencies(poolHasNoInputsOf), spendsCoinbase(_spendsCoinbase), inChainInputValue(_inChainInputValue),
+    sigOpCost(_sigOpsCost), lockPoints(lp)
 {
     nTxWeight = GetTransactionWeight(_tx);
     nModSize = _tx.CalculateModifiedSize(GetTxSize());
@@ -44,6 +44,8 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
     nSizeWithAncestors = GetTxSize();
     nModFeesWithAncestors = nFee;
     nSigOpCostWithAncestors = sigOpCost;
+
+    nEpoch = 0;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -66,6 +68,7 @@ void CTxMemPoolEntry::UpdateFeeDelta(int64_t newFeeDelta)
     nModFeesWithDescendants += newFeeDelta - feeDelta;
     nModFeesWithAncestors += newFeeDelta - feeDelta;
     feeDelta = newFeeDelta;
+    snapshotEntry.reset();
 }
 
 void CTxMemPoolEntry::UpdateLockPoints(const LockPoints& lp)
@@ -78,44 +81,67 @@ size_t CTxMemPoolEntry::GetTxSize() const
     return GetVirtualTransactionSize(nTxWeight, sigOpCost);
 }
 
+CTxMemPool::CTraversal::CTraversal(const CTxMemPool& poolIn) : pool(poolIn)
+{
+    AssertLockHeld(pool.cs);
+    assert(!pool.fInTraversal);
+    pool.fInTraversal = true;
+    ++pool.nEpoch;
+}
+
+CTxMemPool::CTraversal::~CTraversal()
+{
+    pool.fInTraversal = false;
+}
+
 // Update the given tx for any in-mempool descendants.
-// Assumes that setMemPoolChildren is correct for the given tx and all
+// Assumes that vChildren is correct for the given tx and all
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
-
-    while (!stageEntries.empty()) {
-        const txiter cit = *stageEntries.begin();
-        setAllDescendants.insert(cit);
-        stageEntries.erase(cit);
-        const setEntries &setChildren = GetMemPoolChildren(cit);
-        BOOST_FOREACH(const txiter childEntry, setChildren) {
-            cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
-            if (cacheIt != cachedDescendants.end()) {
-                // We've already calculated this one, just add the entries for this set
-                // but don't traverse again.
-                BOOST_FOREACH(const txiter cacheEntry, cacheIt->second) {
-                    setAllDescendants.insert(cacheEntry);
+    vecEntries vAllDescendants;
+    {
+        CTraversal traversal(*this);
+        vecEntries &stageEntries = vTraversalStage;
+        stageEntries.clear();
+        BOOST_FOREACH(const CTxMemPoolEntry* pchild, GetMemPoolChildren(updateIt)) {
+            txiter childEntry = GetIter(pchild);
+            if (Visit(childEntry))
+                stageEntries.push_back(childEntry);
+        }
+
+        while (!stageEntries.empty()) {
+            const txiter cit = stageEntries.back();
+            stageEntries.pop_back();
+            vAllDescendants.push_back(cit);
+            BOOST_FOREACH(const CTxMemPoolEntry* pchild, GetMemPoolChildren(cit)) {
+                txiter childEntry = GetIter(pchild);
+                cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
+                if (cacheIt != cachedDescendants.end()) {
+                    // We've already calculated this one, just add the entries for this set
+                    // but don't traverse again.
+                    BOOST_FOREACH(const txiter cacheEntry, cacheIt->second) {
+                        if (Visit(cacheEntry))
+                            vAllDescendants.push_back(cacheEntry);
+                    }
+                } else if (Visit(childEntry)) {
+                    // Schedule for later processing
+                    stageEntries.push_back(childEntry);
                 }
-            } else if (!setAllDescendants.count(childEntry)) {
-                // Schedule for later processing
-                stageEntries.insert(childEntry);
             }
         }
     }
-    // setAllDescendants now contains all in-mempool descendants of updateIt.
+    // vAllDescendants now contains all in-mempool descendants of updateIt.
     // Update and add to cached descendant map
     int64_t modifySize = 0;
     CAmount modifyFee = 0;
     int64_t modifyCount = 0;
-    BOOST_FOREACH(txiter cit, setAllDescendants) {
+    BOOST_FOREACH(txiter cit, vAllDescendants) {
         if (!setExclude.count(cit->GetTx().GetHash())) {
             modifySize += cit->GetTxSize();
             modifyFee += cit->GetModifiedFee();
             modifyCount++;
-            cachedDescendants[updateIt].insert(cit);
+            cachedDescendants[updateIt].push_back(cit);
             // Update ancestor state for each descendant
             mapTx.modify(cit, update_ancestor_state(updateIt->GetTxSize(), updateIt->GetModifiedFee(), 1, updateIt->GetSigOpCost()));
         }
@@ -143,7 +169,7 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
     // Iterate in reverse, so that whenever we are looking at at a transaction
     // we are sure that all in-mempool descendants have already been processed.
     // This maximizes the benefit of the descendant cache and guarantees that
-    // setMemPoolChildren will be updated, an assumption made in
+    // vChildren will be updated, an assumption made in
     // UpdateForDescendants.
     BOOST_REVERSE_FOREACH(const uint256 &hash, vHashesToUpdate) {
         // we cache the in-mempool children to avoid duplicate updates
@@ -154,8 +180,8 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
             continue;
         }
         auto iter = mapNextTx.lower_bound(COutPoint(hash, 0));
-        // First calculate the children, and update setMemPoolChildren to
-        // include them, and update their setMemPoolParents to include this tx.
+        // First calculate the children, and update vChildren to
+        // include them, and update their vParents to include this tx.
         for (; iter != mapNextTx.end() && iter->first->hash == hash; ++iter) {
             const uint256 &childHash = iter->second->GetHash();
             txiter childIter = mapTx.find(childHash);
@@ -171,9 +197,12 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
     }
 }
 
-bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
+bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, vecEntries &vAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
 {
-    setEntries parentHashes;
+    CTraversal traversal(*this);
+    vecEntries &parentHashes = vTraversalStage;
+    parentHashes.clear();
+    vAncestors.clear();
     const CTransaction &tx = entry.GetTx();
 
     if (fSearchForParents) {
@@ -182,8 +211,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // iterate mapTx to find parents.
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
+            if (piter != mapTx.end() && Visit(piter)) {
+                parentHashes.push_back(piter);
                 if (parentHashes.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
@@ -194,16 +223,22 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        BOOST_FOREACH(const CTxMemPoolEntry* pparent, GetMemPoolParents(it)) {
+            txiter piter = GetIter(pparent);
+            Visit(piter);
+            parentHashes.push_back(piter);
+        }
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
 
+    // Everything staged or in vAncestors has been visited, so no entry is
+    // reached twice.
     while (!parentHashes.empty()) {
-        txiter stageit = *parentHashes.begin();
+        txiter stageit = parentHashes.back();
 
-        setAncestors.insert(stageit);
-        parentHashes.erase(stageit);
+        vAncestors.push_back(stageit);
+        parentHashes.pop_back();
         totalSizeWithAncestors += stageit->GetTxSize();
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
@@ -217,13 +252,13 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
             return false;
         }
 
-        const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
-        BOOST_FOREACH(const txiter &phash, setMemPoolParents) {
+        BOOST_FOREACH(const CTxMemPoolEntry* pparent, GetMemPoolParents(stageit)) {
+            txiter phash = GetIter(pparent);
             // If this is a new ancestor, add it.
-            if (setAncestors.count(phash) == 0) {
-                parentHashes.insert(phash);
+            if (Visit(phash)) {
+                parentHashes.push_back(phash);
             }
-            if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
+            if (parentHashes.size() + vAncestors.size() + 1 > limitAncestorCount) {
                 errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
                 return false;
             }
@@ -233,28 +268,27 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
     return true;
 }
 
-void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
+void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, const vecEntries &vAncestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
     // add or remove this tx as a child of each parent
-    BOOST_FOREACH(txiter piter, parentIters) {
-        UpdateChild(piter, it, add);
+    BOOST_FOREACH(const CTxMemPoolEntry* pparent, GetMemPoolParents(it)) {
+        UpdateChild(GetIter(pparent), it, add);
     }
     const int64_t updateCount = (add ? 1 : -1);
     const int64_t updateSize = updateCount * it->GetTxSize();
     const CAmount updateFee = updateCount * it->GetModifiedFee();
-    BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+    BOOST_FOREACH(txiter ancestorIt, vAncestors) {
         mapTx.modify(ancestorIt, update_descendant_state(updateSize, updateFee, updateCount));
     }
 }
 
-void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries &setAncestors)
+void CTxMemPool::UpdateEntryForAncestors(txiter it, const vecEntries &vAncestors)
 {
-    int64_t updateCount = setAncestors.size();
+    int64_t updateCount = vAncestors.size();
     int64_t updateSize = 0;
     CAmount updateFee = 0;
     int64_t updateSigOpsCost = 0;
-    BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+    BOOST_FOREACH(txiter ancestorIt, vAncestors) {
         updateSize += ancestorIt->GetTxSize();
         updateFee += ancestorIt->GetModifiedFee();
         updateSigOpsCost += ancestorIt->GetSigOpCost();
@@ -264,13 +298,12 @@ void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries &setAncesto
 
 void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 {
-    const setEntries &setMemPoolChildren = GetMemPoolChildren(it);
-    BOOST_FOREACH(txiter updateIt, setMemPoolChildren) {
-        UpdateParent(updateIt, it, false);
+    BOOST_FOREACH(const CTxMemPoolEntry* pchild, GetMemPoolChildren(it)) {
+        UpdateParent(GetIter(pchild), it, false);
     }
 }
 
-void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants)
+void CTxMemPool::UpdateForRemoveFromMempool(const vecEntries &entriesToRemove, bool updateDescendants)
 {
     // For each entry, walk back all ancestors and decrement size associated with this
     // transaction
@@ -279,23 +312,23 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // updateDescendants should be true whenever we're not recursively
         // removing a tx and all its descendants, eg when a transaction is
         // confirmed in a block.
-        // Here we only update statistics and not data in mapLinks (which
+        // Here we only update statistics and not the parent and child links (which
         // we need to preserve until we're finished with all operations that
         // need to traverse the mempool).
+        vecEntries vDescendants;
         BOOST_FOREACH(txiter removeIt, entriesToRemove) {
-            setEntries setDescendants;
-            CalculateDescendants(removeIt, setDescendants);
-            setDescendants.erase(removeIt); // don't update state for self
+            CalculateDescendants(removeIt, vDescendants);
             int64_t modifySize = -((int64_t)removeIt->GetTxSize());
             CAmount modifyFee = -removeIt->GetModifiedFee();
             int modifySigOps = -removeIt->GetSigOpCost();
-            BOOST_FOREACH(txiter dit, setDescendants) {
-                mapTx.modify(dit, update_ancestor_state(modifySize, modifyFee, -1, modifySigOps));
+            // vDescendants starts with removeIt itself, which isn't updated
+            for (size_t i = 1; i < vDescendants.size(); i++) {
+                mapTx.modify(vDescendants[i], update_ancestor_state(modifySize, modifyFee, -1, modifySigOps));
             }
         }
     }
+    vecEntries vAncestors;
     BOOST_FOREACH(txiter removeIt, entriesToRemove) {
-        setEntries setAncestors;
         const CTxMemPoolEntry &entry = *removeIt;
         std::string dummy;
         // Since this is a tx that is already in the mempool, we can call CMPA
@@ -304,24 +337,24 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // should be a bit faster.
         // However, if we happen to be in the middle of processing a reorg, then
         // the mempool can be in an inconsistent state.  In this case, the set
-        // of ancestors reachable via mapLinks will be the same as the set of 
+        // of ancestors reachable via vParents will be the same as the set of 
         // ancestors whose packages include this transaction, because when we
         // add a new transaction to the mempool in addUnchecked(), we assume it
         // has no children, and in the case of a reorg where that assumption is
         // false, the in-mempool children aren't linked to the in-block tx's
         // until UpdateTransactionsFromBlock() is called.
         // So if we're being called during a reorg, ie before
-        // UpdateTransactionsFromBlock() has been called, then mapLinks[] will
+        // UpdateTransactionsFromBlock() has been called, then vParents will
         // differ from the set of mempool parents we'd calculate by searching,
-        // and it's important that we use the mapLinks[] notion of ancestor
+        // and it's important that we use the vParents notion of ancestor
         // transactions as the set of things to update for removal.
-        CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        CalculateMemPoolAncestors(entry, vAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
         // Note that UpdateAncestorsOf severs the child links that point to
         // removeIt in the entries for the parents of removeIt.
-        UpdateAncestorsOf(false, removeIt, setAncestors);
+        UpdateAncestorsOf(false, removeIt, vAncestors);
     }
     // After updating all the ancestor sizes, we can now sever the link between each
-    // transaction being removed and any mempool children (ie, update setMemPoolParents
+    // transaction being removed and any mempool children (ie, update vParents
     // for each direct child of a transaction being removed).
     BOOST_FOREACH(txiter removeIt, entriesToRemove) {
         UpdateChildrenForRemoval(removeIt);
@@ -330,6 +363,7 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
 
 void CTxMemPoolEntry::UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
 {
+    snapshotEntry.reset();
     nSizeWithDescendants += modifySize;
     assert(int64_t(nSizeWithDescendants) > 0);
     nModFeesWithDescendants += modifyFee;
@@ -339,6 +373,7 @@ void CTxMemPoolEntry::UpdateDescendantState(int64_t modifySize, CAmount modifyFe
 
 void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount, int modifySigOps)
 {
+    snapshotEntry.reset();
     nSizeWithAncestors += modifySize;
     assert(int64_t(nSizeWithAncestors) > 0);
     nModFeesWithAncestors += modifyFee;
@@ -348,8 +383,14 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
     assert(int(nSigOpCostWithAncestors) >= 0);
 }
 
+/** Lower ends of the fee histogram buckets, in satoshis per byte */
+static const CAmount FEE_HISTOGRAM_BOUNDS[] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 14, 17, 20, 25, 30, 40, 50, 60, 70, 80, 100, 120, 140, 170, 200,
+    250, 300, 400, 500, 600, 700, 800, 1000, 1200, 1400, 1700, 2000, 2500, 3000, 4000, 5000, 7000, 10000
+};
+
 CTxMemPool::CTxMemPool(const CFeeRate& _minReasonableRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0), nEpoch(0), fInTraversal(false)
 {
     _clear(); //lock free clear
 
@@ -392,14 +433,185 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool fCurrentEstimate)
+//! The fee histogram bucket of the highest lower end not above the entry's modified feerate
+static size_t FeeHistogramBucket(const CTxMemPoolEntry& entry)
+{
+    CAmount nFeeRate = CFeeRate(entry.GetModifiedFee(), entry.GetTxSize()).GetFeePerK() / 1000;
+    size_t nBucket = std::upper_bound(std::begin(FEE_HISTOGRAM_BOUNDS), std::end(FEE_HISTOGRAM_BOUNDS), nFeeRate) - std::begin(FEE_HISTOGRAM_BOUNDS);
+    return nBucket > 0 ? nBucket - 1 : 0;
+}
+
+void CTxMemPool::UpdateFeeHistogram(const CTxMemPoolEntry& entry, int nDirection)
+{
+    CFeeHistogramBucket& bucket = vFeeHistogram[FeeHistogramBucket(entry)];
+    bucket.nCount += nDirection;
+    bucket.nSize += nDirection * (int64_t)entry.GetTxSize();
+    bucket.nFees += nDirection * entry.GetModifiedFee();
+}
+
+std::vector<CFeeHistogramBucket> CTxMemPool::GetFeeHistogram() const
+{
+    LOCK(cs);
+    return vFeeHistogram;
+}
+
+std::shared_ptr<const CTxMemPoolSnapshot> CTxMemPool::GetSnapshot() const
+{
+    LOCK(cs_snapshot);
+    std::vector<CTxMemPoolSnapshot::EntryRef> vEntries;
+    unsigned int nSnapshotUpdated;
+    {
+        LOCK(cs);
+        if (snapshot && snapshot->GetTransactionsUpdated() == nTransactionsUpdated)
+            return snapshot;
+        nSnapshotUpdated = nTransactionsUpdated;
+        vEntries.reserve(mapTx.size());
+        for (txiter it = mapTx.begin(); it != mapTx.end(); it++) {
+            CTxMemPoolSnapshot::EntryRef entry = it->snapshotEntry.lock();
+            if (!entry) {
+                entry = MakeSnapshotEntry(it);
+                it->snapshotEntry = entry;
+            }
+            vEntries.push_back(std::move(entry));
+        }
+    }
+    // Indexing the snapshot does not need the pool
+    std::shared_ptr<const CTxMemPoolSnapshot> newsnapshot = std::make_shared<const CTxMemPoolSnapshot>(std::move(vEntries), nSnapshotUpdated);
+
+    LOCK(cs);
+    size_t nRemovedUsage = 0;
+    if (nTransactionsUpdated != nSnapshotUpdated) {
+        // Transactions that left the pool meanwhile are only kept by the snapshot
+        for (size_t i = 0; i < newsnapshot->size(); i++) {
+            const CTxMemPoolEntry& entry = (*newsnapshot)[i].entry;
+            if (!mapTx.count(entry.GetTx().GetHash()))
+                nRemovedUsage += entry.DynamicMemoryUsage();
+        }
+    }
+    snapshot = newsnapshot;
+    nSnapshotRemovedUsage = nRemovedUsage;
+    nSnapshotUsage = newsnapshot->DynamicMemoryUsage() + nRemovedUsage;
+    nSnapshotTime = GetTime();
+    return newsnapshot;
+}
+
+CTxMemPoolSnapshot::EntryRef CTxMemPool::MakeSnapshotEntry(txiter it) const
+{
+    AssertLockHeld(cs);
+    std::vector<uint256> vParents;
+    vParents.reserve(it->vParents.size());
+    BOOST_FOREACH(const CTxMemPoolEntry* pparent, it->vParents)
+        vParents.push_back(pparent->GetTx().GetHash());
+    // Not make_shared: the live entry only holds a weak reference, which would
+    // keep a shared allocation from being freed along with the snapshot
+    return CTxMemPoolSnapshot::EntryRef(new CTxMemPoolSnapshotEntry(*it, std::move(vParents)));
+}
+
+CTxMemPoolSnapshot::EntryRef CTxMemPool::GetSnapshotEntry(txiter it) const
+{
+    AssertLockHeld(cs);
+    CTxMemPoolSnapshot::EntryRef entry = it->snapshotEntry.lock();
+    return entry ? entry : MakeSnapshotEntry(it);
+}
+
+void CTxMemPool::LimitStaleSnapshot()
+{
+    AssertLockHeld(cs);
+    if (!snapshot || snapshot->GetTransactionsUpdated() == nTransactionsUpdated)
+        return;
+    if (nSnapshotRemovedUsage > SNAPSHOT_REMOVED_BUDGET || GetTime() - nSnapshotTime > SNAPSHOT_STALE_AGE) {
+        // The entry copies go with it, unless a caller still holds it
+        snapshot.reset();
+        nSnapshotUsage = 0;
+        nSnapshotRemovedUsage = 0;
+    }
+}
+
+CTxMemPoolSnapshotEntry::CTxMemPoolSnapshotEntry(const CTxMemPoolEntry& entryIn, std::vector<uint256>&& vParentsIn) :
+    entry(entryIn), vParents(std::move(vParentsIn))
+{
+    // The links point into the live pool
+    entry.vParents.clear();
+    entry.vChildren.clear();
+    entry.snapshotEntry.reset();
+}
+
+CTxMemPoolSnapshot::CTxMemPoolSnapshot(std::vector<EntryRef>&& vEntriesIn, unsigned int nTransactionsUpdatedIn) :
+    vEntries(std::move(vEntriesIn)), nTransactionsUpdated(nTransactionsUpdatedIn)
+{
+    mapIndex.reserve(vEntries.size());
+    for (size_t i = 0; i < vEntries.size(); i++)
+        mapIndex.emplace(vEntries[i]->entry.GetTx().GetHash(), i);
+    for (size_t i = 0; i < vEntries.size(); i++) {
+        BOOST_FOREACH(const uint256& hashParent, vEntries[i]->vParents)
+            mapChildren[mapIndex.at(hashParent)].push_back(i);
+    }
+
+    nUsage = memusage::DynamicUsage(vEntries) + memusage::DynamicUsage(mapIndex) + memusage::DynamicUsage(mapChildren);
+    for (size_t i = 0; i < vEntries.size(); i++)
+        nUsage += memusage::DynamicUsage(vEntries[i]) + memusage::DynamicUsage(vEntries[i]->vParents);
+    for (const auto& children : mapChildren)
+        nUsage += memusage::DynamicUsage(children.second);
+}
+
+bool CTxMemPoolSnapshot::Find(const uint256& hash, size_t& nIndex) const
+{
+    auto it = mapIndex.find(hash);
+    if (it == mapIndex.end())
+        return false;
+    nIndex = it->second;
+    return true;
+}
+
+std::vector<size_t> CTxMemPoolSnapshot::CalculateAncestors(size_t nIndex) const
+{
+    std::vector<size_t> vAncestors;
+    std::set<size_t> setSeen;
+    setSeen.insert(nIndex);
+    std::vector<size_t> vStage(1, nIndex);
+    while (!vStage.empty()) {
+        size_t nNext = vStage.back();
+        vStage.pop_back();
+        BOOST_FOREACH(const uint256& hashParent, vEntries[nNext]->vParents) {
+            size_t nParent = mapIndex.at(hashParent);
+            if (setSeen.insert(nParent).second) {
+                vAncestors.push_back(nParent);
+                vStage.push_back(nParent);
+            }
+        }
+    }
+    return vAncestors;
+}
+
+std::vector<size_t> CTxMemPoolSnapshot::CalculateDescendants(size_t nIndex) const
+{
+    std::vector<size_t> vDescendants;
+    std::set<size_t> setSeen;
+    setSeen.insert(nIndex);
+    std::vector<size_t> vStage(1, nIndex);
+    while (!vStage.empty()) {
+        size_t nNext = vStage.back();
+        vStage.pop_back();
+        auto it = mapChildren.find(nNext);
+        if (it == mapChildren.end())
+            continue;
+        BOOST_FOREACH(size_t nChild, it->second) {
+            if (setSeen.insert(nChild).second) {
+                vDescendants.push_back(nChild);
+                vStage.push_back(nChild);
+            }
+        }
+    }
+    return vDescendants;
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, const vecEntries &vAncestors, bool fCurrentEstimate)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     indexed_transaction_set::iterator newit = mapTx.insert(entry).first;
-    mapLinks.insert(make_pair(newit, TxLinks()));
 
     // Update transaction for any feeDelta created by PrioritiseTransaction
     // TODO: refactor so that the fee delta is calculated before inserting
@@ -437,21 +649,25 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
             UpdateParent(newit, pit, true);
         }
     }
-    UpdateAncestorsOf(true, newit, setAncestors);
-    UpdateEntryForAncestors(newit, setAncestors);
+    UpdateAncestorsOf(true, newit, vAncestors);
+    UpdateEntryForAncestors(newit, vAncestors);
 
     nTransactionsUpdated++;
+    LimitStaleSnapshot();
     totalTxSize += entry.GetTxSize();
+    UpdateFeeHistogram(*newit, 1);
     minerPolicyEstimator->processTransaction(entry, fCurrentEstimate);
 
     vTxHashes.emplace_back(tx.GetWitnessHash(), newit);
     newit->vTxHashesIdx = vTxHashes.size() - 1;
 
+    NotifyEntryAdded(newit->GetSharedTx());
     return true;
 }
 
 void CTxMemPool::removeUnchecked(txiter it)
 {
+    NotifyEntryRemoved(it->GetSharedTx());
     const uint256 hash = it->GetTx().GetHash();
     BOOST_FOREACH(const CTxIn& txin, it->GetTx().vin)
         mapNextTx.erase(txin.prevout);
@@ -466,52 +682,62 @@ void CTxMemPool::removeUnchecked(txiter it)
         vTxHashes.clear();
 
     totalTxSize -= it->GetTxSize();
+    UpdateFeeHistogram(*it, -1);
+    // A transaction in the last snapshot is now only kept by it
+    size_t nSnapshotIndex;
+    if (snapshot && snapshot->Find(hash, nSnapshotIndex)) {
+        nSnapshotUsage += it->DynamicMemoryUsage();
+        nSnapshotRemovedUsage += it->DynamicMemoryUsage();
+    }
     cachedInnerUsage -= it->DynamicMemoryUsage();
-    cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
-    mapLinks.erase(it);
+    cachedInnerUsage -= memusage::DynamicUsage(it->vParents) + memusage::DynamicUsage(it->vChildren);
     mapTx.erase(it);
     nTransactionsUpdated++;
+    LimitStaleSnapshot();
     minerPolicyEstimator->removeTx(hash);
 }
 
-// Calculates descendants of entry that are not already in setDescendants, and adds to
-// setDescendants. Assumes entryit is already a tx in the mempool and setMemPoolChildren
-// is correct for tx and all descendants.
-// Also assumes that if an entry is in setDescendants already, then all
-// in-mempool descendants of it are already in setDescendants as well, so that we
-// can save time by not iterating over those entries.
-void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants)
+void CTxMemPool::ExpandDescendants(vecEntries &vEntries) const
 {
-    setEntries stage;
-    if (setDescendants.count(entryit) == 0) {
-        stage.insert(entryit);
+    CTraversal traversal(*this);
+    size_t nUnique = 0;
+    for (size_t i = 0; i < vEntries.size(); i++) {
+        if (Visit(vEntries[i]))
+            vEntries[nUnique++] = vEntries[i];
     }
-    // Traverse down the children of entry, only adding children that are not
-    // accounted for in setDescendants already (because those children have either
-    // already been walked, or will be walked in this iteration).
-    while (!stage.empty()) {
-        txiter it = *stage.begin();
-        setDescendants.insert(it);
-        stage.erase(it);
-
-        const setEntries &setChildren = GetMemPoolChildren(it);
-        BOOST_FOREACH(const txiter &childiter, setChildren) {
-            if (!setDescendants.count(childiter)) {
-                stage.insert(childiter);
-            }
+    vEntries.resize(nUnique);
+    // vEntries is its own work list: entries before i have had their
+    // children added already.
+    for (size_t i = 0; i < vEntries.size(); i++) {
+        BOOST_FOREACH(const CTxMemPoolEntry* pchild, GetMemPoolChildren(vEntries[i])) {
+            txiter childiter = GetIter(pchild);
+            if (Visit(childiter))
+                vEntries.push_back(childiter);
         }
     }
 }
 
+void CTxMemPool::CalculateDescendants(txiter entryit, vecEntries &vDescendants) const
+{
+    vDescendants.assign(1, entryit);
+    ExpandDescendants(vDescendants);
+}
+
+void CTxMemPool::CalculateDescendants(const vecEntries &vRoots, vecEntries &vDescendants) const
+{
+    vDescendants = vRoots;
+    ExpandDescendants(vDescendants);
+}
+
 void CTxMemPool::removeRecursive(const CTransaction &origTx, std::vector<CTransactionRef>* removed)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        setEntries txToRemove;
+        vecEntries txToRemove;
         txiter origit = mapTx.find(origTx.GetHash());
         if (origit != mapTx.end()) {
-            txToRemove.insert(origit);
+            txToRemove.push_back(origit);
         } else {
             // When recursively removing but origTx isn't in the mempool
             // be sure to remove any children that are in the pool. This can
@@ -523,19 +749,17 @@ void CTxMemPool::removeRecursive(const CTransaction &origTx, std::vector<CTransa
                     continue;
                 txiter nextit = mapTx.find(it->second->GetHash());
                 assert(nextit != mapTx.end());
-                txToRemove.insert(nextit);
+                txToRemove.push_back(nextit);
             }
         }
-        setEntries setAllRemoves;
-        BOOST_FOREACH(txiter it, txToRemove) {
-            CalculateDescendants(it, setAllRemoves);
-        }
+        vecEntries vAllRemoves;
+        CalculateDescendants(txToRemove, vAllRemoves);
         if (removed) {
-            BOOST_FOREACH(txiter it, setAllRemoves) {
+            BOOST_FOREACH(txiter it, vAllRemoves) {
                 removed->emplace_back(it->GetSharedTx());
             }
         }
-        RemoveStaged(setAllRemoves, false);
+        RemoveStaged(vAllRemoves, false);
     }
 }
 
@@ -543,7 +767,7 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
 {
     // Remove transactions spending a coinbase which are now immature and no-longer-final transactions
     LOCK(cs);
-    setEntries txToRemove;
+    vecEntries txToRemove;
     for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         const CTransaction& tx = it->GetTx();
         LockPoints lp = it->GetLockPoints();
@@ -551,7 +775,7 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
         if (!CheckFinalTx(tx, flags) || !CheckSequenceLocks(tx, flags, &lp, validLP)) {
             // Note if CheckSequenceLocks fails the LockPoints may still be invalid
             // So it's critical that we remove the tx and not depend on the LockPoints.
-            txToRemove.insert(it);
+            txToRemove.push_back(it);
         } else if (it->GetSpendsCoinbase()) {
             BOOST_FOREACH(const CTxIn& txin, tx.vin) {
                 indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
@@ -560,7 +784,7 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
                 const CCoins *coins = pcoins->AccessCoins(txin.prevout.hash);
                 if (nCheckFrequency != 0) assert(coins);
                 if (!coins || (coins->IsCoinBase() && ((signed long)nMemPoolHeight) - coins->nHeight < COINBASE_MATURITY)) {
-                    txToRemove.insert(it);
+                    txToRemove.push_back(it);
                     break;
                 }
             }
@@ -569,11 +793,9 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
             mapTx.modify(it, update_lock_points(lp));
         }
     }
-    setEntries setAllRemoves;
-    for (txiter it : txToRemove) {
-        CalculateDescendants(it, setAllRemoves);
-    }
-    RemoveStaged(setAllRemoves, false);
+    vecEntries vAllRemoves;
+    CalculateDescendants(txToRemove, vAllRemoves);
+    RemoveStaged(vAllRemoves, false);
 }
 
 void CTxMemPool::removeConflicts(const CTransaction &tx, std::vector<CTransactionRef>* removed)
@@ -613,9 +835,7 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
     {
         txiter it = mapTx.find(tx->GetHash());
         if (it != mapTx.end()) {
-            setEntries stage;
-            stage.insert(it);
-            RemoveStaged(stage, true);
+            RemoveStaged(vecEntries(1, it), true);
         }
         removeConflicts(*tx, conflicts);
         ClearPrioritisation(tx->GetHash());
@@ -628,11 +848,17 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
 
 void CTxMemPool::_clear()
 {
-    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
+    vFeeHistogram.clear();
+    BOOST_FOREACH(CAmount nFeeRateFrom, FEE_HISTOGRAM_BOUNDS)
+        vFeeHistogram.push_back(CFeeHistogramBucket(nFeeRateFrom));
     cachedInnerUsage = 0;
+    snapshot.reset();
+    nSnapshotUsage = 0;
+    nSnapshotRemovedUsage = 0;
+    nSnapshotTime = 0;
     lastRollingFeeUpdate = GetTime();
     blockSinceLastRollingFeeBump = false;
     rollingMinimumFeeRate = 0;
@@ -656,6 +882,9 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     uint64_t checkTotal = 0;
+    std::vector<CFeeHistogramBucket> vCheckFeeHistogram;
+    BOOST_FOREACH(CAmount nFeeRateFrom, FEE_HISTOGRAM_BOUNDS)
+        vCheckFeeHistogram.push_back(CFeeHistogramBucket(nFeeRateFrom));
     uint64_t innerUsage = 0;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
@@ -666,12 +895,13 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
         checkTotal += it->GetTxSize();
+        CFeeHistogramBucket& bucket = vCheckFeeHistogram[FeeHistogramBucket(*it)];
+        bucket.nCount++;
+        bucket.nSize += it->GetTxSize();
+        bucket.nFees += it->GetModifiedFee();
         innerUsage += it->DynamicMemoryUsage();
         const CTransaction& tx = it->GetTx();
-        txlinksMap::const_iterator linksiter = mapLinks.find(it);
-        assert(linksiter != mapLinks.end());
-        const TxLinks &links = linksiter->second;
-        innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
+        innerUsage += memusage::DynamicUsage(it->vParents) + memusage::DynamicUsage(it->vChildren);
         bool fDependsWait = false;
         setEntries setParentCheck;
         int64_t parentSizes = 0;
@@ -698,18 +928,20 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(it3->second == &tx);
             i++;
         }
-        assert(setParentCheck == GetMemPoolParents(it));
+        assert(setParentCheck.size() == GetMemPoolParents(it).size());
+        BOOST_FOREACH(const CTxMemPoolEntry* pparent, GetMemPoolParents(it))
+            assert(setParentCheck.count(GetIter(pparent)));
         // Verify ancestor state is correct.
-        setEntries setAncestors;
+        vecEntries vAncestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
         std::string dummy;
-        CalculateMemPoolAncestors(*it, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy);
-        uint64_t nCountCheck = setAncestors.size() + 1;
+        CalculateMemPoolAncestors(*it, vAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy);
+        uint64_t nCountCheck = vAncestors.size() + 1;
         uint64_t nSizeCheck = it->GetTxSize();
         CAmount nFeesCheck = it->GetModifiedFee();
         int64_t nSigOpCheck = it->GetSigOpCost();
 
-        BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+        BOOST_FOREACH(txiter ancestorIt, vAncestors) {
             nSizeCheck += ancestorIt->GetTxSize();
             nFeesCheck += ancestorIt->GetModifiedFee();
             nSigOpCheck += ancestorIt->GetSigOpCost();
@@ -731,7 +963,9 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 childSizes += childit->GetTxSize();
             }
         }
-        assert(setChildrenCheck == GetMemPoolChildren(it));
+        assert(setChildrenCheck.size() == GetMemPoolChildren(it).size());
+        BOOST_FOREACH(const CTxMemPoolEntry* pchild, GetMemPoolChildren(it))
+            assert(setChildrenCheck.count(GetIter(pchild)));
         // Also check to make sure size is greater than sum with immediate children.
         // just a sanity check, not definitive that this calc is correct...
         assert(it->GetSizeWithDescendants() >= childSizes + it->GetTxSize());
@@ -773,6 +1007,11 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
+    for (size_t i = 0; i < vFeeHistogram.size(); i++) {
+        assert(vFeeHistogram[i].nCount == vCheckFeeHistogram[i].nCount);
+        assert(vFeeHistogram[i].nSize == vCheckFeeHistogram[i].nSize);
+        assert(vFeeHistogram[i].nFees == vCheckFeeHistogram[i].nFees);
+    }
 }
 
 bool CTxMemPool::CompareDepthAndScore(const uint256& hasha, const uint256& hashb)
@@ -894,10 +1133,15 @@ bool
 CTxMemPool::WriteFeeEstimates(CAutoFile& fileout) const
 {
     try {
-        LOCK(cs);
+        // Serialize in memory so that the file is written without holding cs
+        CDataStream ssEstimates(SER_DISK, CLIENT_VERSION);
+        {
+            LOCK(cs);
+            minerPolicyEstimator->Write(ssEstimates);
+        }
         fileout << 139900; // version required to read: 0.13.99 or later
         fileout << CLIENT_VERSION; // version that wrote the file
-        minerPolicyEstimator->Write(fileout);
+        fileout.write(&ssEstimates[0], ssEstimates.size());
     }
     catch (const std::exception&) {
         LogPrintf("CTxMemPool::WriteFeeEstimates(): unable to write policy estimator data (non-fatal)\n");
@@ -914,8 +1158,14 @@ CTxMemPool::ReadFeeEstimates(CAutoFile& filein)
         filein >> nVersionRequired >> nVersionThatWrote;
         if (nVersionRequired > CLIENT_VERSION)
             return error("CTxMemPool::ReadFeeEstimates(): up-version (%d) fee estimate file", nVersionRequired);
+        // Read the rest of the file at once, and parse it from memory
+        CDataStream ssEstimates(SER_DISK, CLIENT_VERSION);
+        char buf[65536];
+        size_t nRead;
+        while ((nRead = fread(buf, 1, sizeof(buf), filein.Get())) > 0)
+            ssEstimates.write(buf, nRead);
         LOCK(cs);
-        minerPolicyEstimator->Read(filein, nVersionThatWrote);
+        minerPolicyEstimator->Read(ssEstimates, nVersionThatWrote);
     }
     catch (const std::exception&) {
         LogPrintf("CTxMemPool::ReadFeeEstimates(): unable to read policy estimator data (non-fatal)\n");
@@ -933,15 +1183,19 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         deltas.second += nFeeDelta;
         txiter it = mapTx.find(hash);
         if (it != mapTx.end()) {
+            UpdateFeeHistogram(*it, -1);
             mapTx.modify(it, update_fee_delta(deltas.second));
+            UpdateFeeHistogram(*it, 1);
             // Now update all ancestors' modified fees with descendants
-            setEntries setAncestors;
+            vecEntries vAncestors;
             uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
             std::string dummy;
-            CalculateMemPoolAncestors(*it, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
-            BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+            CalculateMemPoolAncestors(*it, vAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            BOOST_FOREACH(txiter ancestorIt, vAncestors) {
                 mapTx.modify(ancestorIt, update_descendant_state(0, nFeeDelta, 0));
             }
+            nTransactionsUpdated++;
+            NotifyEntryPrioritised(it->GetSharedTx());
         }
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
@@ -992,11 +1246,17 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) const {
 
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
-    // Estimate the overhead of mapTx to be 15 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    // Estimate the overhead of mapTx to be 11 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented:
+    // 3 for each of the two ordered indices, 2 for the sequenced one, and 3 for the hashed one including its bucket.
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 11 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
 }
 
-void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants) {
+size_t CTxMemPool::SnapshotMemoryUsage() const {
+    LOCK(cs);
+    return nSnapshotUsage;
+}
+
+void CTxMemPool::RemoveStaged(const vecEntries &stage, bool updateDescendants) {
     AssertLockHeld(cs);
     UpdateForRemoveFromMempool(stage, updateDescendants);
     BOOST_FOREACH(const txiter& it, stage) {
@@ -1007,63 +1267,58 @@ void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants) {
 int CTxMemPool::Expire(int64_t time) {
     LOCK(cs);
     indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
-    setEntries toremove;
+    vecEntries toremove;
     while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
-        toremove.insert(mapTx.project<0>(it));
+        toremove.push_back(mapTx.project<0>(it));
         it++;
     }
-    setEntries stage;
-    BOOST_FOREACH(txiter removeit, toremove) {
-        CalculateDescendants(removeit, stage);
-    }
+    vecEntries stage;
+    CalculateDescendants(toremove, stage);
     RemoveStaged(stage, false);
     return stage.size();
 }
 
+void CTxMemPool::SortByEntryTime() {
+    LOCK(cs);
+    mapTx.get<entry_time>().sort([](const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) {
+        return a.GetTime() < b.GetTime();
+    });
+}
+
 bool CTxMemPool::addUnchecked(const uint256&hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate)
 {
     LOCK(cs);
-    setEntries setAncestors;
+    vecEntries vAncestors;
     uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
     std::string dummy;
-    CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy);
-    return addUnchecked(hash, entry, setAncestors, fCurrentEstimate);
-}
-
-void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
-{
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
-    }
+    CalculateMemPoolAncestors(entry, vAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy);
+    return addUnchecked(hash, entry, vAncestors, fCurrentEstimate);
 }
 
-void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
+// Add or remove a link, returning the change in the links' memory usage.
+static int64_t UpdateLinks(CTxMemPoolEntry::vecLinks &vLinks, const CTxMemPoolEntry* pentry, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    int64_t nUsageBefore = memusage::DynamicUsage(vLinks);
+    CTxMemPoolEntry::vecLinks::iterator it = std::find(vLinks.begin(), vLinks.end(), pentry);
+    if (add && it == vLinks.end()) {
+        vLinks.push_back(pentry);
+    } else if (!add && it != vLinks.end()) {
+        // Order doesn't matter, so fill the gap with the last link
+        *it = vLinks.back();
+        vLinks.pop_back();
     }
+    return (int64_t)memusage::DynamicUsage(vLinks) - nUsageBefore;
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
 {
-    assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.parents;
+    cachedInnerUsage += UpdateLinks(entry->vChildren, &*child, add);
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
-    assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.children;
+    cachedInnerUsage += UpdateLinks(entry->vParents, &*parent, add);
+    entry->snapshotEntry.reset();
 }
 
 CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const {
@@ -1115,7 +1370,7 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRe
         trackPackageRemoved(removed);
         maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
 
-        setEntries stage;
+        vecEntries stage;
         CalculateDescendants(mapTx.project<0>(it), stage);
         nTxnRemoved += stage.size();
 
@@ -1142,3 +1397,40 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRe
     if (maxFeeRateRemoved > CFeeRate(0))
         LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
 }
+
+size_t DisconnectedBlockTransactions::DynamicMemoryUsage() const
+{
+    return memusage::MallocUsage(sizeof(CTransactionRef) + 6 * sizeof(void*)) * queuedTx.size() + cachedInnerUsage;
+}
+
+void DisconnectedBlockTransactions::addTransaction(const CTransactionRef& tx)
+{
+    if (queuedTx.insert(tx).second) {
+        cachedInnerUsage += RecursiveDynamicUsage(*tx) + memusage::DynamicUsage(tx);
+    }
+}
+
+void DisconnectedBlockTransactions::removeForBlock(const std::vector<CTransactionRef>& vtx)
+{
+    if (queuedTx.empty())
+        return;
+    BOOST_FOREACH(const CTransactionRef& tx, vtx) {
+        auto it = queuedTx.find(tx->GetHash());
+        if (it != queuedTx.end()) {
+            cachedInnerUsage -= RecursiveDynamicUsage(**it) + memusage::DynamicUsage(*it);
+            queuedTx.erase(it);
+        }
+    }
+}
+
+void DisconnectedBlockTransactions::removeEntry(indexed_disconnected_transactions::index<insertion_order>::type::iterator entry)
+{
+    cachedInnerUsage -= RecursiveDynamicUsage(**entry) + memusage::DynamicUsage(*entry);
+    queuedTx.get<insertion_order>().erase(entry);
+}
+
+void DisconnectedBlockTransactions::clear()
+{
+    cachedInnerUsage = 0;
+    queuedTx.clear();
+}
@@ -9,6 +9,7 @@
 #include <memory>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <utility>
 #include <string>
@@ -16,6 +17,7 @@
 #include "amount.h"
 #include "coins.h"
 #include "indirectmap.h"
+#include "prevector.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 #include "random.h"
@@ -24,6 +26,9 @@
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 #include "boost/multi_index/hashed_index.hpp"
+#include "boost/multi_index/sequenced_index.hpp"
+
+#include <boost/signals2/signal.hpp>
 
 class CAutoFile;
 class CBlockIndex;
@@ -59,6 +64,7 @@ struct LockPoints
 };
 
 class CTxMemPool;
+struct CTxMemPoolSnapshotEntry;
 
 /** \class CTxMemPoolEntry
  *
@@ -89,8 +95,8 @@ private:
     double entryPriority;      //!< Priority when entering the mempool
     unsigned int entryHeight;  //!< Chain height when entering the mempool
     bool hadNoDependencies;    //!< Not dependent on any other txs when it entered the mempool
-    CAmount inChainInputValue; //!< Sum of all txin values that are already in blockchain
     bool spendsCoinbase;       //!< keep track of transactions that spend a coinbase
+    CAmount inChainInputValue; //!< Sum of all txin values that are already in blockchain
     int64_t sigOpCost;         //!< Total sigop cost
     int64_t feeDelta;          //!< Used for determining the priority of the transaction for mining in a block
     LockPoints lockPoints;     //!< Track the height and time at which tx was final
@@ -111,6 +117,9 @@ private:
     int64_t nSigOpCostWithAncestors;
 
 public:
+    //! Direct in-mempool parents or children; nearly all entries have one or two
+    typedef prevector<2, const CTxMemPoolEntry*> vecLinks;
+
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                     int64_t _nTime, double _entryPriority, unsigned int _entryHeight,
                     bool poolHasNoInputsOf, CAmount _inChainInputValue, bool spendsCoinbase,
@@ -157,6 +166,11 @@ public:
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint64_t nEpoch; //!< Last mempool traversal that visited this entry
+    mutable vecLinks vParents; //!< In-mempool parents, maintained by CTxMemPool
+    mutable vecLinks vChildren; //!< In-mempool children, maintained by CTxMemPool
+    //! Copy of this entry in the snapshots that still exist, dropped when the entry changes
+    mutable std::weak_ptr<const CTxMemPoolSnapshotEntry> snapshotEntry;
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -219,6 +233,11 @@ struct mempoolentry_txid
     {
         return entry.GetTx().GetHash();
     }
+
+    result_type operator() (const CTransactionRef& tx) const
+    {
+        return tx->GetHash();
+    }
 };
 
 /** \class CompareTxMemPoolEntryByDescendantScore
@@ -228,7 +247,7 @@ struct mempoolentry_txid
 class CompareTxMemPoolEntryByDescendantScore
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         bool fUseADescendants = UseDescendantScore(a);
         bool fUseBDescendants = UseDescendantScore(b);
@@ -250,7 +269,7 @@ public:
     }
 
     // Calculate which score to use for an entry (avoiding division).
-    bool UseDescendantScore(const CTxMemPoolEntry &a)
+    bool UseDescendantScore(const CTxMemPoolEntry &a) const
     {
         double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
         double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
@@ -265,7 +284,7 @@ public:
 class CompareTxMemPoolEntryByScore
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
         double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
@@ -276,19 +295,10 @@ public:
     }
 };
 
-class CompareTxMemPoolEntryByEntryTime
-{
-public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
-    {
-        return a.GetTime() < b.GetTime();
-    }
-};
-
 class CompareTxMemPoolEntryByAncestorFee
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         double aFees = a.GetModFeesWithAncestors();
         double aSize = a.GetSizeWithAncestors();
@@ -311,11 +321,70 @@ public:
 // Multi_index tag names
 struct descendant_score {};
 struct entry_time {};
-struct mining_score {};
 struct ancestor_score {};
+struct txid_index {};
+struct insertion_order {};
 
 class CBlockPolicyEstimator;
 
+/** Totals of the mempool transactions in one feerate bucket of the fee histogram */
+struct CFeeHistogramBucket
+{
+    CAmount nFeeRateFrom;  //!< Lowest modified feerate in the bucket, in satoshis per byte
+    uint64_t nCount;       //!< Number of transactions
+    uint64_t nSize;        //!< ... their total virtual size
+    CAmount nFees;         //!< ... and total modified fees
+
+    CFeeHistogramBucket(CAmount nFeeRateFromIn) : nFeeRateFrom(nFeeRateFromIn), nCount(0), nSize(0), nFees(0) {}
+};
+
+/** What a mempool snapshot keeps of an entry */
+struct CTxMemPoolSnapshotEntry
+{
+    CTxMemPoolEntry entry;          //!< Copy of the entry, without its links
+    std::vector<uint256> vParents;  //!< Txids of its in-mempool parents
+
+    CTxMemPoolSnapshotEntry(const CTxMemPoolEntry& entryIn, std::vector<uint256>&& vParentsIn);
+};
+
+/**
+ * A read-only copy of the mempool, for RPC and REST calls to read without
+ * holding the mempool lock. Snapshots are published by
+ * CTxMemPool::GetSnapshot() and never change. Entries that did not change
+ * since the previous snapshot share their copy with it, so publishing a
+ * snapshot after a few changes copies pointers rather than entries. The
+ * copies only live as long as a snapshot holding them.
+ */
+class CTxMemPoolSnapshot
+{
+public:
+    typedef std::shared_ptr<const CTxMemPoolSnapshotEntry> EntryRef;
+
+private:
+    std::vector<EntryRef> vEntries;
+    std::unordered_map<uint256, size_t, SaltedTxidHasher> mapIndex;
+    std::unordered_map<size_t, std::vector<size_t> > mapChildren;
+    unsigned int nTransactionsUpdated;
+    size_t nUsage;
+
+public:
+    CTxMemPoolSnapshot(std::vector<EntryRef>&& vEntriesIn, unsigned int nTransactionsUpdatedIn);
+
+    //! Value of CTxMemPool::GetTransactionsUpdated() the snapshot was taken at
+    unsigned int GetTransactionsUpdated() const { return nTransactionsUpdated; }
+    size_t size() const { return vEntries.size(); }
+    //! Memory held by the entry copies and the indexes, not counting the transactions
+    size_t DynamicMemoryUsage() const { return nUsage; }
+    const CTxMemPoolSnapshotEntry& operator[](size_t nIndex) const { return *vEntries[nIndex]; }
+
+    //! Set nIndex to the position of a transaction; returns false if it is not in the snapshot
+    bool Find(const uint256& hash, size_t& nIndex) const;
+    //! Positions of all in-mempool ancestors of the entry at nIndex, not including itself
+    std::vector<size_t> CalculateAncestors(size_t nIndex) const;
+    //! Positions of all in-mempool descendants of the entry at nIndex, not including itself
+    std::vector<size_t> CalculateDescendants(size_t nIndex) const;
+};
+
 /**
  * Information about a mempool transaction.
  */
@@ -352,8 +421,8 @@ struct TxMempoolInfo
  * mapTx is a boost::multi_index that sorts the mempool on 4 criteria:
  * - transaction hash
  * - feerate [we use max(feerate of tx, feerate of tx with all descendants)]
- * - time in mempool
- * - mining score (feerate modified by any fee deltas from PrioritiseTransaction)
+ * - time in mempool, as the order in which transactions were added
+ * - feerate with all ancestors
  *
  * Note: the term "descendant" refers to in-mempool transactions that depend on
  * this one, while "ancestor" refers to in-mempool transactions that a given
@@ -361,18 +430,19 @@ struct TxMempoolInfo
  *
  * In order for the feerate sort to remain correct, we must update transactions
  * in the mempool when new descendants arrive.  To facilitate this, we track
- * the set of in-mempool direct parents and direct children in mapLinks.  Within
- * each CTxMemPoolEntry, we track the size and fees of all descendants.
+ * the in-mempool direct parents and direct children in each entry's vParents
+ * and vChildren.  Within each CTxMemPoolEntry, we track the size and fees of
+ * all descendants.
  *
  * Usually when a new transaction is added to the mempool, it has no in-mempool
  * children (because any such children would be an orphan).  So in
  * addUnchecked(), we:
- * - update a new entry's setMemPoolParents to include all in-mempool parents
+ * - update a new entry's vParents to include all in-mempool parents
  * - update the new entry's direct parents to include the new tx as a child
  * - update all ancestors of the transaction to include the new tx's size/fee
  *
  * When a transaction is removed from the mempool, we must:
- * - update all in-mempool parents to not track the tx in setMemPoolChildren
+ * - update all in-mempool parents to not track the tx in vChildren
  * - update all ancestors to not include the tx's size/fees in descendant state
  * - update all in-mempool children to not include it as a parent
  *
@@ -394,7 +464,7 @@ struct TxMempoolInfo
  * state, to account for in-mempool, out-of-block descendants for all the
  * in-block transactions by calling UpdateTransactionsFromBlock().  Note that
  * until this is called, the mempool state is not consistent, and in particular
- * mapLinks may not be correct (and therefore functions like
+ * vParents and vChildren may not be correct (and therefore functions like
  * CalculateMemPoolAncestors() and CalculateDescendants() that rely
  * on them to walk the mempool are not generally safe to use).
  *
@@ -432,9 +502,25 @@ private:
 
     void trackPackageRemoved(const CFeeRate& rate);
 
+    //! Transactions by modified feerate, kept up to date as they enter, leave and are prioritised
+    std::vector<CFeeHistogramBucket> vFeeHistogram;
+    void UpdateFeeHistogram(const CTxMemPoolEntry& entry, int nDirection);
+
+    mutable CCriticalSection cs_snapshot; //!< Taken before cs, serializes taking snapshots
+    mutable std::shared_ptr<const CTxMemPoolSnapshot> snapshot; //!< Protected by cs
+    //! Memory the last snapshot holds on to, including transactions that left the pool since
+    mutable size_t nSnapshotUsage;
+    //! Memory of the transactions that left the pool since the last snapshot
+    size_t nSnapshotRemovedUsage;
+    mutable int64_t nSnapshotTime; //!< When the last snapshot was taken
+
 public:
 
     static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; // public only for testing
+    //! A snapshot the pool changed since is released after this many seconds, or once
+    //! the transactions that left the pool and are only kept by it use this many bytes
+    static const int64_t SNAPSHOT_STALE_AGE = 60; // public only for testing
+    static const size_t SNAPSHOT_REMOVED_BUDGET = 4 * 1000 * 1000;
 
     typedef boost::multi_index_container<
         CTxMemPoolEntry,
@@ -447,17 +533,9 @@ public:
                 boost::multi_index::identity<CTxMemPoolEntry>,
                 CompareTxMemPoolEntryByDescendantScore
             >,
-            // sorted by entry time
-            boost::multi_index::ordered_non_unique<
-                boost::multi_index::tag<entry_time>,
-                boost::multi_index::identity<CTxMemPoolEntry>,
-                CompareTxMemPoolEntryByEntryTime
-            >,
-            // sorted by score (for mining prioritization)
-            boost::multi_index::ordered_unique<
-                boost::multi_index::tag<mining_score>,
-                boost::multi_index::identity<CTxMemPoolEntry>,
-                CompareTxMemPoolEntryByScore
+            // in order of addition, standing in for entry time (see Expire())
+            boost::multi_index::sequenced<
+                boost::multi_index::tag<entry_time>
             >,
             // sorted by fee rate with ancestors
             boost::multi_index::ordered_non_unique<
@@ -480,29 +558,64 @@ public:
         }
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
+    //! Entries found by a traversal, each listed once
+    typedef std::vector<txiter> vecEntries;
 
-    const setEntries & GetMemPoolParents(txiter entry) const;
-    const setEntries & GetMemPoolChildren(txiter entry) const;
+    const CTxMemPoolEntry::vecLinks & GetMemPoolParents(txiter entry) const { return entry->vParents; }
+    const CTxMemPoolEntry::vecLinks & GetMemPoolChildren(txiter entry) const { return entry->vChildren; }
+    txiter GetIter(const CTxMemPoolEntry* pentry) const { return mapTx.iterator_to(*pentry); }
 private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
-
-    struct TxLinks {
-        setEntries parents;
-        setEntries children;
-    };
-
-    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
-    txlinksMap mapLinks;
+    typedef std::map<txiter, vecEntries, CompareIteratorByHash> cacheMap;
 
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
+    CTxMemPoolSnapshot::EntryRef MakeSnapshotEntry(txiter it) const;
+    //! Release the last snapshot if it is stale and too old or keeps too much alive
+    void LimitStaleSnapshot();
+
+    /**
+     * Ancestor and descendant walks mark the entries they reach with the
+     * current epoch instead of collecting them in a set, so that checking
+     * and marking an entry is a comparison and a store. Only one walk can be
+     * in progress at a time, under cs.
+     */
+    mutable uint64_t nEpoch;
+    mutable bool fInTraversal;
+    mutable vecEntries vTraversalStage; //!< Work list, kept to reuse its allocation
+
+    class CTraversal
+    {
+    private:
+        const CTxMemPool& pool;
+    public:
+        CTraversal(const CTxMemPool& poolIn);
+        ~CTraversal();
+    };
+
+    //! Mark an entry visited by the current traversal; returns false if it already was
+    bool Visit(txiter it) const
+    {
+        if (it->nEpoch == nEpoch)
+            return false;
+        it->nEpoch = nEpoch;
+        return true;
+    }
+    //! Append all in-mempool descendants of the entries in vEntries to it, dropping duplicates
+    void ExpandDescendants(vecEntries &vEntries) const;
+
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
 public:
     indirectmap<COutPoint, const CTransaction*> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+    /** Fired with cs held once a transaction is in the pool, and before one leaves it */
+    boost::signals2::signal<void (CTransactionRef)> NotifyEntryAdded;
+    boost::signals2::signal<void (CTransactionRef)> NotifyEntryRemoved;
+    /** Fired with cs held once the fee delta of a transaction in the pool changed */
+    boost::signals2::signal<void (CTransactionRef)> NotifyEntryPrioritised;
+
     /** Create a new CTxMemPool.
      *  minReasonableRelayFee should be a feerate which is, roughly, somewhere
      *  around what it "costs" to relay a transaction around the network and
@@ -525,7 +638,7 @@ public:
     // addUnchecked can be used to have it call CalculateMemPoolAncestors(), and
     // then invoke the second version.
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate = true);
-    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool fCurrentEstimate = true);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, const vecEntries &vAncestors, bool fCurrentEstimate = true);
 
     void removeRecursive(const CTransaction &tx, std::vector<CTransactionRef>* removed = NULL);
     void removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight, int flags);
@@ -539,6 +652,16 @@ public:
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
+    /**
+     * Return a snapshot of the pool as it is now. The last one is returned
+     * again if the pool did not change since. Only copying pointers to the
+     * entries, and the entries that changed, happens under cs.
+     */
+    std::shared_ptr<const CTxMemPoolSnapshot> GetSnapshot() const;
+    //! Totals per feerate bucket, from low to high feerates
+    std::vector<CFeeHistogramBucket> GetFeeHistogram() const;
+    //! The snapshot copy of a single entry, or a new one (which is not kept) if it changed since the last snapshot
+    CTxMemPoolSnapshot::EntryRef GetSnapshotEntry(txiter it) const;
     /**
      * Check that none of this transactions inputs are in the mempool, and thus
      * the tx is not dependent on other mempool transactions to be included in a block.
@@ -554,11 +677,11 @@ public:
     /** Remove a set of transactions from the mempool.
      *  If a transaction is in this set, then all in-mempool descendants must
      *  also be in the set, unless this transaction is being removed for being
-     *  in a block.
+     *  in a block. No transaction may be listed twice.
      *  Set updateDescendants to true when removing a tx that was in a block, so
      *  that any in-mempool descendants have their ancestor state updated.
      */
-    void RemoveStaged(setEntries &stage, bool updateDescendants);
+    void RemoveStaged(const vecEntries &stage, bool updateDescendants);
 
     /** When adding transactions from a disconnected block back to the mempool,
      *  new mempool entries may have children in the mempool (which is generally
@@ -579,14 +702,15 @@ public:
      *  limitDescendantSize = max size of descendants any ancestor can have
      *  errString = populated with error reason if any limits are hit
      *  fSearchForParents = whether to search a tx's vin for in-mempool parents, or
-     *    look up parents from mapLinks. Must be true for entries not in the mempool
+     *    look up parents from vParents. Must be true for entries not in the mempool
      */
-    bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents = true) const;
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, vecEntries &vAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents = true) const;
 
-    /** Populate setDescendants with all in-mempool descendants of hash.
-     *  Assumes that setDescendants includes all in-mempool descendants of anything
-     *  already in it.  */
-    void CalculateDescendants(txiter it, setEntries &setDescendants);
+    /** Set vDescendants to it and all its in-mempool descendants, it first. */
+    void CalculateDescendants(txiter it, vecEntries &vDescendants) const;
+    /** Set vDescendants to the entries of vRoots and all their in-mempool
+     *  descendants, each listed once. */
+    void CalculateDescendants(const vecEntries &vRoots, vecEntries &vDescendants) const;
 
     /** The minimum fee to get into the mempool, which may itself not be enough
       *  for larger-sized transactions.
@@ -602,9 +726,14 @@ public:
       */
     void TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining=NULL);
 
-    /** Expire all transaction (and their dependencies) in the mempool older than time. Return the number of removed transactions. */
+    /** Expire all transaction (and their dependencies) in the mempool older than time. Return the number of removed transactions.
+     *  Transactions are expired in the order they were added, so one added with an earlier time than those before it
+     *  (as when loaded from mempool.dat) is only expired once they are, unless SortByEntryTime() is called after. */
     int Expire(int64_t time);
 
+    /** Put the transactions in order of entry time for Expire(), after adding some with earlier times than others */
+    void SortByEntryTime();
+
     unsigned long size()
     {
         LOCK(cs);
@@ -650,6 +779,8 @@ public:
     bool ReadFeeEstimates(CAutoFile& filein);
 
     size_t DynamicMemoryUsage() const;
+    //! Memory the last snapshot holds on to, which -maxmempool does not limit
+    size_t SnapshotMemoryUsage() const;
 
 private:
     /** UpdateForDescendants is used by UpdateTransactionsFromBlock to update
@@ -669,13 +800,13 @@ private:
             cacheMap &cachedDescendants,
             const std::set<uint256> &setExclude);
     /** Update ancestors of hash to add/remove it as a descendant transaction. */
-    void UpdateAncestorsOf(bool add, txiter hash, setEntries &setAncestors);
+    void UpdateAncestorsOf(bool add, txiter hash, const vecEntries &vAncestors);
     /** Set ancestor state for an entry */
-    void UpdateEntryForAncestors(txiter it, const setEntries &setAncestors);
+    void UpdateEntryForAncestors(txiter it, const vecEntries &vAncestors);
     /** For each transaction being removed, update ancestors and any direct children.
       * If updateDescendants is true, then also update in-mempool descendants'
       * ancestor state. */
-    void UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants);
+    void UpdateForRemoveFromMempool(const vecEntries &entriesToRemove, bool updateDescendants);
     /** Sever link between specified transaction and direct children. */
     void UpdateChildrenForRemoval(txiter entry);
 
@@ -705,12 +836,70 @@ public:
     bool HaveCoins(const uint256 &txid) const;
 };
 
+/** Most memory the transactions of disconnected blocks may take, in kilobytes */
+static const unsigned int MAX_DISCONNECTED_TX_POOL_SIZE = 20000;
+
+/**
+ * The transactions of the blocks disconnected in a reorg, held until the
+ * reorg is over to be added back to the mempool in one go, rather than after
+ * each block (see UpdateMempoolForReorg in main.cpp).
+ *
+ * Blocks are disconnected from the tip down and their transactions are added
+ * last to first, so that walking the pool backwards gives the transactions in
+ * chain order, parents before children. Transactions confirmed again by a
+ * block connected during the reorg are dropped. Beyond
+ * MAX_DISCONNECTED_TX_POOL_SIZE the caller evicts the earliest added, which
+ * come from the highest blocks.
+ */
+class DisconnectedBlockTransactions
+{
+public:
+    typedef boost::multi_index_container<
+        CTransactionRef,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::hashed_unique<
+                boost::multi_index::tag<txid_index>,
+                mempoolentry_txid,
+                SaltedTxidHasher
+            >,
+            // in the order they were added
+            boost::multi_index::sequenced<
+                boost::multi_index::tag<insertion_order>
+            >
+        >
+    > indexed_disconnected_transactions;
+
+    indexed_disconnected_transactions queuedTx;
+
+    DisconnectedBlockTransactions() : cachedInnerUsage(0) {}
+
+    // The pool must be emptied with UpdateMempoolForReorg before it goes away,
+    // or its transactions would silently be lost from the mempool.
+    ~DisconnectedBlockTransactions() { assert(queuedTx.empty()); }
+
+    size_t DynamicMemoryUsage() const;
+
+    void addTransaction(const CTransactionRef& tx);
+
+    /** Drop the transactions of a block connected during the reorg */
+    void removeForBlock(const std::vector<CTransactionRef>& vtx);
+
+    /** Drop an entry, e.g. the earliest added to stay within the memory bound */
+    void removeEntry(indexed_disconnected_transactions::index<insertion_order>::type::iterator entry);
+
+    void clear();
+
+private:
+    uint64_t cachedInnerUsage;
+};
+
 // We want to sort transactions by coin age priority
 typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
 
 struct TxCoinAgePriorityCompare
 {
-    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
     {
         if (a.first == b.first)
             return CompareTxMemPoolEntryByScore()(*(b.second), *(a.second)); //Reverse order to make sort less than
@@ -0,0 +1,176 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txreconciliation.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <string>
+
+/** Seeds of the three cell hash functions and the checksum */
+static const uint32_t SKETCH_SEEDS[4] = {0x9e3779b9, 0x3c6ef372, 0xdaa66d2b, 0x78dde6e4};
+
+static inline uint32_t MixShortId(uint32_t nShortId, uint32_t nSeed)
+{
+    // Finalizer of MurmurHash3
+    uint32_t h = nShortId ^ nSeed;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+CReconSketch::CReconSketch(size_t nCells) : vCells((nCells + 2) / 3 * 3)
+{
+}
+
+size_t CReconSketch::CellsForDifference(size_t nDifference)
+{
+    // Peeling gets stuck more often the fuller and the smaller the sketch is;
+    // with twice as many cells, and a few to spare, it fails about one time
+    // in twenty.
+    return std::min(MAX_RECON_SKETCH_CELLS, (2 * nDifference + 12) / 3 * 3);
+}
+
+size_t CReconSketch::GetCellIndex(uint32_t nShortId, int nPartition) const
+{
+    size_t nPartitionSize = vCells.size() / 3;
+    return nPartition * nPartitionSize + MixShortId(nShortId, SKETCH_SEEDS[nPartition]) % nPartitionSize;
+}
+
+void CReconSketch::Add(uint32_t nShortId)
+{
+    if (vCells.empty())
+        return;
+    uint32_t nHash = MixShortId(nShortId, SKETCH_SEEDS[3]);
+    for (int i = 0; i < 3; i++) {
+        Cell& cell = vCells[GetCellIndex(nShortId, i)];
+        cell.nCount++;
+        cell.nKeySum ^= nShortId;
+        cell.nHashSum ^= nHash;
+    }
+}
+
+void CReconSketch::Subtract(const CReconSketch& other)
+{
+    assert(vCells.size() == other.vCells.size());
+    for (size_t i = 0; i < vCells.size(); i++) {
+        vCells[i].nCount -= other.vCells[i].nCount;
+        vCells[i].nKeySum ^= other.vCells[i].nKeySum;
+        vCells[i].nHashSum ^= other.vCells[i].nHashSum;
+    }
+}
+
+bool CReconSketch::Decode(std::vector<uint32_t>& vAdded, std::vector<uint32_t>& vSubtracted) const
+{
+    vAdded.clear();
+    vSubtracted.clear();
+
+    // Repeatedly take an id out of a cell that holds only that id, which
+    // may leave other cells holding a single id in turn.
+    std::vector<Cell> vWork(vCells);
+    std::vector<size_t> vPure;
+    auto IsPure = [&](size_t nIndex) {
+        const Cell& cell = vWork[nIndex];
+        if (cell.nCount != 1 && cell.nCount != -1)
+            return false;
+        if (cell.nHashSum != MixShortId(cell.nKeySum, SKETCH_SEEDS[3]))
+            return false;
+        return GetCellIndex(cell.nKeySum, nIndex / (vWork.size() / 3)) == nIndex;
+    };
+    for (size_t i = 0; i < vWork.size(); i++) {
+        if (IsPure(i))
+            vPure.push_back(i);
+    }
+
+    while (!vPure.empty()) {
+        size_t nIndex = vPure.back();
+        vPure.pop_back();
+        if (!IsPure(nIndex))
+            continue;
+        // Every id decoded empties at least one cell, so a sketch that keeps
+        // yielding ids is bogus.
+        if (vAdded.size() + vSubtracted.size() >= vWork.size())
+            return false;
+
+        int32_t nCount = vWork[nIndex].nCount;
+        uint32_t nShortId = vWork[nIndex].nKeySum;
+        uint32_t nHash = vWork[nIndex].nHashSum;
+        (nCount > 0 ? vAdded : vSubtracted).push_back(nShortId);
+        for (int i = 0; i < 3; i++) {
+            size_t nCell = GetCellIndex(nShortId, i);
+            Cell& cell = vWork[nCell];
+            cell.nCount -= nCount;
+            cell.nKeySum ^= nShortId;
+            cell.nHashSum ^= nHash;
+            if (IsPure(nCell))
+                vPure.push_back(nCell);
+        }
+    }
+
+    for (const Cell& cell : vWork) {
+        if (cell.nCount != 0 || cell.nKeySum != 0 || cell.nHashSum != 0)
+            return false;
+    }
+    return true;
+}
+
+size_t EstimateReconDifference(size_t nLocal, size_t nRemote)
+{
+    // Most of what the smaller side holds is assumed to be on the other side
+    // as well; allow for a quarter of it not to be.
+    size_t nMin = std::min(nLocal, nRemote);
+    size_t nMax = std::max(nLocal, nRemote);
+    return nMax - nMin + nMin / 4 + 1;
+}
+
+CTxReconciliationState::CTxReconciliationState(uint64_t nLocalSaltIn) :
+    nLocalSalt(nLocalSaltIn), fEnabled(false), fInitiator(false),
+    fRequestPending(false), nNextRequest(0), k0(0), k1(0)
+{
+}
+
+void CTxReconciliationState::Enable(bool fInitiatorIn, uint64_t nRemoteSalt)
+{
+    // Both sides derive the short id keys from the two salts, in ascending
+    // order, hashed with a tag.
+    static const std::string strTag = "Tx Relay Salting";
+    unsigned char tag[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write((const unsigned char*)strTag.data(), strTag.size()).Finalize(tag);
+
+    unsigned char salts[16];
+    WriteLE64(salts, std::min(nLocalSalt, nRemoteSalt));
+    WriteLE64(salts + 8, std::max(nLocalSalt, nRemoteSalt));
+
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(tag, sizeof(tag)).Write(tag, sizeof(tag)).Write(salts, sizeof(salts)).Finalize(hash);
+    k0 = ReadLE64(hash);
+    k1 = ReadLE64(hash + 8);
+
+    fInitiator = fInitiatorIn;
+    fEnabled = true;
+}
+
+uint32_t CTxReconciliationState::GetShortId(const uint256& txid) const
+{
+    return (uint32_t)SipHashUint256(k0, k1, txid);
+}
+
+CReconSketch CTxReconciliationState::MakeSketch(size_t nCells, std::map<uint32_t, uint256>& mapIds) const
+{
+    CReconSketch sketch(nCells);
+    for (const uint256& txid : setLocal) {
+        uint32_t nShortId = GetShortId(txid);
+        // On the rare short id collision only one of the transactions makes it.
+        if (mapIds.emplace(nShortId, txid).second)
+            sketch.Add(nShortId);
+    }
+    return sketch;
+}
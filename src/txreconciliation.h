@@ -0,0 +1,129 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXRECONCILIATION_H
+#define BITCOIN_TXRECONCILIATION_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+/** Version of the transaction reconciliation protocol we implement (sendibltrcn) */
+static const uint32_t TXRECONCILIATION_VERSION = 1;
+/** Default for -txreconciliation */
+static const bool DEFAULT_TXRECONCILIATION = false;
+/** Seconds between reconciliations the connecting side requests from a peer */
+static const int RECON_REQUEST_INTERVAL = 2;
+/** Seconds after which the connecting side stops waiting for a sketch and requests another */
+static const int RECON_RESPONSE_TIMEOUT = 30;
+/** Transactions waiting to be reconciled with a peer. Beyond this they are announced by inv. */
+static const size_t MAX_RECON_SET_SIZE = 3000;
+/** Largest sketch, in cells, we send or accept */
+static const size_t MAX_RECON_SKETCH_CELLS = 3 * MAX_RECON_SET_SIZE;
+
+/**
+ * Sketch of a set of 32-bit short transaction ids: an invertible Bloom
+ * lookup table. Subtracting the sketch of one set from that of another, of
+ * the same size, yields a sketch of their symmetric difference, which can be
+ * decoded as long as it isn't much larger than a third of the cells.
+ */
+class CReconSketch
+{
+public:
+    struct Cell
+    {
+        int32_t nCount;
+        uint32_t nKeySum;
+        uint32_t nHashSum;
+
+        Cell() : nCount(0), nKeySum(0), nHashSum(0) {}
+
+        ADD_SERIALIZE_METHODS;
+
+        template <typename Stream, typename Operation>
+        inline void SerializationOp(Stream& s, Operation ser_action) {
+            READWRITE(nCount);
+            READWRITE(nKeySum);
+            READWRITE(nHashSum);
+        }
+    };
+
+    CReconSketch() {}
+    //! Sketch with (at least) nCells cells, rounded up to a multiple of three
+    explicit CReconSketch(size_t nCells);
+
+    //! Number of cells needed to decode a difference of nDifference ids
+    static size_t CellsForDifference(size_t nDifference);
+
+    size_t GetCells() const { return vCells.size(); }
+    //! Whether the sketch has a size a peer may send
+    bool IsValid() const { return !vCells.empty() && vCells.size() % 3 == 0 && vCells.size() <= MAX_RECON_SKETCH_CELLS; }
+
+    void Add(uint32_t nShortId);
+    //! Subtract a sketch of the same size
+    void Subtract(const CReconSketch& other);
+
+    /**
+     * Decode the difference this sketch holds. Ids added more often than
+     * subtracted go to vAdded, the others to vSubtracted. Returns false if
+     * the difference is too large to decode.
+     */
+    bool Decode(std::vector<uint32_t>& vAdded, std::vector<uint32_t>& vSubtracted) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(vCells);
+    }
+
+private:
+    std::vector<Cell> vCells;
+
+    size_t GetCellIndex(uint32_t nShortId, int nPartition) const;
+};
+
+/** Estimate how many transactions two peers' reconciliation sets of the given sizes differ by */
+size_t EstimateReconDifference(size_t nLocal, size_t nRemote);
+
+/**
+ * Transaction reconciliation with one peer. Set up when we send our
+ * sendibltrcn, enabled when the peer sends theirs and dropped if it sends
+ * verack without.
+ */
+class CTxReconciliationState
+{
+public:
+    explicit CTxReconciliationState(uint64_t nLocalSaltIn);
+
+    //! Enable reconciliation with the salt the peer sent us
+    void Enable(bool fInitiatorIn, uint64_t nRemoteSalt);
+
+    uint32_t GetShortId(const uint256& txid) const;
+
+    //! Sketch of setLocal with nCells cells, keeping the ids it covers in mapIds
+    CReconSketch MakeSketch(size_t nCells, std::map<uint32_t, uint256>& mapIds) const;
+
+    const uint64_t nLocalSalt;
+    bool fEnabled;
+    //! We are the side that made the connection, and request the sketches
+    bool fInitiator;
+    //! Transactions we'd announce to the peer
+    std::set<uint256> setLocal;
+    //! Responder: the transactions covered by the sketch we sent, by short id
+    std::map<uint32_t, uint256> mapSketched;
+    //! Initiator: whether we're waiting for a sketch
+    bool fRequestPending;
+    //! Initiator: when to request the next reconciliation (in microseconds)
+    int64_t nNextRequest;
+
+private:
+    uint64_t k0, k1;
+};
+
+#endif // BITCOIN_TXRECONCILIATION_H